@@ -0,0 +1,48 @@
+# Copyright 2016 MongoDB, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measure client contexts created per second.
+
+Compares authGSSClientInit with ClientTemplate.new_context. No KDC traffic
+is involved; only context creation is timed. Set KERBEROS_SERVICE (and
+optionally KERBEROS_PRINCIPAL) as for the test suite.
+"""
+
+import os
+import sys
+import timeit
+
+sys.path[0:0] = [""]
+
+import winkerberos as kerberos
+
+_SPN = os.environ.get('KERBEROS_SERVICE', 'HTTP/localhost')
+_PRINCIPAL = os.environ.get('KERBEROS_PRINCIPAL')
+_NUMBER = int(os.environ.get('BENCH_NUMBER', 10000))
+
+
+def bench(name, func):
+    best = min(timeit.repeat(func, number=_NUMBER, repeat=3))
+    sys.stdout.write("%-30s %12.0f contexts/s\n" % (name, _NUMBER / best))
+
+
+def main():
+    template = kerberos.ClientTemplate(_SPN, _PRINCIPAL)
+    bench("authGSSClientInit",
+          lambda: kerberos.authGSSClientInit(_SPN, _PRINCIPAL))
+    bench("ClientTemplate.new_context", template.new_context)
+
+
+if __name__ == "__main__":
+    main()
@@ -114,14 +114,21 @@ setup(
     ext_modules = [
         Extension(
             "winkerberos",
-            extra_link_args=['crypt32.lib',
+            extra_link_args=['advapi32.lib',
+                             'bcrypt.lib',
+                             'crypt32.lib',
                              'secur32.lib',
                              'Shlwapi.lib',
+                             'ws2_32.lib',
                              '/NXCOMPAT',
                              '/DYNAMICBASE'],
             sources = [
                 "src/winkerberos.c",
-                "src/kerberos_sspi.c"
+                "src/kerberos_sspi.c",
+                "src/kerberos_pool.c",
+                "src/kerberos_session.c",
+                "src/kerberos_token.c",
+                "src/kerberos_shmcache.c"
             ],
         )
     ],
@@ -0,0 +1,532 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Must come before Windows.h. */
+#include <winsock2.h>
+
+#include "kerberos_pool.h"
+
+#include <process.h>
+
+/* Each lane is a pool of its own. Each worker owns a queue. Submissions
+ * are spread over the lane's queues round robin; a worker takes from the
+ * front of its own queue and, when that is empty, steals from the back of
+ * the others in its lane. The semaphore counts the lane's queued tasks, so
+ * a worker that wakes up always finds one somewhere.
+ * */
+typedef struct {
+    CRITICAL_SECTION lock;
+    sspi_task* head;
+    sspi_task* tail;
+} task_queue;
+
+typedef struct {
+    volatile LONG queued;
+    volatile LONG64 max_queued;
+    volatile LONG64 submitted;
+    volatile LONG64 completed;
+    volatile LONG64 stolen;
+    volatile LONG64 wait_us;
+    volatile LONG64 max_wait_us;
+} lane_stats;
+
+typedef struct _worker_pool worker_pool;
+
+typedef struct {
+    worker_pool* pool;
+    ULONG index;
+} worker;
+
+struct _worker_pool {
+    ULONG size;
+    lane_stats* stats;
+    HANDLE wakeup;
+    HANDLE* threads;
+    task_queue* queues;
+    worker* workers;
+    volatile LONG next;
+    volatile LONG stopping;
+};
+
+/* Guards pools and pool_sizes. Held shared to submit. */
+static SRWLOCK pool_lock = SRWLOCK_INIT;
+static worker_pool* pools[SSPI_POOL_LANES] = {NULL, NULL};
+/* 0 means the lane's default size. */
+static ULONG pool_sizes[SSPI_POOL_LANES] = {0, 0};
+static LONGLONG frequency = 0;
+
+static lane_stats lanes[SSPI_POOL_LANES];
+
+static VOID
+push_back(task_queue* queue, sspi_task* task) {
+    EnterCriticalSection(&queue->lock);
+    task->next = NULL;
+    task->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    LeaveCriticalSection(&queue->lock);
+}
+
+static sspi_task*
+pop_front(task_queue* queue) {
+    sspi_task* task;
+    EnterCriticalSection(&queue->lock);
+    task = queue->head;
+    if (task) {
+        queue->head = task->next;
+        if (queue->head) {
+            queue->head->prev = NULL;
+        } else {
+            queue->tail = NULL;
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+    return task;
+}
+
+static sspi_task*
+pop_back(task_queue* queue) {
+    sspi_task* task;
+    EnterCriticalSection(&queue->lock);
+    task = queue->tail;
+    if (task) {
+        queue->tail = task->prev;
+        if (queue->tail) {
+            queue->tail->next = NULL;
+        } else {
+            queue->head = NULL;
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+    return task;
+}
+
+static sspi_task*
+take_task(worker_pool* p, ULONG index) {
+    sspi_task* task = pop_front(&p->queues[index]);
+    ULONG i;
+    for (i = 1; task == NULL && i < p->size; i++) {
+        task = pop_back(&p->queues[(index + i) % p->size]);
+        if (task) {
+            InterlockedIncrement64(&p->stats->stolen);
+        }
+    }
+    return task;
+}
+
+static VOID
+update_max(volatile LONG64* max, LONG64 value) {
+    LONG64 current = *max;
+    while (value > current) {
+        LONG64 prev = InterlockedCompareExchange64(max, value, current);
+        if (prev == current) {
+            break;
+        }
+        current = prev;
+    }
+}
+
+static unsigned __stdcall
+worker_main(void* param) {
+    worker* self = (worker*)param;
+    worker_pool* p = self->pool;
+    sspi_task* task;
+    LARGE_INTEGER now;
+    LONG64 waited;
+
+    for (;;) {
+        WaitForSingleObject(p->wakeup, INFINITE);
+        task = take_task(p, self->index);
+        if (task == NULL) {
+            /* Stopping wakes each worker once more than there are tasks. */
+            if (p->stopping) {
+                break;
+            }
+            continue;
+        }
+        InterlockedDecrement(&p->stats->queued);
+        QueryPerformanceCounter(&now);
+        waited = (now.QuadPart - task->queued) * 1000000 / frequency;
+        InterlockedExchangeAdd64(&p->stats->wait_us, waited);
+        update_max(&p->stats->max_wait_us, waited);
+        task->run(task);
+        InterlockedIncrement64(&p->stats->completed);
+    }
+    return 0;
+}
+
+/* One handshake worker per processor. Wrap and unwrap only use the CPU
+ * and never wait, so half as many message workers keep up with them.
+ * */
+static ULONG
+default_size(INT lane) {
+    SYSTEM_INFO info;
+    ULONG processors;
+    GetSystemInfo(&info);
+    processors = info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+    if (lane == SSPI_LANE_MESSAGE) {
+        return (processors + 1) / 2;
+    }
+    return processors;
+}
+
+static VOID
+pool_stop(worker_pool* p, ULONG started) {
+    ULONG i;
+    InterlockedExchange(&p->stopping, 1);
+    ReleaseSemaphore(p->wakeup, (LONG)started, NULL);
+    for (i = 0; i < started; i++) {
+        WaitForSingleObject(p->threads[i], INFINITE);
+        CloseHandle(p->threads[i]);
+    }
+    for (i = 0; i < p->size; i++) {
+        DeleteCriticalSection(&p->queues[i].lock);
+    }
+    CloseHandle(p->wakeup);
+    free(p->threads);
+    free(p->queues);
+    free(p->workers);
+    free(p);
+}
+
+static worker_pool*
+pool_start(INT lane, ULONG size) {
+    LARGE_INTEGER freq;
+    worker_pool* p;
+    ULONG i;
+
+    p = (worker_pool*)calloc(1, sizeof(worker_pool));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->size = size;
+    p->stats = &lanes[lane];
+    p->threads = (HANDLE*)calloc(size, sizeof(HANDLE));
+    p->queues = (task_queue*)calloc(size, sizeof(task_queue));
+    p->workers = (worker*)calloc(size, sizeof(worker));
+    p->wakeup = CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
+    if (!p->threads || !p->queues || !p->workers || !p->wakeup) {
+        if (p->wakeup) {
+            CloseHandle(p->wakeup);
+        }
+        free(p->threads);
+        free(p->queues);
+        free(p->workers);
+        free(p);
+        return NULL;
+    }
+    QueryPerformanceFrequency(&freq);
+    frequency = freq.QuadPart;
+    for (i = 0; i < size; i++) {
+        InitializeCriticalSection(&p->queues[i].lock);
+    }
+    for (i = 0; i < size; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        p->threads[i] = (HANDLE)_beginthreadex(
+            NULL, 0, worker_main, &p->workers[i], 0, NULL);
+        if (p->threads[i] == NULL) {
+            pool_stop(p, i);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+BOOL
+sspi_pool_submit(sspi_task* task, INT lane) {
+    LARGE_INTEGER now;
+    worker_pool* p;
+    LONG depth;
+
+    AcquireSRWLockShared(&pool_lock);
+    while (pools[lane] == NULL) {
+        /* Start the lane's workers on first use. */
+        ReleaseSRWLockShared(&pool_lock);
+        AcquireSRWLockExclusive(&pool_lock);
+        if (pools[lane] == NULL) {
+            pools[lane] = pool_start(
+                lane,
+                pool_sizes[lane] ? pool_sizes[lane] : default_size(lane));
+            if (pools[lane] == NULL) {
+                ReleaseSRWLockExclusive(&pool_lock);
+                return FALSE;
+            }
+        }
+        ReleaseSRWLockExclusive(&pool_lock);
+        AcquireSRWLockShared(&pool_lock);
+    }
+    p = pools[lane];
+    QueryPerformanceCounter(&now);
+    task->queued = now.QuadPart;
+    InterlockedIncrement64(&p->stats->submitted);
+    depth = InterlockedIncrement(&p->stats->queued);
+    update_max(&p->stats->max_queued, depth);
+    push_back(&p->queues[(ULONG)InterlockedIncrement(&p->next) % p->size],
+              task);
+    ReleaseSemaphore(p->wakeup, 1, NULL);
+    ReleaseSRWLockShared(&pool_lock);
+    return TRUE;
+}
+
+VOID
+sspi_pool_configure(INT lane, ULONG workers) {
+    worker_pool* old;
+
+    AcquireSRWLockExclusive(&pool_lock);
+    old = pools[lane];
+    pools[lane] = NULL;
+    pool_sizes[lane] = workers;
+    ReleaseSRWLockExclusive(&pool_lock);
+
+    /* Queued tasks still run. New ones go to a new pool of the new size. */
+    if (old) {
+        pool_stop(old, old->size);
+    }
+}
+
+VOID
+sspi_pool_get_stats(INT lane, sspi_pool_stats* stats) {
+    lane_stats* counters = &lanes[lane];
+
+    AcquireSRWLockShared(&pool_lock);
+    if (pools[lane]) {
+        stats->workers = pools[lane]->size;
+    } else if (pool_sizes[lane]) {
+        stats->workers = pool_sizes[lane];
+    } else {
+        stats->workers = default_size(lane);
+    }
+    ReleaseSRWLockShared(&pool_lock);
+    stats->queued = counters->queued;
+    stats->max_queued = counters->max_queued;
+    stats->submitted = counters->submitted;
+    stats->completed = counters->completed;
+    stats->stolen = counters->stolen;
+    stats->wait_us = counters->wait_us;
+    stats->max_wait_us = counters->max_wait_us;
+}
+
+struct _sspi_completion_queue {
+    CRITICAL_SECTION lock;
+    sspi_task* head;
+    sspi_task* tail;
+    SOCKET rsock;
+    SOCKET wsock;
+    /* A wakeup byte is unread. Later pushes don't send another. */
+    BOOL signaled;
+    BOOL closed;
+    volatile LONG refcount;
+};
+
+/* The most connections from other processes accept_peer drops while
+ * waiting for its own.
+ * */
+#define MAX_STRANGERS 8
+
+/* Accepts the connection whose peer is wsock. Any local process can
+ * connect to the listener before wsock does; those connections are
+ * closed rather than left to inject or swallow wakeups.
+ * */
+static SOCKET
+accept_peer(SOCKET listener, SOCKET wsock) {
+    struct sockaddr_in expected, peer;
+    INT len = sizeof(expected);
+    INT attempt;
+
+    if (getsockname(wsock, (struct sockaddr*)&expected, &len)) {
+        return INVALID_SOCKET;
+    }
+    for (attempt = 0; attempt <= MAX_STRANGERS; attempt++) {
+        SOCKET sock = accept(listener, NULL, NULL);
+        if (sock == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        len = sizeof(peer);
+        if (getpeername(sock, (struct sockaddr*)&peer, &len) == 0 &&
+            peer.sin_addr.s_addr == expected.sin_addr.s_addr &&
+            peer.sin_port == expected.sin_port) {
+            return sock;
+        }
+        closesocket(sock);
+    }
+    WSASetLastError(WSAECONNREFUSED);
+    return INVALID_SOCKET;
+}
+
+/* Windows has no socketpair. Connect two sockets over loopback. */
+static DWORD
+loopback_pair(SOCKET* rsock, SOCKET* wsock) {
+    struct sockaddr_in addr;
+    INT addrlen = sizeof(addr);
+    SOCKET listener;
+    ULONG nonblocking = 1;
+    BOOL nodelay = TRUE;
+    DWORD error = 0;
+
+    *rsock = INVALID_SOCKET;
+    *wsock = INVALID_SOCKET;
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        return WSAGetLastError();
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) ||
+        getsockname(listener, (struct sockaddr*)&addr, &addrlen) ||
+        listen(listener, SOMAXCONN)) {
+        goto fail;
+    }
+    *wsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*wsock == INVALID_SOCKET ||
+        connect(*wsock, (struct sockaddr*)&addr, sizeof(addr))) {
+        goto fail;
+    }
+    *rsock = accept_peer(listener, *wsock);
+    if (*rsock == INVALID_SOCKET ||
+        ioctlsocket(*rsock, FIONBIO, &nonblocking) ||
+        setsockopt(*wsock,
+                   IPPROTO_TCP,
+                   TCP_NODELAY,
+                   (const char*)&nodelay,
+                   sizeof(nodelay))) {
+        goto fail;
+    }
+    closesocket(listener);
+    return 0;
+
+fail:
+    error = WSAGetLastError();
+    closesocket(listener);
+    if (*wsock != INVALID_SOCKET) {
+        closesocket(*wsock);
+        *wsock = INVALID_SOCKET;
+    }
+    if (*rsock != INVALID_SOCKET) {
+        closesocket(*rsock);
+        *rsock = INVALID_SOCKET;
+    }
+    return error;
+}
+
+sspi_completion_queue*
+sspi_completion_queue_new(DWORD* error) {
+    sspi_completion_queue* queue;
+    WSADATA data;
+    INT res;
+
+    queue = (sspi_completion_queue*)calloc(1, sizeof(sspi_completion_queue));
+    if (queue == NULL) {
+        *error = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+    res = WSAStartup(MAKEWORD(2, 2), &data);
+    if (res) {
+        *error = (DWORD)res;
+        free(queue);
+        return NULL;
+    }
+    *error = loopback_pair(&queue->rsock, &queue->wsock);
+    if (*error) {
+        WSACleanup();
+        free(queue);
+        return NULL;
+    }
+    InitializeCriticalSection(&queue->lock);
+    queue->refcount = 1;
+    return queue;
+}
+
+VOID
+sspi_completion_queue_retain(sspi_completion_queue* queue) {
+    InterlockedIncrement(&queue->refcount);
+}
+
+VOID
+sspi_completion_queue_release(sspi_completion_queue* queue) {
+    if (InterlockedDecrement(&queue->refcount) != 0) {
+        return;
+    }
+    closesocket(queue->rsock);
+    closesocket(queue->wsock);
+    WSACleanup();
+    DeleteCriticalSection(&queue->lock);
+    free(queue);
+}
+
+UINT_PTR
+sspi_completion_queue_fileno(sspi_completion_queue* queue) {
+    return (UINT_PTR)queue->rsock;
+}
+
+BOOL
+sspi_completion_queue_push(sspi_completion_queue* queue, sspi_task* task) {
+    EnterCriticalSection(&queue->lock);
+    if (queue->closed) {
+        LeaveCriticalSection(&queue->lock);
+        return FALSE;
+    }
+    task->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    if (!queue->signaled) {
+        queue->signaled = TRUE;
+        send(queue->wsock, "x", 1, 0);
+    }
+    LeaveCriticalSection(&queue->lock);
+    return TRUE;
+}
+
+sspi_task*
+sspi_completion_queue_drain(sspi_completion_queue* queue) {
+    sspi_task* tasks;
+    CHAR buf[16];
+
+    EnterCriticalSection(&queue->lock);
+    tasks = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    if (queue->signaled) {
+        /* The socket is non-blocking, so this stops once it is empty. */
+        while (recv(queue->rsock, buf, sizeof(buf), 0) > 0) {
+        }
+        queue->signaled = FALSE;
+    }
+    LeaveCriticalSection(&queue->lock);
+    return tasks;
+}
+
+sspi_task*
+sspi_completion_queue_close(sspi_completion_queue* queue) {
+    sspi_task* tasks;
+    EnterCriticalSection(&queue->lock);
+    queue->closed = TRUE;
+    tasks = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    LeaveCriticalSection(&queue->lock);
+    return tasks;
+}
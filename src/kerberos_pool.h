@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <Windows.h>
+
+typedef struct _sspi_task sspi_task;
+typedef VOID (*sspi_task_fn)(sspi_task* task);
+
+/* A unit of work for the worker pool. Callers embed it in a larger struct
+ * holding the operation's arguments and results. run is called once, on a
+ * worker thread, and must not use the Python C API without first taking
+ * the GIL. The pool does not touch the task after run is called, so run
+ * may free it.
+ * */
+struct _sspi_task {
+    sspi_task_fn run;
+    sspi_task* prev;
+    sspi_task* next;
+    LONGLONG queued;
+};
+
+/* Lanes. Each has its own workers and queues and a worker never takes a
+ * task from another lane, so a backlog of handshakes, which wait on the
+ * KDC or the LSA, does not delay message protection on contexts that
+ * are already established.
+ * */
+#define SSPI_LANE_HANDSHAKE 0
+#define SSPI_LANE_MESSAGE 1
+#define SSPI_POOL_LANES 2
+
+typedef struct {
+    ULONG workers;
+    LONG queued;
+    LONG64 max_queued;
+    LONG64 submitted;
+    LONG64 completed;
+    LONG64 stolen;
+    LONG64 wait_us;
+    LONG64 max_wait_us;
+} sspi_pool_stats;
+
+/* Finished tasks, collected from any thread and drained in bulk by one.
+ * A loopback socket becomes readable when the queue goes from empty to
+ * non-empty, so a single select/poll based reactor can wait for any
+ * number of tasks. Reference counted, so that tasks still running can
+ * outlive the queue's owner; pushing to a closed queue fails.
+ * */
+typedef struct _sspi_completion_queue sspi_completion_queue;
+
+BOOL sspi_pool_submit(sspi_task* task, INT lane);
+VOID sspi_pool_configure(INT lane, ULONG workers);
+VOID sspi_pool_get_stats(INT lane, sspi_pool_stats* stats);
+sspi_completion_queue* sspi_completion_queue_new(DWORD* error);
+VOID sspi_completion_queue_retain(sspi_completion_queue* queue);
+VOID sspi_completion_queue_release(sspi_completion_queue* queue);
+UINT_PTR sspi_completion_queue_fileno(sspi_completion_queue* queue);
+BOOL sspi_completion_queue_push(sspi_completion_queue* queue,
+                                sspi_task* task);
+sspi_task* sspi_completion_queue_drain(sspi_completion_queue* queue);
+sspi_task* sspi_completion_queue_close(sspi_completion_queue* queue);
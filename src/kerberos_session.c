@@ -0,0 +1,452 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kerberos_sspi.h"
+#include "kerberos_session.h"
+
+#include <bcrypt.h>
+
+/* Each shard's timing wheel has WHEEL_SLOTS slots of tick milliseconds,
+ * the tick chosen so that the table's TTL spans the wheel. An entry is
+ * linked into the slot of the tick it expires in. Advancing the wheel
+ * to the current tick visits the slots passed since the last advance and
+ * drops their entries that are due. An entry whose TTL is longer than a
+ * revolution stays in its slot until a later visit finds it due.
+ * */
+#define WHEEL_SLOTS 256
+
+typedef struct _session_entry session_entry;
+
+struct _session_entry {
+    /* Bucket chain. */
+    session_entry* hnext;
+    /* LRU list, most recently stored first. */
+    session_entry* lprev;
+    session_entry* lnext;
+    /* Timing wheel slot. */
+    session_entry* wprev;
+    session_entry* wnext;
+    sspi_server_state* state;
+    ULONGLONG expires;
+    ULONG hash;
+    ULONG klen;
+    BYTE key[1];
+};
+
+typedef struct {
+    SRWLOCK lock;
+    session_entry** buckets;
+    ULONG mask;
+    ULONG size;
+    ULONG max;
+    session_entry* lru_head;
+    session_entry* lru_tail;
+    session_entry* wheel[WHEEL_SLOTS];
+    ULONGLONG tick;
+} session_shard;
+
+struct _sspi_session_table {
+    ULONG nshards;
+    ULONG shard_shift;
+    ULONG seed;
+    ULONG max_size;
+    DWORD ttl;
+    DWORD tick_ms;
+    session_shard* shards;
+    volatile LONG64 inserted;
+    volatile LONG64 replaced;
+    volatile LONG64 hits;
+    volatile LONG64 misses;
+    volatile LONG64 expired;
+    volatile LONG64 evicted;
+};
+
+static ULONG
+round_up_pow2(ULONG value) {
+    ULONG result = 1;
+    while (result < value && result < 0x80000000) {
+        result <<= 1;
+    }
+    return result;
+}
+
+/* FNV-1a from a random basis, so that keys colliding in one table do
+ * not collide in another, then a finalizer so that every bit of the
+ * hash depends on every bit of the key. Unlike the shared cache, whose
+ * hash every process must agree on, a table's hash is its own.
+ * */
+static ULONG
+session_hash(sspi_session_table* table, const BYTE* key, ULONG klen) {
+    ULONG hash = 2166136261u ^ table->seed;
+    ULONG i;
+    for (i = 0; i < klen; i++) {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static session_shard*
+shard_for(sspi_session_table* table, ULONG hash) {
+    /* The high bits pick the shard and the low bits the bucket. */
+    return &table->shards[(ULONG)((ULONGLONG)hash >> table->shard_shift)];
+}
+
+sspi_session_table*
+sspi_session_table_new(ULONG shards,
+                       ULONG max_size,
+                       DWORD ttl,
+                       sspi_error* err) {
+    sspi_session_table* table;
+    ULONG shard_max, buckets, i;
+    NTSTATUS status;
+
+    table = (sspi_session_table*)calloc(1, sizeof(sspi_session_table));
+    if (table == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    status = BCryptGenRandom(NULL,
+                             (PUCHAR)&table->seed,
+                             sizeof(table->seed),
+                             BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (!BCRYPT_SUCCESS(status)) {
+        save_error(err, (DWORD)status, "BCryptGenRandom");
+        free(table);
+        return NULL;
+    }
+    /* Every shard holds at least one entry, so that the shards' limits
+     * add up to max_size.
+     * */
+    table->nshards = round_up_pow2(shards ? shards : 1);
+    while (table->nshards > max_size && table->nshards > 1) {
+        table->nshards >>= 1;
+    }
+    table->shard_shift = 32;
+    for (i = table->nshards; i > 1; i >>= 1) {
+        table->shard_shift--;
+    }
+    table->max_size = max_size;
+    table->ttl = ttl;
+    table->tick_ms = ttl / (WHEEL_SLOTS - 1);
+    if (table->tick_ms == 0) {
+        table->tick_ms = 1;
+    }
+    table->shards = (session_shard*)calloc(
+        table->nshards, sizeof(session_shard));
+    if (table->shards == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        free(table);
+        return NULL;
+    }
+    /* The first max_size % nshards shards hold one entry more. */
+    shard_max = (max_size + table->nshards - 1) / table->nshards;
+    buckets = round_up_pow2(shard_max < 16 ? 16 : shard_max);
+    for (i = 0; i < table->nshards; i++) {
+        session_shard* shard = &table->shards[i];
+        InitializeSRWLock(&shard->lock);
+        shard->max = max_size / table->nshards +
+                     (i < max_size % table->nshards ? 1 : 0);
+        shard->mask = buckets - 1;
+        shard->tick = GetTickCount64() / table->tick_ms;
+        shard->buckets = (session_entry**)calloc(
+            buckets, sizeof(session_entry*));
+        if (shard->buckets == NULL) {
+            save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+            sspi_session_table_free(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+static VOID
+entry_destroy(session_entry* entry) {
+    if (entry->state) {
+        destroy_sspi_server_state(entry->state);
+        free(entry->state);
+    }
+    free(entry);
+}
+
+/* Destroys the states dropped from a shard, after its lock is released. */
+static VOID
+destroy_list(session_entry* entry) {
+    while (entry) {
+        session_entry* next = entry->hnext;
+        entry_destroy(entry);
+        entry = next;
+    }
+}
+
+VOID
+sspi_session_table_free(sspi_session_table* table) {
+    ULONG i, j;
+    for (i = 0; i < table->nshards; i++) {
+        session_shard* shard = &table->shards[i];
+        if (shard->buckets == NULL) {
+            continue;
+        }
+        for (j = 0; j <= shard->mask; j++) {
+            destroy_list(shard->buckets[j]);
+        }
+        free(shard->buckets);
+    }
+    free(table->shards);
+    free(table);
+}
+
+static VOID
+unlink_entry(sspi_session_table* table,
+             session_shard* shard,
+             session_entry* entry) {
+    session_entry** link = &shard->buckets[entry->hash & shard->mask];
+    while (*link != entry) {
+        link = &(*link)->hnext;
+    }
+    *link = entry->hnext;
+    entry->hnext = NULL;
+
+    if (entry->lprev) {
+        entry->lprev->lnext = entry->lnext;
+    } else {
+        shard->lru_head = entry->lnext;
+    }
+    if (entry->lnext) {
+        entry->lnext->lprev = entry->lprev;
+    } else {
+        shard->lru_tail = entry->lprev;
+    }
+
+    if (entry->wprev) {
+        entry->wprev->wnext = entry->wnext;
+    } else {
+        shard->wheel[(entry->expires / table->tick_ms) % WHEEL_SLOTS] =
+            entry->wnext;
+    }
+    if (entry->wnext) {
+        entry->wnext->wprev = entry->wprev;
+    }
+    shard->size--;
+}
+
+/* Unlinks the due entries of the slots passed since the last call and
+ * chains them on *dropped through hnext.
+ * */
+static VOID
+advance_wheel(sspi_session_table* table,
+              session_shard* shard,
+              ULONGLONG now,
+              session_entry** dropped) {
+    ULONGLONG tick = now / table->tick_ms;
+    ULONGLONG t, first;
+
+    if (tick <= shard->tick || shard->size == 0) {
+        shard->tick = tick;
+        return;
+    }
+    first = shard->tick + 1;
+    if (tick - shard->tick > WHEEL_SLOTS) {
+        first = tick - WHEEL_SLOTS + 1;
+    }
+    for (t = first; t <= tick; t++) {
+        session_entry* entry = shard->wheel[t % WHEEL_SLOTS];
+        while (entry) {
+            session_entry* next = entry->wnext;
+            if (entry->expires <= now) {
+                unlink_entry(table, shard, entry);
+                entry->hnext = *dropped;
+                *dropped = entry;
+                InterlockedIncrement64(&table->expired);
+            }
+            entry = next;
+        }
+    }
+    shard->tick = tick;
+}
+
+static session_entry*
+find_entry(session_shard* shard, ULONG hash, const BYTE* key, ULONG klen) {
+    session_entry* entry = shard->buckets[hash & shard->mask];
+    while (entry) {
+        if (entry->hash == hash &&
+            entry->klen == klen &&
+            memcmp(entry->key, key, klen) == 0) {
+            return entry;
+        }
+        entry = entry->hnext;
+    }
+    return NULL;
+}
+
+/* Takes ownership of state, even on failure. A ttl of 0 uses the
+ * table's. Replaces and destroys any state already stored under key.
+ * */
+BOOL
+sspi_session_table_put(sspi_session_table* table,
+                       const BYTE* key,
+                       ULONG klen,
+                       sspi_server_state* state,
+                       DWORD ttl) {
+    ULONG hash = session_hash(table, key, klen);
+    session_shard* shard = shard_for(table, hash);
+    session_entry* dropped = NULL;
+    session_entry* entry;
+    session_entry* old;
+    session_entry** slot;
+    ULONGLONG now = GetTickCount64();
+
+    entry = (session_entry*)malloc(sizeof(session_entry) + klen);
+    if (entry == NULL) {
+        destroy_sspi_server_state(state);
+        free(state);
+        return FALSE;
+    }
+    memcpy(entry->key, key, klen);
+    entry->klen = klen;
+    entry->hash = hash;
+    entry->state = state;
+    entry->expires = now + (ttl ? ttl : table->ttl);
+
+    AcquireSRWLockExclusive(&shard->lock);
+    advance_wheel(table, shard, now, &dropped);
+    old = find_entry(shard, hash, key, klen);
+    if (old) {
+        unlink_entry(table, shard, old);
+        old->hnext = dropped;
+        dropped = old;
+        InterlockedIncrement64(&table->replaced);
+    }
+    /* Make room by evicting the least recently stored. */
+    while (shard->size >= shard->max && shard->lru_tail) {
+        session_entry* victim = shard->lru_tail;
+        unlink_entry(table, shard, victim);
+        victim->hnext = dropped;
+        dropped = victim;
+        InterlockedIncrement64(&table->evicted);
+    }
+
+    slot = &shard->buckets[hash & shard->mask];
+    entry->hnext = *slot;
+    *slot = entry;
+
+    entry->lprev = NULL;
+    entry->lnext = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lprev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+
+    slot = &shard->wheel[(entry->expires / table->tick_ms) % WHEEL_SLOTS];
+    entry->wprev = NULL;
+    entry->wnext = *slot;
+    if (*slot) {
+        (*slot)->wprev = entry;
+    }
+    *slot = entry;
+
+    shard->size++;
+    ReleaseSRWLockExclusive(&shard->lock);
+    InterlockedIncrement64(&table->inserted);
+    destroy_list(dropped);
+    return TRUE;
+}
+
+/* Removes the state stored under key and returns it, or NULL. */
+sspi_server_state*
+sspi_session_table_take(sspi_session_table* table,
+                        const BYTE* key,
+                        ULONG klen) {
+    ULONG hash = session_hash(table, key, klen);
+    session_shard* shard = shard_for(table, hash);
+    session_entry* dropped = NULL;
+    session_entry* entry;
+    sspi_server_state* state = NULL;
+    ULONGLONG now = GetTickCount64();
+
+    AcquireSRWLockExclusive(&shard->lock);
+    advance_wheel(table, shard, now, &dropped);
+    entry = find_entry(shard, hash, key, klen);
+    if (entry) {
+        unlink_entry(table, shard, entry);
+        /* Due in a slot the wheel has already passed. */
+        if (entry->expires <= now) {
+            entry->hnext = dropped;
+            dropped = entry;
+            entry = NULL;
+            InterlockedIncrement64(&table->expired);
+        }
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+    destroy_list(dropped);
+
+    if (entry) {
+        state = entry->state;
+        free(entry);
+        InterlockedIncrement64(&table->hits);
+    } else {
+        InterlockedIncrement64(&table->misses);
+    }
+    return state;
+}
+
+/* Destroys the state stored under key. Returns FALSE if there was none. */
+BOOL
+sspi_session_table_remove(sspi_session_table* table,
+                          const BYTE* key,
+                          ULONG klen) {
+    sspi_server_state* state = sspi_session_table_take(table, key, klen);
+    if (state == NULL) {
+        return FALSE;
+    }
+    destroy_sspi_server_state(state);
+    free(state);
+    return TRUE;
+}
+
+VOID
+sspi_session_table_get_stats(sspi_session_table* table,
+                             sspi_session_stats* stats) {
+    ULONG i;
+    ULONGLONG now = GetTickCount64();
+
+    stats->shards = table->nshards;
+    stats->max_size = table->max_size;
+    stats->ttl = table->ttl;
+    stats->size = 0;
+    for (i = 0; i < table->nshards; i++) {
+        session_shard* shard = &table->shards[i];
+        session_entry* dropped = NULL;
+        AcquireSRWLockExclusive(&shard->lock);
+        advance_wheel(table, shard, now, &dropped);
+        stats->size += shard->size;
+        ReleaseSRWLockExclusive(&shard->lock);
+        destroy_list(dropped);
+    }
+    stats->inserted = table->inserted;
+    stats->replaced = table->replaced;
+    stats->hits = table->hits;
+    stats->misses = table->misses;
+    stats->expired = table->expired;
+    stats->evicted = table->evicted;
+}
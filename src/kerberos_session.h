@@ -0,0 +1,59 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Include kerberos_sspi.h first. */
+
+/* Server states of handshakes in progress, keyed by an opaque
+ * conversation id, so that the legs of one handshake can arrive on
+ * different connections. The table owns the states it holds and
+ * destroys those that expire, are evicted or are replaced. Split into
+ * shards, each with its own lock, hash buckets, LRU list and timing
+ * wheel. Expired entries are dropped by the operations on their shard;
+ * there is no reaper thread.
+ * */
+typedef struct _sspi_session_table sspi_session_table;
+
+typedef struct {
+    ULONG shards;
+    ULONG max_size;
+    DWORD ttl;
+    ULONG size;
+    LONG64 inserted;
+    LONG64 replaced;
+    LONG64 hits;
+    LONG64 misses;
+    LONG64 expired;
+    LONG64 evicted;
+} sspi_session_stats;
+
+sspi_session_table* sspi_session_table_new(ULONG shards,
+                                           ULONG max_size,
+                                           DWORD ttl,
+                                           sspi_error* err);
+VOID sspi_session_table_free(sspi_session_table* table);
+BOOL sspi_session_table_put(sspi_session_table* table,
+                            const BYTE* key,
+                            ULONG klen,
+                            sspi_server_state* state,
+                            DWORD ttl);
+sspi_server_state* sspi_session_table_take(sspi_session_table* table,
+                                           const BYTE* key,
+                                           ULONG klen);
+BOOL sspi_session_table_remove(sspi_session_table* table,
+                               const BYTE* key,
+                               ULONG klen);
+VOID sspi_session_table_get_stats(sspi_session_table* table,
+                                  sspi_session_stats* stats);
@@ -0,0 +1,580 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kerberos_sspi.h"
+#include "kerberos_shmcache.h"
+#include <AclAPI.h>
+
+#define SHM_MAGIC 0x534b5357
+#define SHM_VERSION 1
+
+#define SHM_EMPTY 0
+#define SHM_INITIALIZING 1
+#define SHM_READY 2
+
+/* The number of slots a key can be stored in. */
+#define SHM_WINDOW 8
+/* How often a reader retries a slot being written. */
+#define SHM_READ_TRIES 4
+/* How often a writer picks a new slot after losing one to another. */
+#define SHM_WRITE_TRIES 4
+/* How long to wait for another process to set up the mapping, in
+ * milliseconds.
+ * */
+#define SHM_INIT_WAIT 5000
+
+#define SHM_SLOT_SIZE 1024
+#define SHM_SLOT_DATA (SHM_SLOT_SIZE - 32)
+
+/* The layout of the mapping, shared by every process using it. */
+typedef struct {
+    /* 0 when free. */
+    volatile LONG64 expires;
+    /* Odd while a writer holds the slot. */
+    volatile LONG seq;
+    volatile LONG referenced;
+    ULONG hash;
+    USHORT klen;
+    USHORT ulen;
+    USHORT alen;
+    USHORT reserved1;
+    ULONG reserved2;
+    /* The key, username and attributes. */
+    BYTE data[SHM_SLOT_DATA];
+} shm_slot;
+
+typedef struct {
+    volatile LONG state;
+    ULONG magic;
+    ULONG version;
+    ULONG slots;
+    ULONG slot_size;
+    volatile LONG clock;
+} shm_header;
+
+#define SHM_SLOTS_OFFSET 64
+
+struct _sspi_shm_cache {
+    HANDLE mapping;
+    shm_header* header;
+    shm_slot* slots;
+    ULONG mask;
+    ULONG window;
+    volatile LONG64 inserted;
+    volatile LONG64 hits;
+    volatile LONG64 misses;
+    volatile LONG64 expired;
+    volatile LONG64 evicted;
+    volatile LONG64 contended;
+};
+
+/* The user this process runs as, to be freed by the caller. */
+static TOKEN_USER*
+current_user(sspi_error* err) {
+    HANDLE token;
+    TOKEN_USER* user = NULL;
+    DWORD len = 0;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+        save_error(err, GetLastError(), "OpenProcessToken");
+        return NULL;
+    }
+    if (!GetTokenInformation(token, TokenUser, NULL, 0, &len) &&
+        GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        save_error(err, GetLastError(), "GetTokenInformation");
+        goto done;
+    }
+    user = (TOKEN_USER*)malloc(len);
+    if (user == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        goto done;
+    }
+    if (!GetTokenInformation(token, TokenUser, user, len, &len)) {
+        save_error(err, GetLastError(), "GetTokenInformation");
+        free(user);
+        user = NULL;
+    }
+done:
+    CloseHandle(token);
+    return user;
+}
+
+/* A DACL granting the mapping to sid alone, to be freed by the
+ * caller.
+ * */
+static ACL*
+owner_only_acl(PSID sid, sspi_error* err) {
+    DWORD len = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) -
+                sizeof(DWORD) + GetLengthSid(sid);
+    ACL* acl = (ACL*)malloc(len);
+    if (acl == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    if (!InitializeAcl(acl, len, ACL_REVISION) ||
+        !AddAccessAllowedAce(acl, ACL_REVISION, FILE_MAP_ALL_ACCESS, sid)) {
+        save_error(err, GetLastError(), "InitializeAcl");
+        free(acl);
+        return NULL;
+    }
+    return acl;
+}
+
+/* Another user who created the mapping could read and forge entries. */
+static BOOL
+owned_by(HANDLE mapping, PSID sid, sspi_error* err) {
+    PSID owner;
+    PSECURITY_DESCRIPTOR sd;
+    DWORD status;
+    BOOL same;
+
+    status = GetSecurityInfo(mapping,
+                             SE_KERNEL_OBJECT,
+                             OWNER_SECURITY_INFORMATION,
+                             &owner,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &sd);
+    if (status != ERROR_SUCCESS) {
+        save_error(err, status, "GetSecurityInfo");
+        return FALSE;
+    }
+    same = EqualSid(owner, sid);
+    LocalFree(sd);
+    if (!same) {
+        save_error(err, 0, "The shared session cache was created by "
+                           "another user.");
+    }
+    return same;
+}
+
+/* Opens the mapping called name, creating it with room for slots
+ * entries, rounded up to a power of two, if no process has yet. An
+ * existing mapping keeps the size its creator gave it. Only processes
+ * running as the same user can open it.
+ * */
+sspi_shm_cache*
+sspi_shm_cache_open(const WCHAR* name, ULONG slots, sspi_error* err) {
+    sspi_shm_cache* cache;
+    ULONGLONG size;
+    ULONG count = 1;
+    MEMORY_BASIC_INFORMATION info;
+    ULONGLONG deadline;
+    TOKEN_USER* user;
+    ACL* acl = NULL;
+    SECURITY_DESCRIPTOR sd;
+    SECURITY_ATTRIBUTES attrs;
+
+    while (count < slots && count < 0x80000000) {
+        count <<= 1;
+    }
+    user = current_user(err);
+    if (user == NULL) {
+        return NULL;
+    }
+    cache = (sspi_shm_cache*)calloc(1, sizeof(sspi_shm_cache));
+    if (cache == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        goto fail;
+    }
+    acl = owner_only_acl(user->User.Sid, err);
+    if (acl == NULL) {
+        goto fail;
+    }
+    if (!InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION) ||
+        !SetSecurityDescriptorOwner(&sd, user->User.Sid, FALSE) ||
+        !SetSecurityDescriptorDacl(&sd, TRUE, acl, FALSE)) {
+        save_error(err, GetLastError(), "InitializeSecurityDescriptor");
+        goto fail;
+    }
+    attrs.nLength = sizeof(attrs);
+    attrs.lpSecurityDescriptor = &sd;
+    attrs.bInheritHandle = FALSE;
+    size = SHM_SLOTS_OFFSET + (ULONGLONG)count * sizeof(shm_slot);
+    /* Backed by the paging file; the memory lives as long as any
+     * process has the mapping open.
+     * */
+    cache->mapping = CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                        &attrs,
+                                        PAGE_READWRITE,
+                                        (DWORD)(size >> 32),
+                                        (DWORD)size,
+                                        name);
+    if (cache->mapping == NULL) {
+        save_error(err, GetLastError(), "CreateFileMappingW");
+        goto fail;
+    }
+    /* An existing mapping keeps its creator's security descriptor. */
+    if (GetLastError() == ERROR_ALREADY_EXISTS &&
+        !owned_by(cache->mapping, user->User.Sid, err)) {
+        goto fail;
+    }
+    cache->header = (shm_header*)MapViewOfFile(
+        cache->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (cache->header == NULL) {
+        save_error(err, GetLastError(), "MapViewOfFile");
+        goto fail;
+    }
+
+    /* A new mapping is zero filled. The first process to get here lays
+     * it out; the others wait for it.
+     * */
+    if (InterlockedCompareExchange(
+            &cache->header->state, SHM_INITIALIZING, SHM_EMPTY) == SHM_EMPTY) {
+        cache->header->magic = SHM_MAGIC;
+        cache->header->version = SHM_VERSION;
+        cache->header->slots = count;
+        cache->header->slot_size = sizeof(shm_slot);
+        InterlockedExchange(&cache->header->state, SHM_READY);
+    } else {
+        /* Sleep(1) can take a whole timer tick, so count time rather
+         * than sleeps.
+         * */
+        deadline = GetTickCount64() + SHM_INIT_WAIT;
+        while (cache->header->state != SHM_READY) {
+            if (GetTickCount64() >= deadline) {
+                save_error(err, 0, "Timed out waiting for another process "
+                                   "to set up the shared session cache.");
+                goto fail;
+            }
+            Sleep(1);
+        }
+        MemoryBarrier();
+    }
+    count = cache->header->slots;
+    if (cache->header->magic != SHM_MAGIC ||
+        cache->header->version != SHM_VERSION ||
+        cache->header->slot_size != sizeof(shm_slot) ||
+        count == 0 || (count & (count - 1)) != 0 ||
+        !VirtualQuery(cache->header, &info, sizeof(info)) ||
+        info.RegionSize <
+            SHM_SLOTS_OFFSET + (ULONGLONG)count * sizeof(shm_slot)) {
+        save_error(err, 0, "The mapping is not a shared session cache of "
+                           "this version.");
+        goto fail;
+    }
+    cache->slots = (shm_slot*)((BYTE*)cache->header + SHM_SLOTS_OFFSET);
+    cache->mask = count - 1;
+    cache->window = count < SHM_WINDOW ? count : SHM_WINDOW;
+    free(acl);
+    free(user);
+    return cache;
+
+fail:
+    if (cache) {
+        sspi_shm_cache_close(cache);
+    }
+    free(acl);
+    free(user);
+    return NULL;
+}
+
+VOID
+sspi_shm_cache_close(sspi_shm_cache* cache) {
+    if (cache->header) {
+        UnmapViewOfFile(cache->header);
+    }
+    if (cache->mapping) {
+        CloseHandle(cache->mapping);
+    }
+    free(cache);
+}
+
+static shm_slot*
+window_slot(sspi_shm_cache* cache, ULONG hash, ULONG i) {
+    return &cache->slots[(hash + i) & cache->mask];
+}
+
+/* Read unlocked; check again once the slot is claimed. */
+static BOOL
+slot_holds(shm_slot* slot, ULONG hash, const BYTE* key, ULONG klen) {
+    return (slot->expires &&
+            slot->hash == hash &&
+            slot->klen == klen &&
+            memcmp((const VOID*)slot->data, key, klen) == 0);
+}
+
+/* Frees every slot in key's window that holds key, other than keep,
+ * waiting out writers holding them. Concurrent puts of one key can each
+ * claim a different slot; clearing the others keeps a remove from
+ * leaving a copy behind. Returns the number of slots freed.
+ * */
+static ULONG
+clear_matches(sspi_shm_cache* cache,
+              ULONG hash,
+              const BYTE* key,
+              ULONG klen,
+              shm_slot* keep) {
+    ULONG cleared = 0;
+    ULONG i;
+    INT tries;
+
+    for (i = 0; i < cache->window; i++) {
+        shm_slot* slot = window_slot(cache, hash, i);
+        if (slot == keep) {
+            continue;
+        }
+        for (tries = 0; tries < SHM_WRITE_TRIES * SHM_READ_TRIES; tries++) {
+            LONG seq = slot->seq;
+            if (seq & 1) {
+                YieldProcessor();
+                continue;
+            }
+            MemoryBarrier();
+            if (!slot_holds(slot, hash, key, klen)) {
+                break;
+            }
+            if (InterlockedCompareExchange(
+                    &slot->seq, seq + 1, seq) != seq) {
+                continue;
+            }
+            if (slot_holds(slot, hash, key, klen)) {
+                slot->expires = 0;
+                slot->referenced = 0;
+                cleared++;
+            }
+            MemoryBarrier();
+            InterlockedExchange(&slot->seq, (LONG)((ULONG)seq + 2));
+            break;
+        }
+    }
+    return cleared;
+}
+
+/* Copies the slot holding key into copy, as a consistent snapshot.
+ * Returns NULL if there is none.
+ * */
+static shm_slot*
+find_slot(sspi_shm_cache* cache,
+          ULONG hash,
+          const BYTE* key,
+          ULONG klen,
+          shm_slot* copy) {
+    ULONG i;
+    INT tries;
+
+    for (i = 0; i < cache->window; i++) {
+        shm_slot* slot = window_slot(cache, hash, i);
+        for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+            LONG seq = slot->seq;
+            SIZE_T len;
+            if (seq & 1) {
+                YieldProcessor();
+                continue;
+            }
+            MemoryBarrier();
+            /* Most slots are ruled out without copying them. */
+            if (slot->expires == 0 ||
+                slot->hash != hash ||
+                slot->klen != klen) {
+                break;
+            }
+            len = (SIZE_T)klen + slot->ulen + slot->alen;
+            if (len > SHM_SLOT_DATA) {
+                len = SHM_SLOT_DATA;
+            }
+            memcpy(copy,
+                   (const VOID*)slot,
+                   FIELD_OFFSET(shm_slot, data) + len);
+            MemoryBarrier();
+            if (slot->seq != seq) {
+                continue;
+            }
+            if ((ULONG)copy->klen + copy->ulen + copy->alen <= SHM_SLOT_DATA &&
+                memcmp(copy->data, key, klen) == 0) {
+                copy->seq = seq;
+                return slot;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Stores the result of an authentication under key, replacing any
+ * already stored. Returns FALSE if every slot for key was held by other
+ * writers.
+ * */
+BOOL
+sspi_shm_cache_put(sspi_shm_cache* cache,
+                   const BYTE* key,
+                   ULONG klen,
+                   const SEC_CHAR* username,
+                   ULONG ulen,
+                   const BYTE* attributes,
+                   ULONG alen,
+                   LONG64 expires) {
+    ULONG hash = auth_sspi_key_hash(key, klen);
+    LONG64 now = auth_sspi_unix_now();
+    INT attempt;
+
+    if (klen > SSPI_SHM_MAX_KEY ||
+        ulen > SSPI_SHM_MAX_USERNAME ||
+        alen > SSPI_SHM_MAX_ATTRIBUTES) {
+        return FALSE;
+    }
+    for (attempt = 0; attempt < SHM_WRITE_TRIES; attempt++) {
+        shm_slot* target = NULL;
+        shm_slot* free_slot = NULL;
+        LONG target_seq = 0;
+        LONG free_seq = 0;
+        LONG64 free_expires = 0;
+        BOOL evicting = FALSE;
+        ULONG i;
+
+        for (i = 0; i < cache->window; i++) {
+            shm_slot* slot = window_slot(cache, hash, i);
+            LONG seq = slot->seq;
+            LONG64 slot_expires;
+            if (seq & 1) {
+                continue;
+            }
+            MemoryBarrier();
+            slot_expires = slot->expires;
+            /* Read unlocked, but the claim below fails if the slot
+             * changed since seq was read.
+             * */
+            if (slot_holds(slot, hash, key, klen)) {
+                target = slot;
+                target_seq = seq;
+                break;
+            }
+            if (free_slot == NULL && slot_expires <= now) {
+                free_slot = slot;
+                free_seq = seq;
+                free_expires = slot_expires;
+            }
+        }
+        if (target == NULL && free_slot) {
+            target = free_slot;
+            target_seq = free_seq;
+        }
+        if (target == NULL) {
+            /* Clock sweep: the first slot not read since the hand last
+             * passed it loses its place.
+             * */
+            ULONG hand = (ULONG)InterlockedIncrement(&cache->header->clock);
+            for (i = 0; i < 2 * cache->window; i++) {
+                shm_slot* slot = window_slot(
+                    cache, hash, (hand + i) % cache->window);
+                LONG seq = slot->seq;
+                if (seq & 1) {
+                    continue;
+                }
+                if (slot->referenced) {
+                    slot->referenced = 0;
+                    continue;
+                }
+                target = slot;
+                target_seq = seq;
+                evicting = TRUE;
+                break;
+            }
+        }
+        if (target == NULL ||
+            InterlockedCompareExchange(
+                &target->seq, target_seq + 1, target_seq) != target_seq) {
+            continue;
+        }
+
+        target->hash = hash;
+        target->klen = (USHORT)klen;
+        target->ulen = (USHORT)ulen;
+        target->alen = (USHORT)alen;
+        memcpy(target->data, key, klen);
+        memcpy(target->data + klen, username, ulen);
+        if (alen) {
+            memcpy(target->data + klen + ulen, attributes, alen);
+        }
+        target->referenced = 1;
+        target->expires = expires;
+        /* Publish the slot only once it is written. */
+        MemoryBarrier();
+        InterlockedExchange(&target->seq, (LONG)((ULONG)target_seq + 2));
+        /* The scan skips slots being written, which may hold key. */
+        clear_matches(cache, hash, key, klen, target);
+
+        InterlockedIncrement64(&cache->inserted);
+        if (evicting) {
+            InterlockedIncrement64(&cache->evicted);
+        } else if (target == free_slot && free_expires) {
+            InterlockedIncrement64(&cache->expired);
+        }
+        return TRUE;
+    }
+    InterlockedIncrement64(&cache->contended);
+    return FALSE;
+}
+
+/* Looks key up without taking a lock. Returns FALSE if it is not stored
+ * or has expired.
+ * */
+BOOL
+sspi_shm_cache_get(sspi_shm_cache* cache,
+                   const BYTE* key,
+                   ULONG klen,
+                   sspi_shm_entry* entry) {
+    shm_slot copy;
+    shm_slot* slot;
+
+    if (klen > SSPI_SHM_MAX_KEY) {
+        InterlockedIncrement64(&cache->misses);
+        return FALSE;
+    }
+    slot = find_slot(cache, auth_sspi_key_hash(key, klen), key, klen, &copy);
+    if (slot == NULL ||
+        copy.ulen > SSPI_SHM_MAX_USERNAME ||
+        copy.alen > SSPI_SHM_MAX_ATTRIBUTES ||
+        copy.expires <= auth_sspi_unix_now()) {
+        InterlockedIncrement64(&cache->misses);
+        return FALSE;
+    }
+    /* Avoid dirtying the cache line when the bit is already set. */
+    if (!slot->referenced) {
+        slot->referenced = 1;
+    }
+    entry->expires = copy.expires;
+    memcpy(entry->username, copy.data + klen, copy.ulen);
+    entry->username[copy.ulen] = '\0';
+    memcpy(entry->attributes, copy.data + klen + copy.ulen, copy.alen);
+    entry->alen = copy.alen;
+    InterlockedIncrement64(&cache->hits);
+    return TRUE;
+}
+
+/* Frees every slot holding key. Returns FALSE if there was none. */
+BOOL
+sspi_shm_cache_remove(sspi_shm_cache* cache,
+                      const BYTE* key,
+                      ULONG klen) {
+    if (klen > SSPI_SHM_MAX_KEY) {
+        return FALSE;
+    }
+    return clear_matches(
+               cache, auth_sspi_key_hash(key, klen), key, klen, NULL) != 0;
+}
+
+VOID
+sspi_shm_cache_get_stats(sspi_shm_cache* cache, sspi_shm_stats* stats) {
+    stats->slots = cache->mask + 1;
+    stats->inserted = cache->inserted;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->expired = cache->expired;
+    stats->evicted = cache->evicted;
+    stats->contended = cache->contended;
+}
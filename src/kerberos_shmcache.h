@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Include kerberos_sspi.h first. */
+
+/* Results of completed authentications, keyed by an opaque session id,
+ * in a named file mapping that every process on the host opening the
+ * same name shares. Entries live in fixed size slots; a key may be in
+ * any slot of a short window starting at its hash. Lookups take no
+ * lock: each slot has a sequence number, odd while a writer holds it,
+ * and a reader retries a slot whose number changed while it copied
+ * the slot. Writers claim a slot by compare-and-swap on that number,
+ * preferring the key's own slot, then a free or expired one, then one
+ * picked by a clock sweep over the window's referenced bits, and then
+ * free any other slot holding the key, which a concurrent writer of the
+ * same key may have claimed. Removing a key frees every slot holding
+ * it. A process that dies while writing a slot leaves it unusable until
+ * every process has closed the mapping.
+ * */
+#define SSPI_SHM_MAX_KEY 128
+#define SSPI_SHM_MAX_USERNAME 256
+#define SSPI_SHM_MAX_ATTRIBUTES 512
+
+typedef struct _sspi_shm_cache sspi_shm_cache;
+
+typedef struct {
+    /* Milliseconds since the epoch. */
+    LONG64 expires;
+    SEC_CHAR username[SSPI_SHM_MAX_USERNAME + 1];
+    BYTE attributes[SSPI_SHM_MAX_ATTRIBUTES];
+    ULONG alen;
+} sspi_shm_entry;
+
+/* The counters are this process's; sharing them would have every
+ * lookup on the host write the same cache line.
+ * */
+typedef struct {
+    ULONG slots;
+    LONG64 inserted;
+    LONG64 hits;
+    LONG64 misses;
+    LONG64 expired;
+    LONG64 evicted;
+    LONG64 contended;
+} sspi_shm_stats;
+
+sspi_shm_cache* sspi_shm_cache_open(const WCHAR* name,
+                                    ULONG slots,
+                                    sspi_error* err);
+VOID sspi_shm_cache_close(sspi_shm_cache* cache);
+BOOL sspi_shm_cache_put(sspi_shm_cache* cache,
+                        const BYTE* key,
+                        ULONG klen,
+                        const SEC_CHAR* username,
+                        ULONG ulen,
+                        const BYTE* attributes,
+                        ULONG alen,
+                        LONG64 expires);
+BOOL sspi_shm_cache_get(sspi_shm_cache* cache,
+                        const BYTE* key,
+                        ULONG klen,
+                        sspi_shm_entry* entry);
+BOOL sspi_shm_cache_remove(sspi_shm_cache* cache,
+                           const BYTE* key,
+                           ULONG klen);
+VOID sspi_shm_cache_get_stats(sspi_shm_cache* cache, sspi_shm_stats* stats);
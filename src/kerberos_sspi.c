@@ -16,23 +16,31 @@
  */
 
 #include "kerberos_sspi.h"
+#include "kerberos_pool.h"
+#include <process.h>
 #include <stdio.h>
 
 extern PyObject* GSSError;
 
+static VOID cred_release(sspi_cred* cred);
+
 VOID
 destroy_sspi_client_state(sspi_client_state* state) {
     if (state->haveCtx) {
         DeleteSecurityContext(&state->ctx);
         state->haveCtx = 0;
     }
-    if (state->haveCred) {
-        FreeCredentialsHandle(&state->cred);
-        state->haveCred = 0;
+    if (state->cred != NULL) {
+        cred_release(state->cred);
+        state->cred = NULL;
     }
-    if (state->spn != NULL) {
-        free(state->spn);
-        state->spn = NULL;
+    if (state->token != NULL) {
+        CloseHandle(state->token);
+        state->token = NULL;
+    }
+    if (state->tmpl != NULL) {
+        auth_sspi_client_template_release(state->tmpl);
+        state->tmpl = NULL;
     }
     if (state->response != NULL) {
         free(state->response);
@@ -66,8 +74,49 @@ set_gsserror(DWORD errCode, const SEC_CHAR* msg) {
     }
 }
 
+VOID
+set_sspi_error(const sspi_error* err) {
+    if (err->msg == NULL) {
+        PyErr_NoMemory();
+    } else if (err->code == 0) {
+        PyErr_SetString(GSSError, err->msg);
+    } else {
+        set_gsserror(err->code, err->msg);
+    }
+}
+
+VOID
+save_error(sspi_error* err, DWORD code, const SEC_CHAR* msg) {
+    err->code = code;
+    err->msg = msg;
+}
+
+/* Milliseconds since the epoch. */
+LONG64
+auth_sspi_unix_now(VOID) {
+    FILETIME now;
+    ULARGE_INTEGER value;
+    GetSystemTimeAsFileTime(&now);
+    value.LowPart = now.dwLowDateTime;
+    value.HighPart = now.dwHighDateTime;
+    /* FILETIME counts 100ns intervals since 1601. */
+    return (LONG64)((value.QuadPart - 116444736000000000ULL) / 10000);
+}
+
+/* FNV-1a. */
+ULONG
+auth_sspi_key_hash(const BYTE* key, ULONG klen) {
+    ULONG hash = 2166136261u;
+    ULONG i;
+    for (i = 0; i < klen; i++) {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 static SEC_CHAR*
-base64_encode(const SEC_CHAR* value, DWORD vlen) {
+base64_encode(const SEC_CHAR* value, DWORD vlen, sspi_error* err) {
     SEC_CHAR* out = NULL;
     DWORD len;
     /* Get the correct size for the out buffer. */
@@ -90,43 +139,81 @@ base64_encode(const SEC_CHAR* value, DWORD vlen) {
             }
         }
     }
-    PyErr_Format(GSSError, "CryptBinaryToString failed.");
+    save_error(err, 0, "CryptBinaryToString failed.");
     return NULL;
 }
 
-static SEC_CHAR*
-base64_decode(const SEC_CHAR* value, DWORD* rlen) {
-    SEC_CHAR* out = NULL;
+static BOOL
+base64_decoded_length(const SEC_CHAR* value,
+                      DWORD vlen,
+                      DWORD* rlen,
+                      sspi_error* err) {
+    /* A length of 0 tells CryptStringToBinary to scan for a terminating
+     * null, which an empty buffer is not guaranteed to have.
+     * */
+    if (!vlen) {
+        value = "";
+    }
     /* Get the correct size for the out buffer. */
     if (CryptStringToBinaryA(value,
-                             0,
+                             vlen,
                              CRYPT_STRING_BASE64,
                              NULL,
                              rlen,
                              NULL,
                              NULL)) {
-        out = (SEC_CHAR*)malloc(sizeof(SEC_CHAR) * *rlen);
-        if (out) {
-            /* Decode to the out buffer. */
-            if (CryptStringToBinaryA(value,
-                                     0,
-                                     CRYPT_STRING_BASE64,
-                                     (BYTE*)out,
-                                     rlen,
-                                     NULL,
-                                     NULL)) {
-                return out;
-            } else {
-                free(out);
-            }
-        }
+        return TRUE;
     }
-    PyErr_Format(GSSError, "CryptStringToBinary failed.");
-    return NULL;
+    save_error(err, 0, "CryptStringToBinary failed.");
+    return FALSE;
+}
+
+static BOOL
+base64_decode_into(const SEC_CHAR* value,
+                   DWORD vlen,
+                   SEC_CHAR* out,
+                   DWORD* rlen,
+                   sspi_error* err) {
+    if (!vlen) {
+        value = "";
+    }
+    /* Decode to the out buffer. */
+    if (CryptStringToBinaryA(value,
+                             vlen,
+                             CRYPT_STRING_BASE64,
+                             (BYTE*)out,
+                             rlen,
+                             NULL,
+                             NULL)) {
+        return TRUE;
+    }
+    save_error(err, 0, "CryptStringToBinary failed.");
+    return FALSE;
+}
+
+static SEC_CHAR*
+base64_decode(const SEC_CHAR* value,
+              DWORD vlen,
+              DWORD* rlen,
+              sspi_error* err) {
+    SEC_CHAR* out = NULL;
+    if (!base64_decoded_length(value, vlen, rlen, err)) {
+        return NULL;
+    }
+    out = (SEC_CHAR*)malloc(sizeof(SEC_CHAR) * *rlen);
+    if (!out) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    if (!base64_decode_into(value, vlen, out, rlen, err)) {
+        free(out);
+        return NULL;
+    }
+    return out;
 }
 
 static CHAR*
-wide_to_utf8(WCHAR* value) {
+wide_to_utf8(WCHAR* value, sspi_error* err) {
     CHAR* out;
     INT len = WideCharToMultiByte(CP_UTF8,
                                   0,
@@ -139,7 +226,7 @@ wide_to_utf8(WCHAR* value) {
     if (len) {
         out = (CHAR*)malloc(sizeof(CHAR) * len);
         if (!out) {
-            PyErr_SetNone(PyExc_MemoryError);
+            save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
             return NULL;
         } else {
             if (WideCharToMultiByte(CP_UTF8,
@@ -156,243 +243,2211 @@ wide_to_utf8(WCHAR* value) {
             }
         }
     }
-    set_gsserror(GetLastError(), "WideCharToMultiByte");
+    save_error(err, GetLastError(), "WideCharToMultiByte");
     return NULL;
 }
 
 static VOID
-set_uninitialized_context(VOID) {
-    PyErr_SetString(GSSError,
-                    "Uninitialized security context. You must use "
-                    "authGSSClientStep to initialize the security "
-                    "context before calling this function.");
+set_uninitialized_context(sspi_error* err) {
+    save_error(err,
+               0,
+               "Uninitialized security context. You must use "
+               "authGSSClientStep to initialize the security "
+               "context before calling this function.");
 }
 
-INT
-auth_sspi_client_init(WCHAR* service,
-                      ULONG flags,
-                      WCHAR* user,
-                      ULONG ulen,
-                      WCHAR* domain,
-                      ULONG dlen,
-                      WCHAR* password,
-                      ULONG plen,
-                      WCHAR* mechoid,
-                      sspi_client_state* state) {
-    SECURITY_STATUS status;
-    SEC_WINNT_AUTH_IDENTITY_W authIdentity;
-    TimeStamp ignored;
+static VOID
+set_uninitialized_server_context(sspi_error* err) {
+    save_error(err,
+               0,
+               "Uninitialized security context. You must use "
+               "authGSSServerStep to initialize the security "
+               "context before calling this function.");
+}
 
-    state->response = NULL;
-    state->username = NULL;
+INT
+auth_sspi_client_reset(sspi_client_state* state) {
+    /* Keep the SPN, flags and template for the next handshake, which
+     * takes the template's current credentials.
+     * */
+    if (state->haveCtx) {
+        DeleteSecurityContext(&state->ctx);
+        state->haveCtx = 0;
+    }
+    if (state->token != NULL) {
+        CloseHandle(state->token);
+        state->token = NULL;
+    }
+    if (state->cred != NULL) {
+        cred_release(state->cred);
+        state->cred = NULL;
+    }
+    state->haveSizes = 0;
     state->qop = SECQOP_WRAP_NO_ENCRYPT;
-    state->flags = flags;
-    state->haveCred = 0;
-    state->haveCtx = 0;
-    state->spn = _wcsdup(service);
-    if (state->spn == NULL) {
-        PyErr_SetNone(PyExc_MemoryError);
-        return AUTH_GSS_ERROR;
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+    if (state->username != NULL) {
+        free(state->username);
+        state->username = NULL;
+    }
+    return AUTH_GSS_COMPLETE;
+}
+
+static WCHAR*
+spn_from_service(WCHAR* service, sspi_error* err) {
+    WCHAR* spn = _wcsdup(service);
+    if (spn == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
     }
     /* Convert RFC-2078 format to SPN */
-    if (!wcschr(state->spn, L'/')) {
-        WCHAR* ptr = wcschr(state->spn, L'@');
+    if (!wcschr(spn, L'/')) {
+        WCHAR* ptr = wcschr(spn, L'@');
         if (ptr) {
             *ptr = L'/';
         }
     }
+    return spn;
+}
 
-    if (user) {
-        authIdentity.User = user;
-        authIdentity.UserLength = ulen;
-        authIdentity.Domain = domain;
-        authIdentity.DomainLength = dlen;
-        authIdentity.Password = password;
-        authIdentity.PasswordLength = plen;
-        authIdentity.Flags = SEC_WINNT_AUTH_IDENTITY_UNICODE;
-    }
+/* Circuit breaker
+ *
+ * Watches the calls that may have to contact the KDC: acquiring outbound
+ * credentials and the first InitializeSecurityContext of a handshake. A
+ * call fails if SSPI returns an error that suggests the KDC or LSA is in
+ * trouble, or if it takes longer than the slow call threshold. When
+ * enough calls of a window have failed the breaker opens and such calls
+ * fail at once until the cooldown has passed. Then a single probe is let
+ * through. If it succeeds the breaker closes, otherwise it opens again.
+ * Disabled until a cooldown is configured.
+ * */
 
-    /* Note that the first paramater, pszPrincipal, appears to be
-     * completely ignored in the Kerberos SSP. For more details see
-     * https://github.com/mongodb-labs/winkerberos/issues/11.
-     * */
-    status = AcquireCredentialsHandleW(/* Principal */
-                                       NULL,
-                                       /* Security package name */
-                                       mechoid,
-                                       /* Credentials Use */
-                                       SECPKG_CRED_OUTBOUND,
-                                       /* LogonID (We don't use this) */
-                                       NULL,
-                                       /* AuthData */
-                                       user ? &authIdentity : NULL,
-                                       /* Always NULL */
-                                       NULL,
-                                       /* Always NULL */
-                                       NULL,
-                                       /* CredHandle */
-                                       &state->cred,
-                                       /* Expiry (Required but unused by us) */
-                                       &ignored);
-    if (status != SEC_E_OK) {
-        set_gsserror(status, "AcquireCredentialsHandle");
-        return AUTH_GSS_ERROR;
+static SRWLOCK breaker_lock = SRWLOCK_INIT;
+static sspi_breaker_config breaker_config = {0, INFINITE, 0.5, 20};
+static LONG breaker_state = SSPI_BREAKER_CLOSED;
+static ULONGLONG breaker_open_until;
+static BOOL breaker_probing;
+static ULONG breaker_window_calls;
+static ULONG breaker_window_failures;
+static LONG64 breaker_calls;
+static LONG64 breaker_failures;
+static LONG64 breaker_rejected;
+static LONG64 breaker_opened;
+static LONG64 breaker_half_opened;
+static LONG64 breaker_closed;
+
+static BOOL
+breaker_counts(SECURITY_STATUS status) {
+    switch (status) {
+    case SEC_E_OK:
+    case SEC_I_CONTINUE_NEEDED:
+    /* Mistakes of the caller, not signs of an unhealthy KDC. */
+    case SEC_E_TARGET_UNKNOWN:
+    case SEC_E_WRONG_PRINCIPAL:
+    case SEC_E_LOGON_DENIED:
+    case SEC_E_UNKNOWN_CREDENTIALS:
+    case SEC_E_SECPKG_NOT_FOUND:
+        return FALSE;
+    default:
+        return TRUE;
     }
-    state->haveCred = 1;
-    return AUTH_GSS_COMPLETE;
 }
 
-INT
-auth_sspi_client_step(sspi_client_state* state, SEC_CHAR* challenge) {
-    SecBufferDesc inbuf;
-    SecBuffer inBufs[1];
-    SecBufferDesc outbuf;
-    SecBuffer outBufs[1];
-    ULONG ignored;
-    SECURITY_STATUS status = AUTH_GSS_CONTINUE;
-    DWORD len;
+/* Caller holds breaker_lock exclusively. */
+static VOID
+breaker_open(ULONGLONG now) {
+    breaker_state = SSPI_BREAKER_OPEN;
+    breaker_open_until = now + breaker_config.cooldown;
+    breaker_probing = FALSE;
+    breaker_opened++;
+}
 
-    if (state->response != NULL) {
-        free(state->response);
-        state->response = NULL;
-    }
+/* Caller holds breaker_lock exclusively. */
+static VOID
+breaker_reset_window(VOID) {
+    breaker_window_calls = 0;
+    breaker_window_failures = 0;
+}
 
-    inbuf.ulVersion = SECBUFFER_VERSION;
-    inbuf.cBuffers = 1;
-    inbuf.pBuffers = inBufs;
-    inBufs[0].pvBuffer = NULL;
-    inBufs[0].cbBuffer = 0;
-    inBufs[0].BufferType = SECBUFFER_TOKEN;
-    if (state->haveCtx) {
-        inBufs[0].pvBuffer = base64_decode(challenge, &len);
-        if (!inBufs[0].pvBuffer) {
-            return AUTH_GSS_ERROR;
-        }
-        inBufs[0].cbBuffer = len;
+/* Returns FALSE if the call must fail fast. Sets probe if the call is
+ * the one let through while half open.
+ * */
+static BOOL
+breaker_admit(BOOL* probe, sspi_error* err) {
+    BOOL admitted = TRUE;
+    ULONGLONG now;
+
+    *probe = FALSE;
+    if (breaker_config.cooldown == 0) {
+        return TRUE;
     }
+    now = GetTickCount64();
+    AcquireSRWLockExclusive(&breaker_lock);
+    if (breaker_state == SSPI_BREAKER_OPEN && now >= breaker_open_until) {
+        breaker_state = SSPI_BREAKER_HALF_OPEN;
+        breaker_half_opened++;
+    }
+    if (breaker_state == SSPI_BREAKER_HALF_OPEN && !breaker_probing) {
+        breaker_probing = TRUE;
+        *probe = TRUE;
+    } else if (breaker_state != SSPI_BREAKER_CLOSED) {
+        breaker_rejected++;
+        admitted = FALSE;
+    }
+    ReleaseSRWLockExclusive(&breaker_lock);
+    if (!admitted) {
+        save_error(err,
+                   0,
+                   "The circuit breaker is open. Calls that contact the "
+                   "KDC fail fast until it has recovered.");
+    }
+    return admitted;
+}
 
-    outbuf.ulVersion = SECBUFFER_VERSION;
-    outbuf.cBuffers = 1;
-    outbuf.pBuffers = outBufs;
-    outBufs[0].pvBuffer = NULL;
-    outBufs[0].cbBuffer = 0;
-    outBufs[0].BufferType = SECBUFFER_TOKEN;
+/* Records the outcome of a call admitted at start. */
+static VOID
+breaker_record(BOOL probe, ULONGLONG start, SECURITY_STATUS status) {
+    ULONGLONG now;
+    BOOL failed;
 
-    Py_BEGIN_ALLOW_THREADS
-    status = InitializeSecurityContextW(/* CredHandle */
-                                        &state->cred,
-                                        /* CtxtHandle (NULL on first call) */
-                                        state->haveCtx ? &state->ctx : NULL,
-                                        /* Service Principal Name */
-                                        state->spn,
-                                        /* Flags */
-                                        ISC_REQ_ALLOCATE_MEMORY | state->flags,
-                                        /* Always 0 */
-                                        0,
-                                        /* Target data representation */
-                                        SECURITY_NETWORK_DREP,
-                                        /* Challenge (NULL on first call) */
-                                        state->haveCtx ? &inbuf : NULL,
-                                        /* Always 0 */
-                                        0,
-                                        /* CtxtHandle (Set on first call) */
-                                        &state->ctx,
-                                        /* Output */
-                                        &outbuf,
-                                        /* Context attributes */
-                                        &ignored,
-                                        /* Expiry (We don't use this) */
-                                        NULL);
-    Py_END_ALLOW_THREADS
-    if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
-        set_gsserror(status, "InitializeSecurityContext");
-        status = AUTH_GSS_ERROR;
-        goto done;
+    if (breaker_config.cooldown == 0) {
+        return;
     }
-    state->haveCtx = 1;
-    if (outBufs[0].cbBuffer) {
-        state->response = base64_encode(outBufs[0].pvBuffer,
-                                        outBufs[0].cbBuffer);
-        if (!state->response) {
-            status = AUTH_GSS_ERROR;
-            goto done;
-        }
+    now = GetTickCount64();
+    AcquireSRWLockExclusive(&breaker_lock);
+    failed = (breaker_counts(status) ||
+              (breaker_config.slow_call != INFINITE &&
+               now - start >= breaker_config.slow_call));
+    breaker_calls++;
+    if (failed) {
+        breaker_failures++;
     }
-    if (status == SEC_E_OK) {
-        /* Get authenticated username. */
-        SecPkgContext_NamesW names;
-        status = QueryContextAttributesW(
-            &state->ctx, SECPKG_ATTR_NAMES, &names);
-        if (status != SEC_E_OK) {
-            set_gsserror(status, "QueryContextAttributesW");
-            status = AUTH_GSS_ERROR;
-            goto done;
+    if (probe) {
+        if (failed) {
+            breaker_open(now);
+        } else {
+            breaker_state = SSPI_BREAKER_CLOSED;
+            breaker_probing = FALSE;
+            breaker_reset_window();
+            breaker_closed++;
         }
-        state->username = wide_to_utf8(names.sUserName);
-        if (state->username == NULL) {
-            FreeContextBuffer(names.sUserName);
-            status = AUTH_GSS_ERROR;
-            goto done;
+    } else if (breaker_state == SSPI_BREAKER_CLOSED) {
+        /* Calls admitted before the breaker opened don't count. */
+        breaker_window_calls++;
+        if (failed) {
+            breaker_window_failures++;
         }
-        FreeContextBuffer(names.sUserName);
-        status = AUTH_GSS_COMPLETE;
+        if (breaker_window_calls >= breaker_config.min_calls) {
+            if (breaker_window_failures >=
+                    breaker_config.failure_ratio * breaker_window_calls) {
+                breaker_open(now);
+            }
+            breaker_reset_window();
+        }
+    }
+    ReleaseSRWLockExclusive(&breaker_lock);
+}
+
+VOID
+auth_sspi_breaker_configure(const sspi_breaker_config* config) {
+    AcquireSRWLockExclusive(&breaker_lock);
+    breaker_config = *config;
+    breaker_state = SSPI_BREAKER_CLOSED;
+    breaker_probing = FALSE;
+    breaker_reset_window();
+    ReleaseSRWLockExclusive(&breaker_lock);
+}
+
+VOID
+auth_sspi_breaker_get_stats(sspi_breaker_stats* stats) {
+    AcquireSRWLockExclusive(&breaker_lock);
+    /* Report an open breaker whose cooldown is over as half open. */
+    if (breaker_state == SSPI_BREAKER_OPEN &&
+        GetTickCount64() >= breaker_open_until) {
+        stats->state = SSPI_BREAKER_HALF_OPEN;
     } else {
-        status = AUTH_GSS_CONTINUE;
+        stats->state = breaker_state;
     }
-done:
-    if (inBufs[0].pvBuffer) {
-        free(inBufs[0].pvBuffer);
+    stats->config = breaker_config;
+    stats->calls = breaker_calls;
+    stats->failures = breaker_failures;
+    stats->rejected = breaker_rejected;
+    stats->opened = breaker_opened;
+    stats->half_opened = breaker_half_opened;
+    stats->closed = breaker_closed;
+    ReleaseSRWLockExclusive(&breaker_lock);
+}
+
+/* Server admission
+ *
+ * Limits the number of handshake legs inside AcceptSecurityContext at
+ * once, so that a storm of connections queues in front of the LSA
+ * instead of slowing every handshake in it. Legs over the limit wait
+ * in FIFO order, each on its own condition variable; a leg leaving
+ * hands its slot straight to the longest waiting one. A leg is rejected
+ * when the queue is full or it waited queue_timeout. Disabled until a
+ * limit is configured.
+ * */
+
+typedef struct _admission_waiter {
+    struct _admission_waiter* next;
+    CONDITION_VARIABLE cv;
+    BOOL granted;
+} admission_waiter;
+
+static SRWLOCK admission_lock = SRWLOCK_INIT;
+static sspi_admission_config admission_config = {0, 1024, INFINITE};
+static ULONG admission_in_flight;
+static ULONG admission_queued;
+static admission_waiter* admission_head;
+static admission_waiter* admission_tail;
+static LONG64 admission_admitted;
+static LONG64 admission_rejected;
+static LONG64 admission_timed_out;
+static LONG64 admission_waited;
+static LONG64 admission_wait_us;
+static LONG64 admission_max_wait_us;
+
+static LONG64
+elapsed_us(const LARGE_INTEGER* start) {
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (end.QuadPart - start->QuadPart) * 1000000 / freq.QuadPart;
+}
+
+static VOID
+admission_unlink(admission_waiter* waiter) {
+    admission_waiter** link = &admission_head;
+    admission_waiter* prev = NULL;
+    while (*link != waiter) {
+        prev = *link;
+        link = &(*link)->next;
     }
-    if (outBufs[0].pvBuffer) {
-        FreeContextBuffer(outBufs[0].pvBuffer);
+    *link = waiter->next;
+    if (admission_tail == waiter) {
+        admission_tail = prev;
     }
-    return status;
+    admission_queued--;
 }
 
-INT
-auth_sspi_client_unwrap(sspi_client_state* state, SEC_CHAR* challenge) {
-    SECURITY_STATUS status;
-    DWORD len;
-    SecBuffer wrapBufs[2];
-    SecBufferDesc wrapBufDesc;
-    wrapBufDesc.ulVersion = SECBUFFER_VERSION;
-    wrapBufDesc.cBuffers = 2;
-    wrapBufDesc.pBuffers = wrapBufs;
+/* Waits for a slot. Sets *entered if the caller must call
+ * admission_leave, which is not the case while the limiter is disabled.
+ * */
+static BOOL
+admission_enter(BOOL* entered, sspi_error* err) {
+    admission_waiter waiter;
+    LARGE_INTEGER start;
+    ULONGLONG deadline = 0;
+    LONG64 waited;
 
-    if (state->response != NULL) {
-        free(state->response);
-        state->response = NULL;
-        state->qop = SECQOP_WRAP_NO_ENCRYPT;
+    *entered = FALSE;
+    if (admission_config.max_concurrent == 0) {
+        return TRUE;
     }
-
-    if (!state->haveCtx) {
-        set_uninitialized_context();
-        return AUTH_GSS_ERROR;
+    AcquireSRWLockExclusive(&admission_lock);
+    if (admission_config.max_concurrent == 0) {
+        ReleaseSRWLockExclusive(&admission_lock);
+        return TRUE;
     }
-
-    wrapBufs[0].pvBuffer = base64_decode(challenge, &len);
-    if (!wrapBufs[0].pvBuffer) {
-        return AUTH_GSS_ERROR;
+    if (admission_head == NULL &&
+        admission_in_flight < admission_config.max_concurrent) {
+        admission_in_flight++;
+        admission_admitted++;
+        ReleaseSRWLockExclusive(&admission_lock);
+        *entered = TRUE;
+        return TRUE;
+    }
+    if (admission_queued >= admission_config.max_queue) {
+        admission_rejected++;
+        ReleaseSRWLockExclusive(&admission_lock);
+        save_error(err, 0, "Too many server handshakes are waiting for "
+                           "the LSA.");
+        return FALSE;
     }
-    wrapBufs[0].cbBuffer = len;
-    wrapBufs[0].BufferType = SECBUFFER_STREAM;
-
-    wrapBufs[1].pvBuffer = NULL;
-    wrapBufs[1].cbBuffer = 0;
-    wrapBufs[1].BufferType = SECBUFFER_DATA;
 
-    status = DecryptMessage(&state->ctx, &wrapBufDesc, 0, &state->qop);
-    if (status == SEC_E_OK) {
-        status = AUTH_GSS_COMPLETE;
+    waiter.next = NULL;
+    waiter.granted = FALSE;
+    InitializeConditionVariable(&waiter.cv);
+    if (admission_tail) {
+        admission_tail->next = &waiter;
     } else {
-        set_gsserror(status, "DecryptMessage");
-        status = AUTH_GSS_ERROR;
-        goto done;
+        admission_head = &waiter;
+    }
+    admission_tail = &waiter;
+    admission_queued++;
+    QueryPerformanceCounter(&start);
+    if (admission_config.queue_timeout != INFINITE) {
+        deadline = GetTickCount64() + admission_config.queue_timeout;
+    }
+    while (!waiter.granted) {
+        DWORD wait = INFINITE;
+        if (deadline) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                admission_unlink(&waiter);
+                admission_timed_out++;
+                ReleaseSRWLockExclusive(&admission_lock);
+                save_error(err, 0, "Timed out waiting for the LSA to "
+                                   "accept another server handshake.");
+                return FALSE;
+            }
+            wait = (DWORD)(deadline - now);
+        }
+        SleepConditionVariableSRW(&waiter.cv, &admission_lock, wait, 0);
+    }
+    /* The leg that left counted this one in flight. */
+    waited = elapsed_us(&start);
+    admission_admitted++;
+    admission_waited++;
+    admission_wait_us += waited;
+    if (waited > admission_max_wait_us) {
+        admission_max_wait_us = waited;
+    }
+    ReleaseSRWLockExclusive(&admission_lock);
+    *entered = TRUE;
+    return TRUE;
+}
+
+static VOID
+admission_grant_head(VOID) {
+    admission_waiter* waiter = admission_head;
+    admission_head = waiter->next;
+    if (admission_head == NULL) {
+        admission_tail = NULL;
+    }
+    admission_queued--;
+    waiter->granted = TRUE;
+    WakeConditionVariable(&waiter->cv);
+}
+
+static VOID
+admission_leave(VOID) {
+    AcquireSRWLockExclusive(&admission_lock);
+    /* Hand the slot over unless the limit was lowered below the legs in
+     * flight.
+     * */
+    if (admission_head &&
+        admission_in_flight <= admission_config.max_concurrent) {
+        admission_grant_head();
+    } else {
+        admission_in_flight--;
+    }
+    ReleaseSRWLockExclusive(&admission_lock);
+}
+
+VOID
+auth_sspi_admission_configure(const sspi_admission_config* config) {
+    AcquireSRWLockExclusive(&admission_lock);
+    admission_config = *config;
+    /* Let in the waiters a raised or removed limit has room for. */
+    while (admission_head &&
+           (config->max_concurrent == 0 ||
+            admission_in_flight < config->max_concurrent)) {
+        admission_in_flight++;
+        admission_grant_head();
+    }
+    ReleaseSRWLockExclusive(&admission_lock);
+}
+
+VOID
+auth_sspi_admission_get_stats(sspi_admission_stats* stats) {
+    AcquireSRWLockExclusive(&admission_lock);
+    stats->config = admission_config;
+    stats->in_flight = admission_in_flight;
+    stats->queued = admission_queued;
+    stats->admitted = admission_admitted;
+    stats->rejected = admission_rejected;
+    stats->timed_out = admission_timed_out;
+    stats->waited = admission_waited;
+    stats->wait_us = admission_wait_us;
+    stats->max_wait_us = admission_max_wait_us;
+    ReleaseSRWLockExclusive(&admission_lock);
+}
+
+/* Token screening
+ *
+ * Classifies the token given to a server step by its DER framing, in
+ * place, so that garbage or an unwanted mechanism is turned away without
+ * a call into the LSA. Oversized tokens are the size limits' concern.
+ * Only the headers are read: the outer InitialContextToken or
+ * NegTokenResp, its mechanism OID and, for SPNEGO, the optimistic
+ * mechToken or the responseToken.
+ * */
+
+static const BYTE krb5_oid[] = {
+    0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02};
+/* The OID early Windows versions sent for Kerberos by mistake. */
+static const BYTE ms_krb5_oid[] = {
+    0x2a, 0x86, 0x48, 0x82, 0xf7, 0x12, 0x01, 0x02, 0x02};
+static const BYTE spnego_oid[] = {0x2b, 0x06, 0x01, 0x05, 0x05, 0x02};
+static const BYTE ntlmssp_signature[] = "NTLMSSP";
+
+static SRWLOCK screen_lock = SRWLOCK_INIT;
+static sspi_screen_config screen_config = {FALSE, TRUE};
+static volatile LONG64 screen_seen[SSPI_CLASSES];
+static volatile LONG64 screen_rejected[SSPI_CLASSES];
+
+/* Reads the tag and length at *pos and leaves *pos at the contents.
+ * Fails unless the contents end by end.
+ * */
+static BOOL
+der_header(const BYTE* buf, ULONG end, ULONG* pos, BYTE* tag, ULONG* len) {
+    ULONG p = *pos;
+    ULONG n;
+
+    if (end - p < 2) {
+        return FALSE;
+    }
+    *tag = buf[p++];
+    n = buf[p++];
+    if (n & 0x80) {
+        ULONG count = n & 0x7f;
+        /* DER has no indefinite lengths. */
+        if (count == 0 || count > 4 || end - p < count) {
+            return FALSE;
+        }
+        for (n = 0; count; count--) {
+            n = (n << 8) | buf[p++];
+        }
+    }
+    if (n > end - p) {
+        return FALSE;
+    }
+    *pos = p;
+    *len = n;
+    return TRUE;
+}
+
+static BOOL
+oid_equal(const BYTE* oid, ULONG len, const BYTE* expected, ULONG elen) {
+    return len == elen && memcmp(oid, expected, elen) == 0;
+}
+
+static BOOL
+is_ntlmssp(const BYTE* token, ULONG len) {
+    return len >= sizeof(ntlmssp_signature) &&
+        memcmp(token, ntlmssp_signature, sizeof(ntlmssp_signature)) == 0;
+}
+
+/* Classifies an InitialContextToken whose contents are buf[pos, end):
+ * the mechanism OID followed by the mechanism's token.
+ * */
+static INT
+classify_initial(const BYTE* buf, ULONG end, ULONG pos, INT* mech);
+
+/* Finds the mechanism of the token a NegTokenInit or NegTokenResp
+ * carries in its [2] field. Both are sequences of context tagged
+ * fields, and the token is the same field in each. The mechanism is
+ * SSPI_CLASS_INVALID when there is no token or it is not one we know.
+ * */
+static BOOL
+spnego_mech(const BYTE* buf, ULONG end, ULONG pos, INT* mech) {
+    ULONG len, inner;
+    BYTE tag;
+
+    *mech = SSPI_CLASS_INVALID;
+    if (!der_header(buf, end, &pos, &tag, &len) || tag != 0x30) {
+        return FALSE;
+    }
+    end = pos + len;
+    while (pos < end) {
+        if (!der_header(buf, end, &pos, &tag, &len)) {
+            return FALSE;
+        }
+        if (tag == 0xa2) {
+            inner = pos;
+            if (!der_header(buf, pos + len, &inner, &tag, &len) ||
+                tag != 0x04) {
+                return FALSE;
+            }
+            if (is_ntlmssp(buf + inner, len)) {
+                *mech = SSPI_CLASS_NTLM;
+            } else if (der_header(buf, inner + len, &inner, &tag, &len) &&
+                       tag == 0x60 &&
+                       classify_initial(buf, inner + len, inner, mech) ==
+                           SSPI_CLASS_KERBEROS) {
+                *mech = SSPI_CLASS_KERBEROS;
+            } else {
+                *mech = SSPI_CLASS_INVALID;
+            }
+            return TRUE;
+        }
+        pos += len;
+    }
+    return TRUE;
+}
+
+static INT
+classify_initial(const BYTE* buf, ULONG end, ULONG pos, INT* mech) {
+    const BYTE* oid;
+    ULONG len;
+    BYTE tag;
+
+    if (!der_header(buf, end, &pos, &tag, &len) || tag != 0x06) {
+        return SSPI_CLASS_INVALID;
+    }
+    oid = buf + pos;
+    pos += len;
+    if (oid_equal(oid, len, krb5_oid, sizeof(krb5_oid)) ||
+        oid_equal(oid, len, ms_krb5_oid, sizeof(ms_krb5_oid))) {
+        /* TOK_ID 01 00 is an AP-REQ. */
+        if (end - pos < 2 || buf[pos] != 0x01 || buf[pos + 1] != 0x00) {
+            return SSPI_CLASS_INVALID;
+        }
+        *mech = SSPI_CLASS_KERBEROS;
+        return SSPI_CLASS_KERBEROS;
+    }
+    if (oid_equal(oid, len, spnego_oid, sizeof(spnego_oid))) {
+        /* NegotiationToken, choice negTokenInit [0]. */
+        if (!der_header(buf, end, &pos, &tag, &len) ||
+            tag != 0xa0 ||
+            !spnego_mech(buf, pos + len, pos, mech)) {
+            return SSPI_CLASS_INVALID;
+        }
+        return SSPI_CLASS_SPNEGO_INIT;
+    }
+    return SSPI_CLASS_INVALID;
+}
+
+/* Returns the token's class, and in *mech the mechanism whose token it
+ * is or carries: SSPI_CLASS_KERBEROS, SSPI_CLASS_NTLM or, when that is
+ * unknown, SSPI_CLASS_INVALID. Reads the token without copying it.
+ * */
+INT
+auth_sspi_classify_token(const BYTE* token, ULONG len, INT* mech) {
+    ULONG pos = 0;
+    ULONG clen;
+    BYTE tag;
+
+    *mech = SSPI_CLASS_INVALID;
+    if (is_ntlmssp(token, len)) {
+        *mech = SSPI_CLASS_NTLM;
+        return SSPI_CLASS_NTLM;
+    }
+    if (!der_header(token, len, &pos, &tag, &clen) || pos + clen != len) {
+        return SSPI_CLASS_INVALID;
+    }
+    if (tag == 0x60) {
+        return classify_initial(token, len, pos, mech);
+    }
+    /* NegotiationToken, choice negTokenResp [1]. */
+    if (tag == 0xa1) {
+        if (!spnego_mech(token, len, pos, mech)) {
+            return SSPI_CLASS_INVALID;
+        }
+        return SSPI_CLASS_SPNEGO_RESP;
+    }
+    return SSPI_CLASS_INVALID;
+}
+
+/* Counts the token and, when screening is enabled, fails if the policy
+ * turns it away.
+ * */
+static BOOL
+screen_token(const BYTE* token, ULONG len, sspi_error* err) {
+    sspi_screen_config config;
+    INT mech;
+    INT cls = auth_sspi_classify_token(token, len, &mech);
+
+    InterlockedIncrement64(&screen_seen[cls]);
+    AcquireSRWLockShared(&screen_lock);
+    config = screen_config;
+    ReleaseSRWLockShared(&screen_lock);
+    if (!config.enabled) {
+        return TRUE;
+    }
+    if (cls == SSPI_CLASS_INVALID) {
+        save_error(err, 0, "The token is not a Kerberos, NTLM or SPNEGO "
+                           "token.");
+    } else if (mech == SSPI_CLASS_NTLM && !config.allow_ntlm) {
+        save_error(err, 0, "NTLM is not accepted.");
+    } else {
+        return TRUE;
+    }
+    InterlockedIncrement64(&screen_rejected[cls]);
+    return FALSE;
+}
+
+VOID
+auth_sspi_screen_configure(const sspi_screen_config* config) {
+    AcquireSRWLockExclusive(&screen_lock);
+    screen_config = *config;
+    ReleaseSRWLockExclusive(&screen_lock);
+}
+
+VOID
+auth_sspi_screen_get_stats(sspi_screen_stats* stats) {
+    INT i;
+    AcquireSRWLockShared(&screen_lock);
+    stats->config = screen_config;
+    ReleaseSRWLockShared(&screen_lock);
+    for (i = 0; i < SSPI_CLASSES; i++) {
+        stats->seen[i] = screen_seen[i];
+        stats->rejected[i] = screen_rejected[i];
+    }
+}
+
+/* Token size limits
+ *
+ * Bound the base64 input of steps and unwraps by its encoded length, so
+ * that an oversized token is rejected before any memory is allocated or
+ * any time spent decoding it. The step limits default to 128K
+ * characters, well above the encoded length of the largest
+ * MaxTokenSize, 65535 bytes. Unwrap has no limit by default.
+ * */
+
+static SRWLOCK size_limits_lock = SRWLOCK_INIT;
+static sspi_size_limits size_limits = {{131072, 131072, 0}};
+static volatile LONG64 size_limits_rejected[SSPI_LIMITS];
+
+static BOOL
+within_size_limit(INT kind, ULONG len, sspi_error* err) {
+    ULONG max_length;
+
+    AcquireSRWLockShared(&size_limits_lock);
+    max_length = size_limits.max_length[kind];
+    ReleaseSRWLockShared(&size_limits_lock);
+    if (max_length && len > max_length) {
+        InterlockedIncrement64(&size_limits_rejected[kind]);
+        save_error(err, 0, "The token is longer than the size limit.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID
+auth_sspi_size_limits_configure(const sspi_size_limits* limits) {
+    AcquireSRWLockExclusive(&size_limits_lock);
+    size_limits = *limits;
+    ReleaseSRWLockExclusive(&size_limits_lock);
+}
+
+VOID
+auth_sspi_size_limits_get_stats(sspi_size_limit_stats* stats) {
+    INT i;
+    AcquireSRWLockShared(&size_limits_lock);
+    stats->limits = size_limits;
+    ReleaseSRWLockShared(&size_limits_lock);
+    for (i = 0; i < SSPI_LIMITS; i++) {
+        stats->rejected[i] = size_limits_rejected[i];
+    }
+}
+
+/* Credentials
+ *
+ * Outbound credentials are shared by reference count, so the refresher
+ * can replace a template's credentials while contexts are still using
+ * the old ones. Inbound credentials belong to one server state, which
+ * swaps in the renewed ones between handshakes.
+ * */
+
+/* Packages report credentials that never expire with a time close to
+ * the largest FILETIME.
+ * */
+#define NEVER_EXPIRES_HIGH 0x7FFFFF36
+
+static LONGLONG
+timestamp_value(const TimeStamp* ts) {
+    return ((LONGLONG)ts->HighPart << 32) | ts->LowPart;
+}
+
+/* Converts an SSPI expiry, in local time, to seconds since the epoch.
+ * Returns FALSE if it is unknown or never comes.
+ * */
+BOOL
+auth_sspi_expiry_to_unix(const TimeStamp* expiry, double* seconds) {
+    FILETIME local, utc;
+    ULARGE_INTEGER value;
+
+    if (timestamp_value(expiry) <= 0 ||
+        expiry->HighPart >= NEVER_EXPIRES_HIGH) {
+        return FALSE;
+    }
+    local.dwLowDateTime = expiry->LowPart;
+    local.dwHighDateTime = (DWORD)expiry->HighPart;
+    if (!LocalFileTimeToFileTime(&local, &utc)) {
+        return FALSE;
+    }
+    value.LowPart = utc.dwLowDateTime;
+    value.HighPart = utc.dwHighDateTime;
+    /* FILETIME counts 100ns intervals since 1601. */
+    *seconds = ((double)value.QuadPart - 116444736000000000.0) / 1e7;
+    return TRUE;
+}
+
+static BOOL
+cred_expiring(const TimeStamp* expiry, DWORD margin) {
+    FILETIME utc, local;
+    LONGLONG now;
+
+    if (timestamp_value(expiry) <= 0 ||
+        expiry->HighPart >= NEVER_EXPIRES_HIGH) {
+        return FALSE;
+    }
+    GetSystemTimeAsFileTime(&utc);
+    FileTimeToLocalFileTime(&utc, &local);
+    now = ((LONGLONG)local.dwHighDateTime << 32) | local.dwLowDateTime;
+    return timestamp_value(expiry) - now <= (LONGLONG)margin * 10000;
+}
+
+static SECURITY_STATUS
+cred_acquire(WCHAR* mechoid,
+             SEC_WINNT_AUTH_IDENTITY_W* identity,
+             sspi_cred** out) {
+    SECURITY_STATUS status;
+    sspi_cred* cred = (sspi_cred*)malloc(sizeof(sspi_cred));
+    if (cred == NULL) {
+        return SEC_E_INSUFFICIENT_MEMORY;
+    }
+    /* Note that the first paramater, pszPrincipal, appears to be
+     * completely ignored in the Kerberos SSP. For more details see
+     * https://github.com/mongodb-labs/winkerberos/issues/11.
+     * */
+    status = AcquireCredentialsHandleW(/* Principal */
+                                       NULL,
+                                       /* Security package name */
+                                       mechoid,
+                                       /* Credentials Use */
+                                       SECPKG_CRED_OUTBOUND,
+                                       /* LogonID (We don't use this) */
+                                       NULL,
+                                       /* AuthData */
+                                       identity,
+                                       /* Always NULL */
+                                       NULL,
+                                       /* Always NULL */
+                                       NULL,
+                                       /* CredHandle */
+                                       &cred->handle,
+                                       /* Expiry */
+                                       &cred->expiry);
+    if (status != SEC_E_OK) {
+        free(cred);
+        return status;
+    }
+    cred->refcount = 1;
+    *out = cred;
+    return SEC_E_OK;
+}
+
+static VOID
+cred_release(sspi_cred* cred) {
+    if (InterlockedDecrement(&cred->refcount) == 0) {
+        FreeCredentialsHandle(&cred->handle);
+        free(cred);
+    }
+}
+
+/* Returns a reference to the current credentials of tmpl, or of the
+ * template they are borrowed from.
+ * */
+static sspi_cred*
+template_cred(sspi_client_template* tmpl) {
+    sspi_cred* cred;
+    while (tmpl->parent) {
+        tmpl = tmpl->parent;
+    }
+    AcquireSRWLockShared(&tmpl->credLock);
+    cred = tmpl->cred;
+    InterlockedIncrement(&cred->refcount);
+    ReleaseSRWLockShared(&tmpl->credLock);
+    return cred;
+}
+
+static SEC_WINNT_AUTH_IDENTITY_W*
+identity_copy(const SEC_WINNT_AUTH_IDENTITY_W* identity) {
+    SEC_WINNT_AUTH_IDENTITY_W* copy;
+    WCHAR* next;
+
+    copy = (SEC_WINNT_AUTH_IDENTITY_W*)malloc(
+        sizeof(SEC_WINNT_AUTH_IDENTITY_W) +
+        sizeof(WCHAR) * (identity->UserLength +
+                         identity->DomainLength +
+                         identity->PasswordLength + 3));
+    if (copy == NULL) {
+        return NULL;
+    }
+    *copy = *identity;
+    next = (WCHAR*)(copy + 1);
+    if (identity->User) {
+        memcpy(next, identity->User, sizeof(WCHAR) * identity->UserLength);
+        next[identity->UserLength] = 0;
+        copy->User = next;
+        next += identity->UserLength + 1;
+    }
+    if (identity->Domain) {
+        memcpy(next,
+               identity->Domain,
+               sizeof(WCHAR) * identity->DomainLength);
+        next[identity->DomainLength] = 0;
+        copy->Domain = next;
+        next += identity->DomainLength + 1;
+    }
+    if (identity->Password) {
+        memcpy(next,
+               identity->Password,
+               sizeof(WCHAR) * identity->PasswordLength);
+        next[identity->PasswordLength] = 0;
+        copy->Password = next;
+    }
+    return copy;
+}
+
+static VOID
+identity_free(SEC_WINNT_AUTH_IDENTITY_W* identity) {
+    SecureZeroMemory(identity,
+                     sizeof(SEC_WINNT_AUTH_IDENTITY_W) +
+                     sizeof(WCHAR) * (identity->UserLength +
+                                      identity->DomainLength +
+                                      identity->PasswordLength + 3));
+    free(identity);
+}
+
+/* Credential refresher
+ *
+ * A thread that wakes up every interval and renews the credentials of
+ * registered client templates and server states that expire within the
+ * margin, so that no handshake waits for AcquireCredentialsHandle or
+ * fails with expired credentials. Templates and server states created
+ * while the refresher runs are registered until they are freed.
+ *
+ * A pass takes a snapshot of the lists and renews outside the lock, so
+ * that registering and freeing never wait for the KDC. Templates in the
+ * snapshot are kept alive by a reference; server states, which the
+ * bindings own, are pinned and unregistering one waits until the
+ * refresher is done with it.
+ * */
+
+static SRWLOCK refresh_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE refresh_unpinned = CONDITION_VARIABLE_INIT;
+static sspi_client_template* refresh_clients;
+static sspi_server_state* refresh_servers;
+static volatile ULONG refresh_client_count;
+static volatile ULONG refresh_server_count;
+/* Guards the thread and the configuration. */
+static SRWLOCK refresh_config_lock = SRWLOCK_INIT;
+static HANDLE refresh_thread;
+static HANDLE refresh_stop;
+/* Milliseconds. 0 disables the refresher. */
+static volatile DWORD refresh_interval;
+static volatile DWORD refresh_margin = 600 * 1000;
+static volatile LONG64 refresh_refreshed;
+static volatile LONG64 refresh_failures;
+
+/* Takes a copy of identity, the explicit credentials or NULL. */
+static BOOL
+refresh_register_client(sspi_client_template* tmpl,
+                        SEC_WINNT_AUTH_IDENTITY_W* identity) {
+    if (identity) {
+        tmpl->renewIdentity = identity_copy(identity);
+        if (tmpl->renewIdentity == NULL) {
+            return FALSE;
+        }
+    }
+    AcquireSRWLockExclusive(&refresh_lock);
+    tmpl->refreshPrev = NULL;
+    tmpl->refreshNext = refresh_clients;
+    if (refresh_clients) {
+        refresh_clients->refreshPrev = tmpl;
+    }
+    refresh_clients = tmpl;
+    refresh_client_count++;
+    tmpl->refreshing = 1;
+    ReleaseSRWLockExclusive(&refresh_lock);
+    return TRUE;
+}
+
+static VOID
+refresh_unregister_client(sspi_client_template* tmpl) {
+    AcquireSRWLockExclusive(&refresh_lock);
+    if (tmpl->refreshPrev) {
+        tmpl->refreshPrev->refreshNext = tmpl->refreshNext;
+    } else {
+        refresh_clients = tmpl->refreshNext;
+    }
+    if (tmpl->refreshNext) {
+        tmpl->refreshNext->refreshPrev = tmpl->refreshPrev;
+    }
+    refresh_client_count--;
+    tmpl->refreshing = 0;
+    ReleaseSRWLockExclusive(&refresh_lock);
+    if (tmpl->renewIdentity) {
+        identity_free(tmpl->renewIdentity);
+        tmpl->renewIdentity = NULL;
+    }
+}
+
+static VOID
+refresh_register_server(sspi_server_state* state) {
+    AcquireSRWLockExclusive(&refresh_lock);
+    state->refreshPrev = NULL;
+    state->refreshNext = refresh_servers;
+    if (refresh_servers) {
+        refresh_servers->refreshPrev = state;
+    }
+    refresh_servers = state;
+    refresh_server_count++;
+    state->refreshPinned = 0;
+    state->refreshing = 1;
+    ReleaseSRWLockExclusive(&refresh_lock);
+}
+
+static VOID
+refresh_unregister_server(sspi_server_state* state) {
+    AcquireSRWLockExclusive(&refresh_lock);
+    while (state->refreshPinned) {
+        SleepConditionVariableSRW(
+            &refresh_unpinned, &refresh_lock, INFINITE, 0);
+    }
+    if (state->refreshPrev) {
+        state->refreshPrev->refreshNext = state->refreshNext;
+    } else {
+        refresh_servers = state->refreshNext;
+    }
+    if (state->refreshNext) {
+        state->refreshNext->refreshPrev = state->refreshPrev;
+    }
+    refresh_server_count--;
+    state->refreshing = 0;
+    ReleaseSRWLockExclusive(&refresh_lock);
+}
+
+static VOID
+refresh_client(sspi_client_template* tmpl, DWORD margin) {
+    sspi_cred* cred;
+    sspi_cred* old;
+
+    /* Only this thread replaces the credentials of a template. */
+    if (!cred_expiring(&tmpl->cred->expiry, margin)) {
+        return;
+    }
+    if (cred_acquire(tmpl->mechoid, tmpl->renewIdentity, &cred) != SEC_E_OK) {
+        InterlockedIncrement64(&refresh_failures);
+        return;
+    }
+    AcquireSRWLockExclusive(&tmpl->credLock);
+    old = tmpl->cred;
+    tmpl->cred = cred;
+    ReleaseSRWLockExclusive(&tmpl->credLock);
+    /* Contexts that started a handshake with them keep them alive. */
+    cred_release(old);
+    InterlockedIncrement64(&refresh_refreshed);
+}
+
+static VOID
+refresh_server(sspi_server_state* state, DWORD margin) {
+    SECURITY_STATUS status;
+    CredHandle cred;
+    TimeStamp expiry;
+    BOOL needed;
+
+    AcquireSRWLockShared(&state->credLock);
+    needed = !state->haveNextCred &&
+             cred_expiring(&state->cred_expiry, margin);
+    ReleaseSRWLockShared(&state->credLock);
+    if (!needed) {
+        return;
+    }
+    /* As in auth_sspi_server_init. */
+    status = AcquireCredentialsHandleW(NULL,
+                                       GSS_MECH_OID_SPNEGO,
+                                       SECPKG_CRED_INBOUND,
+                                       NULL,
+                                       NULL,
+                                       NULL,
+                                       NULL,
+                                       &cred,
+                                       &expiry);
+    if (status != SEC_E_OK) {
+        InterlockedIncrement64(&refresh_failures);
+        return;
+    }
+    AcquireSRWLockExclusive(&state->credLock);
+    state->nextCred = cred;
+    state->next_cred_expiry = expiry;
+    state->haveNextCred = 1;
+    ReleaseSRWLockExclusive(&state->credLock);
+    InterlockedIncrement64(&refresh_refreshed);
+}
+
+/* Takes a reference unless the template is already being freed, in
+ * which case its final release is waiting to unregister it.
+ * */
+static BOOL
+template_try_retain(sspi_client_template* tmpl) {
+    LONG count = tmpl->refcount;
+    while (count > 0) {
+        LONG seen = InterlockedCompareExchange(
+            &tmpl->refcount, count + 1, count);
+        if (seen == count) {
+            return TRUE;
+        }
+        count = seen;
+    }
+    return FALSE;
+}
+
+static VOID
+refresh_pass(DWORD margin) {
+    sspi_client_template** clients;
+    sspi_server_state** servers;
+    sspi_client_template* tmpl;
+    sspi_server_state* state;
+    /* Registered after this are left for the next pass. */
+    ULONG maxClients = refresh_client_count;
+    ULONG maxServers = refresh_server_count;
+    ULONG nclients = 0;
+    ULONG nservers = 0;
+    ULONG i;
+
+    clients = (sspi_client_template**)malloc(
+        sizeof(sspi_client_template*) * (maxClients + 1));
+    servers = (sspi_server_state**)malloc(
+        sizeof(sspi_server_state*) * (maxServers + 1));
+    if (clients == NULL || servers == NULL) {
+        free(clients);
+        free(servers);
+        InterlockedIncrement64(&refresh_failures);
+        return;
+    }
+
+    AcquireSRWLockExclusive(&refresh_lock);
+    for (tmpl = refresh_clients; tmpl && nclients < maxClients;
+         tmpl = tmpl->refreshNext) {
+        if (template_try_retain(tmpl)) {
+            clients[nclients++] = tmpl;
+        }
+    }
+    for (state = refresh_servers; state && nservers < maxServers;
+         state = state->refreshNext) {
+        state->refreshPinned = 1;
+        servers[nservers++] = state;
+    }
+    ReleaseSRWLockExclusive(&refresh_lock);
+
+    for (i = 0; i < nclients; i++) {
+        refresh_client(clients[i], margin);
+        /* May be the last reference, which unregisters the template. */
+        auth_sspi_client_template_release(clients[i]);
+    }
+    for (i = 0; i < nservers; i++) {
+        refresh_server(servers[i], margin);
+        AcquireSRWLockExclusive(&refresh_lock);
+        servers[i]->refreshPinned = 0;
+        ReleaseSRWLockExclusive(&refresh_lock);
+        WakeAllConditionVariable(&refresh_unpinned);
+    }
+    free(clients);
+    free(servers);
+}
+
+static unsigned __stdcall
+refresh_main(void* param) {
+    HANDLE stop = (HANDLE)param;
+    while (WaitForSingleObject(stop, refresh_interval) == WAIT_TIMEOUT) {
+        refresh_pass(refresh_margin);
+    }
+    return 0;
+}
+
+/* Stops the refresher and, if interval is not 0, starts it again with
+ * the new settings. Returns FALSE if the thread could not be started.
+ * */
+BOOL
+auth_sspi_refresh_configure(DWORD interval, DWORD margin) {
+    BOOL ok = TRUE;
+
+    AcquireSRWLockExclusive(&refresh_config_lock);
+    if (refresh_thread) {
+        SetEvent(refresh_stop);
+        WaitForSingleObject(refresh_thread, INFINITE);
+        CloseHandle(refresh_thread);
+        CloseHandle(refresh_stop);
+        refresh_thread = NULL;
+        refresh_stop = NULL;
+    }
+    refresh_interval = interval;
+    refresh_margin = margin;
+    if (interval) {
+        refresh_stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (refresh_stop) {
+            refresh_thread = (HANDLE)_beginthreadex(
+                NULL, 0, refresh_main, refresh_stop, 0, NULL);
+        }
+        if (refresh_thread == NULL) {
+            if (refresh_stop) {
+                CloseHandle(refresh_stop);
+                refresh_stop = NULL;
+            }
+            refresh_interval = 0;
+            ok = FALSE;
+        }
+    }
+    ReleaseSRWLockExclusive(&refresh_config_lock);
+    return ok;
+}
+
+VOID
+auth_sspi_refresh_get_stats(sspi_refresh_stats* stats) {
+    AcquireSRWLockShared(&refresh_config_lock);
+    stats->interval = refresh_interval;
+    stats->margin = refresh_margin;
+    ReleaseSRWLockShared(&refresh_config_lock);
+    stats->clients = refresh_client_count;
+    stats->servers = refresh_server_count;
+    stats->refreshed = refresh_refreshed;
+    stats->failures = refresh_failures;
+}
+
+VOID
+auth_sspi_client_template_get_expiry(sspi_client_template* tmpl,
+                                     TimeStamp* cred_expiry) {
+    sspi_cred* cred = template_cred(tmpl);
+    *cred_expiry = cred->expiry;
+    cred_release(cred);
+}
+
+/* The context expiry is 0 until the first step succeeds. */
+VOID
+auth_sspi_client_get_expiry(sspi_client_state* state,
+                            TimeStamp* cred_expiry,
+                            TimeStamp* ctx_expiry) {
+    if (state->cred) {
+        *cred_expiry = state->cred->expiry;
+    } else {
+        auth_sspi_client_template_get_expiry(state->tmpl, cred_expiry);
+    }
+    if (state->haveCtx) {
+        *ctx_expiry = state->expiry;
+    } else {
+        ctx_expiry->LowPart = 0;
+        ctx_expiry->HighPart = 0;
+    }
+}
+
+static WCHAR* mech_memory_lookup(const WCHAR* spn, const WCHAR* identity);
+
+sspi_client_template*
+auth_sspi_client_template_new(WCHAR* service,
+                              ULONG flags,
+                              WCHAR* user,
+                              ULONG ulen,
+                              WCHAR* domain,
+                              ULONG dlen,
+                              WCHAR* password,
+                              ULONG plen,
+                              WCHAR* mechoid,
+                              sspi_error* err) {
+    SECURITY_STATUS status;
+    SEC_WINNT_AUTH_IDENTITY_W authIdentity;
+    sspi_client_template* tmpl;
+    ULONGLONG start;
+    BOOL probe;
+
+    tmpl = (sspi_client_template*)malloc(sizeof(sspi_client_template));
+    if (tmpl == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    tmpl->refcount = 1;
+    tmpl->flags = flags;
+    tmpl->mechoid = mechoid;
+    tmpl->identity = NULL;
+    tmpl->cred = NULL;
+    InitializeSRWLock(&tmpl->credLock);
+    tmpl->autoMech = 0;
+    tmpl->parent = NULL;
+    tmpl->renewIdentity = NULL;
+    tmpl->refreshing = 0;
+    tmpl->spn = spn_from_service(service, err);
+    if (tmpl->spn == NULL) {
+        goto fail;
+    }
+
+    if (user) {
+        tmpl->identity = (WCHAR*)malloc(sizeof(WCHAR) * (dlen + ulen + 2));
+        if (tmpl->identity == NULL) {
+            save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+            goto fail;
+        }
+        memcpy(tmpl->identity, domain, sizeof(WCHAR) * dlen);
+        tmpl->identity[dlen] = L'\\';
+        memcpy(tmpl->identity + dlen + 1, user, sizeof(WCHAR) * ulen);
+        tmpl->identity[dlen + ulen + 1] = 0;
+        authIdentity.User = user;
+        authIdentity.UserLength = ulen;
+        authIdentity.Domain = domain;
+        authIdentity.DomainLength = dlen;
+        authIdentity.Password = password;
+        authIdentity.PasswordLength = plen;
+        authIdentity.Flags = SEC_WINNT_AUTH_IDENTITY_UNICODE;
+    }
+
+    if (wcscmp(mechoid, GSS_MECH_OID_AUTO) == 0) {
+        tmpl->mechoid = mech_memory_lookup(tmpl->spn, tmpl->identity);
+        tmpl->autoMech = 1;
+    }
+
+    if (!breaker_admit(&probe, err)) {
+        goto fail;
+    }
+    start = GetTickCount64();
+    status = cred_acquire(
+        tmpl->mechoid, user ? &authIdentity : NULL, &tmpl->cred);
+    breaker_record(probe, start, status);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "AcquireCredentialsHandle");
+        goto fail;
+    }
+    if (refresh_interval &&
+        !refresh_register_client(tmpl, user ? &authIdentity : NULL)) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        goto fail;
+    }
+    return tmpl;
+
+fail:
+    auth_sspi_client_template_release(tmpl);
+    return NULL;
+}
+
+sspi_client_template*
+auth_sspi_client_template_derive(sspi_client_template* parent,
+                                 WCHAR* service,
+                                 sspi_error* err) {
+    sspi_client_template* tmpl;
+
+    tmpl = (sspi_client_template*)malloc(sizeof(sspi_client_template));
+    if (tmpl == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    tmpl->spn = spn_from_service(service, err);
+    if (tmpl->spn == NULL) {
+        free(tmpl);
+        return NULL;
+    }
+    tmpl->refcount = 1;
+    tmpl->flags = parent->flags;
+    tmpl->mechoid = parent->mechoid;
+    tmpl->autoMech = parent->autoMech;
+    /* The credentials are borrowed. Only the parent frees them. */
+    tmpl->identity = parent->identity;
+    tmpl->cred = NULL;
+    InitializeSRWLock(&tmpl->credLock);
+    tmpl->renewIdentity = NULL;
+    tmpl->refreshing = 0;
+    auth_sspi_client_template_retain(parent);
+    tmpl->parent = parent;
+    return tmpl;
+}
+
+VOID
+auth_sspi_client_template_retain(sspi_client_template* tmpl) {
+    InterlockedIncrement(&tmpl->refcount);
+}
+
+VOID
+auth_sspi_client_template_release(sspi_client_template* tmpl) {
+    /* Contexts may be destroyed on any thread. */
+    if (InterlockedDecrement(&tmpl->refcount) != 0) {
+        return;
+    }
+    if (tmpl->refreshing) {
+        refresh_unregister_client(tmpl);
+    }
+    if (tmpl->cred) {
+        cred_release(tmpl->cred);
+    }
+    if (tmpl->parent) {
+        auth_sspi_client_template_release(tmpl->parent);
+    } else {
+        free(tmpl->identity);
+    }
+    free(tmpl->spn);
+    free(tmpl);
+}
+
+INT
+auth_sspi_client_init(sspi_client_template* tmpl, sspi_client_state* state) {
+    state->response = NULL;
+    state->username = NULL;
+    state->qop = SECQOP_WRAP_NO_ENCRYPT;
+    state->haveCtx = 0;
+    state->haveSizes = 0;
+    state->cred = NULL;
+    state->token = NULL;
+    state->expiry.LowPart = 0;
+    state->expiry.HighPart = 0;
+    /* The SPN and credentials are shared, not copied. */
+    auth_sspi_client_template_retain(tmpl);
+    state->tmpl = tmpl;
+    return AUTH_GSS_COMPLETE;
+}
+
+/* TTL lists
+ *
+ * Small process-wide lists of per-SPN outcomes that expire, used by the
+ * negative cache and the mechanism memory. An entry is keyed by SPN,
+ * package and identity; the package is NULL for lists that do not key on
+ * it. Expired entries are dropped by the next record, and a full list
+ * replaces the entry closest to expiring.
+ * */
+
+typedef struct _ttl_entry {
+    struct _ttl_entry* next;
+    WCHAR* spn;
+    WCHAR* mechoid;
+    WCHAR* identity;
+    LONG_PTR value;
+    /* Refreshed with the lock held shared. */
+    volatile LONG64 expires;
+} ttl_entry;
+
+typedef struct {
+    SRWLOCK lock;
+    ttl_entry* entries;
+    ULONG count;
+    ULONG max;
+    /* Milliseconds. 0 disables the list. */
+    volatile DWORD ttl;
+    volatile LONG64 recorded;
+    volatile LONG64 hits;
+} ttl_list;
+
+static WCHAR*
+copy_wide(const WCHAR* value) {
+    WCHAR* copy;
+    SIZE_T len;
+    if (value == NULL) {
+        return NULL;
+    }
+    len = wcslen(value) + 1;
+    copy = (WCHAR*)malloc(sizeof(WCHAR) * len);
+    if (copy) {
+        memcpy(copy, value, sizeof(WCHAR) * len);
+    }
+    return copy;
+}
+
+static BOOL
+same_wide(const WCHAR* a, const WCHAR* b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return wcscmp(a, b) == 0;
+}
+
+static BOOL
+ttl_matches(ttl_entry* entry,
+            const WCHAR* spn,
+            const WCHAR* mechoid,
+            const WCHAR* identity) {
+    return (_wcsicmp(entry->spn, spn) == 0 &&
+            same_wide(entry->mechoid, mechoid) &&
+            same_wide(entry->identity, identity));
+}
+
+static VOID
+ttl_free(ttl_entry* entry) {
+    free(entry->spn);
+    free(entry->mechoid);
+    free(entry->identity);
+    free(entry);
+}
+
+/* Caller holds list->lock exclusively. */
+static VOID
+ttl_clear(ttl_list* list) {
+    while (list->entries) {
+        ttl_entry* next = list->entries->next;
+        ttl_free(list->entries);
+        list->entries = next;
+    }
+    list->count = 0;
+}
+
+/* Returns TRUE and sets *value if a live entry matches. Counts a hit. */
+static BOOL
+ttl_lookup(ttl_list* list,
+           const WCHAR* spn,
+           const WCHAR* mechoid,
+           const WCHAR* identity,
+           LONG_PTR* value) {
+    ttl_entry* entry;
+    ULONGLONG now;
+    BOOL found = FALSE;
+
+    if (list->ttl == 0) {
+        return FALSE;
+    }
+    now = GetTickCount64();
+    AcquireSRWLockShared(&list->lock);
+    for (entry = list->entries; entry; entry = entry->next) {
+        if ((ULONGLONG)entry->expires > now &&
+            ttl_matches(entry, spn, mechoid, identity)) {
+            *value = entry->value;
+            found = TRUE;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&list->lock);
+    if (found) {
+        InterlockedIncrement64(&list->hits);
+    }
+    return found;
+}
+
+/* Extends a live entry that already holds value, with the lock shared. */
+static BOOL
+ttl_refresh(ttl_list* list,
+            const WCHAR* spn,
+            const WCHAR* mechoid,
+            const WCHAR* identity,
+            LONG_PTR value,
+            ULONGLONG now,
+            DWORD ttl) {
+    ttl_entry* entry;
+    BOOL found = FALSE;
+
+    AcquireSRWLockShared(&list->lock);
+    for (entry = list->entries; entry; entry = entry->next) {
+        if ((ULONGLONG)entry->expires > now &&
+            ttl_matches(entry, spn, mechoid, identity)) {
+            if (entry->value == value) {
+                InterlockedExchange64(&entry->expires, (LONG64)(now + ttl));
+                found = TRUE;
+            }
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&list->lock);
+    return found;
+}
+
+/* Remembers value for the key. Returns TRUE if an entry was added rather
+ * than an existing one updated. */
+static BOOL
+ttl_record(ttl_list* list,
+           const WCHAR* spn,
+           const WCHAR* mechoid,
+           const WCHAR* identity,
+           LONG_PTR value) {
+    ttl_entry** link;
+    ttl_entry** oldest = NULL;
+    ttl_entry* entry = NULL;
+    ttl_entry* added;
+    ttl_entry* evicted = NULL;
+    ULONGLONG now;
+    DWORD ttl = list->ttl;
+
+    if (ttl == 0) {
+        return FALSE;
+    }
+    now = GetTickCount64();
+    /* The common case of repeating the last outcome needs neither the
+     * exclusive lock nor a copy of the key. */
+    if (ttl_refresh(list, spn, mechoid, identity, value, now, ttl)) {
+        return FALSE;
+    }
+    /* Allocate before taking the lock. */
+    added = (ttl_entry*)malloc(sizeof(ttl_entry));
+    if (added == NULL) {
+        return FALSE;
+    }
+    added->spn = copy_wide(spn);
+    added->mechoid = copy_wide(mechoid);
+    added->identity = copy_wide(identity);
+    if (added->spn == NULL ||
+        (mechoid && added->mechoid == NULL) ||
+        (identity && added->identity == NULL)) {
+        ttl_free(added);
+        return FALSE;
+    }
+    added->value = value;
+
+    AcquireSRWLockExclusive(&list->lock);
+    /* Drop expired entries, look for an existing one and note the one
+     * closest to expiring in case the list is full. */
+    link = &list->entries;
+    while (*link) {
+        ttl_entry* current = *link;
+        if ((ULONGLONG)current->expires <= now) {
+            *link = current->next;
+            ttl_free(current);
+            list->count--;
+        } else {
+            if (ttl_matches(current, spn, mechoid, identity)) {
+                entry = current;
+            }
+            if (oldest == NULL || current->expires < (*oldest)->expires) {
+                oldest = link;
+            }
+            link = &current->next;
+        }
+    }
+    if (entry) {
+        entry->value = value;
+        entry->expires = (LONG64)(now + ttl);
+    } else {
+        if (list->count >= list->max) {
+            evicted = *oldest;
+            *oldest = evicted->next;
+            list->count--;
+        }
+        added->expires = (LONG64)(now + ttl);
+        added->next = list->entries;
+        list->entries = added;
+        list->count++;
+        added = NULL;
+    }
+    ReleaseSRWLockExclusive(&list->lock);
+    if (evicted) {
+        ttl_free(evicted);
+    }
+    if (added) {
+        ttl_free(added);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static VOID
+ttl_configure(ttl_list* list, DWORD ttl) {
+    AcquireSRWLockExclusive(&list->lock);
+    list->ttl = ttl;
+    ttl_clear(list);
+    ReleaseSRWLockExclusive(&list->lock);
+}
+
+static VOID
+ttl_get_stats(ttl_list* list, DWORD* ttl, ULONG* entries) {
+    AcquireSRWLockShared(&list->lock);
+    *ttl = list->ttl;
+    *entries = list->count;
+    ReleaseSRWLockShared(&list->lock);
+}
+
+/* Negative cache
+ *
+ * First steps that failed because the SPN is unknown, keyed by SPN,
+ * package and identity, so that retries fail without asking the KDC
+ * again until the entry expires. Disabled until a TTL is configured.
+ * */
+
+static ttl_list negative_cache = {SRWLOCK_INIT, NULL, 0, 256, 0, 0, 0};
+
+static BOOL
+negative_cacheable(SECURITY_STATUS status) {
+    return status == SEC_E_TARGET_UNKNOWN || status == SEC_E_WRONG_PRINCIPAL;
+}
+
+static BOOL
+negative_lookup(sspi_client_template* tmpl, SECURITY_STATUS* status) {
+    LONG_PTR value;
+    if (!ttl_lookup(&negative_cache,
+                    tmpl->spn, tmpl->mechoid, tmpl->identity, &value)) {
+        return FALSE;
+    }
+    *status = (SECURITY_STATUS)value;
+    return TRUE;
+}
+
+static VOID
+negative_record(sspi_client_template* tmpl, SECURITY_STATUS status) {
+    if (!negative_cacheable(status)) {
+        return;
+    }
+    /* Count failures that add an entry, not ones that extend it. */
+    if (ttl_record(&negative_cache, tmpl->spn, tmpl->mechoid,
+                   tmpl->identity, (LONG_PTR)status)) {
+        InterlockedIncrement64(&negative_cache.recorded);
+    }
+}
+
+VOID
+auth_sspi_negative_cache_configure(DWORD ttl) {
+    ttl_configure(&negative_cache, ttl);
+}
+
+VOID
+auth_sspi_negative_cache_get_stats(sspi_negative_cache_stats* stats) {
+    ttl_get_stats(&negative_cache, &stats->ttl, &stats->entries);
+    stats->recorded = negative_cache.recorded;
+    stats->suppressed = negative_cache.hits;
+}
+
+/* Mechanism memory
+ *
+ * For templates created with GSS_MECH_OID_AUTO, the package that last
+ * completed a handshake with an SPN, keyed by SPN and identity. Kerberos
+ * is used for SPNs not in the memory. A first step that fails because
+ * Kerberos is unavailable makes later templates for the SPN use
+ * Negotiate, which can fall back to NTLM, instead of failing the same
+ * way. Failures that would fail Negotiate too, such as an unreachable KDC
+ * or an unknown SPN, are not remembered.
+ * */
+
+static ttl_list mech_memory = {SRWLOCK_INIT, NULL, 0, 1024, 3600 * 1000, 0, 0};
+
+static BOOL
+mech_unavailable(SECURITY_STATUS status) {
+    switch (status) {
+    case SEC_E_SECPKG_NOT_FOUND:
+    case SEC_E_NO_CREDENTIALS:
+    case SEC_E_UNSUPPORTED_FUNCTION:
+    case SEC_E_KDC_UNKNOWN_ETYPE:
+    case SEC_E_NO_KERB_KEY:
+    case SEC_E_UNSUPPORTED_PREAUTH:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static WCHAR*
+mech_memory_lookup(const WCHAR* spn, const WCHAR* identity) {
+    LONG_PTR value;
+    if (!ttl_lookup(&mech_memory, spn, NULL, identity, &value)) {
+        return GSS_MECH_OID_KRB5;
+    }
+    return (WCHAR*)value;
+}
+
+/* mechoid is GSS_MECH_OID_KRB5 or GSS_MECH_OID_SPNEGO, never copied. */
+static VOID
+mech_memory_record(sspi_client_template* tmpl, WCHAR* mechoid) {
+    if (!tmpl->autoMech || mech_memory.ttl == 0) {
+        return;
+    }
+    ttl_record(&mech_memory, tmpl->spn, NULL, tmpl->identity,
+               (LONG_PTR)mechoid);
+    InterlockedIncrement64(&mech_memory.recorded);
+}
+
+VOID
+auth_sspi_mech_memory_configure(DWORD ttl) {
+    ttl_configure(&mech_memory, ttl);
+}
+
+VOID
+auth_sspi_mech_memory_get_stats(sspi_mech_memory_stats* stats) {
+    ttl_get_stats(&mech_memory, &stats->ttl, &stats->entries);
+    stats->recorded = mech_memory.recorded;
+    stats->hits = mech_memory.hits;
+}
+
+INT
+auth_sspi_client_step(sspi_client_state* state,
+                      SEC_CHAR* challenge,
+                      ULONG clen,
+                      sspi_error* err) {
+    SecBufferDesc inbuf;
+    SecBuffer inBufs[1];
+    SecBufferDesc outbuf;
+    SecBuffer outBufs[1];
+    ULONG ignored;
+    SECURITY_STATUS status = AUTH_GSS_CONTINUE;
+    DWORD len;
+    ULONGLONG start = 0;
+    BOOL probe = FALSE;
+
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+
+    inbuf.ulVersion = SECBUFFER_VERSION;
+    inbuf.cBuffers = 1;
+    inbuf.pBuffers = inBufs;
+    inBufs[0].pvBuffer = NULL;
+    inBufs[0].cbBuffer = 0;
+    inBufs[0].BufferType = SECBUFFER_TOKEN;
+    if (state->haveCtx) {
+        if (!within_size_limit(SSPI_LIMIT_CLIENT_STEP, clen, err)) {
+            return AUTH_GSS_ERROR;
+        }
+        inBufs[0].pvBuffer = base64_decode(challenge, clen, &len, err);
+        if (!inBufs[0].pvBuffer) {
+            return AUTH_GSS_ERROR;
+        }
+        inBufs[0].cbBuffer = len;
+    } else if (negative_lookup(state->tmpl, &status)) {
+        save_error(err, status, "InitializeSecurityContext (cached)");
+        return AUTH_GSS_ERROR;
+    } else if (!breaker_admit(&probe, err)) {
+        return AUTH_GSS_ERROR;
+    } else {
+        /* Start each handshake with the template's current credentials. */
+        if (state->cred) {
+            cred_release(state->cred);
+        }
+        state->cred = template_cred(state->tmpl);
+        /* Only the first leg asks the KDC for a service ticket. */
+        start = GetTickCount64();
+    }
+
+    outbuf.ulVersion = SECBUFFER_VERSION;
+    outbuf.cBuffers = 1;
+    outbuf.pBuffers = outBufs;
+    outBufs[0].pvBuffer = NULL;
+    outBufs[0].cbBuffer = 0;
+    outBufs[0].BufferType = SECBUFFER_TOKEN;
+
+    status = InitializeSecurityContextW(/* CredHandle */
+                                        &state->cred->handle,
+                                        /* CtxtHandle (NULL on first call) */
+                                        state->haveCtx ? &state->ctx : NULL,
+                                        /* Service Principal Name */
+                                        state->tmpl->spn,
+                                        /* Flags */
+                                        ISC_REQ_ALLOCATE_MEMORY |
+                                        state->tmpl->flags,
+                                        /* Always 0 */
+                                        0,
+                                        /* Target data representation */
+                                        SECURITY_NETWORK_DREP,
+                                        /* Challenge (NULL on first call) */
+                                        state->haveCtx ? &inbuf : NULL,
+                                        /* Always 0 */
+                                        0,
+                                        /* CtxtHandle (Set on first call) */
+                                        &state->ctx,
+                                        /* Output */
+                                        &outbuf,
+                                        /* Context attributes */
+                                        &ignored,
+                                        /* Expiry */
+                                        &state->expiry);
+    if (!state->haveCtx) {
+        breaker_record(probe, start, status);
+    }
+    if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
+        if (!state->haveCtx) {
+            negative_record(state->tmpl, status);
+            if (same_wide(state->tmpl->mechoid, GSS_MECH_OID_KRB5) &&
+                mech_unavailable(status)) {
+                mech_memory_record(state->tmpl, GSS_MECH_OID_SPNEGO);
+            }
+        }
+        save_error(err, status, "InitializeSecurityContext");
+        status = AUTH_GSS_ERROR;
+        goto done;
+    }
+    state->haveCtx = 1;
+    if (outBufs[0].cbBuffer) {
+        state->response = base64_encode(
+            outBufs[0].pvBuffer, outBufs[0].cbBuffer, err);
+        if (!state->response) {
+            status = AUTH_GSS_ERROR;
+            goto done;
+        }
+    }
+    if (status == SEC_E_OK) {
+        /* Get authenticated username. */
+        SecPkgContext_NamesW names;
+        status = QueryContextAttributesW(
+            &state->ctx, SECPKG_ATTR_NAMES, &names);
+        if (status != SEC_E_OK) {
+            save_error(err, status, "QueryContextAttributesW");
+            status = AUTH_GSS_ERROR;
+            goto done;
+        }
+        state->username = wide_to_utf8(names.sUserName, err);
+        if (state->username == NULL) {
+            FreeContextBuffer(names.sUserName);
+            status = AUTH_GSS_ERROR;
+            goto done;
+        }
+        FreeContextBuffer(names.sUserName);
+        mech_memory_record(state->tmpl, state->tmpl->mechoid);
+        status = AUTH_GSS_COMPLETE;
+    } else {
+        status = AUTH_GSS_CONTINUE;
+    }
+done:
+    if (inBufs[0].pvBuffer) {
+        free(inBufs[0].pvBuffer);
+    }
+    if (outBufs[0].pvBuffer) {
+        FreeContextBuffer(outBufs[0].pvBuffer);
+    }
+    return status;
+}
+
+typedef struct {
+    sspi_task task;
+    sspi_client_state* state;
+    INT* result;
+    sspi_error* err;
+    volatile LONG* remaining;
+    HANDLE finished;
+} step_many_item;
+
+static VOID
+step_many_run(sspi_task* task) {
+    step_many_item* item = (step_many_item*)task;
+    *item->result = auth_sspi_client_step(item->state, "", 0, item->err);
+    if (InterlockedDecrement(item->remaining) == 0) {
+        SetEvent(item->finished);
+    }
+}
+
+VOID
+auth_sspi_client_step_many(sspi_client_state** states,
+                           ULONG count,
+                           INT* results,
+                           sspi_error* errs) {
+    step_many_item* items;
+    volatile LONG remaining;
+    HANDLE finished;
+    ULONG i;
+
+    items = (step_many_item*)malloc(sizeof(step_many_item) * count);
+    finished = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (items == NULL || finished == NULL) {
+        /* No room to fan out. Run the legs one after another instead. */
+        free(items);
+        if (finished) {
+            CloseHandle(finished);
+        }
+        for (i = 0; i < count; i++) {
+            results[i] = auth_sspi_client_step(states[i], "", 0, &errs[i]);
+        }
+        return;
+    }
+
+    remaining = (LONG)count;
+    for (i = 0; i < count; i++) {
+        items[i].task.run = step_many_run;
+        items[i].state = states[i];
+        items[i].result = &results[i];
+        items[i].err = &errs[i];
+        items[i].remaining = &remaining;
+        items[i].finished = finished;
+        if (!sspi_pool_submit(&items[i].task, SSPI_LANE_HANDSHAKE)) {
+            step_many_run(&items[i].task);
+        }
+    }
+    WaitForSingleObject(finished, INFINITE);
+    CloseHandle(finished);
+    free(items);
+}
+
+/* Ownership of a hedged leg's state. */
+enum {
+    LEG_RUNNING,
+    LEG_FINISHED,
+    /* The caller returned without the leg, which destroys its own state. */
+    LEG_ABANDONED
+};
+
+typedef struct _hedge_group hedge_group;
+
+typedef struct {
+    sspi_task task;
+    hedge_group* group;
+    LONG index;
+    sspi_client_state* state;
+    INT result;
+    sspi_error err;
+    volatile LONG owner;
+} hedge_leg;
+
+struct _hedge_group {
+    /* The caller and each leg still running. */
+    volatile LONG refs;
+    volatile LONG winner;
+    volatile LONG failed;
+    /* Set when a leg finishes. */
+    HANDLE changed;
+    hedge_leg legs[1];
+};
+
+static VOID
+hedge_group_release(hedge_group* group) {
+    if (InterlockedDecrement(&group->refs) == 0) {
+        CloseHandle(group->changed);
+        free(group);
+    }
+}
+
+static VOID
+free_client_state(sspi_client_state* state) {
+    destroy_sspi_client_state(state);
+    free(state);
+}
+
+static VOID
+hedge_leg_run(sspi_task* task) {
+    hedge_leg* leg = (hedge_leg*)task;
+    hedge_group* group = leg->group;
+
+    leg->result = auth_sspi_client_step(leg->state, "", 0, &leg->err);
+    if (leg->result == AUTH_GSS_ERROR) {
+        InterlockedIncrement(&group->failed);
+    } else if (InterlockedCompareExchange(
+                   &group->winner, leg->index, -1) == -1) {
+        /* The caller owns the winner's state from here on. */
+        SetEvent(group->changed);
+        hedge_group_release(group);
+        return;
+    }
+    if (InterlockedCompareExchange(
+            &leg->owner, LEG_FINISHED, LEG_RUNNING) == LEG_ABANDONED) {
+        free_client_state(leg->state);
+    }
+    SetEvent(group->changed);
+    hedge_group_release(group);
+}
+
+LONG
+auth_sspi_client_step_hedged(sspi_client_state** states,
+                             ULONG count,
+                             DWORD delay,
+                             INT* result,
+                             sspi_error* err) {
+    hedge_group* group;
+    ULONG started = 0;
+    LONG winner;
+    ULONG i;
+
+    group = (hedge_group*)malloc(
+        sizeof(hedge_group) + sizeof(hedge_leg) * (count - 1));
+    if (group == NULL) {
+        for (i = 0; i < count; i++) {
+            free_client_state(states[i]);
+        }
+        save_error(err, 0, NULL);
+        return -1;
+    }
+    group->changed = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (group->changed == NULL) {
+        for (i = 0; i < count; i++) {
+            free_client_state(states[i]);
+        }
+        save_error(err, GetLastError(), "CreateEvent");
+        free(group);
+        return -1;
+    }
+    group->refs = 1;
+    group->winner = -1;
+    group->failed = 0;
+
+    for (;;) {
+        DWORD wait;
+        /* Start the next leg after delay, or at once if all have failed. */
+        if (started < count &&
+            (started == 0 || (ULONG)group->failed == started)) {
+            wait = WAIT_TIMEOUT;
+        } else {
+            wait = WaitForSingleObject(
+                group->changed, started < count ? delay : INFINITE);
+        }
+        if (group->winner != -1 || (ULONG)group->failed == count) {
+            break;
+        }
+        if (wait == WAIT_TIMEOUT && started < count) {
+            hedge_leg* leg = &group->legs[started];
+            leg->task.run = hedge_leg_run;
+            leg->group = group;
+            leg->index = (LONG)started;
+            leg->state = states[started];
+            leg->owner = LEG_RUNNING;
+            InterlockedIncrement(&group->refs);
+            started++;
+            if (!sspi_pool_submit(&leg->task, SSPI_LANE_HANDSHAKE)) {
+                hedge_leg_run(&leg->task);
+            }
+        }
+    }
+
+    winner = group->winner;
+    if (winner == -1) {
+        /* Report why the primary service failed. */
+        *result = AUTH_GSS_ERROR;
+        *err = group->legs[0].err;
+    } else {
+        *result = group->legs[winner].result;
+    }
+    for (i = 0; i < count; i++) {
+        if ((LONG)i == winner) {
+            continue;
+        }
+        if (i >= started ||
+            InterlockedCompareExchange(&group->legs[i].owner,
+                                       LEG_ABANDONED,
+                                       LEG_RUNNING) == LEG_FINISHED) {
+            free_client_state(states[i]);
+        }
+    }
+    hedge_group_release(group);
+    return winner;
+}
+
+typedef struct _prefetch_group prefetch_group;
+
+typedef struct {
+    sspi_task task;
+    prefetch_group* group;
+    sspi_client_state state;
+    sspi_prefetch_result* out;
+} prefetch_leg;
+
+struct _prefetch_group {
+    /* The legs still running, and the submitter until it is done. */
+    volatile LONG remaining;
+    VOID (*done)(VOID* arg);
+    VOID* arg;
+    prefetch_leg legs[1];
+};
+
+static VOID
+prefetch_group_release(prefetch_group* group) {
+    if (InterlockedDecrement(&group->remaining) == 0) {
+        group->done(group->arg);
+        free(group);
+    }
+}
+
+static VOID
+prefetch_leg_run(sspi_task* task) {
+    prefetch_leg* leg = (prefetch_leg*)task;
+    LARGE_INTEGER start, end, freq;
+
+    QueryPerformanceCounter(&start);
+    leg->out->result = auth_sspi_client_step(
+        &leg->state, "", 0, &leg->out->err);
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    leg->out->elapsed_us =
+        (end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart;
+    /* Only the service ticket in the LSA cache is wanted. */
+    destroy_sspi_client_state(&leg->state);
+    prefetch_group_release(leg->group);
+}
+
+/* Runs a first step for each service and throws the contexts away, so
+ * that the service tickets are in the LSA cache before they are needed.
+ * A NULL service is root's own SPN. The steps run on the worker pool
+ * and done(arg) is called on the thread that finishes last, perhaps
+ * before this returns. Returns FALSE, without calling done, if nothing
+ * could be started.
+ * */
+BOOL
+auth_sspi_client_prefetch(sspi_client_template* root,
+                          WCHAR** services,
+                          ULONG count,
+                          sspi_prefetch_result* results,
+                          VOID (*done)(VOID* arg),
+                          VOID* arg,
+                          sspi_error* err) {
+    prefetch_group* group;
+    ULONG i;
+
+    group = (prefetch_group*)malloc(
+        sizeof(prefetch_group) +
+        sizeof(prefetch_leg) * (count ? count - 1 : 0));
+    if (group == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return FALSE;
+    }
+    group->remaining = 1;
+    group->done = done;
+    group->arg = arg;
+
+    for (i = 0; i < count; i++) {
+        prefetch_leg* leg = &group->legs[i];
+        sspi_client_template* tmpl = root;
+
+        results[i].elapsed_us = 0;
+        if (services[i]) {
+            tmpl = auth_sspi_client_template_derive(
+                root, services[i], &results[i].err);
+            if (tmpl == NULL) {
+                results[i].result = AUTH_GSS_ERROR;
+                continue;
+            }
+        }
+        auth_sspi_client_init(tmpl, &leg->state);
+        if (services[i]) {
+            auth_sspi_client_template_release(tmpl);
+        }
+        leg->task.run = prefetch_leg_run;
+        leg->group = group;
+        leg->out = &results[i];
+        InterlockedIncrement(&group->remaining);
+        if (!sspi_pool_submit(&leg->task, SSPI_LANE_HANDSHAKE)) {
+            prefetch_leg_run(&leg->task);
+        }
+    }
+    prefetch_group_release(group);
+    return TRUE;
+}
+
+static BOOL
+query_sizes(CtxtHandle* ctx,
+            SecPkgContext_Sizes* sizes,
+            UCHAR* haveSizes,
+            sspi_error* err) {
+    SECURITY_STATUS status;
+    /* The sizes are fixed once the context is established. */
+    if (*haveSizes) {
+        return TRUE;
+    }
+    status = QueryContextAttributes(ctx, SECPKG_ATTR_SIZES, sizes);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "QueryContextAttributes");
+        return FALSE;
+    }
+    *haveSizes = 1;
+    return TRUE;
+}
+
+static INT
+unwrap_message(CtxtHandle* ctx,
+               SEC_CHAR* challenge,
+               ULONG clen,
+               ULONG* qop,
+               SEC_CHAR** response,
+               sspi_error* err) {
+    SECURITY_STATUS status;
+    DWORD len;
+    SecBuffer wrapBufs[2];
+    SecBufferDesc wrapBufDesc;
+    wrapBufDesc.ulVersion = SECBUFFER_VERSION;
+    wrapBufDesc.cBuffers = 2;
+    wrapBufDesc.pBuffers = wrapBufs;
+
+    if (!within_size_limit(SSPI_LIMIT_UNWRAP, clen, err)) {
+        return AUTH_GSS_ERROR;
+    }
+    wrapBufs[0].pvBuffer = base64_decode(challenge, clen, &len, err);
+    if (!wrapBufs[0].pvBuffer) {
+        return AUTH_GSS_ERROR;
+    }
+    wrapBufs[0].cbBuffer = len;
+    wrapBufs[0].BufferType = SECBUFFER_STREAM;
+
+    wrapBufs[1].pvBuffer = NULL;
+    wrapBufs[1].cbBuffer = 0;
+    wrapBufs[1].BufferType = SECBUFFER_DATA;
+
+    status = DecryptMessage(ctx, &wrapBufDesc, 0, qop);
+    if (status == SEC_E_OK) {
+        status = AUTH_GSS_COMPLETE;
+    } else {
+        save_error(err, status, "DecryptMessage");
+        status = AUTH_GSS_ERROR;
+        goto done;
     }
     if (wrapBufs[1].cbBuffer) {
-        state->response = base64_encode(wrapBufs[1].pvBuffer,
-                                        wrapBufs[1].cbBuffer);
-        if (!state->response) {
+        *response = base64_encode(
+            wrapBufs[1].pvBuffer, wrapBufs[1].cbBuffer, err);
+        if (!*response) {
             status = AUTH_GSS_ERROR;
         }
     }
@@ -403,23 +2458,240 @@ done:
     return status;
 }
 
+static INT
+wrap_message(CtxtHandle* ctx,
+             SecPkgContext_Sizes* sizes,
+             SEC_CHAR* data,
+             ULONG dlen,
+             SEC_CHAR* user,
+             ULONG ulen,
+             INT protect,
+             SEC_CHAR** response,
+             sspi_error* err) {
+    SECURITY_STATUS status;
+    SecBuffer wrapBufs[3];
+    SecBufferDesc wrapBufDesc;
+    SEC_CHAR* inbuf;
+    SIZE_T inbufSize;
+    DWORD outbufSize;
+    SEC_CHAR* plaintextMessage;
+    DWORD plaintextMessageSize;
+
+    if (user) {
+        /* Length of user + 4 bytes for security layer (see below). */
+        plaintextMessageSize = ulen + 4;
+    } else if (!base64_decoded_length(
+                   data, dlen, &plaintextMessageSize, err)) {
+        return AUTH_GSS_ERROR;
+    }
+
+    /* The trailer, message and padding share a single allocation. The
+     * message is decoded directly into place and the encrypted result is
+     * compacted in place, so the payload is never copied.
+     * */
+    inbufSize =
+        sizes->cbSecurityTrailer + plaintextMessageSize + sizes->cbBlockSize;
+    inbuf = (SEC_CHAR*)malloc(inbufSize);
+    if (inbuf == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return AUTH_GSS_ERROR;
+    }
+
+    plaintextMessage = inbuf + sizes->cbSecurityTrailer;
+    if (user) {
+        /* Authenticate the provided user. Unlike pykerberos, we don't
+         * need any information from "data" to do that.
+         * */
+        plaintextMessage[0] = 1; /* No security layer */
+        plaintextMessage[1] = 0;
+        plaintextMessage[2] = 0;
+        plaintextMessage[3] = 0;
+        memcpy_s(
+            plaintextMessage + 4,
+            inbufSize - sizes->cbSecurityTrailer - 4,
+            user,
+            ulen);
+    } else {
+        /* No user provided. Just rewrap data. */
+        if (!base64_decode_into(data,
+                                dlen,
+                                plaintextMessage,
+                                &plaintextMessageSize,
+                                err)) {
+            free(inbuf);
+            return AUTH_GSS_ERROR;
+        }
+    }
+
+    wrapBufDesc.cBuffers = 3;
+    wrapBufDesc.pBuffers = wrapBufs;
+    wrapBufDesc.ulVersion = SECBUFFER_VERSION;
+
+    wrapBufs[0].cbBuffer = sizes->cbSecurityTrailer;
+    wrapBufs[0].BufferType = SECBUFFER_TOKEN;
+    wrapBufs[0].pvBuffer = inbuf;
+
+    wrapBufs[1].cbBuffer = (ULONG)plaintextMessageSize;
+    wrapBufs[1].BufferType = SECBUFFER_DATA;
+    wrapBufs[1].pvBuffer = inbuf + sizes->cbSecurityTrailer;
+
+    wrapBufs[2].cbBuffer = sizes->cbBlockSize;
+    wrapBufs[2].BufferType = SECBUFFER_PADDING;
+    wrapBufs[2].pvBuffer =
+        inbuf + (sizes->cbSecurityTrailer + plaintextMessageSize);
+
+    status = EncryptMessage(
+        ctx,
+        protect ? 0 : SECQOP_WRAP_NO_ENCRYPT,
+        &wrapBufDesc,
+        0);
+    if (status != SEC_E_OK) {
+        free(inbuf);
+        save_error(err, status, "EncryptMessage");
+        return AUTH_GSS_ERROR;
+    }
+
+    /* The trailer and padding may be shorter than reserved. Close the
+     * gaps so the token is contiguous at the start of inbuf.
+     * */
+    outbufSize = wrapBufs[0].cbBuffer;
+    memmove(inbuf + outbufSize, wrapBufs[1].pvBuffer, wrapBufs[1].cbBuffer);
+    outbufSize += wrapBufs[1].cbBuffer;
+    memmove(inbuf + outbufSize, wrapBufs[2].pvBuffer, wrapBufs[2].cbBuffer);
+    outbufSize += wrapBufs[2].cbBuffer;
+
+    *response = base64_encode(inbuf, outbufSize, err);
+    free(inbuf);
+    if (!*response) {
+        return AUTH_GSS_ERROR;
+    }
+    return AUTH_GSS_COMPLETE;
+}
+
+INT
+auth_sspi_client_unwrap(sspi_client_state* state,
+                        SEC_CHAR* challenge,
+                        ULONG clen,
+                        sspi_error* err) {
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+        state->qop = SECQOP_WRAP_NO_ENCRYPT;
+    }
+
+    if (!state->haveCtx) {
+        set_uninitialized_context(err);
+        return AUTH_GSS_ERROR;
+    }
+
+    return unwrap_message(
+        &state->ctx, challenge, clen, &state->qop, &state->response, err);
+}
+
 INT
 auth_sspi_client_wrap(sspi_client_state* state,
                       SEC_CHAR* data,
+                      ULONG dlen,
                       SEC_CHAR* user,
                       ULONG ulen,
-                      INT protect) {
+                      INT protect,
+                      sspi_error* err) {
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+
+    if (!state->haveCtx) {
+        set_uninitialized_context(err);
+        return AUTH_GSS_ERROR;
+    }
+
+    if (!query_sizes(&state->ctx, &state->sizes, &state->haveSizes, err)) {
+        return AUTH_GSS_ERROR;
+    }
+
+    return wrap_message(&state->ctx,
+                        &state->sizes,
+                        data,
+                        dlen,
+                        user,
+                        ulen,
+                        protect,
+                        &state->response,
+                        err);
+}
+
+INT
+auth_sspi_client_get_mic(sspi_client_state* state,
+                         SEC_CHAR* data,
+                         ULONG dlen,
+                         sspi_error* err) {
+    SECURITY_STATUS status;
+    SecBuffer sigBufs[2];
+    SecBufferDesc sigBufDesc;
+
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+
+    if (!state->haveCtx) {
+        set_uninitialized_context(err);
+        return AUTH_GSS_ERROR;
+    }
+
+    if (!query_sizes(&state->ctx, &state->sizes, &state->haveSizes, err)) {
+        return AUTH_GSS_ERROR;
+    }
+
+    sigBufDesc.ulVersion = SECBUFFER_VERSION;
+    sigBufDesc.cBuffers = 2;
+    sigBufDesc.pBuffers = sigBufs;
+
+    /* MakeSignature only reads the payload, so sign it in place. */
+    sigBufs[0].cbBuffer = dlen;
+    sigBufs[0].BufferType = SECBUFFER_DATA;
+    sigBufs[0].pvBuffer = data;
+
+    sigBufs[1].cbBuffer = state->sizes.cbMaxSignature;
+    sigBufs[1].BufferType = SECBUFFER_TOKEN;
+    sigBufs[1].pvBuffer = malloc(state->sizes.cbMaxSignature);
+    if (sigBufs[1].pvBuffer == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return AUTH_GSS_ERROR;
+    }
+
+    status = MakeSignature(&state->ctx, 0, &sigBufDesc, 0);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "MakeSignature");
+        status = AUTH_GSS_ERROR;
+        goto done;
+    }
+
+    state->response = base64_encode(
+        sigBufs[1].pvBuffer, sigBufs[1].cbBuffer, err);
+    if (!state->response) {
+        status = AUTH_GSS_ERROR;
+    } else {
+        status = AUTH_GSS_COMPLETE;
+    }
+done:
+    free(sigBufs[1].pvBuffer);
+    return status;
+}
+
+INT
+auth_sspi_client_verify_mic(sspi_client_state* state,
+                            SEC_CHAR* data,
+                            ULONG dlen,
+                            SEC_CHAR* mic,
+                            ULONG miclen,
+                            sspi_error* err) {
     SECURITY_STATUS status;
-    SecPkgContext_Sizes sizes;
-    SecBuffer wrapBufs[3];
-    SecBufferDesc wrapBufDesc;
-    SEC_CHAR* decodedData = NULL;
-    SEC_CHAR* inbuf;
-    SIZE_T inbufSize;
-    SEC_CHAR* outbuf;
-    DWORD outbufSize;
-    SEC_CHAR* plaintextMessage;
-    ULONG plaintextMessageSize;
+    DWORD len;
+    ULONG qop;
+    SecBuffer sigBufs[2];
+    SecBufferDesc sigBufDesc;
 
     if (state->response != NULL) {
         free(state->response);
@@ -427,129 +2699,58 @@ auth_sspi_client_wrap(sspi_client_state* state,
     }
 
     if (!state->haveCtx) {
-        set_uninitialized_context();
+        set_uninitialized_context(err);
         return AUTH_GSS_ERROR;
     }
 
-    status = QueryContextAttributes(&state->ctx, SECPKG_ATTR_SIZES, &sizes);
-    if (status != SEC_E_OK) {
-        set_gsserror(status, "QueryContextAttributes");
-        return AUTH_GSS_ERROR;
-    }
+    sigBufDesc.ulVersion = SECBUFFER_VERSION;
+    sigBufDesc.cBuffers = 2;
+    sigBufDesc.pBuffers = sigBufs;
 
-    if (user) {
-        /* Length of user + 4 bytes for security layer (see below). */
-        plaintextMessageSize = ulen + 4;
-    } else {
-        decodedData = base64_decode(data, &plaintextMessageSize);
-        if (!decodedData) {
-            return AUTH_GSS_ERROR;
-        }
-    }
+    sigBufs[0].cbBuffer = dlen;
+    sigBufs[0].BufferType = SECBUFFER_DATA;
+    sigBufs[0].pvBuffer = data;
 
-    inbufSize =
-        sizes.cbSecurityTrailer + plaintextMessageSize + sizes.cbBlockSize;
-    inbuf = (SEC_CHAR*)malloc(inbufSize);
-    if (inbuf == NULL) {
-        free(decodedData);
-        PyErr_SetNone(PyExc_MemoryError);
+    sigBufs[1].pvBuffer = base64_decode(mic, miclen, &len, err);
+    if (!sigBufs[1].pvBuffer) {
         return AUTH_GSS_ERROR;
     }
+    sigBufs[1].cbBuffer = len;
+    sigBufs[1].BufferType = SECBUFFER_TOKEN;
 
-    plaintextMessage = inbuf + sizes.cbSecurityTrailer;
-    if (user) {
-        /* Authenticate the provided user. Unlike pykerberos, we don't
-         * need any information from "data" to do that.
-         * */
-        plaintextMessage[0] = 1; /* No security layer */
-        plaintextMessage[1] = 0;
-        plaintextMessage[2] = 0;
-        plaintextMessage[3] = 0;
-        memcpy_s(
-            plaintextMessage + 4,
-            inbufSize - sizes.cbSecurityTrailer - 4,
-            user,
-            strlen(user));
+    status = VerifySignature(&state->ctx, &sigBufDesc, 0, &qop);
+    if (status == SEC_E_OK) {
+        status = AUTH_GSS_COMPLETE;
     } else {
-        /* No user provided. Just rewrap data. */
-        memcpy_s(
-            plaintextMessage,
-            inbufSize - sizes.cbSecurityTrailer,
-            decodedData,
-            plaintextMessageSize);
-        free(decodedData);
-    }
-
-    wrapBufDesc.cBuffers = 3;
-    wrapBufDesc.pBuffers = wrapBufs;
-    wrapBufDesc.ulVersion = SECBUFFER_VERSION;
-
-    wrapBufs[0].cbBuffer = sizes.cbSecurityTrailer;
-    wrapBufs[0].BufferType = SECBUFFER_TOKEN;
-    wrapBufs[0].pvBuffer = inbuf;
-
-    wrapBufs[1].cbBuffer = (ULONG)plaintextMessageSize;
-    wrapBufs[1].BufferType = SECBUFFER_DATA;
-    wrapBufs[1].pvBuffer = inbuf + sizes.cbSecurityTrailer;
-
-    wrapBufs[2].cbBuffer = sizes.cbBlockSize;
-    wrapBufs[2].BufferType = SECBUFFER_PADDING;
-    wrapBufs[2].pvBuffer =
-        inbuf + (sizes.cbSecurityTrailer + plaintextMessageSize);
-
-    status = EncryptMessage(
-        &state->ctx,
-        protect ? 0 : SECQOP_WRAP_NO_ENCRYPT,
-        &wrapBufDesc,
-        0);
-    if (status != SEC_E_OK) {
-        free(inbuf);
-        set_gsserror(status, "EncryptMessage");
-        return AUTH_GSS_ERROR;
-    }
-
-    outbufSize =
-        wrapBufs[0].cbBuffer + wrapBufs[1].cbBuffer + wrapBufs[2].cbBuffer;
-    outbuf = (SEC_CHAR*)malloc(sizeof(SEC_CHAR) * outbufSize);
-    if (outbuf == NULL) {
-        free(inbuf);
-        PyErr_SetNone(PyExc_MemoryError);
-        return AUTH_GSS_ERROR;
-    }
-    memcpy_s(outbuf,
-             outbufSize,
-             wrapBufs[0].pvBuffer,
-             wrapBufs[0].cbBuffer);
-    memcpy_s(outbuf + wrapBufs[0].cbBuffer,
-             outbufSize - wrapBufs[0].cbBuffer,
-             wrapBufs[1].pvBuffer,
-             wrapBufs[1].cbBuffer);
-    memcpy_s(outbuf + wrapBufs[0].cbBuffer + wrapBufs[1].cbBuffer,
-             outbufSize - wrapBufs[0].cbBuffer - wrapBufs[1].cbBuffer,
-             wrapBufs[2].pvBuffer,
-             wrapBufs[2].cbBuffer);
-    state->response = base64_encode(outbuf, outbufSize);
-    if (!state->response) {
+        save_error(err, status, "VerifySignature");
         status = AUTH_GSS_ERROR;
-    } else {
-        status = AUTH_GSS_COMPLETE;
     }
-    free(inbuf);
-    free(outbuf);
+    free(sigBufs[1].pvBuffer);
     return status;
 }
 
 
 VOID
 destroy_sspi_server_state(sspi_server_state* state) {
+    if (state->refreshing) {
+        refresh_unregister_server(state);
+    }
     if (state->haveCtx) {
         DeleteSecurityContext(&state->ctx);
         state->haveCtx = 0;
     }
+    if (state->token != NULL) {
+        CloseHandle(state->token);
+        state->token = NULL;
+    }
     if (state->haveCred) {
         FreeCredentialsHandle(&state->cred);
         state->haveCred = 0;
     }
+    if (state->haveNextCred) {
+        FreeCredentialsHandle(&state->nextCred);
+        state->haveNextCred = 0;
+    }
     if (state->spn != NULL) {
         free(state->spn);
         state->spn = NULL;
@@ -569,7 +2770,39 @@ destroy_sspi_server_state(sspi_server_state* state) {
 }
 
 INT
-auth_sspi_server_init(WCHAR* service, sspi_server_state* state) {
+auth_sspi_server_reset(sspi_server_state* state) {
+    /* Keep the SPN and credentials for the next handshake. */
+    if (state->haveCtx) {
+        DeleteSecurityContext(&state->ctx);
+        state->haveCtx = 0;
+    }
+    if (state->token != NULL) {
+        CloseHandle(state->token);
+        state->token = NULL;
+    }
+    state->haveSizes = 0;
+    state->qop = SECQOP_WRAP_NO_ENCRYPT;
+    state->ctx_attr = 0;
+    state->authenticated = FALSE;
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+    if (state->username != NULL) {
+        free(state->username);
+        state->username = NULL;
+    }
+    if (state->targetname != NULL) {
+        free(state->targetname);
+        state->targetname = NULL;
+    }
+    return AUTH_GSS_COMPLETE;
+}
+
+INT
+auth_sspi_server_init(WCHAR* service,
+                      sspi_server_state* state,
+                      sspi_error* err) {
     WCHAR *mechoid = GSS_MECH_OID_SPNEGO; //GSS_MECH_OID_KRB5;
     SECURITY_STATUS status;
     PSecPkgInfoW pkgInfo;
@@ -577,6 +2810,7 @@ auth_sspi_server_init(WCHAR* service, sspi_server_state* state) {
     state->response = NULL;
     state->username = NULL;
     state->targetname = NULL;
+    state->token = NULL;
     state->flags = ASC_REQ_INTEGRITY |
                    ASC_REQ_SEQUENCE_DETECT |
                    ASC_REQ_REPLAY_DETECT |
@@ -584,11 +2818,19 @@ auth_sspi_server_init(WCHAR* service, sspi_server_state* state) {
                    ASC_REQ_CONFIDENTIALITY;
     state->haveCred = 0;
     state->haveCtx = 0;
+    state->haveSizes = 0;
+    state->qop = SECQOP_WRAP_NO_ENCRYPT;
     state->ctx_attr = 0;
+    state->ctx_expiry.LowPart = 0;
+    state->ctx_expiry.HighPart = 0;
+    InitializeSRWLock(&state->credLock);
+    state->haveNextCred = 0;
+    state->refreshing = 0;
+    state->refreshPinned = 0;
     state->spn = _wcsdup(service);
     state->authenticated = FALSE;
     if (state->spn == NULL) {
-        PyErr_SetNone(PyExc_MemoryError);
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
         return AUTH_GSS_ERROR;
     }
     /* Convert RFC-2078 format to SPN */
@@ -603,7 +2845,7 @@ auth_sspi_server_init(WCHAR* service, sspi_server_state* state) {
 
     if (status < 0) 
     {
-        set_gsserror(status, "QuerySecurityPackageInfo");
+        save_error(err, status, "QuerySecurityPackageInfo");
         return AUTH_GSS_ERROR;
     }
 
@@ -630,38 +2872,91 @@ auth_sspi_server_init(WCHAR* service, sspi_server_state* state) {
                                        /* Expiry  */
                                        &state->cred_expiry);
     if (status != SEC_E_OK) {
-        set_gsserror(status, "AcquireCredentialsHandle");
+        save_error(err, status, "AcquireCredentialsHandle");
         return AUTH_GSS_ERROR;
     }
     state->haveCred = 1;
+    if (refresh_interval) {
+        refresh_register_server(state);
+    }
     return AUTH_GSS_COMPLETE;
 }
 
+/* Swaps in credentials renewed by the refresher. Only called between
+ * handshakes, when no context uses the old ones.
+ * */
+static VOID
+server_take_next_cred(sspi_server_state* state) {
+    CredHandle old;
+    BOOL swapped = FALSE;
+
+    AcquireSRWLockExclusive(&state->credLock);
+    if (state->haveNextCred) {
+        old = state->cred;
+        state->cred = state->nextCred;
+        state->cred_expiry = state->next_cred_expiry;
+        state->haveNextCred = 0;
+        swapped = TRUE;
+    }
+    ReleaseSRWLockExclusive(&state->credLock);
+    if (swapped) {
+        FreeCredentialsHandle(&old);
+    }
+}
+
+/* The context expiry is 0 until the first step succeeds. */
+VOID
+auth_sspi_server_get_expiry(sspi_server_state* state,
+                            TimeStamp* cred_expiry,
+                            TimeStamp* ctx_expiry) {
+    AcquireSRWLockShared(&state->credLock);
+    *cred_expiry = state->cred_expiry;
+    ReleaseSRWLockShared(&state->credLock);
+    if (state->haveCtx) {
+        *ctx_expiry = state->ctx_expiry;
+    } else {
+        ctx_expiry->LowPart = 0;
+        ctx_expiry->HighPart = 0;
+    }
+}
+
 INT
-auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
+auth_sspi_server_step(sspi_server_state *state,
+                      SEC_CHAR* challenge,
+                      ULONG clen,
+                      sspi_error* err) {
     SecBufferDesc inbuf;
     SecBuffer inBufs[1];
     SecBufferDesc outbuf;
     SecBuffer outBufs[1];
     SECURITY_STATUS status = AUTH_GSS_CONTINUE;
-    SECURITY_STATUS ret_status;
     DWORD len;
+    BOOL entered;
 
     if (state->response != NULL) {
         free(state->response);
         state->response = NULL;
     }
+    if (!state->haveCtx) {
+        server_take_next_cred(state);
+    }
 
     inbuf.ulVersion = SECBUFFER_VERSION;
     inbuf.cBuffers = 1;
     inbuf.pBuffers = inBufs;
     inBufs[0].BufferType = SECBUFFER_TOKEN;
-    inBufs[0].pvBuffer = base64_decode(challenge, &len);
+    if (!within_size_limit(SSPI_LIMIT_SERVER_STEP, clen, err)) {
+        return AUTH_GSS_ERROR;
+    }
+    inBufs[0].pvBuffer = base64_decode(challenge, clen, &len, err);
     if (!inBufs[0].pvBuffer) {
         return AUTH_GSS_ERROR;
     }
     inBufs[0].cbBuffer = len;
-
+    if (!screen_token((BYTE*)inBufs[0].pvBuffer, len, err)) {
+        free(inBufs[0].pvBuffer);
+        return AUTH_GSS_ERROR;
+    }
 
     outbuf.ulVersion = SECBUFFER_VERSION;
     outbuf.cBuffers = 1;
@@ -671,12 +2966,15 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
     outBufs[0].BufferType = SECBUFFER_TOKEN;
 
     if (outBufs[0].pvBuffer == NULL) {
-        set_gsserror(status, "Failed to allocate memory for out buffer");
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
         status = AUTH_GSS_ERROR;
         goto done;
     }
 
-    Py_BEGIN_ALLOW_THREADS
+    if (!admission_enter(&entered, err)) {
+        status = AUTH_GSS_ERROR;
+        goto done;
+    }
     status = AcceptSecurityContext(/* CredHandle */
                                    &state->cred,
                                    /* CtxtInHandle (NULL on first call) */
@@ -695,15 +2993,15 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
                                    &state->ctx_attr, 
                                    /* Expiry */
                                    &state->ctx_expiry);
+    if (entered) {
+        admission_leave();
+    }
 
-    ret_status = status;
-    Py_END_ALLOW_THREADS
-    fprintf(stderr, "STATUS: %X\n", ret_status);
     if (status == SEC_I_COMPLETE_NEEDED)  {
         state->haveCtx = 1;
         status = CompleteAuthToken(&state->ctx, &outbuf);
         if (status != SEC_E_OK) {
-            set_gsserror(status, "CompleteAuthToken");
+            save_error(err, status, "CompleteAuthToken");
             status = AUTH_GSS_ERROR;
             goto done;
         }
@@ -712,7 +3010,7 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
         state->haveCtx = 1;
         status = CompleteAuthToken(&state->ctx, &outbuf);
         if (status != SEC_E_OK) {
-            set_gsserror(status, "CompleteAuthToken");
+            save_error(err, status, "CompleteAuthToken");
             status = AUTH_GSS_ERROR;
             goto done;
         }
@@ -724,14 +3022,14 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
         state->haveCtx = 1;
         status = AUTH_GSS_COMPLETE;
     } else {
-        set_gsserror(status, "AcceptSecurityContext");
+        save_error(err, status, "AcceptSecurityContext");
         status = AUTH_GSS_ERROR;
         goto done;
     }
 
     if (outBufs[0].cbBuffer) {
-        state->response = base64_encode(outBufs[0].pvBuffer,
-                                        outBufs[0].cbBuffer);
+        state->response = base64_encode(
+            outBufs[0].pvBuffer, outBufs[0].cbBuffer, err);
         if (!state->response) {
             status = AUTH_GSS_ERROR;
             goto done;
@@ -744,11 +3042,11 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
         status = QueryContextAttributesW(
             &state->ctx, SECPKG_ATTR_NAMES, &names);
         if (status != SEC_E_OK) {
-            set_gsserror(status, "QueryContextAttributesW");
+            save_error(err, status, "QueryContextAttributesW");
             status = AUTH_GSS_ERROR;
             goto done;
         }
-        state->username = wide_to_utf8(names.sUserName);
+        state->username = wide_to_utf8(names.sUserName, err);
         FreeContextBuffer(names.sUserName);
         if (state->username == NULL) {
             status = AUTH_GSS_ERROR;
@@ -758,13 +3056,20 @@ auth_sspi_server_step(sspi_server_state *state, SEC_CHAR* challenge) {
         status = QueryContextAttributesW(
             &state->ctx, SECPKG_ATTR_NATIVE_NAMES, &native_names);
         if (status != SEC_E_OK) {
-            set_gsserror(status, "QueryContextAttributesW SECPKG_ATTR_NATIVE_NAMES");
+            save_error(err,
+                       status,
+                       "QueryContextAttributesW SECPKG_ATTR_NATIVE_NAMES");
             status = AUTH_GSS_ERROR;
             goto done;
         }
-        state->targetname = wide_to_utf8(native_names.sServerName);
+        state->targetname = wide_to_utf8(native_names.sServerName, err);
         FreeContextBuffer(native_names.sClientName);
         FreeContextBuffer(native_names.sServerName);
+        if (state->targetname == NULL) {
+            status = AUTH_GSS_ERROR;
+            goto done;
+        }
+        status = AUTH_GSS_COMPLETE;
     }
 done:
     if (inBufs[0].pvBuffer) {
@@ -773,7 +3078,7 @@ done:
     if (outBufs[0].pvBuffer) {
         free(outBufs[0].pvBuffer);
     }
-    return ret_status;
+    return status;
 }
 
 
@@ -792,4 +3097,532 @@ INT auth_sspi_server_impersonate(sspi_server_state* state) {
 }
 INT auth_sspi_server_revert(sspi_server_state* state) {
     return RevertSecurityContext(&state->ctx);
-}
\ No newline at end of file
+}
+
+INT
+auth_sspi_server_unwrap(sspi_server_state* state,
+                        SEC_CHAR* challenge,
+                        ULONG clen,
+                        sspi_error* err) {
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+    state->qop = SECQOP_WRAP_NO_ENCRYPT;
+
+    if (!state->haveCtx) {
+        set_uninitialized_server_context(err);
+        return AUTH_GSS_ERROR;
+    }
+
+    return unwrap_message(
+        &state->ctx, challenge, clen, &state->qop, &state->response, err);
+}
+
+INT
+auth_sspi_server_wrap(sspi_server_state* state,
+                      SEC_CHAR* data,
+                      ULONG dlen,
+                      INT protect,
+                      sspi_error* err) {
+    if (state->response != NULL) {
+        free(state->response);
+        state->response = NULL;
+    }
+
+    if (!state->haveCtx) {
+        set_uninitialized_server_context(err);
+        return AUTH_GSS_ERROR;
+    }
+
+    if (!query_sizes(&state->ctx, &state->sizes, &state->haveSizes, err)) {
+        return AUTH_GSS_ERROR;
+    }
+
+    return wrap_message(&state->ctx,
+                        &state->sizes,
+                        data,
+                        dlen,
+                        NULL,
+                        0,
+                        protect,
+                        &state->response,
+                        err);
+}
+
+/* Context export
+ *
+ * A completed context is exported with ExportSecurityContext into a blob
+ * that another process on the host imports, so that one process can run
+ * the handshakes and hand the contexts to others. The exported context
+ * is deleted. Its token, if the package returned one, is duplicated into
+ * the importing process, named by its id, and the handle travels in the
+ * blob with the token's id. The importer checks that the handle is that
+ * token, takes its own duplicate and closes the blob's handle, so the
+ * blob can be imported once and only by that process.
+ * The blob is in native byte order: the header below, then the SPN, the
+ * username, the target name and the packed context.
+ * */
+
+#define EXPORT_MAGIC 0x43534b57
+#define EXPORT_VERSION 1
+#define EXPORT_CLIENT 1
+#define EXPORT_SERVER 2
+
+typedef struct {
+    ULONG magic;
+    USHORT version;
+    USHORT kind;
+    DWORD pid;
+    /* Kerberos or Negotiate. */
+    ULONG spnego;
+    ULONG64 token;
+    /* TokenStatistics.TokenId of the token, to recognize the handle. */
+    LUID token_id;
+    /* The template's flags for a client, the context attributes for a
+     * server.
+     * */
+    ULONG flags;
+    TimeStamp expiry;
+    ULONG spn_len;
+    ULONG username_len;
+    ULONG targetname_len;
+    ULONG packed_len;
+} export_header;
+
+static BOOL
+export_context(CtxtHandle* ctx,
+               export_header* hdr,
+               const WCHAR* spn,
+               const SEC_CHAR* username,
+               const SEC_CHAR* targetname,
+               BYTE** blob,
+               ULONG* blen,
+               BOOL* deleted,
+               sspi_error* err) {
+    SECURITY_STATUS status;
+    SecBuffer packed;
+    HANDLE token = NULL;
+    HANDLE target = NULL;
+    HANDLE dup = NULL;
+    BYTE* out;
+    BOOL result = FALSE;
+
+    packed.pvBuffer = NULL;
+    status = ExportSecurityContext(
+        ctx, SECPKG_CONTEXT_EXPORT_DELETE_OLD, &packed, &token);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "ExportSecurityContext");
+        return FALSE;
+    }
+    *deleted = TRUE;
+    if (token != NULL) {
+        TOKEN_STATISTICS stats;
+        DWORD len;
+        if (!GetTokenInformation(
+                token, TokenStatistics, &stats, sizeof(stats), &len)) {
+            save_error(err, GetLastError(), "GetTokenInformation");
+            goto done;
+        }
+        hdr->token_id = stats.TokenId;
+        if (hdr->pid == GetCurrentProcessId()) {
+            dup = token;
+            token = NULL;
+        } else {
+            target = OpenProcess(PROCESS_DUP_HANDLE, FALSE, hdr->pid);
+            if (target == NULL) {
+                save_error(err, GetLastError(), "OpenProcess");
+                goto done;
+            }
+            if (!DuplicateHandle(GetCurrentProcess(),
+                                 token,
+                                 target,
+                                 &dup,
+                                 0,
+                                 FALSE,
+                                 DUPLICATE_SAME_ACCESS)) {
+                dup = NULL;
+                save_error(err, GetLastError(), "DuplicateHandle");
+                goto done;
+            }
+        }
+    }
+
+    hdr->magic = EXPORT_MAGIC;
+    hdr->version = EXPORT_VERSION;
+    hdr->token = (ULONG64)(ULONG_PTR)dup;
+    hdr->spn_len = (ULONG)(wcslen(spn) * sizeof(WCHAR));
+    hdr->username_len = (ULONG)strlen(username);
+    hdr->targetname_len = targetname ? (ULONG)strlen(targetname) : 0;
+    hdr->packed_len = packed.cbBuffer;
+    *blen = sizeof(export_header) + hdr->spn_len + hdr->username_len +
+            hdr->targetname_len + hdr->packed_len;
+    out = (BYTE*)malloc(*blen);
+    if (out == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        goto done;
+    }
+    *blob = out;
+    memcpy(out, hdr, sizeof(export_header));
+    out += sizeof(export_header);
+    memcpy(out, spn, hdr->spn_len);
+    out += hdr->spn_len;
+    memcpy(out, username, hdr->username_len);
+    out += hdr->username_len;
+    if (hdr->targetname_len) {
+        memcpy(out, targetname, hdr->targetname_len);
+        out += hdr->targetname_len;
+    }
+    memcpy(out, packed.pvBuffer, hdr->packed_len);
+    result = TRUE;
+
+done:
+    if (!result && dup != NULL) {
+        if (target != NULL) {
+            /* Close the copy in the other process. */
+            DuplicateHandle(
+                target, dup, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+        } else {
+            CloseHandle(dup);
+        }
+    }
+    if (target != NULL) {
+        CloseHandle(target);
+    }
+    if (token != NULL) {
+        CloseHandle(token);
+    }
+    if (packed.pvBuffer) {
+        SecureZeroMemory(packed.pvBuffer, packed.cbBuffer);
+        FreeContextBuffer(packed.pvBuffer);
+    }
+    return result;
+}
+
+/* Validates blob and points the fields at its parts. */
+static BOOL
+parse_export(const BYTE* blob,
+             ULONG blen,
+             USHORT kind,
+             export_header* hdr,
+             WCHAR** spn,
+             SEC_CHAR** username,
+             SEC_CHAR** targetname,
+             const BYTE** packed,
+             sspi_error* err) {
+    ULONGLONG len;
+    const BYTE* next = blob + sizeof(export_header);
+
+    if (blen < sizeof(export_header)) {
+        goto invalid;
+    }
+    memcpy(hdr, blob, sizeof(export_header));
+    if (hdr->magic != EXPORT_MAGIC ||
+        hdr->version != EXPORT_VERSION ||
+        hdr->kind != kind ||
+        hdr->spn_len % sizeof(WCHAR) != 0 ||
+        hdr->username_len == 0) {
+        goto invalid;
+    }
+    len = (ULONGLONG)sizeof(export_header) + hdr->spn_len +
+          hdr->username_len + hdr->targetname_len + hdr->packed_len;
+    if (len != blen) {
+        goto invalid;
+    }
+    /* The token handle is only meaningful in the process the context
+     * was exported for.
+     * */
+    if (hdr->pid != GetCurrentProcessId()) {
+        save_error(err, 0, "The context was exported for another process.");
+        return FALSE;
+    }
+
+    *spn = (WCHAR*)calloc(hdr->spn_len / sizeof(WCHAR) + 1, sizeof(WCHAR));
+    *username = (SEC_CHAR*)calloc(hdr->username_len + 1, 1);
+    *targetname = (SEC_CHAR*)calloc(hdr->targetname_len + 1, 1);
+    if (*spn == NULL || *username == NULL || *targetname == NULL) {
+        free(*spn);
+        free(*username);
+        free(*targetname);
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return FALSE;
+    }
+    memcpy(*spn, next, hdr->spn_len);
+    next += hdr->spn_len;
+    memcpy(*username, next, hdr->username_len);
+    next += hdr->username_len;
+    memcpy(*targetname, next, hdr->targetname_len);
+    next += hdr->targetname_len;
+    *packed = next;
+    return TRUE;
+
+invalid:
+    save_error(err, 0, "Not an exported security context.");
+    return FALSE;
+}
+
+/* Takes the token the context was exported with into *token, a
+ * duplicate the caller closes. The handle in the blob is only trusted
+ * once it is shown to be that token; it is then closed, so the blob
+ * cannot be imported again. Any other handle is left alone.
+ * */
+static BOOL
+take_export_token(const export_header* hdr, HANDLE* token, sspi_error* err) {
+    HANDLE handle = (HANDLE)(ULONG_PTR)hdr->token;
+    TOKEN_STATISTICS stats;
+    DWORD len;
+
+    *token = NULL;
+    if (handle == NULL) {
+        return TRUE;
+    }
+    if (!GetTokenInformation(
+            handle, TokenStatistics, &stats, sizeof(stats), &len) ||
+        stats.TokenId.LowPart != hdr->token_id.LowPart ||
+        stats.TokenId.HighPart != hdr->token_id.HighPart) {
+        save_error(err, 0, "The exported context's token is not open in "
+                           "this process. It may have been imported "
+                           "already.");
+        return FALSE;
+    }
+    if (!DuplicateHandle(GetCurrentProcess(),
+                         handle,
+                         GetCurrentProcess(),
+                         token,
+                         0,
+                         FALSE,
+                         DUPLICATE_SAME_ACCESS)) {
+        *token = NULL;
+        save_error(err, GetLastError(), "DuplicateHandle");
+        return FALSE;
+    }
+    CloseHandle(handle);
+    return TRUE;
+}
+
+static SECURITY_STATUS
+import_context(const export_header* hdr,
+               const BYTE* packed,
+               CtxtHandle* ctx,
+               HANDLE token) {
+    SecBuffer buffer;
+
+    buffer.BufferType = SECBUFFER_EMPTY;
+    buffer.cbBuffer = hdr->packed_len;
+    buffer.pvBuffer = (VOID*)packed;
+    return ImportSecurityContextW(
+        hdr->spnego ? GSS_MECH_OID_SPNEGO : GSS_MECH_OID_KRB5,
+        &buffer,
+        token,
+        ctx);
+}
+
+/* Exports a completed client context for process pid. The context is
+ * deleted once ExportSecurityContext succeeds, even if a later step
+ * fails.
+ * */
+BOOL
+auth_sspi_client_export(sspi_client_state* state,
+                        DWORD pid,
+                        BYTE** blob,
+                        ULONG* blen,
+                        sspi_error* err) {
+    export_header hdr;
+    BOOL deleted = FALSE;
+    BOOL result;
+
+    if (!state->haveCtx || state->username == NULL) {
+        save_error(err, 0, "Only a completed context can be exported.");
+        return FALSE;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = EXPORT_CLIENT;
+    hdr.pid = pid;
+    hdr.spnego = !same_wide(state->tmpl->mechoid, GSS_MECH_OID_KRB5);
+    hdr.flags = state->tmpl->flags;
+    hdr.expiry = state->expiry;
+    result = export_context(&state->ctx,
+                            &hdr,
+                            state->tmpl->spn,
+                            state->username,
+                            NULL,
+                            blob,
+                            blen,
+                            &deleted,
+                            err);
+    if (deleted) {
+        state->haveCtx = 0;
+    }
+    return result;
+}
+
+/* Imports a client context exported for this process into state, which
+ * is initialized here. Outbound credentials for the logged on user are
+ * acquired, for any handshake after a reset. On failure state must
+ * still be destroyed.
+ * */
+INT
+auth_sspi_client_import(const BYTE* blob,
+                        ULONG blen,
+                        sspi_client_state* state,
+                        sspi_error* err) {
+    export_header hdr;
+    WCHAR* spn;
+    SEC_CHAR* username;
+    SEC_CHAR* targetname;
+    const BYTE* packed;
+    sspi_client_template* tmpl;
+    SECURITY_STATUS status;
+    HANDLE token;
+
+    memset(state, 0, sizeof(sspi_client_state));
+    if (!parse_export(blob,
+                      blen,
+                      EXPORT_CLIENT,
+                      &hdr,
+                      &spn,
+                      &username,
+                      &targetname,
+                      &packed,
+                      err)) {
+        return AUTH_GSS_ERROR;
+    }
+    free(targetname);
+    if (!take_export_token(&hdr, &token, err)) {
+        free(spn);
+        free(username);
+        return AUTH_GSS_ERROR;
+    }
+    tmpl = auth_sspi_client_template_new(
+        spn,
+        hdr.flags,
+        NULL, 0, NULL, 0, NULL, 0,
+        hdr.spnego ? GSS_MECH_OID_SPNEGO : GSS_MECH_OID_KRB5,
+        err);
+    free(spn);
+    if (tmpl == NULL) {
+        free(username);
+        if (token) {
+            CloseHandle(token);
+        }
+        return AUTH_GSS_ERROR;
+    }
+    auth_sspi_client_init(tmpl, state);
+    auth_sspi_client_template_release(tmpl);
+    state->cred = template_cred(state->tmpl);
+    state->username = username;
+    state->expiry = hdr.expiry;
+    state->token = token;
+
+    status = import_context(&hdr, packed, &state->ctx, state->token);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "ImportSecurityContext");
+        return AUTH_GSS_ERROR;
+    }
+    state->haveCtx = 1;
+    return AUTH_GSS_COMPLETE;
+}
+
+/* Exports a completed server context for process pid, like
+ * auth_sspi_client_export.
+ * */
+BOOL
+auth_sspi_server_export(sspi_server_state* state,
+                        DWORD pid,
+                        BYTE** blob,
+                        ULONG* blen,
+                        sspi_error* err) {
+    export_header hdr;
+    BOOL deleted = FALSE;
+    BOOL result;
+
+    if (!state->haveCtx || state->username == NULL) {
+        save_error(err, 0, "Only a completed context can be exported.");
+        return FALSE;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = EXPORT_SERVER;
+    hdr.pid = pid;
+    /* Servers always accept with Negotiate. */
+    hdr.spnego = 1;
+    hdr.flags = state->ctx_attr;
+    hdr.expiry = state->ctx_expiry;
+    result = export_context(&state->ctx,
+                            &hdr,
+                            state->spn,
+                            state->username,
+                            state->targetname,
+                            blob,
+                            blen,
+                            &deleted,
+                            err);
+    if (deleted) {
+        state->haveCtx = 0;
+    }
+    return result;
+}
+
+/* Imports a server context exported for this process into state, which
+ * is initialized here with inbound credentials for the SPN, for any
+ * handshake after a reset. On failure state must still be destroyed.
+ * */
+INT
+auth_sspi_server_import(const BYTE* blob,
+                        ULONG blen,
+                        sspi_server_state* state,
+                        sspi_error* err) {
+    export_header hdr;
+    WCHAR* spn;
+    SEC_CHAR* username;
+    SEC_CHAR* targetname;
+    const BYTE* packed;
+    SECURITY_STATUS status;
+    INT result;
+    HANDLE token;
+
+    memset(state, 0, sizeof(sspi_server_state));
+    if (!parse_export(blob,
+                      blen,
+                      EXPORT_SERVER,
+                      &hdr,
+                      &spn,
+                      &username,
+                      &targetname,
+                      &packed,
+                      err)) {
+        return AUTH_GSS_ERROR;
+    }
+    if (!take_export_token(&hdr, &token, err)) {
+        free(spn);
+        free(username);
+        free(targetname);
+        return AUTH_GSS_ERROR;
+    }
+    result = auth_sspi_server_init(spn, state, err);
+    free(spn);
+    if (result == AUTH_GSS_ERROR) {
+        free(username);
+        free(targetname);
+        if (token) {
+            CloseHandle(token);
+        }
+        return AUTH_GSS_ERROR;
+    }
+    state->token = token;
+    state->username = username;
+    if (hdr.targetname_len) {
+        state->targetname = targetname;
+    } else {
+        free(targetname);
+    }
+    state->ctx_attr = hdr.flags;
+    state->ctx_expiry = hdr.expiry;
+
+    status = import_context(&hdr, packed, &state->ctx, state->token);
+    if (status != SEC_E_OK) {
+        save_error(err, status, "ImportSecurityContext");
+        return AUTH_GSS_ERROR;
+    }
+    state->haveCtx = 1;
+    return AUTH_GSS_COMPLETE;
+}
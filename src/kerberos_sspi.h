@@ -17,6 +17,7 @@
 
 #define SECURITY_WIN32 1 /* Required for SSPI */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include <Windows.h>
 #include <sspi.h>
@@ -27,20 +28,74 @@
 
 #define GSS_MECH_OID_KRB5 L"Kerberos"
 #define GSS_MECH_OID_SPNEGO L"Negotiate"
+/* Not a package. Picks one of the above per SPN, see mech_memory_*. */
+#define GSS_MECH_OID_AUTO L"Auto"
 
+/* Where an auth_sspi_* function that failed records why, so the caller
+ * can raise the error once it holds the GIL. A NULL msg means out of
+ * memory. A code of 0 means msg alone describes the error.
+ * */
 typedef struct {
-    CredHandle cred;
-    CtxtHandle ctx;
+    DWORD code;
+    const SEC_CHAR* msg;
+} sspi_error;
+
+/* Credentials shared by reference count. A template's credentials are
+ * replaced when the refresher renews them. Each context keeps the ones
+ * its handshake started with.
+ * */
+typedef struct {
+    CredHandle handle;
+    TimeStamp expiry;
+    volatile LONG refcount;
+} sspi_cred;
+
+/* The SPN, flags and credentials of a client context. Immutable once
+ * created and shared, by reference count, between all the contexts
+ * initialized from it. A derived template borrows its parent's
+ * credentials and keeps the parent alive.
+ * */
+typedef struct _sspi_client_template {
+    /* NULL in a derived template. Guarded by credLock. */
+    sspi_cred* cred;
+    SRWLOCK credLock;
     WCHAR* spn;
+    WCHAR* mechoid;
+    /* domain\user for explicit credentials, NULL for the logged on user.
+     * Owned by the template that acquired the credentials.
+     * */
+    WCHAR* identity;
+    ULONG flags;
+    /* mechoid was picked from the mechanism memory. */
+    UCHAR autoMech;
+    volatile LONG refcount;
+    struct _sspi_client_template* parent;
+    /* A copy of the explicit credentials, kept to renew them. Only set
+     * while registered with the refresher.
+     * */
+    SEC_WINNT_AUTH_IDENTITY_W* renewIdentity;
+    UCHAR refreshing;
+    struct _sspi_client_template* refreshPrev;
+    struct _sspi_client_template* refreshNext;
+} sspi_client_template;
+
+typedef struct {
+    sspi_client_template* tmpl;
+    /* The credentials of the current handshake, or NULL. */
+    sspi_cred* cred;
+    CtxtHandle ctx;
+    TimeStamp expiry;
     SEC_CHAR* response;
     SEC_CHAR* username;
-    ULONG flags;
-    UCHAR haveCred;
     UCHAR haveCtx;
+    UCHAR haveSizes;
+    SecPkgContext_Sizes sizes;
     ULONG qop;
+    /* The token an imported context came with, or NULL. */
+    HANDLE token;
 } sspi_client_state;
 
-typedef struct {
+typedef struct _sspi_server_state {
     CredHandle cred;
     CtxtHandle ctx;
     WCHAR* spn;
@@ -50,35 +105,283 @@ typedef struct {
     ULONG flags;
     UCHAR haveCred;
     UCHAR haveCtx;
+    UCHAR haveSizes;
+    SecPkgContext_Sizes sizes;
+    ULONG qop;
     TimeStamp cred_expiry;
     TimeStamp ctx_expiry;
     ULONG ctx_attr;
     BOOL authenticated;
     ULONG max_token;
+    /* The token an imported context came with, or NULL. */
+    HANDLE token;
+    /* Credentials the refresher acquired ahead of expiry, swapped in
+     * when the next handshake starts. Guarded by credLock, as is the
+     * swap.
+     * */
+    SRWLOCK credLock;
+    CredHandle nextCred;
+    TimeStamp next_cred_expiry;
+    UCHAR haveNextCred;
+    UCHAR refreshing;
+    /* Set while the refresher works on the state outside its lock.
+     * Guarded by the refresher's lock.
+     * */
+    UCHAR refreshPinned;
+    struct _sspi_server_state* refreshPrev;
+    struct _sspi_server_state* refreshNext;
 } sspi_server_state;
 
+typedef struct {
+    DWORD ttl;
+    ULONG entries;
+    LONG64 recorded;
+    LONG64 suppressed;
+} sspi_negative_cache_stats;
+
+typedef struct {
+    DWORD ttl;
+    ULONG entries;
+    LONG64 recorded;
+    LONG64 hits;
+} sspi_mech_memory_stats;
+
+/* The outcome of one prefetched first step. */
+typedef struct {
+    INT result;
+    sspi_error err;
+    LONG64 elapsed_us;
+} sspi_prefetch_result;
+
+typedef struct {
+    /* Milliseconds between passes. 0 disables the refresher. */
+    DWORD interval;
+    /* Milliseconds before expiry that credentials are renewed. */
+    DWORD margin;
+    ULONG clients;
+    ULONG servers;
+    LONG64 refreshed;
+    LONG64 failures;
+} sspi_refresh_stats;
+
+/* Values of sspi_breaker_stats.state. */
+#define SSPI_BREAKER_CLOSED 0
+#define SSPI_BREAKER_OPEN 1
+#define SSPI_BREAKER_HALF_OPEN 2
+
+typedef struct {
+    /* Milliseconds to stay open. 0 disables the breaker. */
+    DWORD cooldown;
+    /* Milliseconds after which a call counts as failed, or INFINITE. */
+    DWORD slow_call;
+    /* The fraction of failed calls in a window that opens the breaker. */
+    double failure_ratio;
+    /* The number of calls in a window. */
+    ULONG min_calls;
+} sspi_breaker_config;
+
+typedef struct {
+    LONG state;
+    sspi_breaker_config config;
+    LONG64 calls;
+    LONG64 failures;
+    LONG64 rejected;
+    LONG64 opened;
+    LONG64 half_opened;
+    LONG64 closed;
+} sspi_breaker_stats;
+
+typedef struct {
+    /* The most handshake legs in AcceptSecurityContext at once. 0
+     * disables the limiter.
+     * */
+    ULONG max_concurrent;
+    /* The most legs waiting for their turn. */
+    ULONG max_queue;
+    /* Milliseconds a leg waits before it is rejected, or INFINITE. */
+    DWORD queue_timeout;
+} sspi_admission_config;
+
+typedef struct {
+    sspi_admission_config config;
+    ULONG in_flight;
+    ULONG queued;
+    LONG64 admitted;
+    LONG64 rejected;
+    LONG64 timed_out;
+    /* Legs admitted after waiting, and their waits in microseconds. */
+    LONG64 waited;
+    LONG64 wait_us;
+    LONG64 max_wait_us;
+} sspi_admission_stats;
+
+/* Classes of the tokens a server step is given. */
+#define SSPI_CLASS_INVALID 0
+/* A Kerberos AP-REQ in its GSS-API framing. */
+#define SSPI_CLASS_KERBEROS 1
+#define SSPI_CLASS_NTLM 2
+#define SSPI_CLASS_SPNEGO_INIT 3
+#define SSPI_CLASS_SPNEGO_RESP 4
+#define SSPI_CLASSES 5
+
+typedef struct {
+    /* Reject invalid tokens and tokens the fields below rule out before
+     * AcceptSecurityContext sees them. Tokens are classified and counted
+     * either way.
+     * */
+    BOOL enabled;
+    /* Accept NTLM tokens, bare or carried by SPNEGO. */
+    BOOL allow_ntlm;
+} sspi_screen_config;
+
+typedef struct {
+    sspi_screen_config config;
+    LONG64 seen[SSPI_CLASSES];
+    LONG64 rejected[SSPI_CLASSES];
+} sspi_screen_stats;
+
+/* Calls whose base64 input is checked against a size limit. */
+#define SSPI_LIMIT_CLIENT_STEP 0
+#define SSPI_LIMIT_SERVER_STEP 1
+#define SSPI_LIMIT_UNWRAP 2
+#define SSPI_LIMITS 3
+
+typedef struct {
+    /* The longest base64 input each call accepts, in characters, checked
+     * before it is decoded. 0 means no limit.
+     * */
+    ULONG max_length[SSPI_LIMITS];
+} sspi_size_limits;
+
+typedef struct {
+    sspi_size_limits limits;
+    LONG64 rejected[SSPI_LIMITS];
+} sspi_size_limit_stats;
+
 VOID set_gsserror(DWORD errCode, const SEC_CHAR* msg);
+VOID set_sspi_error(const sspi_error* err);
+VOID save_error(sspi_error* err, DWORD code, const SEC_CHAR* msg);
+LONG64 auth_sspi_unix_now(VOID);
+ULONG auth_sspi_key_hash(const BYTE* key, ULONG klen);
 VOID destroy_sspi_client_state(sspi_client_state* state);
-INT auth_sspi_client_init(WCHAR* service,
-                          ULONG flags,
-                          WCHAR* user,
-                          ULONG ulen,
-                          WCHAR* domain,
-                          ULONG dlen,
-                          WCHAR* password,
-                          ULONG plen,
-                          WCHAR* mechoid,
+sspi_client_template* auth_sspi_client_template_new(WCHAR* service,
+                                                    ULONG flags,
+                                                    WCHAR* user,
+                                                    ULONG ulen,
+                                                    WCHAR* domain,
+                                                    ULONG dlen,
+                                                    WCHAR* password,
+                                                    ULONG plen,
+                                                    WCHAR* mechoid,
+                                                    sspi_error* err);
+sspi_client_template* auth_sspi_client_template_derive(
+    sspi_client_template* parent, WCHAR* service, sspi_error* err);
+VOID auth_sspi_client_template_retain(sspi_client_template* tmpl);
+VOID auth_sspi_client_template_release(sspi_client_template* tmpl);
+INT auth_sspi_client_init(sspi_client_template* tmpl,
                           sspi_client_state* state);
-INT auth_sspi_client_step(sspi_client_state* state, SEC_CHAR* challenge);
-INT auth_sspi_client_unwrap(sspi_client_state* state, SEC_CHAR* challenge);
+INT auth_sspi_client_reset(sspi_client_state* state);
+INT auth_sspi_client_step(sspi_client_state* state,
+                          SEC_CHAR* challenge,
+                          ULONG clen,
+                          sspi_error* err);
+VOID auth_sspi_client_step_many(sspi_client_state** states,
+                                ULONG count,
+                                INT* results,
+                                sspi_error* errs);
+LONG auth_sspi_client_step_hedged(sspi_client_state** states,
+                                  ULONG count,
+                                  DWORD delay,
+                                  INT* result,
+                                  sspi_error* err);
+VOID auth_sspi_negative_cache_configure(DWORD ttl);
+VOID auth_sspi_negative_cache_get_stats(sspi_negative_cache_stats* stats);
+BOOL auth_sspi_client_prefetch(sspi_client_template* root,
+                               WCHAR** services,
+                               ULONG count,
+                               sspi_prefetch_result* results,
+                               VOID (*done)(VOID* arg),
+                               VOID* arg,
+                               sspi_error* err);
+VOID auth_sspi_mech_memory_configure(DWORD ttl);
+VOID auth_sspi_mech_memory_get_stats(sspi_mech_memory_stats* stats);
+BOOL auth_sspi_expiry_to_unix(const TimeStamp* expiry, double* seconds);
+VOID auth_sspi_client_get_expiry(sspi_client_state* state,
+                                 TimeStamp* cred_expiry,
+                                 TimeStamp* ctx_expiry);
+VOID auth_sspi_client_template_get_expiry(sspi_client_template* tmpl,
+                                          TimeStamp* cred_expiry);
+VOID auth_sspi_server_get_expiry(sspi_server_state* state,
+                                 TimeStamp* cred_expiry,
+                                 TimeStamp* ctx_expiry);
+BOOL auth_sspi_refresh_configure(DWORD interval, DWORD margin);
+VOID auth_sspi_refresh_get_stats(sspi_refresh_stats* stats);
+VOID auth_sspi_breaker_configure(const sspi_breaker_config* config);
+VOID auth_sspi_breaker_get_stats(sspi_breaker_stats* stats);
+VOID auth_sspi_admission_configure(const sspi_admission_config* config);
+VOID auth_sspi_admission_get_stats(sspi_admission_stats* stats);
+INT auth_sspi_classify_token(const BYTE* token, ULONG len, INT* mech);
+VOID auth_sspi_screen_configure(const sspi_screen_config* config);
+VOID auth_sspi_screen_get_stats(sspi_screen_stats* stats);
+VOID auth_sspi_size_limits_configure(const sspi_size_limits* limits);
+VOID auth_sspi_size_limits_get_stats(sspi_size_limit_stats* stats);
+INT auth_sspi_client_unwrap(sspi_client_state* state,
+                            SEC_CHAR* challenge,
+                            ULONG clen,
+                            sspi_error* err);
 INT auth_sspi_client_wrap(sspi_client_state* state,
                           SEC_CHAR* data,
+                          ULONG dlen,
                           SEC_CHAR* user,
                           ULONG ulen,
-                          INT protect);
+                          INT protect,
+                          sspi_error* err);
+BOOL auth_sspi_client_export(sspi_client_state* state,
+                             DWORD pid,
+                             BYTE** blob,
+                             ULONG* blen,
+                             sspi_error* err);
+INT auth_sspi_client_import(const BYTE* blob,
+                            ULONG blen,
+                            sspi_client_state* state,
+                            sspi_error* err);
+INT auth_sspi_client_get_mic(sspi_client_state* state,
+                             SEC_CHAR* data,
+                             ULONG dlen,
+                             sspi_error* err);
+INT auth_sspi_client_verify_mic(sspi_client_state* state,
+                                SEC_CHAR* data,
+                                ULONG dlen,
+                                SEC_CHAR* mic,
+                                ULONG miclen,
+                                sspi_error* err);
 VOID destroy_sspi_server_state(sspi_server_state* state);
-INT auth_sspi_server_init(WCHAR* service, sspi_server_state* state);
-INT auth_sspi_server_step(sspi_server_state* state, SEC_CHAR* challenge);
+INT auth_sspi_server_init(WCHAR* service,
+                          sspi_server_state* state,
+                          sspi_error* err);
+INT auth_sspi_server_reset(sspi_server_state* state);
+INT auth_sspi_server_step(sspi_server_state* state,
+                          SEC_CHAR* challenge,
+                          ULONG clen,
+                          sspi_error* err);
+INT auth_sspi_server_unwrap(sspi_server_state* state,
+                            SEC_CHAR* challenge,
+                            ULONG clen,
+                            sspi_error* err);
+INT auth_sspi_server_wrap(sspi_server_state* state,
+                          SEC_CHAR* data,
+                          ULONG dlen,
+                          INT protect,
+                          sspi_error* err);
+BOOL auth_sspi_server_export(sspi_server_state* state,
+                             DWORD pid,
+                             BYTE** blob,
+                             ULONG* blen,
+                             sspi_error* err);
+INT auth_sspi_server_import(const BYTE* blob,
+                            ULONG blen,
+                            sspi_server_state* state,
+                            sspi_error* err);
 INT auth_sspi_server_clean(sspi_server_state* state);
 INT auth_sspi_server_impersonate(sspi_server_state* state);
 INT auth_sspi_server_revert(sspi_server_state* state);
\ No newline at end of file
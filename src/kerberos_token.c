@@ -0,0 +1,300 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kerberos_sspi.h"
+#include "kerberos_token.h"
+#include <bcrypt.h>
+
+/* Token layout, before base64: a version byte, the expiry as a big
+ * endian 64 bit integer, the UTF-8 username and the MAC of everything
+ * before it.
+ * */
+#define TOKEN_VERSION 1
+#define TOKEN_HEADER 9
+#define TOKEN_MAC 32
+#define TOKEN_MAX (TOKEN_HEADER + SSPI_TOKEN_MAX_USERNAME + TOKEN_MAC)
+/* The base64 length of TOKEN_MAX bytes. */
+#define TOKEN_MAX_ENCODED (((TOKEN_MAX + 2) / 3) * 4)
+
+struct _sspi_token_issuer {
+    BCRYPT_ALG_HANDLE alg;
+    BYTE* key;
+    ULONG klen;
+    BYTE* prev_key;
+    ULONG prev_klen;
+    DWORD ttl;
+    volatile LONG64 issued;
+    volatile LONG64 verified;
+    volatile LONG64 rejected;
+    volatile LONG64 expired;
+};
+
+static BYTE*
+copy_key(const BYTE* key, ULONG klen) {
+    BYTE* copy = (BYTE*)malloc(klen ? klen : 1);
+    if (copy) {
+        memcpy(copy, key, klen);
+    }
+    return copy;
+}
+
+static VOID
+free_key(BYTE* key, ULONG klen) {
+    if (key) {
+        SecureZeroMemory(key, klen);
+        free(key);
+    }
+}
+
+BOOL
+sspi_token_random_key(BYTE* key, ULONG klen, sspi_error* err) {
+    NTSTATUS status = BCryptGenRandom(
+        NULL, key, klen, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (!BCRYPT_SUCCESS(status)) {
+        save_error(err, (DWORD)status, "BCryptGenRandom");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+sspi_token_issuer*
+sspi_token_issuer_new(const BYTE* key,
+                      ULONG klen,
+                      const BYTE* prev_key,
+                      ULONG prev_klen,
+                      DWORD ttl,
+                      sspi_error* err) {
+    sspi_token_issuer* issuer;
+    NTSTATUS status;
+
+    issuer = (sspi_token_issuer*)calloc(1, sizeof(sspi_token_issuer));
+    if (issuer == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    issuer->ttl = ttl;
+    issuer->klen = klen;
+    issuer->key = copy_key(key, klen);
+    if (issuer->key == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        goto fail;
+    }
+    if (prev_key) {
+        issuer->prev_klen = prev_klen;
+        issuer->prev_key = copy_key(prev_key, prev_klen);
+        if (issuer->prev_key == NULL) {
+            save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+            goto fail;
+        }
+    }
+    /* The provider handle is shared by every thread; each MAC gets its
+     * own hash object.
+     * */
+    status = BCryptOpenAlgorithmProvider(&issuer->alg,
+                                         BCRYPT_SHA256_ALGORITHM,
+                                         NULL,
+                                         BCRYPT_ALG_HANDLE_HMAC_FLAG);
+    if (!BCRYPT_SUCCESS(status)) {
+        issuer->alg = NULL;
+        save_error(err, (DWORD)status, "BCryptOpenAlgorithmProvider");
+        goto fail;
+    }
+    return issuer;
+
+fail:
+    sspi_token_issuer_free(issuer);
+    return NULL;
+}
+
+VOID
+sspi_token_issuer_free(sspi_token_issuer* issuer) {
+    if (issuer->alg) {
+        BCryptCloseAlgorithmProvider(issuer->alg, 0);
+    }
+    free_key(issuer->key, issuer->klen);
+    free_key(issuer->prev_key, issuer->prev_klen);
+    free(issuer);
+}
+
+static BOOL
+compute_mac(sspi_token_issuer* issuer,
+            const BYTE* key,
+            ULONG klen,
+            const BYTE* data,
+            ULONG dlen,
+            BYTE* mac) {
+    BCRYPT_HASH_HANDLE hash;
+    NTSTATUS status;
+
+    status = BCryptCreateHash(
+        issuer->alg, &hash, NULL, 0, (PUCHAR)key, klen, 0);
+    if (!BCRYPT_SUCCESS(status)) {
+        return FALSE;
+    }
+    status = BCryptHashData(hash, (PUCHAR)data, dlen, 0);
+    if (BCRYPT_SUCCESS(status)) {
+        status = BCryptFinishHash(hash, mac, TOKEN_MAC, 0);
+    }
+    BCryptDestroyHash(hash);
+    return BCRYPT_SUCCESS(status);
+}
+
+/* Compares in time independent of where the MACs differ, so a forger
+ * learns nothing from how long a rejection takes.
+ * */
+static BOOL
+mac_equal(const BYTE* a, const BYTE* b) {
+    volatile BYTE diff = 0;
+    ULONG i;
+    for (i = 0; i < TOKEN_MAC; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+/* Mints a token for username expiring after the issuer's TTL, or at
+ * not_after if that is sooner and not 0. Returns the base64 token, to
+ * be freed by the caller.
+ * */
+SEC_CHAR*
+sspi_token_issue(sspi_token_issuer* issuer,
+                 const SEC_CHAR* username,
+                 LONG64 not_after,
+                 sspi_error* err) {
+    BYTE raw[TOKEN_MAX];
+    SIZE_T ulen = strlen(username);
+    ULONG len;
+    LONG64 expires = auth_sspi_unix_now() + issuer->ttl;
+    SEC_CHAR* out;
+    DWORD olen;
+    INT i;
+
+    if (ulen == 0 || ulen > SSPI_TOKEN_MAX_USERNAME) {
+        save_error(err, 0, "The username does not fit in a session token.");
+        return NULL;
+    }
+    if (not_after && not_after < expires) {
+        expires = not_after;
+    }
+    raw[0] = TOKEN_VERSION;
+    for (i = 0; i < 8; i++) {
+        raw[1 + i] = (BYTE)((ULONG64)expires >> (56 - 8 * i));
+    }
+    memcpy(raw + TOKEN_HEADER, username, ulen);
+    len = TOKEN_HEADER + (ULONG)ulen;
+    if (!compute_mac(issuer, issuer->key, issuer->klen, raw, len, raw + len)) {
+        save_error(err, 0, "Computing the session token MAC failed.");
+        return NULL;
+    }
+    len += TOKEN_MAC;
+
+    if (!CryptBinaryToStringA(raw,
+                              len,
+                              CRYPT_STRING_BASE64|CRYPT_STRING_NOCRLF,
+                              NULL,
+                              &olen)) {
+        save_error(err, 0, "CryptBinaryToString failed.");
+        return NULL;
+    }
+    out = (SEC_CHAR*)malloc(olen);
+    if (out == NULL) {
+        save_error(err, ERROR_NOT_ENOUGH_MEMORY, NULL);
+        return NULL;
+    }
+    if (!CryptBinaryToStringA(raw,
+                              len,
+                              CRYPT_STRING_BASE64|CRYPT_STRING_NOCRLF,
+                              out,
+                              &olen)) {
+        free(out);
+        save_error(err, 0, "CryptBinaryToString failed.");
+        return NULL;
+    }
+    InterlockedIncrement64(&issuer->issued);
+    return out;
+}
+
+/* Checks a token minted under the issuer's key or its previous key.
+ * On SSPI_TOKEN_VALID copies the null terminated username into
+ * username, which holds SSPI_TOKEN_MAX_USERNAME + 1 bytes, and the
+ * expiry into expires. Only the whole MAC is compared and only after
+ * it matches is the expiry looked at, so a token that was tampered with
+ * is always SSPI_TOKEN_INVALID.
+ * */
+INT
+sspi_token_verify(sspi_token_issuer* issuer,
+                  const SEC_CHAR* token,
+                  ULONG tlen,
+                  SEC_CHAR* username,
+                  LONG64* expires) {
+    BYTE raw[TOKEN_MAX];
+    BYTE mac[TOKEN_MAC];
+    DWORD len = sizeof(raw);
+    ULONG dlen;
+    ULONG64 value = 0;
+    INT i;
+
+    /* Reject oversized tokens before decoding them. */
+    if (tlen == 0 || tlen > TOKEN_MAX_ENCODED ||
+        !CryptStringToBinaryA(
+            token, tlen, CRYPT_STRING_BASE64, raw, &len, NULL, NULL) ||
+        len <= TOKEN_HEADER + TOKEN_MAC ||
+        raw[0] != TOKEN_VERSION) {
+        goto invalid;
+    }
+    dlen = len - TOKEN_MAC;
+    if (!compute_mac(issuer, issuer->key, issuer->klen, raw, dlen, mac)) {
+        goto invalid;
+    }
+    if (!mac_equal(mac, raw + dlen)) {
+        if (issuer->prev_key == NULL ||
+            !compute_mac(issuer,
+                         issuer->prev_key,
+                         issuer->prev_klen,
+                         raw,
+                         dlen,
+                         mac) ||
+            !mac_equal(mac, raw + dlen)) {
+            goto invalid;
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        value = (value << 8) | raw[1 + i];
+    }
+    *expires = (LONG64)value;
+    if (*expires <= auth_sspi_unix_now()) {
+        InterlockedIncrement64(&issuer->expired);
+        return SSPI_TOKEN_EXPIRED;
+    }
+    memcpy(username, raw + TOKEN_HEADER, dlen - TOKEN_HEADER);
+    username[dlen - TOKEN_HEADER] = '\0';
+    InterlockedIncrement64(&issuer->verified);
+    return SSPI_TOKEN_VALID;
+
+invalid:
+    InterlockedIncrement64(&issuer->rejected);
+    return SSPI_TOKEN_INVALID;
+}
+
+VOID
+sspi_token_get_stats(sspi_token_issuer* issuer, sspi_token_stats* stats) {
+    stats->ttl = issuer->ttl;
+    stats->issued = issuer->issued;
+    stats->verified = issuer->verified;
+    stats->rejected = issuer->rejected;
+    stats->expired = issuer->expired;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2017 Benjamin Norrington.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Include kerberos_sspi.h first. */
+
+/* Session tokens, handed to a client once its handshake completes so
+ * that its later requests are authenticated without another one. A
+ * token carries the username and an expiry, in milliseconds since the
+ * epoch, followed by their HMAC-SHA256 under the issuer's key, and is
+ * base64 encoded.
+ * */
+#define SSPI_TOKEN_EXPIRED -1
+#define SSPI_TOKEN_INVALID 0
+#define SSPI_TOKEN_VALID 1
+
+/* The longest username a token can carry, in bytes. */
+#define SSPI_TOKEN_MAX_USERNAME 1024
+
+typedef struct _sspi_token_issuer sspi_token_issuer;
+
+typedef struct {
+    DWORD ttl;
+    LONG64 issued;
+    LONG64 verified;
+    LONG64 rejected;
+    LONG64 expired;
+} sspi_token_stats;
+
+BOOL sspi_token_random_key(BYTE* key, ULONG klen, sspi_error* err);
+sspi_token_issuer* sspi_token_issuer_new(const BYTE* key,
+                                         ULONG klen,
+                                         const BYTE* prev_key,
+                                         ULONG prev_klen,
+                                         DWORD ttl,
+                                         sspi_error* err);
+VOID sspi_token_issuer_free(sspi_token_issuer* issuer);
+SEC_CHAR* sspi_token_issue(sspi_token_issuer* issuer,
+                           const SEC_CHAR* username,
+                           LONG64 not_after,
+                           sspi_error* err);
+INT sspi_token_verify(sspi_token_issuer* issuer,
+                      const SEC_CHAR* token,
+                      ULONG tlen,
+                      SEC_CHAR* username,
+                      LONG64* expires);
+VOID sspi_token_get_stats(sspi_token_issuer* issuer,
+                          sspi_token_stats* stats);
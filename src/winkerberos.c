@@ -16,8 +16,13 @@
  */
 
 #include "kerberos_sspi.h"
+#include "kerberos_pool.h"
+#include "kerberos_session.h"
+#include "kerberos_token.h"
+#include "kerberos_shmcache.h"
 
 #include <Shlwapi.h>
+#include <math.h>
 
 #if PY_MAJOR_VERSION >= 3
 #define PyInt_FromLong PyLong_FromLong
@@ -43,6 +48,7 @@ PyDoc_STRVAR(winkerberos_documentation,
 PyObject* KrbError;
 /* Note - also defined extern in kerberos_sspi.c */
 PyObject* GSSError;
+PyObject* GSSTimeoutError;
 
 static BOOL
 _string_too_long(const SEC_CHAR* key, SIZE_T len) {
@@ -53,6 +59,15 @@ _string_too_long(const SEC_CHAR* key, SIZE_T len) {
     return FALSE;
 }
 
+static BOOL
+_too_many(const SEC_CHAR* key, Py_ssize_t count) {
+    if ((SIZE_T)count > LONG_MAX) {
+        PyErr_Format(PyExc_ValueError, "too many %s", key);
+        return TRUE;
+    }
+    return FALSE;
+}
+
 static BOOL
 _py_buffer_to_wchar(PyObject* obj, WCHAR** out, Py_ssize_t* outlen) {
     Py_buffer view;
@@ -185,23 +200,303 @@ StringObject_AsWCHAR(PyObject* arg,
 }
 
 static VOID
-#if PY_MAJOR_VERSION >=3
-destroy_sspi_client(PyObject* obj) {
-    sspi_client_state* state = PyCapsule_GetPointer(obj, NULL);
-#else
-destroy_sspi_client(VOID* obj) {
-    sspi_client_state* state = (sspi_client_state*)obj;
-#endif
-    if (state) {
-        destroy_sspi_client_state(state);
-        free(state);
+set_destroyed_context(VOID) {
+    PyErr_SetString(GSSError,
+                    "The security context has been destroyed. A context "
+                    "cannot be used after it has been cleaned.");
+}
+
+static VOID
+set_busy_context(VOID) {
+    PyErr_SetString(GSSError,
+                    "The security context is in use by another thread.");
+}
+
+/* Converts a timeout in seconds, or None, to milliseconds. */
+static BOOL
+parse_timeout(PyObject* obj, const SEC_CHAR* key, DWORD* timeout) {
+    double seconds;
+    if (obj == Py_None) {
+        *timeout = INFINITE;
+        return TRUE;
+    }
+    seconds = PyFloat_AsDouble(obj);
+    if (seconds == -1.0 && PyErr_Occurred()) {
+        return FALSE;
+    }
+    if (!(seconds >= 0.0)) {
+        PyErr_Format(PyExc_ValueError, "%s must be non-negative", key);
+        return FALSE;
+    }
+    if (seconds * 1000.0 >= (double)(INFINITE - 1)) {
+        PyErr_Format(PyExc_OverflowError, "%s too large", key);
+        return FALSE;
+    }
+    *timeout = (DWORD)ceil(seconds * 1000.0);
+    return TRUE;
+}
+
+/* Converts an SSPI expiry to seconds since the epoch, or None. */
+static PyObject*
+expiry_value(const TimeStamp* expiry) {
+    double seconds;
+    if (!auth_sspi_expiry_to_unix(expiry, &seconds)) {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble(seconds);
+}
+
+/* Converts the target process id of an export, None meaning this one. */
+static BOOL
+parse_pid(PyObject* obj, DWORD* pid) {
+    unsigned long value;
+    if (obj == Py_None) {
+        *pid = GetCurrentProcessId();
+        return TRUE;
+    }
+    value = PyLong_AsUnsignedLong(obj);
+    if (value == (unsigned long)-1 && PyErr_Occurred()) {
+        return FALSE;
+    }
+    *pid = (DWORD)value;
+    return TRUE;
+}
+
+/* Client context type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_client_state* state;
+    /* Number of calls using state with the GIL released, including
+     * operations queued on or running on the worker pool.
+     * */
+    volatile LONG busy;
+} ClientContext;
+
+static PyTypeObject ClientContext_Type;
+
+static sspi_client_state*
+client_context_state(PyObject* pyctx) {
+    sspi_client_state* state;
+    if (!PyObject_TypeCheck(pyctx, &ClientContext_Type)) {
+        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+        return NULL;
+    }
+    state = ((ClientContext*)pyctx)->state;
+    if (state == NULL) {
+        set_destroyed_context();
+    }
+    return state;
+}
+
+static INT
+client_context_clean(ClientContext* self) {
+    /* Already destroyed, perhaps after a timeout. */
+    if (self->state == NULL) {
+        return AUTH_GSS_COMPLETE;
+    }
+    if (self->busy) {
+        set_busy_context();
+        return AUTH_GSS_ERROR;
+    }
+    destroy_sspi_client_state(self->state);
+    free(self->state);
+    self->state = NULL;
+    return AUTH_GSS_COMPLETE;
+}
+
+static VOID
+client_context_dealloc(ClientContext* self) {
+    if (self->state) {
+        destroy_sspi_client_state(self->state);
+        free(self->state);
+    }
+    PyObject_Del(self);
+}
+
+static INT
+client_context_reset(ClientContext* self) {
+    if (self->state == NULL) {
+        set_destroyed_context();
+        return AUTH_GSS_ERROR;
+    }
+    if (self->busy) {
+        set_busy_context();
+        return AUTH_GSS_ERROR;
+    }
+    return auth_sspi_client_reset(self->state);
+}
+
+PyDoc_STRVAR(client_context_clean_doc,
+"clean()\n"
+"\n"
+"Destroys the context. Equivalent to :func:`authGSSClientClean`.");
+
+static PyObject*
+client_context_clean_method(ClientContext* self, PyObject* unused) {
+    if (client_context_clean(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(client_context_reset_doc,
+"reset()\n"
+"\n"
+"Resets the context for a new handshake. Equivalent to\n"
+":func:`authGSSClientReset`.");
+
+static PyObject*
+client_context_reset_method(ClientContext* self, PyObject* unused) {
+    if (client_context_reset(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+static PyObject*
+client_context_enter(ClientContext* self, PyObject* unused) {
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+client_context_exit(ClientContext* self, PyObject* args) {
+    if (client_context_clean(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject*
+client_context_step_async(ClientContext* self, PyObject* args);
+PyDoc_STRVAR(client_context_step_async_doc,
+"step_async(challenge)\n"
+"\n"
+"Runs :func:`authGSSClientStep` on the worker pool and completes an\n"
+":class:`asyncio.Future` of the current event loop with its result, so\n"
+"that ``result = await context.step_async(challenge)`` does not block\n"
+"the loop. Cancelling the asyncio future does not stop the step.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyMethodDef ClientContext_methods[] = {
+    {"clean", (PyCFunction)client_context_clean_method,
+     METH_NOARGS, client_context_clean_doc},
+    {"reset", (PyCFunction)client_context_reset_method,
+     METH_NOARGS, client_context_reset_doc},
+    {"step_async", (PyCFunction)client_context_step_async,
+     METH_VARARGS, client_context_step_async_doc},
+    {"__enter__", (PyCFunction)client_context_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)client_context_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(client_context_doc,
+"The context object returned by :func:`authGSSClientInit`.\n"
+"\n"
+"Contexts are opaque and cannot be created directly. They support the\n"
+"context manager protocol; leaving the ``with`` block destroys the\n"
+"context as if by :func:`authGSSClientClean`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static sspi_client_state*
+client_context_idle_state(ClientContext* self) {
+    sspi_client_state* state = client_context_state((PyObject*)self);
+    if (state != NULL && self->busy) {
+        set_busy_context();
+        return NULL;
+    }
+    return state;
+}
+
+static PyObject*
+client_context_get_credentials_expiry(ClientContext* self, void* closure) {
+    TimeStamp cred, ctx;
+    sspi_client_state* state = client_context_idle_state(self);
+    if (state == NULL) {
+        return NULL;
+    }
+    auth_sspi_client_get_expiry(state, &cred, &ctx);
+    return expiry_value(&cred);
+}
+
+static PyObject*
+client_context_get_expiry(ClientContext* self, void* closure) {
+    TimeStamp cred, ctx;
+    sspi_client_state* state = client_context_idle_state(self);
+    if (state == NULL) {
+        return NULL;
+    }
+    auth_sspi_client_get_expiry(state, &cred, &ctx);
+    return expiry_value(&ctx);
+}
+
+static PyGetSetDef ClientContext_getset[] = {
+    {"credentials_expiry",
+     (getter)client_context_get_credentials_expiry, NULL,
+     "When the credentials of the context expire, in seconds since the\n"
+     "epoch, or None if they do not. Before the first step, the\n"
+     "credentials the next handshake will use.\n"
+     "\n"
+     ".. versionadded:: 0.7.0", NULL},
+    {"expiry", (getter)client_context_get_expiry, NULL,
+     "When the security context expires, in seconds since the epoch, or\n"
+     "None before the first step.\n"
+     "\n"
+     ".. versionadded:: 0.7.0", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject ClientContext_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.ClientContext",            /* tp_name */
+    sizeof(ClientContext),                  /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)client_context_dealloc,     /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    client_context_doc,                     /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    ClientContext_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    ClientContext_getset,                   /* tp_getset */
+};
+
+static PyObject*
+new_client_context(sspi_client_state* state) {
+    ClientContext* self = PyObject_New(ClientContext, &ClientContext_Type);
+    if (self == NULL) {
+        return NULL;
     }
+    self->state = state;
+    self->busy = 0;
+    return (PyObject*)self;
 }
 
 PyDoc_STRVAR(sspi_client_init_doc,
 "authGSSClientInit(service, principal=None, gssflags="
 "GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
-" password=None, mech_oid=GSS_MECH_OID_KRB5)\n"
+" password=None, mech_oid=GSS_MECH_OID_KRB5, timeout=None)\n"
 "\n"
 "Initializes a context for Kerberos SSPI client side authentication with\n"
 "the given service principal.\n"
@@ -252,7 +547,13 @@ PyDoc_STRVAR(sspi_client_init_doc,
 "    for `user` in `domain`. Can be unicode (str in python 3.x) or any 8 \n"
 "    bit string type that implements the buffer interface.\n"
 "  - `mech_oid`: Optional GSS mech OID. Defaults to GSS_MECH_OID_KRB5.\n"
-"    Another possible value is GSS_MECH_OID_SPNEGO."
+"    Other possible values are GSS_MECH_OID_SPNEGO and\n"
+"    GSS_MECH_OID_AUTO, which uses the mechanism that last completed a\n"
+"    handshake with `service`, or Negotiate if Kerberos was last\n"
+"    unavailable for it. See :func:`configureMechanismMemory`.\n"
+"  - `timeout`: An optional number of seconds to wait for credentials to\n"
+"    be acquired, which may have to contact the KDC. Raises\n"
+"    :exc:`GSSTimeoutError` if they are not acquired in time.\n"
 "\n"
 ":Returns: A tuple of (result, context) where result is\n"
 "          :data:`AUTH_GSS_COMPLETE` and context is an opaque value passed\n"
@@ -262,67 +563,126 @@ PyDoc_STRVAR(sspi_client_init_doc,
 "  The `principal` parameter actually works now. Deprecated the `user`,\n"
 "  `domain`, and `password` parameters.\n"
 ".. versionchanged:: 0.6.0\n"
-"  Added support for the `mech_oid` parameter.\n");
+"  Added support for the `mech_oid` parameter.\n"
+".. versionchanged:: 0.7.0\n"
+"  Added the `timeout` parameter and GSS_MECH_OID_AUTO.\n");
+
+/* The arguments of authGSSClientInit after the service. */
+typedef struct {
+    PyObject* principal;
+    LONG flags;
+    PyObject* user;
+    PyObject* domain;
+    PyObject* password;
+    PyObject* mechoid;
+} client_init_options;
+
+/* Parses the arguments of authGSSClientInit, with the name of the first
+ * argument replaced by first. If extra is not NULL, one more optional
+ * argument with that name is accepted after mech_oid. extraobj is left
+ * as it is if the argument is not passed.
+ * */
+static BOOL
+parse_client_init_args(PyObject* args,
+                       PyObject* kw,
+                       SEC_CHAR* first,
+                       PyObject** firstobj,
+                       client_init_options* opts,
+                       SEC_CHAR* extra,
+                       PyObject** extraobj) {
+    SEC_CHAR* keywords[] = {
+        first, "principal", "gssflags", "user", "domain", "password",
+        "mech_oid", NULL, NULL};
+
+    opts->principal = Py_None;
+    opts->flags = ISC_REQ_MUTUAL_AUTH | ISC_REQ_SEQUENCE_DETECT;
+    opts->user = Py_None;
+    opts->domain = Py_None;
+    opts->password = Py_None;
+    opts->mechoid = Py_None;
+    if (extra) {
+        keywords[7] = extra;
+    }
+    return PyArg_ParseTupleAndKeywords(args,
+                                       kw,
+                                       extra ? "O|OlOOOOO" : "O|OlOOOO",
+                                       keywords,
+                                       firstobj,
+                                       &opts->principal,
+                                       &opts->flags,
+                                       &opts->user,
+                                       &opts->domain,
+                                       &opts->password,
+                                       &opts->mechoid,
+                                       extraobj);
+}
 
-static PyObject*
-sspi_client_init(PyObject* self, PyObject* args, PyObject* kw) {
-    sspi_client_state* state;
-    PyObject* pyctx = NULL;
-    PyObject* serviceobj;
-    PyObject* principalobj = Py_None;
-    LONG flags = ISC_REQ_MUTUAL_AUTH | ISC_REQ_SEQUENCE_DETECT;
-    PyObject* userobj = Py_None;
-    PyObject* domainobj = Py_None;
-    PyObject* passwordobj = Py_None;
-    PyObject* mechoidobj = Py_None;
-    WCHAR *service = NULL, *principal = NULL;
-    WCHAR *user = NULL, *domain = NULL, *password = NULL;
-    Py_ssize_t slen, len, ulen, dlen, plen = 0;
-    WCHAR *mechoid = GSS_MECH_OID_KRB5;
-    PyObject* resultobj = NULL;
-    INT result = 0;
-    static SEC_CHAR* keywords[] = {
-        "service", "principal", "gssflags", "user", "domain", "password", "mech_oid", NULL};
+/* The converted arguments of authGSSClientInit, owned by the caller. */
+typedef struct {
+    WCHAR* service;
+    WCHAR* user;
+    WCHAR* domain;
+    WCHAR* password;
+    Py_ssize_t ulen;
+    Py_ssize_t dlen;
+    Py_ssize_t plen;
+    ULONG flags;
+    WCHAR* mechoid;
+} client_args;
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kw,
-                                     "O|OlOOOO",
-                                     keywords,
-                                     &serviceobj,
-                                     &principalobj,
-                                     &flags,
-                                     &userobj,
-                                     &domainobj,
-                                     &passwordobj,
-                                     &mechoidobj)) {
-        return NULL;
+static VOID
+client_args_free(client_args* ca) {
+    free(ca->service);
+    free(ca->user);
+    free(ca->domain);
+    if (ca->password) {
+        SecureZeroMemory(ca->password, sizeof(WCHAR) * ca->plen);
+        free(ca->password);
     }
-    if (flags < 0) {
+    memset(ca, 0, sizeof(client_args));
+}
+
+static BOOL
+client_args_from_values(PyObject* serviceobj,
+                        client_init_options* opts,
+                        client_args* ca) {
+    WCHAR* principal = NULL;
+    Py_ssize_t slen, len = 0;
+    BOOL ok = FALSE;
+
+    memset(ca, 0, sizeof(client_args));
+    ca->mechoid = GSS_MECH_OID_KRB5;
+
+    if (opts->flags < 0) {
         PyErr_SetString(PyExc_ValueError, "gss_flags must be >= 0");
-        return NULL;
+        return FALSE;
     }
-
-    if (!StringObject_AsWCHAR(serviceobj, 1, FALSE, &service, &slen) ||
-        !BufferObject_AsWCHAR(principalobj, &principal, &len) ||
-        !StringObject_AsWCHAR(userobj, 4, TRUE, &user, &ulen) ||
-        !StringObject_AsWCHAR(domainobj, 5, TRUE, &domain, &dlen) ||
-        !BufferObject_AsWCHAR(passwordobj, &password, &plen) ||
-        _string_too_long("user", (SIZE_T)ulen) ||
-        _string_too_long("domain", (SIZE_T)dlen) ||
-        _string_too_long("password", (SIZE_T)plen)) {
+    ca->flags = (ULONG)opts->flags;
+
+    if (!StringObject_AsWCHAR(serviceobj, 1, FALSE, &ca->service, &slen) ||
+        !BufferObject_AsWCHAR(opts->principal, &principal, &len) ||
+        !StringObject_AsWCHAR(opts->user, 4, TRUE, &ca->user, &ca->ulen) ||
+        !StringObject_AsWCHAR(
+            opts->domain, 5, TRUE, &ca->domain, &ca->dlen) ||
+        !BufferObject_AsWCHAR(opts->password, &ca->password, &ca->plen) ||
+        _string_too_long("user", (SIZE_T)ca->ulen) ||
+        _string_too_long("domain", (SIZE_T)ca->dlen) ||
+        _string_too_long("password", (SIZE_T)ca->plen)) {
         goto done;
     }
 
     /* Prefer (user, domain, password) for backward compatibility. */
-    if (!user && principal) {
+    if (!ca->user && principal) {
         HRESULT res;
         /* Use (user, domain, password) or principal, not a mix of both. */
-        free(domain);
-        domain = NULL;
-        if (password) {
-            SecureZeroMemory(password, sizeof(WCHAR) * plen);
-            free(password);
-            password = NULL;
+        free(ca->domain);
+        ca->domain = NULL;
+        ca->dlen = 0;
+        if (ca->password) {
+            SecureZeroMemory(ca->password, sizeof(WCHAR) * ca->plen);
+            free(ca->password);
+            ca->password = NULL;
+            ca->plen = 0;
         }
         /* Support password as part of the principal parameter. */
         if (wcschr(principal, L':')) {
@@ -332,693 +692,5041 @@ sspi_client_init(PyObject* self, PyObject* args, PyObject* kw) {
             if (!current) {
                 goto memoryerror;
             }
-            user = _wcsdup(current);
-            if (!user) {
+            ca->user = _wcsdup(current);
+            if (!ca->user) {
                 goto memoryerror;
             }
             current = wcstok_s(NULL, L":", &next);
             if (!current) {
                 goto memoryerror;
             }
-            password = _wcsdup(current);
-            if (!password) {
+            ca->password = _wcsdup(current);
+            if (!ca->password) {
                 goto memoryerror;
             }
+            ca->plen = wcslen(ca->password);
         } else {
-            user = _wcsdup(principal);
-            if (!user) {
+            ca->user = _wcsdup(principal);
+            if (!ca->user) {
                 goto memoryerror;
             }
         }
         /* Support user principal or password including the : character. */
-        res = UrlUnescapeW(user, NULL, NULL, URL_UNESCAPE_INPLACE);
+        res = UrlUnescapeW(ca->user, NULL, NULL, URL_UNESCAPE_INPLACE);
         if (res != S_OK) {
             set_gsserror(res, "UrlUnescapeW");
             goto done;
         }
-        if (password) {
-            res = UrlUnescapeW(password, NULL, NULL, URL_UNESCAPE_INPLACE);
+        if (ca->password) {
+            res = UrlUnescapeW(
+                ca->password, NULL, NULL, URL_UNESCAPE_INPLACE);
             if (res != S_OK) {
                 set_gsserror(res, "UrlUnescapeW");
                 goto done;
             }
-            plen = wcslen(password);
+            ca->plen = wcslen(ca->password);
         }
-        ulen = wcslen(user);
+        ca->ulen = wcslen(ca->user);
     }
 
-    if (mechoidobj != Py_None) {
-        if (!PyCObject_Check(mechoidobj)) {
+    if (opts->mechoid != Py_None) {
+        if (!PyCObject_Check(opts->mechoid)) {
             PyErr_SetString(PyExc_TypeError, "Invalid type for mech_oid");
             goto done;
         }
-        mechoid = (WCHAR*)PyCObject_AsVoidPtr(mechoidobj);
-        if (mechoid == NULL) {
+        ca->mechoid = (WCHAR*)PyCObject_AsVoidPtr(opts->mechoid);
+        if (ca->mechoid == NULL) {
             PyErr_SetString(PyExc_TypeError, "Invalid value for mech_oid");
             goto done;
         }
     }
 
-    state = (sspi_client_state*)malloc(sizeof(sspi_client_state));
-    if (state == NULL) {
-        goto memoryerror;
-    }
-
-    pyctx = PyCObject_FromVoidPtr(state, &destroy_sspi_client);
-    if (pyctx == NULL) {
-        free(state);
-        goto done;
-    }
-
-    result = auth_sspi_client_init(
-        service, (ULONG)flags,
-        user, (ULONG)ulen, domain, (ULONG)dlen, password, (ULONG)plen, mechoid, state);
-    if (result == AUTH_GSS_ERROR) {
-        Py_DECREF(pyctx);
-        goto done;
-    }
-
-    resultobj =  Py_BuildValue("(iN)", result, pyctx);
+    ok = TRUE;
     goto done;
 
 memoryerror:
     PyErr_SetNone(PyExc_MemoryError);
 
 done:
-    free(service);
     /* The principal parameter can include a password. */
     if (principal) {
         SecureZeroMemory(principal, sizeof(WCHAR) * len);
         free(principal);
     }
-    free(user);
-    free(domain);
-    if (password) {
-        SecureZeroMemory(password, sizeof(WCHAR) * plen);
-        free(password);
+    if (!ok) {
+        client_args_free(ca);
     }
-    return resultobj;
+    return ok;
 }
 
-PyDoc_STRVAR(sspi_client_clean_doc,
-"authGSSClientClean(context)\n"
-"\n"
-"Destroys the context. This function is provided for API compatibility with\n"
-"pykerberos but does nothing. The context object destroys itself when it\n"
-"is reclaimed.\n"
-"\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
-"\n"
-":Returns: :data:`AUTH_GSS_COMPLETE`");
-
-static PyObject*
-sspi_client_clean(PyObject* self, PyObject* args) {
-    /* Do nothing. For compatibility with pykerberos only. */
-    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+/* Acquires credentials. May block, so does not need the GIL. */
+static sspi_client_template*
+client_args_new_template(client_args* ca, sspi_error* err) {
+    return auth_sspi_client_template_new(ca->service,
+                                         ca->flags,
+                                         ca->user,
+                                         (ULONG)ca->ulen,
+                                         ca->domain,
+                                         (ULONG)ca->dlen,
+                                         ca->password,
+                                         (ULONG)ca->plen,
+                                         ca->mechoid,
+                                         err);
 }
 
-PyDoc_STRVAR(sspi_client_step_doc,
-"authGSSClientStep(context, challenge)\n"
-"\n"
-"Executes a single Kerberos SSPI client step using the supplied server "
-"challenge.\n"
-"\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
-"  - `challenge`: A string containing the base64 encoded server challenge.\n"
-"    Ignored for the first step (pass the empty string).\n"
-"\n"
-":Returns: :data:`AUTH_GSS_CONTINUE` or :data:`AUTH_GSS_COMPLETE`");
-
-static PyObject*
-sspi_client_step(PyObject* self, PyObject* args) {
-    sspi_client_state* state;
-    PyObject* pyctx;
-    SEC_CHAR* challenge = NULL;
-    INT result = 0;
+static sspi_client_template*
+client_template_from_values(PyObject* serviceobj, client_init_options* opts) {
+    sspi_client_template* tmpl;
+    client_args ca;
+    sspi_error err;
 
-    if (!PyArg_ParseTuple(args, "Os", &pyctx, &challenge)) {
+    if (!client_args_from_values(serviceobj, opts, &ca)) {
         return NULL;
     }
-
-    if (_string_too_long("challenge", strlen(challenge))) {
-        return NULL;
+    tmpl = client_args_new_template(&ca, &err);
+    client_args_free(&ca);
+    if (tmpl == NULL) {
+        set_sspi_error(&err);
     }
+    return tmpl;
+}
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+static sspi_client_template*
+client_template_from_args(PyObject* args, PyObject* kw) {
+    PyObject* serviceobj;
+    client_init_options opts;
+
+    if (!parse_client_init_args(
+            args, kw, "service", &serviceobj, &opts, NULL, NULL)) {
         return NULL;
     }
+    return client_template_from_values(serviceobj, &opts);
+}
+
+static PyObject*
+new_client_context_from_template(sspi_client_template* tmpl) {
+    sspi_client_state* state;
+    PyObject* pyctx;
 
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
+    state = (sspi_client_state*)malloc(sizeof(sspi_client_state));
     if (state == NULL) {
-        return NULL;
+        return PyErr_NoMemory();
     }
-
-    result = auth_sspi_client_step(state, challenge);
-    if (result == AUTH_GSS_ERROR) {
-        return NULL;
+    auth_sspi_client_init(tmpl, state);
+    pyctx = new_client_context(state);
+    if (pyctx == NULL) {
+        destroy_sspi_client_state(state);
+        free(state);
     }
-
-    return Py_BuildValue("i", result);
+    return pyctx;
 }
 
-PyDoc_STRVAR(sspi_client_response_doc,
-"authGSSClientResponse(context)\n"
-"\n"
-"Get the response to the last successful client operation.\n"
-"\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
-"\n"
-":Returns: A base64 encoded string to return to the server.");
+/* Run the operation on the worker pool and give up on it after timeout
+ * milliseconds. Defined with the worker pool below.
+ * */
+static PyObject*
+client_init_within(PyObject* serviceobj,
+                   client_init_options* opts,
+                   DWORD timeout);
+static PyObject*
+client_step_within(PyObject* pyctx, Py_buffer* challenge, DWORD timeout);
+static PyObject*
+server_step_within(PyObject* pyctx, Py_buffer* challenge, DWORD timeout);
 
 static PyObject*
-sspi_client_response(PyObject* self, PyObject* args) {
-    sspi_client_state* state;
+sspi_client_init(PyObject* self, PyObject* args, PyObject* kw) {
+    sspi_client_template* tmpl;
     PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+    PyObject* serviceobj;
+    client_init_options opts;
+    PyObject* timeoutobj = Py_None;
+    DWORD timeout;
+
+    if (!parse_client_init_args(args,
+                                kw,
+                                "service",
+                                &serviceobj,
+                                &opts,
+                                "timeout",
+                                &timeoutobj)) {
+        return NULL;
+    }
+    if (!parse_timeout(timeoutobj, "timeout", &timeout)) {
         return NULL;
     }
+    if (timeout != INFINITE) {
+        return client_init_within(serviceobj, &opts, timeout);
+    }
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    tmpl = client_template_from_values(serviceobj, &opts);
+    if (tmpl == NULL) {
         return NULL;
     }
 
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    pyctx = new_client_context_from_template(tmpl);
+    auth_sspi_client_template_release(tmpl);
+    if (pyctx == NULL) {
         return NULL;
     }
 
-    return Py_BuildValue("s", state->response);
+    return Py_BuildValue("(iN)", AUTH_GSS_COMPLETE, pyctx);
 }
 
-PyDoc_STRVAR(sspi_client_response_conf_doc,
-"authGSSClientResponseConf(context)\n"
+PyDoc_STRVAR(sspi_client_init_many_doc,
+"authGSSClientInitMany(services, principal=None, gssflags="
+"GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
+" password=None, mech_oid=GSS_MECH_OID_KRB5)\n"
 "\n"
-"Determine whether confidentiality was enabled in the previously unwrapped\n"
-"buffer.\n"
+"Initializes a context and executes the first client step for each of\n"
+"several services.\n"
+"\n"
+"Credentials are acquired once and shared by all the contexts. The\n"
+"first steps run concurrently on the worker pool (see\n"
+":func:`configureThreadPool`), without holding the GIL, so the call\n"
+"takes about as long as the slowest service ticket fetch rather than\n"
+"the sum of all of them.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `services`: A sequence of service principal names, each in the\n"
+"    format accepted by :func:`authGSSClientInit`.\n"
+"  - The remaining parameters are the same as for\n"
+"    :func:`authGSSClientInit` and apply to every service.\n"
 "\n"
-":Returns: 1 if confidentiality was enabled in the previously unwrapped\n"
-"          buffer, 0 otherwise.\n"
+":Returns: A list with a (result, context) tuple for each service, in the\n"
+"          order given. result is the return value of the first\n"
+"          :func:`authGSSClientStep` on context, :data:`AUTH_GSS_CONTINUE`\n"
+"          or :data:`AUTH_GSS_COMPLETE`, and\n"
+"          :func:`authGSSClientResponse` returns the token to send to the\n"
+"          service. If the step failed for a service, result is the\n"
+"          :exc:`GSSError` that :func:`authGSSClientStep` would have\n"
+"          raised, and is not raised.\n"
 "\n"
-".. versionadded:: 0.5.0");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_client_response_conf(PyObject* self, PyObject* args) {
-    sspi_client_state* state;
-    PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+sspi_client_init_many(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* servicesobj;
+    client_init_options opts;
+    PyObject* services = NULL;
+    PyObject* contexts = NULL;
+    PyObject* resultobj = NULL;
+    sspi_client_template* root = NULL;
+    sspi_client_state** states = NULL;
+    INT* results = NULL;
+    sspi_error* errs = NULL;
+    Py_ssize_t count, i;
+
+    if (!parse_client_init_args(
+            args, kw, "services", &servicesobj, &opts, NULL, NULL)) {
         return NULL;
     }
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    services = PySequence_Fast(servicesobj, "services must be a sequence");
+    if (services == NULL) {
         return NULL;
     }
-
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
-        return NULL;
+    count = PySequence_Fast_GET_SIZE(services);
+    if (count == 0) {
+        resultobj = PyList_New(0);
+        goto done;
+    }
+    if (_too_many("services", count)) {
+        goto done;
     }
 
-    return Py_BuildValue("i", state->qop != SECQOP_WRAP_NO_ENCRYPT);
+    contexts = PyList_New(count);
+    states = (sspi_client_state**)malloc(sizeof(sspi_client_state*) * count);
+    results = (INT*)malloc(sizeof(INT) * count);
+    errs = (sspi_error*)malloc(sizeof(sspi_error) * count);
+    if (contexts == NULL ||
+        states == NULL ||
+        results == NULL ||
+        errs == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* Only the first service acquires credentials. */
+    root = client_template_from_values(
+        PySequence_Fast_GET_ITEM(services, 0), &opts);
+    if (root == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        sspi_client_template* tmpl = root;
+        PyObject* pyctx;
+
+        if (i > 0) {
+            WCHAR* service = NULL;
+            Py_ssize_t slen;
+            sspi_error err;
+            if (!StringObject_AsWCHAR(PySequence_Fast_GET_ITEM(services, i),
+                                      1,
+                                      FALSE,
+                                      &service,
+                                      &slen)) {
+                goto done;
+            }
+            tmpl = auth_sspi_client_template_derive(root, service, &err);
+            free(service);
+            if (tmpl == NULL) {
+                set_sspi_error(&err);
+                goto done;
+            }
+        }
+        pyctx = new_client_context_from_template(tmpl);
+        if (i > 0) {
+            auth_sspi_client_template_release(tmpl);
+        }
+        if (pyctx == NULL) {
+            goto done;
+        }
+        PyList_SET_ITEM(contexts, i, pyctx);
+        states[i] = ((ClientContext*)pyctx)->state;
+    }
+
+    /* No other thread can see the contexts yet. */
+    Py_BEGIN_ALLOW_THREADS
+    auth_sspi_client_step_many(states, (ULONG)count, results, errs);
+    Py_END_ALLOW_THREADS
+
+    resultobj = PyList_New(count);
+    if (resultobj == NULL) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        PyObject* result;
+        PyObject* item;
+        if (results[i] == AUTH_GSS_ERROR) {
+            PyObject *type, *traceback;
+            set_sspi_error(&errs[i]);
+            PyErr_Fetch(&type, &result, &traceback);
+            PyErr_NormalizeException(&type, &result, &traceback);
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+        } else {
+            result = Py_BuildValue("i", results[i]);
+        }
+        if (result == NULL) {
+            Py_CLEAR(resultobj);
+            goto done;
+        }
+        item = Py_BuildValue(
+            "(NO)", result, PyList_GET_ITEM(contexts, i));
+        if (item == NULL) {
+            Py_CLEAR(resultobj);
+            goto done;
+        }
+        PyList_SET_ITEM(resultobj, i, item);
+    }
+
+done:
+    if (root) {
+        auth_sspi_client_template_release(root);
+    }
+    free(errs);
+    free(results);
+    free(states);
+    Py_XDECREF(contexts);
+    Py_DECREF(services);
+    return resultobj;
 }
 
-PyDoc_STRVAR(sspi_client_username_doc,
-"authGSSClientUsername(context)\n"
+PyDoc_STRVAR(sspi_client_init_hedged_doc,
+"authGSSClientInitHedged(services, principal=None, gssflags="
+"GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
+" password=None, mech_oid=GSS_MECH_OID_KRB5, hedge_delay=0.1)\n"
 "\n"
-"Get the user name of the authenticated principal. Will only succeed after\n"
-"authentication is complete.\n"
+"Initializes a context and executes the first client step for one of\n"
+"several names of the same service, such as host aliases or replicas.\n"
+"\n"
+"The first step for the first service starts at once. Each time\n"
+"`hedge_delay` seconds pass without a step succeeding, or as soon as\n"
+"every step started so far has failed, the step for the next service\n"
+"is started on the worker pool. The first step to succeed wins. Steps\n"
+"still running are abandoned, and their contexts destroyed when they\n"
+"finish. Steps that have not started are skipped.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `services`: A non-empty sequence of service principal names, in\n"
+"    order of preference and in the format accepted by\n"
+"    :func:`authGSSClientInit`.\n"
+"  - `hedge_delay`: The number of seconds to wait for a step before\n"
+"    starting the next one. With None the next step is only started\n"
+"    when the previous ones have failed.\n"
+"  - The remaining parameters are the same as for\n"
+"    :func:`authGSSClientInit` and apply to every service.\n"
 "\n"
-":Returns: A string containing the username.");
+":Returns: A tuple of (result, context, service) where service is the\n"
+"          element of `services` whose step succeeded, and result is the\n"
+"          return value of that first :func:`authGSSClientStep` on\n"
+"          context. If every step failed, raises the :exc:`GSSError` of\n"
+"          the first service.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_client_username(PyObject* self, PyObject* args) {
-    sspi_client_state* state;
+sspi_client_init_hedged(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* servicesobj;
+    client_init_options opts;
+    PyObject* delayobj = NULL;
+    DWORD delay = 100;
+    PyObject* services = NULL;
+    PyObject* resultobj = NULL;
     PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+    sspi_client_template* root = NULL;
+    sspi_client_state** states = NULL;
+    Py_ssize_t count, created = 0, i;
+    LONG winner;
+    INT result;
+    sspi_error err;
+
+    if (!parse_client_init_args(args,
+                                kw,
+                                "services",
+                                &servicesobj,
+                                &opts,
+                                "hedge_delay",
+                                &delayobj)) {
+        return NULL;
+    }
+    if (delayobj && !parse_timeout(delayobj, "hedge_delay", &delay)) {
         return NULL;
     }
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    services = PySequence_Fast(servicesobj, "services must be a sequence");
+    if (services == NULL) {
         return NULL;
     }
+    count = PySequence_Fast_GET_SIZE(services);
+    if (count == 0) {
+        PyErr_SetString(PyExc_ValueError, "services must not be empty");
+        goto done;
+    }
+    if (_too_many("services", count)) {
+        goto done;
+    }
 
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    states = (sspi_client_state**)malloc(sizeof(sspi_client_state*) * count);
+    if (states == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* Only the first service acquires credentials. */
+    root = client_template_from_values(
+        PySequence_Fast_GET_ITEM(services, 0), &opts);
+    if (root == NULL) {
+        goto done;
+    }
+
+    for (created = 0; created < count; created++) {
+        sspi_client_template* tmpl = root;
+        sspi_client_state* state;
+
+        if (created > 0) {
+            WCHAR* service = NULL;
+            Py_ssize_t slen;
+            if (!StringObject_AsWCHAR(
+                    PySequence_Fast_GET_ITEM(services, created),
+                    1,
+                    FALSE,
+                    &service,
+                    &slen)) {
+                goto done;
+            }
+            tmpl = auth_sspi_client_template_derive(root, service, &err);
+            free(service);
+            if (tmpl == NULL) {
+                set_sspi_error(&err);
+                goto done;
+            }
+        }
+        state = (sspi_client_state*)malloc(sizeof(sspi_client_state));
+        if (state != NULL) {
+            auth_sspi_client_init(tmpl, state);
+        }
+        if (created > 0) {
+            auth_sspi_client_template_release(tmpl);
+        }
+        if (state == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        states[created] = state;
+    }
+
+    /* Takes over the states. */
+    created = 0;
+    Py_BEGIN_ALLOW_THREADS
+    winner = auth_sspi_client_step_hedged(
+        states, (ULONG)count, delay, &result, &err);
+    Py_END_ALLOW_THREADS
+    if (winner == -1) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    pyctx = new_client_context(states[winner]);
+    if (pyctx == NULL) {
+        destroy_sspi_client_state(states[winner]);
+        free(states[winner]);
+        goto done;
+    }
+    resultobj = Py_BuildValue("(iNO)",
+                              result,
+                              pyctx,
+                              PySequence_Fast_GET_ITEM(services, winner));
+
+done:
+    for (i = 0; i < created; i++) {
+        destroy_sspi_client_state(states[i]);
+        free(states[i]);
+    }
+    if (root) {
+        auth_sspi_client_template_release(root);
+    }
+    free(states);
+    Py_DECREF(services);
+    return resultobj;
+}
+
+/* Client template type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_client_template* tmpl;
+} ClientTemplate;
+
+static PyObject*
+client_template_new(PyTypeObject* type, PyObject* args, PyObject* kw) {
+    ClientTemplate* self;
+    sspi_client_template* tmpl = client_template_from_args(args, kw);
+    if (tmpl == NULL) {
+        return NULL;
+    }
+    self = (ClientTemplate*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        auth_sspi_client_template_release(tmpl);
         return NULL;
     }
+    self->tmpl = tmpl;
+    return (PyObject*)self;
+}
 
-    return Py_BuildValue("s", state->username);
+static VOID
+client_template_dealloc(ClientTemplate* self) {
+    /* Contexts created from the template keep their own reference. */
+    if (self->tmpl) {
+        auth_sspi_client_template_release(self->tmpl);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-PyDoc_STRVAR(sspi_client_unwrap_doc,
-"authGSSClientUnwrap(context, challenge)\n"
+PyDoc_STRVAR(client_template_new_context_doc,
+"new_context()\n"
 "\n"
-"Execute the client side DecryptMessage (GSSAPI Unwrap) operation.\n"
+"Create a new client context for the template's service principal.\n"
+"\n"
+"The context shares the template's service principal name and\n"
+"credentials, so no strings are converted and no credentials are\n"
+"acquired.\n"
+"\n"
+":Returns: A new :class:`ClientContext`, equivalent to the context\n"
+"          returned by :func:`authGSSClientInit`.");
+
+static PyObject*
+client_template_new_context(ClientTemplate* self, PyObject* unused) {
+    return new_client_context_from_template(self->tmpl);
+}
+
+static PyMethodDef ClientTemplate_methods[] = {
+    {"new_context", (PyCFunction)client_template_new_context,
+     METH_NOARGS, client_template_new_context_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyObject*
+client_template_get_credentials_expiry(ClientTemplate* self, void* closure) {
+    TimeStamp cred;
+    auth_sspi_client_template_get_expiry(self->tmpl, &cred);
+    return expiry_value(&cred);
+}
+
+static PyGetSetDef ClientTemplate_getset[] = {
+    {"credentials_expiry",
+     (getter)client_template_get_credentials_expiry, NULL,
+     "When the template's current credentials expire, in seconds since\n"
+     "the epoch, or None if they do not.\n"
+     "\n"
+     ".. versionadded:: 0.7.0", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(client_template_doc,
+"ClientTemplate(service, principal=None, gssflags="
+"GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
+" password=None, mech_oid=GSS_MECH_OID_KRB5)\n"
+"\n"
+"A template for creating many client contexts with identical parameters.\n"
+"\n"
+"The parameters are the same as for :func:`authGSSClientInit`. They are\n"
+"converted, the service principal name is computed and the credentials\n"
+"are acquired once, when the template is created. Each call to\n"
+":meth:`new_context` then creates a context that shares them, which is\n"
+"much cheaper than calling :func:`authGSSClientInit` for every\n"
+"connection to the same service.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject ClientTemplate_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.ClientTemplate",           /* tp_name */
+    sizeof(ClientTemplate),                 /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)client_template_dealloc,    /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    client_template_doc,                    /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    ClientTemplate_methods,                 /* tp_methods */
+    0,                                      /* tp_members */
+    ClientTemplate_getset,                  /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    client_template_new,                    /* tp_new */
+};
+
+PyDoc_STRVAR(sspi_client_clean_doc,
+"authGSSClientClean(context)\n"
+"\n"
+"Destroys the context, releasing its SSPI credentials and security context\n"
+"handles immediately instead of when the context object is reclaimed.\n"
+"Cleaning a context more than once has no effect. Any other use of a\n"
+"cleaned context raises :exc:`GSSError`.\n"
 "\n"
 ":Parameters:\n"
 "  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
-"  - `challenge`: A string containing the base64 encoded server\n"
-"    challenge.\n"
 "\n"
-":Returns: :data:`AUTH_GSS_COMPLETE`");
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionchanged:: 0.7.0\n"
+"   Previously this function did nothing.");
 
 static PyObject*
-sspi_client_unwrap(PyObject* self, PyObject* args) {
-    sspi_client_state* state;
+sspi_client_clean(PyObject* self, PyObject* args) {
     PyObject* pyctx;
-    SEC_CHAR* challenge;
-    INT result;
 
-    if (!PyArg_ParseTuple(args, "Os", &pyctx, &challenge)) {
+    if (!PyArg_ParseTuple(args, "O!", &ClientContext_Type, &pyctx)) {
         return NULL;
     }
 
-    if (_string_too_long("challenge", strlen(challenge))) {
+    if (client_context_clean((ClientContext*)pyctx) == AUTH_GSS_ERROR) {
         return NULL;
     }
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(sspi_client_reset_doc,
+"authGSSClientReset(context)\n"
+"\n"
+"Deletes the security context so the context object can be used for a new\n"
+"handshake with the same service. The service principal, flags and\n"
+"credentials are kept, so a new handshake only requires the calls to\n"
+":func:`authGSSClientStep`. Any response and username are cleared.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_reset(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O!", &ClientContext_Type, &pyctx)) {
+        return NULL;
+    }
+
+    if (client_context_reset((ClientContext*)pyctx) == AUTH_GSS_ERROR) {
         return NULL;
     }
 
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(sspi_client_export_doc,
+"authGSSClientExport(context, pid=None)\n"
+"\n"
+"Export a completed context so that another process on this host can\n"
+"import it with :func:`authGSSClientImport` and use it for message\n"
+"protection without a second handshake. The context is deleted, so\n"
+"`context` behaves as if cleaned afterwards.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `pid`: The id of the process that will import the context. Its\n"
+"    logon token is duplicated into that process, which must allow\n"
+"    this one PROCESS_DUP_HANDLE access. Defaults to this process.\n"
+"\n"
+":Returns: The exported context, as :class:`bytes`, which can be\n"
+"          imported once and only by process `pid`. It holds the\n"
+"          context's session keys, so only send it over a channel\n"
+"          private to the two processes, such as a pipe.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_export(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* pyctx;
+    PyObject* pidobj = Py_None;
+    sspi_client_state* state;
+    DWORD pid;
+    BYTE* blob = NULL;
+    ULONG blen;
+    UCHAR hadCtx;
+    BOOL exported;
+    PyObject* resultobj;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"context", "pid", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "O!|O",
+                                     keywords,
+                                     &ClientContext_Type,
+                                     &pyctx,
+                                     &pidobj)) {
+        return NULL;
+    }
+    if (!parse_pid(pidobj, &pid)) {
+        return NULL;
+    }
+    state = client_context_idle_state((ClientContext*)pyctx);
     if (state == NULL) {
         return NULL;
     }
+    hadCtx = state->haveCtx;
+    exported = auth_sspi_client_export(state, pid, &blob, &blen, &err);
+    /* The security context is gone once exported. */
+    if (hadCtx && !state->haveCtx) {
+        client_context_clean((ClientContext*)pyctx);
+    }
+    if (!exported) {
+        set_sspi_error(&err);
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    resultobj = PyBytes_FromStringAndSize((SEC_CHAR*)blob, blen);
+#else
+    resultobj = PyString_FromStringAndSize((SEC_CHAR*)blob, blen);
+#endif
+    SecureZeroMemory(blob, blen);
+    free(blob);
+    return resultobj;
+}
 
-    result = auth_sspi_client_unwrap(state, challenge);
-    if (result == AUTH_GSS_ERROR) {
+PyDoc_STRVAR(sspi_client_import_doc,
+"authGSSClientImport(data)\n"
+"\n"
+"Import a context exported for this process by\n"
+":func:`authGSSClientExport`. The token that came with the context is\n"
+"checked against the one exported and then taken over, so `data` can be\n"
+"imported only once.\n"
+"\n"
+":Parameters:\n"
+"  - `data`: The exported context, a bytes-like object.\n"
+"\n"
+":Returns: A new :class:`ClientContext`, completed, with the username of\n"
+"          the original.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_import(PyObject* self, PyObject* args) {
+    Py_buffer data;
+    sspi_client_state* state;
+    PyObject* pyctx = NULL;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "s*", &data)) {
         return NULL;
     }
+    if (_string_too_long("data", (SIZE_T)data.len)) {
+        goto done;
+    }
+    state = (sspi_client_state*)malloc(sizeof(sspi_client_state));
+    if (state == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (auth_sspi_client_import(
+            (BYTE*)data.buf, (ULONG)data.len, state, &err) == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        destroy_sspi_client_state(state);
+        free(state);
+        goto done;
+    }
+    pyctx = new_client_context(state);
+    if (pyctx == NULL) {
+        destroy_sspi_client_state(state);
+        free(state);
+    }
 
-    return Py_BuildValue("i", result);
+done:
+    PyBuffer_Release(&data);
+    return pyctx;
 }
 
-PyDoc_STRVAR(sspi_client_wrap_doc,
-"authGSSClientWrap(context, data, user=None, protect=0)\n"
+PyDoc_STRVAR(sspi_client_step_doc,
+"authGSSClientStep(context, challenge, timeout=None)\n"
 "\n"
-"Execute the client side EncryptMessage (GSSAPI Wrap) operation.\n"
+"Executes a single Kerberos SSPI client step using the supplied server "
+"challenge.\n"
 "\n"
 ":Parameters:\n"
 "  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
-"  - `data`: If `user` is not None, this should be the result of calling\n"
-"    :func:`authGSSClientResponse` after :func:`authGSSClientUnwrap`.\n"
-"    If `user` is None, this should be a base64 encoded authorization\n"
-"    message as specified in Section 3.1 of RFC-4752.\n"
-"  - `user`: An optional string containing the user principal to authorize.\n"
-"  - `protect`: If 0 (the default), then just provide integrity protection.\n"
-"    If 1, then provide confidentiality as well (requires passing\n"
-"    GSS_C_CONF_FLAG to gssflags in :func:`authGSSClientInit`).\n"
+"  - `challenge`: A string containing the base64 encoded server challenge.\n"
+"    Ignored for the first step (pass the empty string).\n"
+"  - `timeout`: An optional number of seconds to wait for the step, which\n"
+"    may have to contact the KDC. If it does not finish in time the\n"
+"    context is destroyed, as if cleaned, and :exc:`GSSTimeoutError` is\n"
+"    raised. The step itself runs to completion on the worker pool.\n"
 "\n"
-":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+":Returns: :data:`AUTH_GSS_CONTINUE` or :data:`AUTH_GSS_COMPLETE`\n"
 "\n"
-".. versionchanged:: 0.5.0\n"
-"   Added the `protect` parameter.");
+".. versionchanged:: 0.7.0\n"
+"   `challenge` can be any object that implements the buffer interface.\n"
+"   Added the `timeout` parameter.");
 
 static PyObject*
-sspi_client_wrap(PyObject* self, PyObject* args) {
+sspi_client_step(PyObject* self, PyObject* args, PyObject* kw) {
     sspi_client_state* state;
     PyObject* pyctx;
-    SEC_CHAR* data;
-    SEC_CHAR* user = NULL;
-    SIZE_T ulen = 0;
-    INT protect = 0;
-    INT result;
+    Py_buffer challenge;
+    PyObject* timeoutobj = Py_None;
+    DWORD timeout;
+    PyObject* resultobj = NULL;
+    INT result = 0;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"context", "challenge", "timeout", NULL};
 
-    if (!PyArg_ParseTuple(args, "Os|zi", &pyctx, &data, &user, &protect)) {
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "Os*|O", keywords, &pyctx, &challenge, &timeoutobj)) {
         return NULL;
     }
-    if (user) {
-        ulen = strlen(user);
+
+    if (_string_too_long("challenge", (SIZE_T)challenge.len)) {
+        goto done;
     }
 
-    if (_string_too_long("data", strlen(data)) ||
-        /* Length of user + 4 bytes for security options. */
-        _string_too_long("user", ulen + 4)) {
-        return NULL;
+    if (!parse_timeout(timeoutobj, "timeout", &timeout)) {
+        goto done;
+    }
+    if (timeout != INFINITE) {
+        /* Takes over the challenge buffer. */
+        return client_step_within(pyctx, &challenge, timeout);
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    /* The GIL is released during the step. Keep the state alive. */
+    InterlockedIncrement(&((ClientContext*)pyctx)->busy);
+    Py_BEGIN_ALLOW_THREADS
+    result = auth_sspi_client_step(
+        state, (SEC_CHAR*)challenge.buf, (ULONG)challenge.len, &err);
+    Py_END_ALLOW_THREADS
+    InterlockedDecrement(&((ClientContext*)pyctx)->busy);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
     }
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&challenge);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_client_response_doc,
+"authGSSClientResponse(context)\n"
+"\n"
+"Get the response to the last successful client operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"\n"
+":Returns: A base64 encoded string to return to the server.");
+
+static PyObject*
+sspi_client_response(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("s", state->response);
+}
+
+PyDoc_STRVAR(sspi_client_response_conf_doc,
+"authGSSClientResponseConf(context)\n"
+"\n"
+"Determine whether confidentiality was enabled in the previously unwrapped\n"
+"buffer.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"\n"
+":Returns: 1 if confidentiality was enabled in the previously unwrapped\n"
+"          buffer, 0 otherwise.\n"
+"\n"
+".. versionadded:: 0.5.0");
+
+static PyObject*
+sspi_client_response_conf(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", state->qop != SECQOP_WRAP_NO_ENCRYPT);
+}
+
+PyDoc_STRVAR(sspi_client_username_doc,
+"authGSSClientUsername(context)\n"
+"\n"
+"Get the user name of the authenticated principal. Will only succeed after\n"
+"authentication is complete.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"\n"
+":Returns: A string containing the username.");
+
+static PyObject*
+sspi_client_username(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("s", state->username);
+}
+
+PyDoc_STRVAR(sspi_client_unwrap_doc,
+"authGSSClientUnwrap(context, challenge)\n"
+"\n"
+"Execute the client side DecryptMessage (GSSAPI Unwrap) operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `challenge`: A string containing the base64 encoded server\n"
+"    challenge.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionchanged:: 0.7.0\n"
+"   `challenge` can be any object that implements the buffer interface.");
+
+static PyObject*
+sspi_client_unwrap(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+    Py_buffer challenge;
+    PyObject* resultobj = NULL;
+    INT result = 0;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "Os*", &pyctx, &challenge)) {
+        return NULL;
+    }
+
+    if (_string_too_long("challenge", (SIZE_T)challenge.len)) {
+        goto done;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_client_unwrap(
+        state, (SEC_CHAR*)challenge.buf, (ULONG)challenge.len, &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&challenge);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_client_wrap_doc,
+"authGSSClientWrap(context, data, user=None, protect=0)\n"
+"\n"
+"Execute the client side EncryptMessage (GSSAPI Wrap) operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `data`: If `user` is not None, this should be the result of calling\n"
+"    :func:`authGSSClientResponse` after :func:`authGSSClientUnwrap`.\n"
+"    If `user` is None, this should be a base64 encoded authorization\n"
+"    message as specified in Section 3.1 of RFC-4752.\n"
+"  - `user`: An optional string containing the user principal to authorize.\n"
+"  - `protect`: If 0 (the default), then just provide integrity protection.\n"
+"    If 1, then provide confidentiality as well (requires passing\n"
+"    GSS_C_CONF_FLAG to gssflags in :func:`authGSSClientInit`).\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionchanged:: 0.5.0\n"
+"   Added the `protect` parameter.\n"
+".. versionchanged:: 0.7.0\n"
+"   `data` can be any object that implements the buffer interface.");
+
+static PyObject*
+sspi_client_wrap(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+    Py_buffer data;
+    SEC_CHAR* user = NULL;
+    Py_ssize_t ulen = 0;
+    INT protect = 0;
+    PyObject* resultobj = NULL;
+    INT result;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(
+            args, "Os*|z#i", &pyctx, &data, &user, &ulen, &protect)) {
+        return NULL;
+    }
+
+    if (_string_too_long("data", (SIZE_T)data.len) ||
+        /* Length of user + 4 bytes for security options. */
+        _string_too_long("user", (SIZE_T)ulen + 4)) {
+        goto done;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_client_wrap(state,
+                                   (SEC_CHAR*)data.buf,
+                                   (ULONG)data.len,
+                                   user,
+                                   (ULONG)ulen,
+                                   protect,
+                                   &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&data);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_client_get_mic_doc,
+"authGSSClientGetMIC(context, data)\n"
+"\n"
+"Execute the client side MakeSignature (GSSAPI GetMIC) operation.\n"
+"\n"
+"Unlike :func:`authGSSClientWrap` the payload is not copied into the\n"
+"output token. Only a detached message integrity code (MIC) is produced,\n"
+"which must be sent to the peer along with the unmodified payload.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `data`: The payload to sign. Any object that implements the buffer\n"
+"    interface (e.g. :class:`bytes`, :class:`bytearray` or\n"
+"    :class:`memoryview`). It is *not* base64 encoded.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`. Call :func:`authGSSClientResponse`\n"
+"          to get the base64 encoded MIC.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_get_mic(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+    Py_buffer data;
+    PyObject* resultobj = NULL;
+    INT result;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "Os*", &pyctx, &data)) {
+        return NULL;
+    }
+
+    if (_string_too_long("data", (SIZE_T)data.len)) {
+        goto done;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_client_get_mic(
+        state, (SEC_CHAR*)data.buf, (ULONG)data.len, &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&data);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_client_verify_mic_doc,
+"authGSSClientVerifyMIC(context, data, mic)\n"
+"\n"
+"Execute the client side VerifySignature (GSSAPI VerifyMIC) operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSClientInit`.\n"
+"  - `data`: The payload the MIC was computed over. Any object that\n"
+"    implements the buffer interface. It is *not* base64 encoded.\n"
+"  - `mic`: A string containing the base64 encoded MIC sent by the server.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`. Raises :exc:`GSSError` if the MIC\n"
+"          does not match the payload.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_verify_mic(PyObject* self, PyObject* args) {
+    sspi_client_state* state;
+    PyObject* pyctx;
+    Py_buffer data;
+    Py_buffer mic;
+    PyObject* resultobj = NULL;
+    INT result;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "Os*s*", &pyctx, &data, &mic)) {
+        return NULL;
+    }
+
+    if (_string_too_long("data", (SIZE_T)data.len) ||
+        _string_too_long("mic", (SIZE_T)mic.len)) {
+        goto done;
+    }
+
+    state = client_context_idle_state((ClientContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_client_verify_mic(state,
+                                         (SEC_CHAR*)data.buf,
+                                         (ULONG)data.len,
+                                         (SEC_CHAR*)mic.buf,
+                                         (ULONG)mic.len,
+                                         &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&mic);
+    PyBuffer_Release(&data);
+    return resultobj;
+}
+
+
+/* Server Methods */
+
+/* Server context type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_server_state* state;
+    /* Number of calls using state with the GIL released, including
+     * operations queued on or running on the worker pool.
+     * */
+    volatile LONG busy;
+} ServerContext;
+
+static PyTypeObject ServerContext_Type;
+
+static sspi_server_state*
+server_context_state(PyObject* pyctx) {
+    sspi_server_state* state;
+    if (!PyObject_TypeCheck(pyctx, &ServerContext_Type)) {
+        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+        return NULL;
+    }
+    state = ((ServerContext*)pyctx)->state;
+    if (state == NULL) {
+        set_destroyed_context();
+    }
+    return state;
+}
+
+static INT
+server_context_clean(ServerContext* self) {
+    /* Already destroyed, perhaps after a timeout. */
+    if (self->state == NULL) {
+        return AUTH_GSS_COMPLETE;
+    }
+    if (self->busy) {
+        set_busy_context();
+        return AUTH_GSS_ERROR;
+    }
+    destroy_sspi_server_state(self->state);
+    free(self->state);
+    self->state = NULL;
+    return AUTH_GSS_COMPLETE;
+}
+
+static VOID
+server_context_dealloc(ServerContext* self) {
+    if (self->state) {
+        destroy_sspi_server_state(self->state);
+        free(self->state);
+    }
+    PyObject_Del(self);
+}
+
+static INT
+server_context_reset(ServerContext* self) {
+    if (self->state == NULL) {
+        set_destroyed_context();
+        return AUTH_GSS_ERROR;
+    }
+    if (self->busy) {
+        set_busy_context();
+        return AUTH_GSS_ERROR;
+    }
+    return auth_sspi_server_reset(self->state);
+}
+
+PyDoc_STRVAR(server_context_clean_doc,
+"clean()\n"
+"\n"
+"Destroys the context. Equivalent to :func:`authGSSServerClean`.");
+
+static PyObject*
+server_context_clean_method(ServerContext* self, PyObject* unused) {
+    if (server_context_clean(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(server_context_reset_doc,
+"reset()\n"
+"\n"
+"Resets the context for a new handshake. Equivalent to\n"
+":func:`authGSSServerReset`.");
+
+static PyObject*
+server_context_reset_method(ServerContext* self, PyObject* unused) {
+    if (server_context_reset(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+static PyObject*
+server_context_enter(ServerContext* self, PyObject* unused) {
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+server_context_exit(ServerContext* self, PyObject* args) {
+    if (server_context_clean(self) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject*
+server_context_step_async(ServerContext* self, PyObject* args);
+PyDoc_STRVAR(server_context_step_async_doc,
+"step_async(challenge)\n"
+"\n"
+"Runs :func:`authGSSServerStep` on the worker pool and completes an\n"
+":class:`asyncio.Future` of the current event loop with its result, so\n"
+"that ``result = await context.step_async(challenge)`` does not block\n"
+"the loop. Cancelling the asyncio future does not stop the step.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyMethodDef ServerContext_methods[] = {
+    {"clean", (PyCFunction)server_context_clean_method,
+     METH_NOARGS, server_context_clean_doc},
+    {"reset", (PyCFunction)server_context_reset_method,
+     METH_NOARGS, server_context_reset_doc},
+    {"step_async", (PyCFunction)server_context_step_async,
+     METH_VARARGS, server_context_step_async_doc},
+    {"__enter__", (PyCFunction)server_context_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)server_context_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static sspi_server_state*
+server_context_idle_state(ServerContext* self) {
+    sspi_server_state* state = server_context_state((PyObject*)self);
+    if (state != NULL && self->busy) {
+        set_busy_context();
+        return NULL;
+    }
+    return state;
+}
+
+static PyObject*
+server_context_get_credentials_expiry(ServerContext* self, void* closure) {
+    TimeStamp cred, ctx;
+    sspi_server_state* state = server_context_idle_state(self);
+    if (state == NULL) {
+        return NULL;
+    }
+    auth_sspi_server_get_expiry(state, &cred, &ctx);
+    return expiry_value(&cred);
+}
+
+static PyObject*
+server_context_get_expiry(ServerContext* self, void* closure) {
+    TimeStamp cred, ctx;
+    sspi_server_state* state = server_context_idle_state(self);
+    if (state == NULL) {
+        return NULL;
+    }
+    auth_sspi_server_get_expiry(state, &cred, &ctx);
+    return expiry_value(&ctx);
+}
+
+static PyGetSetDef ServerContext_getset[] = {
+    {"credentials_expiry",
+     (getter)server_context_get_credentials_expiry, NULL,
+     "When the server credentials expire, in seconds since the epoch, or\n"
+     "None if they do not.\n"
+     "\n"
+     ".. versionadded:: 0.7.0", NULL},
+    {"expiry", (getter)server_context_get_expiry, NULL,
+     "When the security context expires, in seconds since the epoch, or\n"
+     "None before the first step.\n"
+     "\n"
+     ".. versionadded:: 0.7.0", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(server_context_doc,
+"The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+"Contexts are opaque and cannot be created directly. They support the\n"
+"context manager protocol; leaving the ``with`` block destroys the\n"
+"context as if by :func:`authGSSServerClean`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject ServerContext_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.ServerContext",            /* tp_name */
+    sizeof(ServerContext),                  /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)server_context_dealloc,     /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    server_context_doc,                     /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    ServerContext_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    ServerContext_getset,                   /* tp_getset */
+};
+
+static PyObject*
+new_server_context(sspi_server_state* state) {
+    ServerContext* self = PyObject_New(ServerContext, &ServerContext_Type);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->state = state;
+    self->busy = 0;
+    return (PyObject*)self;
+}
+
+PyDoc_STRVAR(sspi_server_init_doc,
+"authGSSServerInit(service)\n"
+"\n"
+"Initializes a context for Kerberos SSPI server side authentication.\n"
+"the given service principal.\n"
+
+"\n"
+":Parameters:\n"
+"  - `service`: A string containing the service principal in RFC-2078 format\n"
+"    (``service@hostname``) or SPN format (``service/hostname`` or\n"
+"    ``service/hostname@REALM``).\n"
+"\n"
+":Returns: A tuple of (result, context) where result is\n"
+"          :data:`AUTH_GSS_COMPLETE` and context is an opaque value passed\n"
+"          in subsequent function calls.\n");
+
+static PyObject*
+sspi_server_init(PyObject* self, PyObject* args, PyObject* kw) {
+    sspi_server_state* state;
+    PyObject* pyctx = NULL;
+    PyObject* serviceobj;
+    WCHAR *service = NULL;
+    Py_ssize_t slen = 0;
+    PyObject* resultobj = NULL;
+    INT result = 0;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {
+        "service", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "O|OlOOOO",
+                                     keywords,
+                                     &serviceobj)) {
+        return NULL;
+    }
+
+    if (!StringObject_AsWCHAR(serviceobj, 1, FALSE, &service, &slen)) {
+        goto done;
+    }
+
+    state = (sspi_server_state*)malloc(sizeof(sspi_server_state));
+    if (state == NULL) {
+        goto memoryerror;
+    }
+
+    pyctx = new_server_context(state);
+    if (pyctx == NULL) {
+        free(state);
+        goto done;
+    }
+
+    result = auth_sspi_server_init(service, state, &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        Py_DECREF(pyctx);
+        goto done;
+    }
+
+    resultobj =  Py_BuildValue("(iN)", result, pyctx);
+    goto done;
+
+memoryerror:
+    PyErr_SetNone(PyExc_MemoryError);
+
+done:
+    free(service);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_server_step_doc,
+"authGSSServerStep(context, challenge, timeout=None)\n"
+"\n"
+"Executes a single Kerberos SSPI server step using the supplied client "
+"data.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `challenge`: A string containing the base64 encoded client data.\n"
+"  - `timeout`: An optional number of seconds to wait for the step. If it\n"
+"    does not finish in time the context is destroyed, as if cleaned, and\n"
+"    :exc:`GSSTimeoutError` is raised.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_CONTINUE` or :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionchanged:: 0.7.0\n"
+"   `challenge` can be any object that implements the buffer interface.\n"
+"   Added the `timeout` parameter.");
+
+static PyObject*
+sspi_server_step(PyObject* self, PyObject* args, PyObject* kw) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+    Py_buffer challenge;
+    PyObject* timeoutobj = Py_None;
+    DWORD timeout;
+    PyObject* resultobj = NULL;
+    INT result = 0;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"context", "challenge", "timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "Os*|O", keywords, &pyctx, &challenge, &timeoutobj)) {
+        return NULL;
+    }
+
+    if (_string_too_long("challenge", (SIZE_T)challenge.len)) {
+        goto done;
+    }
+
+    if (!parse_timeout(timeoutobj, "timeout", &timeout)) {
+        goto done;
+    }
+    if (timeout != INFINITE) {
+        /* Takes over the challenge buffer. */
+        return server_step_within(pyctx, &challenge, timeout);
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    /* The GIL is released during the step. Keep the state alive. */
+    InterlockedIncrement(&((ServerContext*)pyctx)->busy);
+    Py_BEGIN_ALLOW_THREADS
+    result = auth_sspi_server_step(
+        state, (SEC_CHAR*)challenge.buf, (ULONG)challenge.len, &err);
+    Py_END_ALLOW_THREADS
+    InterlockedDecrement(&((ServerContext*)pyctx)->busy);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&challenge);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_server_response_doc,
+"authGSSServerResponse(context)\n"
+"\n"
+"Get the response to the last successful server operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: A base64 encoded string to return to the client.");
+
+static PyObject*
+sspi_server_response(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("s", state->response);
+}
+
+PyDoc_STRVAR(sspi_server_username_doc,
+"authGSSServerUserName(context)\n"
+"\n"
+"Get the user name of the authenticated principal. Will only succeed after\n"
+"authentication is complete.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: A string containing the username.");
+
+static PyObject*
+sspi_server_username(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("s", state->username);
+}
+
+PyDoc_STRVAR(sspi_server_targetname_doc,
+"authGSSServerTargetName(context)\n"
+"\n"
+"Get the target name if the server did not supply its own credentials. Will only succeed after\n"
+"authentication is complete.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: A string containing the target name.");
+
+static PyObject*
+sspi_server_targetname(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return Py_BuildValue("s", state->targetname);
+}
+
+PyDoc_STRVAR(sspi_server_unwrap_doc,
+"authGSSServerUnwrap(context, challenge)\n"
+"\n"
+"Execute the server side DecryptMessage (GSSAPI Unwrap) operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `challenge`: A string containing the base64 encoded client data.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`. Call :func:`authGSSServerResponse`\n"
+"          to get the base64 encoded plaintext.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_unwrap(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+    Py_buffer challenge;
+    PyObject* resultobj = NULL;
+    INT result = 0;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "Os*", &pyctx, &challenge)) {
+        return NULL;
+    }
+
+    if (_string_too_long("challenge", (SIZE_T)challenge.len)) {
+        goto done;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_server_unwrap(
+        state, (SEC_CHAR*)challenge.buf, (ULONG)challenge.len, &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&challenge);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_server_wrap_doc,
+"authGSSServerWrap(context, data, protect=0)\n"
+"\n"
+"Execute the server side EncryptMessage (GSSAPI Wrap) operation.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `data`: A string containing the base64 encoded message to wrap.\n"
+"  - `protect`: If 0 (the default), then just provide integrity protection.\n"
+"    If 1, then provide confidentiality as well.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`. Call :func:`authGSSServerResponse`\n"
+"          to get the base64 encoded token to send to the client.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_wrap(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+    Py_buffer data;
+    INT protect = 0;
+    PyObject* resultobj = NULL;
+    INT result;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "Os*|i", &pyctx, &data, &protect)) {
+        return NULL;
+    }
+
+    if (_string_too_long("data", (SIZE_T)data.len)) {
+        goto done;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+
+    result = auth_sspi_server_wrap(
+        state, (SEC_CHAR*)data.buf, (ULONG)data.len, protect, &err);
+    if (result == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        goto done;
+    }
+
+    resultobj = Py_BuildValue("i", result);
+
+done:
+    PyBuffer_Release(&data);
+    return resultobj;
+}
+
+
+PyDoc_STRVAR(sspi_server_clean_doc,
+"authGSSServerClean(context)\n"
+"\n"
+"Destroys the context, releasing its SSPI credentials and security context\n"
+"handles immediately instead of when the context object is reclaimed.\n"
+"Cleaning a context more than once has no effect. Any other use of a\n"
+"cleaned context raises :exc:`GSSError`.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionchanged:: 0.7.0\n"
+"   Previously this function did nothing.");
+
+static PyObject*
+sspi_server_clean(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O!", &ServerContext_Type, &pyctx)) {
+        return NULL;
+    }
+
+    if (server_context_clean((ServerContext*)pyctx) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(sspi_server_reset_doc,
+"authGSSServerReset(context)\n"
+"\n"
+"Deletes the security context so the context object can be used for a new\n"
+"handshake with the same service. The service principal, flags and\n"
+"credentials are kept, so a new handshake only requires the calls to\n"
+":func:`authGSSServerStep`. Any response and username are cleared.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: :data:`AUTH_GSS_COMPLETE`\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_reset(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "O!", &ServerContext_Type, &pyctx)) {
+        return NULL;
+    }
+
+    if (server_context_reset((ServerContext*)pyctx) == AUTH_GSS_ERROR) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+}
+
+PyDoc_STRVAR(sspi_server_export_doc,
+"authGSSServerExport(context, pid=None)\n"
+"\n"
+"Export a completed context so that another process on this host can\n"
+"import it with :func:`authGSSServerImport` and use it for message\n"
+"protection without a second handshake. The context is deleted, so\n"
+"`context` behaves as if cleaned afterwards.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `pid`: The id of the process that will import the context. Its\n"
+"    logon token is duplicated into that process, which must allow\n"
+"    this one PROCESS_DUP_HANDLE access. Defaults to this process.\n"
+"\n"
+":Returns: The exported context, as :class:`bytes`, which can be\n"
+"          imported once and only by process `pid`. It holds the\n"
+"          context's session keys, so only send it over a channel\n"
+"          private to the two processes, such as a pipe.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_export(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* pyctx;
+    PyObject* pidobj = Py_None;
+    sspi_server_state* state;
+    DWORD pid;
+    BYTE* blob = NULL;
+    ULONG blen;
+    UCHAR hadCtx;
+    BOOL exported;
+    PyObject* resultobj;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"context", "pid", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "O!|O",
+                                     keywords,
+                                     &ServerContext_Type,
+                                     &pyctx,
+                                     &pidobj)) {
+        return NULL;
+    }
+    if (!parse_pid(pidobj, &pid)) {
+        return NULL;
+    }
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+    hadCtx = state->haveCtx;
+    exported = auth_sspi_server_export(state, pid, &blob, &blen, &err);
+    /* The security context is gone once exported. */
+    if (hadCtx && !state->haveCtx) {
+        server_context_clean((ServerContext*)pyctx);
+    }
+    if (!exported) {
+        set_sspi_error(&err);
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    resultobj = PyBytes_FromStringAndSize((SEC_CHAR*)blob, blen);
+#else
+    resultobj = PyString_FromStringAndSize((SEC_CHAR*)blob, blen);
+#endif
+    SecureZeroMemory(blob, blen);
+    free(blob);
+    return resultobj;
+}
+
+PyDoc_STRVAR(sspi_server_import_doc,
+"authGSSServerImport(data)\n"
+"\n"
+"Import a context exported for this process by\n"
+":func:`authGSSServerExport`. The token that came with the context is\n"
+"checked against the one exported and then taken over, so `data` can be\n"
+"imported only once.\n"
+"\n"
+":Parameters:\n"
+"  - `data`: The exported context, a bytes-like object.\n"
+"\n"
+":Returns: A new :class:`ServerContext`, completed, with the username of\n"
+"          the original.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_import(PyObject* self, PyObject* args) {
+    Py_buffer data;
+    sspi_server_state* state;
+    PyObject* pyctx = NULL;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "s*", &data)) {
+        return NULL;
+    }
+    if (_string_too_long("data", (SIZE_T)data.len)) {
+        goto done;
+    }
+    state = (sspi_server_state*)malloc(sizeof(sspi_server_state));
+    if (state == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (auth_sspi_server_import(
+            (BYTE*)data.buf, (ULONG)data.len, state, &err) == AUTH_GSS_ERROR) {
+        set_sspi_error(&err);
+        destroy_sspi_server_state(state);
+        free(state);
+        goto done;
+    }
+    pyctx = new_server_context(state);
+    if (pyctx == NULL) {
+        destroy_sspi_server_state(state);
+        free(state);
+    }
+
+done:
+    PyBuffer_Release(&data);
+    return pyctx;
+}
+
+
+//Helpers to figure stuff out
+
+PyDoc_STRVAR(sspi_server_impersonate_doc,
+"authGSSServerImpersonate(context)\n"
+"\n"
+"Impersonate client credentials\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: :data:");
+
+static PyObject*
+sspi_server_impersonate(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+    INT result = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    result = auth_sspi_server_impersonate(state);
+    return Py_BuildValue("i", result);
+}
+
+PyDoc_STRVAR(sspi_server_revert_doc,
+"authGSSServerRevert(context)\n"
+"\n"
+"Revert client credentials (to server creds)\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"\n"
+":Returns: :data:");
+
+static PyObject*
+sspi_server_revert(PyObject* self, PyObject* args) {
+    sspi_server_state* state;
+    PyObject* pyctx;
+    INT result = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+        return NULL;
+    }
+
+
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    result = auth_sspi_server_revert(state);
+    return Py_BuildValue("i", result);
+}
+
+/* Server session table type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_session_table* table;
+} ServerSessionTable;
+
+static PyObject*
+server_session_table_new(PyTypeObject* type, PyObject* args, PyObject* kw) {
+    ServerSessionTable* self;
+    LONG max_size = 100000;
+    LONG shards = 16;
+    PyObject* ttlobj = NULL;
+    DWORD ttl = 60 * 1000;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"max_size", "ttl", "shards", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|lOl", keywords, &max_size, &ttlobj, &shards)) {
+        return NULL;
+    }
+    if (max_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_size must be >= 1");
+        return NULL;
+    }
+    if (shards < 1 || shards > 1024) {
+        PyErr_SetString(PyExc_ValueError,
+                        "shards must be between 1 and 1024");
+        return NULL;
+    }
+    if (ttlobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "ttl must be a number");
+        return NULL;
+    }
+    if (ttlobj && !parse_timeout(ttlobj, "ttl", &ttl)) {
+        return NULL;
+    }
+    if (ttl == 0) {
+        PyErr_SetString(PyExc_ValueError, "ttl must be positive");
+        return NULL;
+    }
+    self = (ServerSessionTable*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->table = sspi_session_table_new(
+        (ULONG)shards, (ULONG)max_size, ttl, &err);
+    if (self->table == NULL) {
+        Py_DECREF(self);
+        set_sspi_error(&err);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static VOID
+server_session_table_dealloc(ServerSessionTable* self) {
+    if (self->table) {
+        sspi_session_table_free(self->table);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(server_session_table_put_doc,
+"put(key, context, ttl=None)\n"
+"\n"
+"Store a server context under key until the next leg of its handshake\n"
+"arrives. The table takes over the context's security context, so\n"
+"`context` behaves as if cleaned afterwards. Replaces the context\n"
+"already stored under key, if any. When the table's shard for key is\n"
+"full, the context stored least recently in it is destroyed.\n"
+"\n"
+":Parameters:\n"
+"  - `key`: The conversation id, a :class:`str` or bytes-like object.\n"
+"  - `context`: A :class:`ServerContext` not in use by another thread.\n"
+"  - `ttl`: An optional number of seconds after which the context is\n"
+"    destroyed, instead of the table's `ttl`.");
+
+static PyObject*
+server_session_table_put(ServerSessionTable* self,
+                         PyObject* args,
+                         PyObject* kw) {
+    Py_buffer key;
+    PyObject* pyctx;
+    PyObject* ttlobj = Py_None;
+    sspi_server_state* state;
+    DWORD ttl = 0;
+    PyObject* resultobj = NULL;
+    static SEC_CHAR* keywords[] = {"key", "context", "ttl", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "s*O!|O",
+                                     keywords,
+                                     &key,
+                                     &ServerContext_Type,
+                                     &pyctx,
+                                     &ttlobj)) {
+        return NULL;
+    }
+    if (_string_too_long("key", (SIZE_T)key.len)) {
+        goto done;
+    }
+    if (ttlobj != Py_None) {
+        if (!parse_timeout(ttlobj, "ttl", &ttl)) {
+            goto done;
+        }
+        if (ttl == 0) {
+            PyErr_SetString(PyExc_ValueError, "ttl must be positive");
+            goto done;
+        }
+    }
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        goto done;
+    }
+    ((ServerContext*)pyctx)->state = NULL;
+    if (!sspi_session_table_put(
+            self->table, (BYTE*)key.buf, (ULONG)key.len, state, ttl)) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    Py_INCREF(Py_None);
+    resultobj = Py_None;
+
+done:
+    PyBuffer_Release(&key);
+    return resultobj;
+}
+
+PyDoc_STRVAR(server_session_table_take_doc,
+"take(key)\n"
+"\n"
+"Remove the context stored under key and return it.\n"
+"\n"
+":Returns: A new :class:`ServerContext` continuing the handshake, or\n"
+"          None if no context is stored under key or it expired.");
+
+static PyObject*
+server_session_table_take(ServerSessionTable* self, PyObject* args) {
+    Py_buffer key;
+    sspi_server_state* state;
+    PyObject* pyctx;
+
+    if (!PyArg_ParseTuple(args, "s*", &key)) {
+        return NULL;
+    }
+    if (_string_too_long("key", (SIZE_T)key.len)) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    state = sspi_session_table_take(
+        self->table, (BYTE*)key.buf, (ULONG)key.len);
+    PyBuffer_Release(&key);
+    if (state == NULL) {
+        Py_RETURN_NONE;
+    }
+    pyctx = new_server_context(state);
+    if (pyctx == NULL) {
+        destroy_sspi_server_state(state);
+        free(state);
+    }
+    return pyctx;
+}
+
+PyDoc_STRVAR(server_session_table_remove_doc,
+"remove(key)\n"
+"\n"
+"Destroy the context stored under key.\n"
+"\n"
+":Returns: True if a context was stored under key.");
+
+static PyObject*
+server_session_table_remove(ServerSessionTable* self, PyObject* args) {
+    Py_buffer key;
+    BOOL removed;
+
+    if (!PyArg_ParseTuple(args, "s*", &key)) {
+        return NULL;
+    }
+    if (_string_too_long("key", (SIZE_T)key.len)) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    removed = sspi_session_table_remove(
+        self->table, (BYTE*)key.buf, (ULONG)key.len);
+    PyBuffer_Release(&key);
+    return PyBool_FromLong(removed);
+}
+
+PyDoc_STRVAR(server_session_table_stats_doc,
+"stats()\n"
+"\n"
+"Get the table's configuration and metrics.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `shards`, `max_size` and `ttl`: The configuration. `shards` is\n"
+"    rounded up to a power of two.\n"
+"  - `size`: The number of contexts stored, after dropping those that\n"
+"    expired.\n"
+"  - `inserted`: The number of calls to :meth:`put`.\n"
+"  - `replaced`: The number of contexts replaced by :meth:`put`.\n"
+"  - `hits` and `misses`: The number of lookups that found a context\n"
+"    and that did not.\n"
+"  - `expired`: The number of contexts destroyed after their TTL.\n"
+"  - `evicted`: The number of contexts destroyed to make room.");
+
+static PyObject*
+server_session_table_stats(ServerSessionTable* self, PyObject* unused) {
+    sspi_session_stats stats;
+    sspi_session_table_get_stats(self->table, &stats);
+    return Py_BuildValue("{s:k,s:k,s:d,s:k,s:L,s:L,s:L,s:L,s:L,s:L}",
+                         "shards", stats.shards,
+                         "max_size", stats.max_size,
+                         "ttl", stats.ttl / 1e3,
+                         "size", stats.size,
+                         "inserted", stats.inserted,
+                         "replaced", stats.replaced,
+                         "hits", stats.hits,
+                         "misses", stats.misses,
+                         "expired", stats.expired,
+                         "evicted", stats.evicted);
+}
+
+static Py_ssize_t
+server_session_table_length(ServerSessionTable* self) {
+    sspi_session_stats stats;
+    sspi_session_table_get_stats(self->table, &stats);
+    return (Py_ssize_t)stats.size;
+}
+
+static PyMethodDef ServerSessionTable_methods[] = {
+    {"put", (PyCFunction)server_session_table_put,
+     METH_VARARGS | METH_KEYWORDS, server_session_table_put_doc},
+    {"take", (PyCFunction)server_session_table_take,
+     METH_VARARGS, server_session_table_take_doc},
+    {"remove", (PyCFunction)server_session_table_remove,
+     METH_VARARGS, server_session_table_remove_doc},
+    {"stats", (PyCFunction)server_session_table_stats,
+     METH_NOARGS, server_session_table_stats_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods ServerSessionTable_as_sequence = {
+    (lenfunc)server_session_table_length,   /* sq_length */
+};
+
+PyDoc_STRVAR(server_session_table_doc,
+"ServerSessionTable(max_size=100000, ttl=60, shards=16)\n"
+"\n"
+"A table of server contexts with handshakes in progress, keyed by a\n"
+"conversation id, for multi-leg handshakes whose legs can arrive on\n"
+"different connections, such as HTTP Negotiate.\n"
+"\n"
+"The table is native and thread safe. It is split into `shards`, each\n"
+"with its own lock and an equal share of `max_size`, so that the\n"
+"table never holds more than `max_size` contexts. Contexts are\n"
+"destroyed when their TTL expires, checked by the operations on their\n"
+"shard with a timing wheel, or when their shard is full and they are\n"
+"the least recently stored.\n"
+"\n"
+":Parameters:\n"
+"  - `max_size`: The maximum number of contexts.\n"
+"  - `ttl`: The number of seconds a context stays in the table.\n"
+"  - `shards`: The number of shards, rounded up to a power of two and\n"
+"    reduced, if need be, to at most `max_size`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject ServerSessionTable_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.ServerSessionTable",       /* tp_name */
+    sizeof(ServerSessionTable),             /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)server_session_table_dealloc, /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &ServerSessionTable_as_sequence,        /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    server_session_table_doc,               /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    ServerSessionTable_methods,             /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    server_session_table_new,               /* tp_new */
+};
+
+/* Session token issuer type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_token_issuer* issuer;
+} SessionTokenIssuer;
+
+/* Keys shorter than this are refused. */
+#define MIN_TOKEN_KEY 16
+
+static PyObject*
+session_token_issuer_new(PyTypeObject* type, PyObject* args, PyObject* kw) {
+    SessionTokenIssuer* self = NULL;
+    Py_buffer key = {NULL};
+    Py_buffer prev = {NULL};
+    BYTE random_key[32];
+    const BYTE* keybuf;
+    ULONG klen;
+    PyObject* ttlobj = NULL;
+    DWORD ttl = 3600 * 1000;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"key", "ttl", "previous_key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|z*Oz*", keywords, &key, &ttlobj, &prev)) {
+        return NULL;
+    }
+    if ((key.buf && key.len < MIN_TOKEN_KEY) ||
+        (prev.buf && prev.len < MIN_TOKEN_KEY)) {
+        PyErr_Format(PyExc_ValueError,
+                     "keys must be at least %d bytes", MIN_TOKEN_KEY);
+        goto done;
+    }
+    if (_string_too_long("key", (SIZE_T)key.len) ||
+        _string_too_long("previous_key", (SIZE_T)prev.len)) {
+        goto done;
+    }
+    if (ttlobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "ttl must be a number");
+        goto done;
+    }
+    if (ttlobj && !parse_timeout(ttlobj, "ttl", &ttl)) {
+        goto done;
+    }
+    if (ttl == 0) {
+        PyErr_SetString(PyExc_ValueError, "ttl must be positive");
+        goto done;
+    }
+    if (key.buf) {
+        keybuf = (BYTE*)key.buf;
+        klen = (ULONG)key.len;
+    } else {
+        /* Only this process can verify the tokens. */
+        if (!sspi_token_random_key(random_key, sizeof(random_key), &err)) {
+            set_sspi_error(&err);
+            goto done;
+        }
+        keybuf = random_key;
+        klen = sizeof(random_key);
+    }
+    self = (SessionTokenIssuer*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        goto done;
+    }
+    self->issuer = sspi_token_issuer_new(
+        keybuf, klen, (BYTE*)prev.buf, (ULONG)prev.len, ttl, &err);
+    if (self->issuer == NULL) {
+        Py_CLEAR(self);
+        set_sspi_error(&err);
+    }
+
+done:
+    SecureZeroMemory(random_key, sizeof(random_key));
+    if (key.obj) {
+        PyBuffer_Release(&key);
+    }
+    if (prev.obj) {
+        PyBuffer_Release(&prev);
+    }
+    return (PyObject*)self;
+}
+
+static VOID
+session_token_issuer_dealloc(SessionTokenIssuer* self) {
+    if (self->issuer) {
+        sspi_token_issuer_free(self->issuer);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(session_token_issuer_issue_doc,
+"issue(context)\n"
+"\n"
+"Mint a session token for the user authenticated by a completed server\n"
+"context. The token expires after the issuer's `ttl`, or when the\n"
+"context does if that is sooner.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: A :class:`ServerContext` whose handshake completed.\n"
+"\n"
+":Returns: The token, a base64 encoded string.");
+
+static PyObject*
+session_token_issuer_issue(SessionTokenIssuer* self, PyObject* args) {
+    PyObject* pyctx;
+    sspi_server_state* state;
+    TimeStamp cred, ctx;
+    double seconds;
+    LONG64 not_after = 0;
+    SEC_CHAR* token;
+    PyObject* pytoken;
+    sspi_error err;
+
+    if (!PyArg_ParseTuple(args, "O!", &ServerContext_Type, &pyctx)) {
+        return NULL;
+    }
+    state = server_context_idle_state((ServerContext*)pyctx);
+    if (state == NULL) {
+        return NULL;
+    }
+    if (state->username == NULL) {
+        PyErr_SetString(GSSError,
+                        "The handshake has not completed.");
+        return NULL;
+    }
+    auth_sspi_server_get_expiry(state, &cred, &ctx);
+    if (auth_sspi_expiry_to_unix(&ctx, &seconds)) {
+        not_after = (LONG64)(seconds * 1000.0);
+    }
+    token = sspi_token_issue(self->issuer, state->username, not_after, &err);
+    if (token == NULL) {
+        set_sspi_error(&err);
+        return NULL;
+    }
+    pytoken = Py_BuildValue("s", token);
+    free(token);
+    return pytoken;
+}
+
+PyDoc_STRVAR(session_token_issuer_verify_doc,
+"verify(token)\n"
+"\n"
+"Check a session token minted by this issuer, or by one with its\n"
+"`previous_key` as `key`. Runs in microseconds without calling SSPI;\n"
+"the MAC is compared in constant time.\n"
+"\n"
+":Parameters:\n"
+"  - `token`: The token, a :class:`str` or bytes-like object.\n"
+"\n"
+":Returns: The username the token was minted for, or None if the\n"
+"          token is invalid or expired.");
+
+static PyObject*
+session_token_issuer_verify(SessionTokenIssuer* self, PyObject* args) {
+    Py_buffer token;
+    SEC_CHAR username[SSPI_TOKEN_MAX_USERNAME + 1];
+    LONG64 expires;
+    INT result;
+
+    if (!PyArg_ParseTuple(args, "s*", &token)) {
+        return NULL;
+    }
+    if (_string_too_long("token", (SIZE_T)token.len)) {
+        PyBuffer_Release(&token);
+        return NULL;
+    }
+    /* Too quick to be worth releasing the GIL for. */
+    result = sspi_token_verify(self->issuer,
+                               (SEC_CHAR*)token.buf,
+                               (ULONG)token.len,
+                               username,
+                               &expires);
+    PyBuffer_Release(&token);
+    if (result != SSPI_TOKEN_VALID) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("s", username);
+}
+
+PyDoc_STRVAR(session_token_issuer_stats_doc,
+"stats()\n"
+"\n"
+"Get the issuer's configuration and metrics.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `ttl`: The lifetime of new tokens, in seconds.\n"
+"  - `issued`: The number of tokens minted.\n"
+"  - `verified`: The number of tokens :meth:`verify` accepted.\n"
+"  - `rejected`: The number of tokens that were malformed or whose MAC\n"
+"    did not match.\n"
+"  - `expired`: The number of genuine tokens that had expired.");
+
+static PyObject*
+session_token_issuer_stats(SessionTokenIssuer* self, PyObject* unused) {
+    sspi_token_stats stats;
+    sspi_token_get_stats(self->issuer, &stats);
+    return Py_BuildValue("{s:d,s:L,s:L,s:L,s:L}",
+                         "ttl", stats.ttl / 1e3,
+                         "issued", stats.issued,
+                         "verified", stats.verified,
+                         "rejected", stats.rejected,
+                         "expired", stats.expired);
+}
+
+static PyMethodDef SessionTokenIssuer_methods[] = {
+    {"issue", (PyCFunction)session_token_issuer_issue,
+     METH_VARARGS, session_token_issuer_issue_doc},
+    {"verify", (PyCFunction)session_token_issuer_verify,
+     METH_VARARGS, session_token_issuer_verify_doc},
+    {"stats", (PyCFunction)session_token_issuer_stats,
+     METH_NOARGS, session_token_issuer_stats_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(session_token_issuer_doc,
+"SessionTokenIssuer(key=None, ttl=3600, previous_key=None)\n"
+"\n"
+"Mints session tokens once a server handshake completes, so that a\n"
+"client's later requests, presenting the token in a cookie or header,\n"
+"are authenticated by :meth:`verify` instead of another handshake.\n"
+"\n"
+"A token carries the username and its expiry, protected by\n"
+"HMAC-SHA256 under `key`. It is not encrypted, so the username is\n"
+"visible to anyone holding the token, and it is a bearer credential\n"
+"until it expires: only send it over a protected channel.\n"
+"\n"
+":Parameters:\n"
+"  - `key`: The secret key, bytes-like and at least 16 bytes long.\n"
+"    Processes sharing the key accept each other's tokens. If None a\n"
+"    random key is generated, valid for the life of this issuer.\n"
+"  - `ttl`: The number of seconds a token is valid for.\n"
+"  - `previous_key`: An optional key whose tokens :meth:`verify` still\n"
+"    accepts, for rotating `key` without logging clients out.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject SessionTokenIssuer_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.SessionTokenIssuer",       /* tp_name */
+    sizeof(SessionTokenIssuer),             /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)session_token_issuer_dealloc, /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    session_token_issuer_doc,               /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    SessionTokenIssuer_methods,             /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    session_token_issuer_new,               /* tp_new */
+};
+
+/* Shared session cache type */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_shm_cache* cache;
+    DWORD ttl;
+} SharedSessionCache;
+
+/* Keeps the mapping under 1GB. */
+#define MAX_SHARED_ENTRIES (1 << 20)
+
+static PyObject*
+shared_session_cache_new(PyTypeObject* type, PyObject* args, PyObject* kw) {
+    SharedSessionCache* self;
+    PyObject* nameobj;
+    WCHAR* name = NULL;
+    Py_ssize_t namelen;
+    LONG max_entries = 16384;
+    PyObject* ttlobj = NULL;
+    DWORD ttl = 3600 * 1000;
+    sspi_shm_cache* cache;
+    sspi_error err;
+    static SEC_CHAR* keywords[] = {"name", "max_entries", "ttl", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "O|lO", keywords, &nameobj, &max_entries, &ttlobj)) {
+        return NULL;
+    }
+    if (max_entries < 1 || max_entries > MAX_SHARED_ENTRIES) {
+        PyErr_Format(PyExc_ValueError,
+                     "max_entries must be between 1 and %d",
+                     MAX_SHARED_ENTRIES);
+        return NULL;
+    }
+    if (ttlobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "ttl must be a number");
+        return NULL;
+    }
+    if (ttlobj && !parse_timeout(ttlobj, "ttl", &ttl)) {
+        return NULL;
+    }
+    if (ttl == 0) {
+        PyErr_SetString(PyExc_ValueError, "ttl must be positive");
+        return NULL;
+    }
+    if (!StringObject_AsWCHAR(nameobj, 1, FALSE, &name, &namelen)) {
+        return NULL;
+    }
+    if (namelen == 0) {
+        free(name);
+        PyErr_SetString(PyExc_ValueError, "name must not be empty");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    cache = sspi_shm_cache_open(name, (ULONG)max_entries, &err);
+    Py_END_ALLOW_THREADS
+    free(name);
+    if (cache == NULL) {
+        set_sspi_error(&err);
+        return NULL;
+    }
+    self = (SharedSessionCache*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        sspi_shm_cache_close(cache);
+        return NULL;
+    }
+    self->cache = cache;
+    self->ttl = ttl;
+    return (PyObject*)self;
+}
+
+static VOID
+shared_session_cache_dealloc(SharedSessionCache* self) {
+    if (self->cache) {
+        sspi_shm_cache_close(self->cache);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(shared_session_cache_put_doc,
+"put(key, username, expires=None, attributes=None)\n"
+"\n"
+"Store the result of an authentication for every process sharing the\n"
+"cache, replacing any stored under key.\n"
+"\n"
+":Parameters:\n"
+"  - `key`: The session id, a :class:`str` or bytes-like object of at\n"
+"    most 128 bytes.\n"
+"  - `username`: The authenticated username, at most 256 bytes UTF-8\n"
+"    encoded.\n"
+"  - `expires`: When the entry expires, in seconds since the epoch. It\n"
+"    never outlives the cache's `ttl`. Defaults to the end of the\n"
+"    `ttl`. A time already past removes any entry stored under key.\n"
+"  - `attributes`: Optional bytes-like data of at most 512 bytes, such\n"
+"    as the context's flags or the user's groups, returned with the\n"
+"    username.\n"
+"\n"
+":Returns: True, or False if all the slots key can be stored in were\n"
+"          being written by other threads or processes.");
+
+static PyObject*
+shared_session_cache_put(SharedSessionCache* self,
+                         PyObject* args,
+                         PyObject* kw) {
+    Py_buffer key;
+    Py_buffer attributes = {NULL};
+    SEC_CHAR* username;
+    Py_ssize_t ulen;
+    PyObject* expiresobj = Py_None;
+    LONG64 now = auth_sspi_unix_now();
+    LONG64 expires = now + self->ttl;
+    BOOL stored;
+    PyObject* resultobj = NULL;
+    static SEC_CHAR* keywords[] = {
+        "key", "username", "expires", "attributes", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "s*s#|Oz*",
+                                     keywords,
+                                     &key,
+                                     &username,
+                                     &ulen,
+                                     &expiresobj,
+                                     &attributes)) {
+        return NULL;
+    }
+    if (key.len > SSPI_SHM_MAX_KEY) {
+        PyErr_Format(PyExc_ValueError,
+                     "key must be at most %d bytes", SSPI_SHM_MAX_KEY);
+        goto done;
+    }
+    if (ulen > SSPI_SHM_MAX_USERNAME) {
+        PyErr_Format(PyExc_ValueError,
+                     "username must be at most %d bytes",
+                     SSPI_SHM_MAX_USERNAME);
+        goto done;
+    }
+    if (attributes.buf && attributes.len > SSPI_SHM_MAX_ATTRIBUTES) {
+        PyErr_Format(PyExc_ValueError,
+                     "attributes must be at most %d bytes",
+                     SSPI_SHM_MAX_ATTRIBUTES);
+        goto done;
+    }
+    if (expiresobj != Py_None) {
+        double seconds = PyFloat_AsDouble(expiresobj);
+        if (seconds == -1.0 && PyErr_Occurred()) {
+            goto done;
+        }
+        if (seconds * 1000.0 < (double)expires) {
+            expires = (LONG64)(seconds * 1000.0);
+        }
+        if (expires <= now) {
+            /* Already expired: drop what an earlier put shared, which
+             * must not outlive this result.
+             * */
+            sspi_shm_cache_remove(self->cache,
+                                  (BYTE*)key.buf,
+                                  (ULONG)key.len);
+            Py_INCREF(Py_True);
+            resultobj = Py_True;
+            goto done;
+        }
+    }
+    stored = sspi_shm_cache_put(self->cache,
+                                (BYTE*)key.buf,
+                                (ULONG)key.len,
+                                username,
+                                (ULONG)ulen,
+                                (BYTE*)attributes.buf,
+                                (ULONG)attributes.len,
+                                expires);
+    resultobj = PyBool_FromLong(stored);
+
+done:
+    PyBuffer_Release(&key);
+    if (attributes.obj) {
+        PyBuffer_Release(&attributes);
+    }
+    return resultobj;
+}
+
+PyDoc_STRVAR(shared_session_cache_get_doc,
+"get(key)\n"
+"\n"
+"Look up the result of an authentication stored by any process sharing\n"
+"the cache. Takes no lock.\n"
+"\n"
+":Returns: A tuple of the username, the expiry in seconds since the\n"
+"          epoch and the attributes as bytes, or None if nothing\n"
+"          unexpired is stored under key.");
+
+static PyObject*
+shared_session_cache_get(SharedSessionCache* self, PyObject* args) {
+    Py_buffer key;
+    sspi_shm_entry entry;
+    BOOL found;
+
+    if (!PyArg_ParseTuple(args, "s*", &key)) {
+        return NULL;
+    }
+    found = sspi_shm_cache_get(
+        self->cache, (BYTE*)key.buf, (ULONG)key.len, &entry);
+    PyBuffer_Release(&key);
+    if (!found) {
+        Py_RETURN_NONE;
+    }
+#if PY_MAJOR_VERSION >= 3
+    return Py_BuildValue("(sdy#)",
+#else
+    return Py_BuildValue("(sds#)",
+#endif
+                         entry.username,
+                         entry.expires / 1e3,
+                         (SEC_CHAR*)entry.attributes,
+                         (Py_ssize_t)entry.alen);
+}
+
+PyDoc_STRVAR(shared_session_cache_remove_doc,
+"remove(key)\n"
+"\n"
+"Remove the entry stored under key, for every process sharing the\n"
+"cache.\n"
+"\n"
+":Returns: True if an entry was stored under key.");
+
+static PyObject*
+shared_session_cache_remove(SharedSessionCache* self, PyObject* args) {
+    Py_buffer key;
+    BOOL removed;
+
+    if (!PyArg_ParseTuple(args, "s*", &key)) {
+        return NULL;
+    }
+    removed = sspi_shm_cache_remove(
+        self->cache, (BYTE*)key.buf, (ULONG)key.len);
+    PyBuffer_Release(&key);
+    return PyBool_FromLong(removed);
+}
+
+PyDoc_STRVAR(shared_session_cache_stats_doc,
+"stats()\n"
+"\n"
+"Get the cache's configuration and this process's metrics.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `slots`: The number of entries the mapping holds, as set by the\n"
+"    process that created it.\n"
+"  - `ttl`: The longest lifetime of entries this process stores, in\n"
+"    seconds.\n"
+"  - `inserted`: The number of entries stored.\n"
+"  - `hits` and `misses`: The number of lookups that found an unexpired\n"
+"    entry and that did not.\n"
+"  - `expired`: The number of expired entries overwritten.\n"
+"  - `evicted`: The number of unexpired entries overwritten to make\n"
+"    room.\n"
+"  - `contended`: The number of :meth:`put` calls that returned False.");
+
+static PyObject*
+shared_session_cache_stats(SharedSessionCache* self, PyObject* unused) {
+    sspi_shm_stats stats;
+    sspi_shm_cache_get_stats(self->cache, &stats);
+    return Py_BuildValue("{s:k,s:d,s:L,s:L,s:L,s:L,s:L,s:L}",
+                         "slots", stats.slots,
+                         "ttl", self->ttl / 1e3,
+                         "inserted", stats.inserted,
+                         "hits", stats.hits,
+                         "misses", stats.misses,
+                         "expired", stats.expired,
+                         "evicted", stats.evicted,
+                         "contended", stats.contended);
+}
+
+static PyMethodDef SharedSessionCache_methods[] = {
+    {"put", (PyCFunction)shared_session_cache_put,
+     METH_VARARGS | METH_KEYWORDS, shared_session_cache_put_doc},
+    {"get", (PyCFunction)shared_session_cache_get,
+     METH_VARARGS, shared_session_cache_get_doc},
+    {"remove", (PyCFunction)shared_session_cache_remove,
+     METH_VARARGS, shared_session_cache_remove_doc},
+    {"stats", (PyCFunction)shared_session_cache_stats,
+     METH_NOARGS, shared_session_cache_stats_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(shared_session_cache_doc,
+"SharedSessionCache(name, max_entries=16384, ttl=3600)\n"
+"\n"
+"A cache of authentication results keyed by session id, shared by\n"
+"every process on the host that opens the same `name`, so that a\n"
+"client authenticated by one worker process is known to the others.\n"
+"\n"
+"The cache lives in a named file mapping backed by the paging file,\n"
+"with a fixed number of 1KB slots. Lookups take no lock. When the\n"
+"slots a key can go in are full, a clock sweep picks the one read\n"
+"least recently to overwrite. The mapping is freed when every process\n"
+"has closed it.\n"
+"\n"
+"The mapping is created with a DACL that grants access to the user this\n"
+"process runs as alone, and opening one created by another user raises\n"
+":exc:`GSSError`. Every process running as that user can read, add and\n"
+"forge entries, so share a cache only among processes that trust each\n"
+"other, and give each application its own account.\n"
+"\n"
+":Parameters:\n"
+"  - `name`: The name of the file mapping, for example\n"
+"    ``\"Local\\\\myapp-sessions\"``. Processes in other sessions need\n"
+"    a ``Global\\\\`` name.\n"
+"  - `max_entries`: The number of slots, rounded up to a power of two.\n"
+"    Only the process creating the mapping sets it.\n"
+"  - `ttl`: The longest number of seconds an entry this process stores\n"
+"    stays valid.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject SharedSessionCache_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.SharedSessionCache",       /* tp_name */
+    sizeof(SharedSessionCache),             /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)shared_session_cache_dealloc, /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    shared_session_cache_doc,               /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    SharedSessionCache_methods,             /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    shared_session_cache_new,               /* tp_new */
+};
+
+
+/* Worker pool */
+
+enum {
+    OP_CLIENT_INIT,
+    OP_CLIENT_STEP,
+    OP_CLIENT_UNWRAP,
+    OP_CLIENT_WRAP,
+    OP_SERVER_STEP,
+    OP_SERVER_UNWRAP,
+    OP_SERVER_WRAP,
+    OP_CLIENT_PREFETCH
+};
+
+/* Values of Future.finished. */
+enum {
+    FUTURE_PENDING,
+    FUTURE_FINISHED,
+    /* The caller timed out and left the worker the last reference. */
+    FUTURE_ABANDONED
+};
+
+typedef struct _Future Future;
+typedef VOID (*future_notify)(Future* future);
+
+struct _Future {
+    PyObject_HEAD
+    sspi_task task;
+    INT op;
+    /* The context the operation uses, kept alive until the future is. */
+    PyObject* pyctx;
+    sspi_client_state* client;
+    sspi_server_state* server;
+    volatile LONG* busy;
+    /* Arguments. The buffers are held, not copied. */
+    client_args args;
+    Py_buffer data;
+    Py_buffer user;
+    UCHAR haveData;
+    UCHAR haveUser;
+    INT protect;
+    /* OP_CLIENT_PREFETCH: the services after the first, and a result for
+     * each service.
+     * */
+    PyObject* services;
+    WCHAR** names;
+    sspi_prefetch_result* prefetch;
+    ULONG count;
+    /* Results, written by the worker before finished is set. */
+    sspi_client_template* tmpl;
+    INT result;
+    sspi_error err;
+    PyObject* value;
+    HANDLE done;
+    UCHAR submitted;
+    volatile LONG finished;
+    /* Called on the worker once finished is set. Owns a reference to
+     * the future.
+     * */
+    future_notify notify;
+    /* The event loop and asyncio future for step_async. */
+    PyObject* loop;
+    PyObject* aiofuture;
+    /* The completion queue the future is pushed to when finished. */
+    sspi_completion_queue* cq;
+};
+
+static PyTypeObject Future_Type;
+
+/* Runs on the worker. Drops the reference the caller left behind. */
+static VOID
+future_release_abandoned(Future* self) {
+    SetEvent(self->done);
+#if PY_VERSION_HEX >= 0x030D0000
+    if (Py_IsFinalizing()) {
+        return;
+    }
+#elif PY_VERSION_HEX >= 0x03070000
+    if (_Py_IsFinalizing()) {
+        return;
+    }
+#endif
+    {
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        Py_DECREF(self);
+        PyGILState_Release(gstate);
+    }
+}
+
+static VOID
+future_finish(Future* self) {
+    future_notify notify;
+    HANDLE done;
+
+    notify = self->notify;
+    done = self->done;
+    if (InterlockedCompareExchange(&self->finished,
+                                   FUTURE_FINISHED,
+                                   FUTURE_PENDING) == FUTURE_ABANDONED) {
+        /* The caller detached the state and released the context. */
+        future_release_abandoned(self);
+        return;
+    }
+    /* Only now may the context be cleaned: an abandoning caller owns the
+     * state until the exchange above.
+     * */
+    if (self->busy) {
+        InterlockedDecrement(self->busy);
+    }
+    /* Without notify the future may be freed once the event is set. */
+    SetEvent(done);
+    if (notify) {
+        notify(self);
+    }
+}
+
+static VOID
+future_prefetch_done(VOID* arg) {
+    Future* self = (Future*)arg;
+    self->result = AUTH_GSS_COMPLETE;
+    future_finish(self);
+}
+
+static VOID
+future_run(sspi_task* task) {
+    Future* self = (Future*)((CHAR*)task - offsetof(Future, task));
+    sspi_client_template* root;
+    SEC_CHAR* data = (SEC_CHAR*)self->data.buf;
+    ULONG dlen = (ULONG)self->data.len;
+
+    switch (self->op) {
+    case OP_CLIENT_INIT:
+        self->tmpl = client_args_new_template(&self->args, &self->err);
+        self->result = self->tmpl ? AUTH_GSS_COMPLETE : AUTH_GSS_ERROR;
+        /* Don't keep the password around any longer than needed. */
+        client_args_free(&self->args);
+        break;
+    case OP_CLIENT_STEP:
+        self->result = auth_sspi_client_step(
+            self->client, data, dlen, &self->err);
+        break;
+    case OP_CLIENT_UNWRAP:
+        self->result = auth_sspi_client_unwrap(
+            self->client, data, dlen, &self->err);
+        break;
+    case OP_CLIENT_WRAP:
+        self->result = auth_sspi_client_wrap(self->client,
+                                             data,
+                                             dlen,
+                                             (SEC_CHAR*)self->user.buf,
+                                             (ULONG)self->user.len,
+                                             self->protect,
+                                             &self->err);
+        break;
+    case OP_SERVER_STEP:
+        self->result = auth_sspi_server_step(
+            self->server, data, dlen, &self->err);
+        break;
+    case OP_SERVER_UNWRAP:
+        self->result = auth_sspi_server_unwrap(
+            self->server, data, dlen, &self->err);
+        break;
+    case OP_SERVER_WRAP:
+        self->result = auth_sspi_server_wrap(
+            self->server, data, dlen, self->protect, &self->err);
+        break;
+    case OP_CLIENT_PREFETCH:
+        root = client_args_new_template(&self->args, &self->err);
+        client_args_free(&self->args);
+        if (root == NULL) {
+            break;
+        }
+        /* The step that finishes last finishes the future, which may
+         * be freed before this returns.
+         * */
+        if (auth_sspi_client_prefetch(root,
+                                      self->names,
+                                      self->count,
+                                      self->prefetch,
+                                      future_prefetch_done,
+                                      self,
+                                      &self->err)) {
+            auth_sspi_client_template_release(root);
+            return;
+        }
+        auth_sspi_client_template_release(root);
+        break;
+    }
+    future_finish(self);
+}
+
+static Future*
+new_future(INT op) {
+    Future* self = PyObject_New(Future, &Future_Type);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->task.run = future_run;
+    self->op = op;
+    self->pyctx = NULL;
+    self->client = NULL;
+    self->server = NULL;
+    self->busy = NULL;
+    memset(&self->args, 0, sizeof(client_args));
+    self->haveData = 0;
+    self->haveUser = 0;
+    self->protect = 0;
+    self->services = NULL;
+    self->names = NULL;
+    self->prefetch = NULL;
+    self->count = 0;
+    self->tmpl = NULL;
+    self->result = AUTH_GSS_ERROR;
+    self->value = NULL;
+    self->submitted = 0;
+    self->finished = FUTURE_PENDING;
+    self->notify = NULL;
+    self->loop = NULL;
+    self->aiofuture = NULL;
+    self->cq = NULL;
+    self->done = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (self->done == NULL) {
+        set_gsserror(GetLastError(), "CreateEvent");
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+/* Wrap and unwrap run in their own lane, so a queue of handshakes does
+ * not hold up the established contexts.
+ * */
+static INT
+future_lane(INT op) {
+    switch (op) {
+    case OP_CLIENT_UNWRAP:
+    case OP_CLIENT_WRAP:
+    case OP_SERVER_UNWRAP:
+    case OP_SERVER_WRAP:
+        return SSPI_LANE_MESSAGE;
+    default:
+        return SSPI_LANE_HANDSHAKE;
+    }
+}
+
+/* Queues the operation. Steals the reference to self. */
+static PyObject*
+submit_future(Future* self, PyObject* pyctx, volatile LONG* busy) {
+    if (pyctx) {
+        /* One operation at a time per context. */
+        if (*busy) {
+            set_busy_context();
+            Py_DECREF(self);
+            return NULL;
+        }
+        Py_INCREF(pyctx);
+        self->pyctx = pyctx;
+        self->busy = busy;
+        InterlockedIncrement(busy);
+    }
+    if (self->notify) {
+        Py_INCREF(self);
+    }
+    if (!sspi_pool_submit(&self->task, future_lane(self->op))) {
+        if (busy) {
+            InterlockedDecrement(busy);
+        }
+        if (self->notify) {
+            Py_DECREF(self);
+        }
+        PyErr_SetString(GSSError, "Unable to start the worker threads.");
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->submitted = 1;
+    return (PyObject*)self;
+}
+
+static PyObject*
+submit_client_future(Future* self, PyObject* pyctx) {
+    self->client = client_context_state(pyctx);
+    if (self->client == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return submit_future(self, pyctx, &((ClientContext*)pyctx)->busy);
+}
+
+static PyObject*
+submit_server_future(Future* self, PyObject* pyctx) {
+    self->server = server_context_state(pyctx);
+    if (self->server == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return submit_future(self, pyctx, &((ServerContext*)pyctx)->busy);
+}
+
+/* Returns FALSE if the operation did not finish within timeout
+ * milliseconds. Waits for the event rather than checking finished, which
+ * the worker sets before it is done with the future.
+ * */
+static BOOL
+future_wait(Future* self, DWORD timeout) {
+    DWORD status = WaitForSingleObject(self->done, 0);
+    if (status == WAIT_TIMEOUT && timeout != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        status = WaitForSingleObject(self->done, timeout);
+        Py_END_ALLOW_THREADS
+    }
+    return status != WAIT_TIMEOUT;
+}
+
+static VOID
+future_dealloc(Future* self) {
+    /* The worker may still be using the buffers and the context. */
+    if (self->submitted) {
+        future_wait(self, INFINITE);
+    }
+    /* The state was detached from its context when the caller gave up. */
+    if (self->finished == FUTURE_ABANDONED) {
+        if (self->client) {
+            destroy_sspi_client_state(self->client);
+            free(self->client);
+        }
+        if (self->server) {
+            destroy_sspi_server_state(self->server);
+            free(self->server);
+        }
+    }
+    if (self->done) {
+        CloseHandle(self->done);
+    }
+    if (self->tmpl) {
+        auth_sspi_client_template_release(self->tmpl);
+    }
+    client_args_free(&self->args);
+    if (self->names) {
+        ULONG i;
+        for (i = 0; i < self->count; i++) {
+            free(self->names[i]);
+        }
+        free(self->names);
+    }
+    free(self->prefetch);
+    Py_XDECREF(self->services);
+    if (self->haveData) {
+        PyBuffer_Release(&self->data);
+    }
+    if (self->haveUser) {
+        PyBuffer_Release(&self->user);
+    }
+    Py_XDECREF(self->value);
+    Py_XDECREF(self->pyctx);
+    Py_XDECREF(self->loop);
+    Py_XDECREF(self->aiofuture);
+    if (self->cq) {
+        sspi_completion_queue_release(self->cq);
+    }
+    PyObject_Del(self);
+}
+
+PyDoc_STRVAR(future_done_doc,
+"done()\n"
+"\n"
+":Returns: True if the operation has finished, successfully or not.");
+
+static PyObject*
+future_done(Future* self, PyObject* unused) {
+    return PyBool_FromLong(self->finished == FUTURE_FINISHED);
+}
+
+PyDoc_STRVAR(future_result_doc,
+"result(timeout=None)\n"
+"\n"
+"Wait for the operation to finish, without holding the GIL.\n"
+"\n"
+":Parameters:\n"
+"  - `timeout`: An optional number of seconds to wait. Raises\n"
+"    :exc:`GSSTimeoutError` if the operation has not finished by then.\n"
+"    The operation is not cancelled and the future can be waited on\n"
+"    again.\n"
+"\n"
+":Returns: What the synchronous version of the operation returns. If\n"
+"          the operation failed, raises the :exc:`GSSError` that the\n"
+"          synchronous version would have raised.");
+
+static PyObject*
+prefetch_results(Future* self) {
+    PyObject* resultobj = PyList_New(self->count);
+    ULONG i;
+
+    if (resultobj == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < self->count; i++) {
+        sspi_prefetch_result* pr = &self->prefetch[i];
+        PyObject* result;
+        PyObject* item;
+        if (pr->result == AUTH_GSS_ERROR) {
+            PyObject *type, *traceback;
+            set_sspi_error(&pr->err);
+            PyErr_Fetch(&type, &result, &traceback);
+            PyErr_NormalizeException(&type, &result, &traceback);
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+        } else {
+            result = Py_BuildValue("i", pr->result);
+        }
+        if (result == NULL) {
+            Py_DECREF(resultobj);
+            return NULL;
+        }
+        item = Py_BuildValue("(ONd)",
+                             PySequence_Fast_GET_ITEM(self->services, i),
+                             result,
+                             (double)pr->elapsed_us / 1000000.0);
+        if (item == NULL) {
+            Py_DECREF(resultobj);
+            return NULL;
+        }
+        PyList_SET_ITEM(resultobj, i, item);
+    }
+    return resultobj;
+}
+
+/* Returns the result of a finished future. */
+static PyObject*
+future_value(Future* self) {
+    if (self->result == AUTH_GSS_ERROR) {
+        set_sspi_error(&self->err);
+        return NULL;
+    }
+    if (self->value == NULL) {
+        if (self->op == OP_CLIENT_INIT) {
+            PyObject* pyctx = new_client_context_from_template(self->tmpl);
+            if (pyctx == NULL) {
+                return NULL;
+            }
+            auth_sspi_client_template_release(self->tmpl);
+            self->tmpl = NULL;
+            self->value = Py_BuildValue("(iN)", AUTH_GSS_COMPLETE, pyctx);
+        } else if (self->op == OP_CLIENT_PREFETCH) {
+            self->value = prefetch_results(self);
+        } else {
+            self->value = Py_BuildValue("i", self->result);
+        }
+        if (self->value == NULL) {
+            return NULL;
+        }
+    }
+    Py_INCREF(self->value);
+    return self->value;
+}
+
+static PyObject*
+future_result(Future* self, PyObject* args, PyObject* kw) {
+    PyObject* timeoutobj = Py_None;
+    DWORD timeout;
+    static SEC_CHAR* keywords[] = {"timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|O", keywords, &timeoutobj)) {
+        return NULL;
+    }
+    if (!parse_timeout(timeoutobj, "timeout", &timeout)) {
+        return NULL;
+    }
+    if (!future_wait(self, timeout)) {
+        PyErr_SetString(GSSTimeoutError,
+                        "The operation did not finish in time.");
+        return NULL;
+    }
+    return future_value(self);
+}
+
+static PyMethodDef Future_methods[] = {
+    {"done", (PyCFunction)future_done, METH_NOARGS, future_done_doc},
+    {"result", (PyCFunction)future_result,
+     METH_VARARGS | METH_KEYWORDS, future_result_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(future_doc,
+"The result of an operation queued on the worker pool by one of the\n"
+"``*Async`` functions, such as :func:`authGSSClientStepAsync`.\n"
+"\n"
+"Futures cannot be created directly. The context the operation uses\n"
+"cannot be cleaned, reset or used by another ``*Async`` call until the\n"
+"operation has finished. Dropping the last reference to an unfinished\n"
+"future waits for the operation to finish.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject Future_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.Future",                   /* tp_name */
+    sizeof(Future),                         /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)future_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    future_doc,                             /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    Future_methods,                         /* tp_methods */
+};
+
+/* Deadlines */
+
+/* Gives up on a submitted future. The caller's reference passes to the
+ * worker, and the state of the context the operation uses is destroyed
+ * once it finishes. Returns FALSE if the operation finished first.
+ * */
+static BOOL
+future_abandon(Future* self) {
+    if (InterlockedCompareExchange(&self->finished,
+                                   FUTURE_ABANDONED,
+                                   FUTURE_PENDING) != FUTURE_PENDING) {
+        return FALSE;
+    }
+    /* The worker can't drop the future until the GIL is released. */
+    if (self->client) {
+        ((ClientContext*)self->pyctx)->state = NULL;
+    }
+    if (self->server) {
+        ((ServerContext*)self->pyctx)->state = NULL;
+    }
+    /* The worker leaves busy alone once it sees the future abandoned. */
+    if (self->busy) {
+        InterlockedDecrement(self->busy);
+        self->busy = NULL;
+    }
+    return TRUE;
+}
+
+/* Waits up to timeout milliseconds for a submitted future. Steals the
+ * reference to it.
+ * */
+static PyObject*
+future_result_within(PyObject* pyfuture, DWORD timeout) {
+    Future* self = (Future*)pyfuture;
+    PyObject* value;
+    if (self == NULL) {
+        return NULL;
+    }
+    if (!future_wait(self, timeout) && future_abandon(self)) {
+        PyErr_SetString(GSSTimeoutError,
+                        "The operation did not finish in time.");
+        return NULL;
+    }
+    value = future_value(self);
+    Py_DECREF(self);
+    return value;
+}
+
+static PyObject*
+client_init_within(PyObject* serviceobj,
+                   client_init_options* opts,
+                   DWORD timeout) {
+    Future* future = new_future(OP_CLIENT_INIT);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!client_args_from_values(serviceobj, opts, &future->args)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return future_result_within(submit_future(future, NULL, NULL), timeout);
+}
+
+/* Steals the challenge buffer. */
+static PyObject*
+client_step_within(PyObject* pyctx, Py_buffer* challenge, DWORD timeout) {
+    Future* future = new_future(OP_CLIENT_STEP);
+    if (future == NULL) {
+        PyBuffer_Release(challenge);
+        return NULL;
+    }
+    future->data = *challenge;
+    future->haveData = 1;
+    return future_result_within(submit_client_future(future, pyctx),
+                                timeout);
+}
+
+/* Steals the challenge buffer. */
+static PyObject*
+server_step_within(PyObject* pyctx, Py_buffer* challenge, DWORD timeout) {
+    Future* future = new_future(OP_SERVER_STEP);
+    if (future == NULL) {
+        PyBuffer_Release(challenge);
+        return NULL;
+    }
+    future->data = *challenge;
+    future->haveData = 1;
+    return future_result_within(submit_server_future(future, pyctx),
+                                timeout);
+}
+
+/* asyncio */
+
+static PyObject*
+future_deliver(PyObject* pyfuture, PyObject* unused) {
+    Future* self = (Future*)pyfuture;
+    PyObject* cancelled;
+    PyObject* value;
+    PyObject* res;
+
+    cancelled = PyObject_CallMethod(self->aiofuture, "cancelled", NULL);
+    if (cancelled == NULL) {
+        return NULL;
+    }
+    if (PyObject_IsTrue(cancelled)) {
+        Py_DECREF(cancelled);
+        Py_RETURN_NONE;
+    }
+    Py_DECREF(cancelled);
+
+    value = future_value(self);
+    if (value == NULL) {
+        PyObject *type, *exc, *traceback;
+        PyErr_Fetch(&type, &exc, &traceback);
+        PyErr_NormalizeException(&type, &exc, &traceback);
+        if (exc == NULL) {
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+            return NULL;
+        }
+        res = PyObject_CallMethod(
+            self->aiofuture, "set_exception", "O", exc);
+        Py_XDECREF(type);
+        Py_DECREF(exc);
+        Py_XDECREF(traceback);
+    } else {
+        res = PyObject_CallMethod(self->aiofuture, "set_result", "O", value);
+        Py_DECREF(value);
+    }
+    return res;
+}
+
+static PyMethodDef future_deliver_def = {
+    "_deliver", (PyCFunction)future_deliver, METH_NOARGS, NULL};
+
+/* Runs on the worker. Hands the result to the event loop's thread. */
+static VOID
+future_notify_loop(Future* self) {
+    PyGILState_STATE gstate;
+    PyObject* deliver;
+    PyObject* res = NULL;
+
+#if PY_VERSION_HEX >= 0x030D0000
+    if (Py_IsFinalizing()) {
+        return;
+    }
+#elif PY_VERSION_HEX >= 0x03070000
+    if (_Py_IsFinalizing()) {
+        return;
+    }
+#endif
+    gstate = PyGILState_Ensure();
+    deliver = PyCFunction_New(&future_deliver_def, (PyObject*)self);
+    if (deliver) {
+        res = PyObject_CallMethod(
+            self->loop, "call_soon_threadsafe", "O", deliver);
+        Py_DECREF(deliver);
+    }
+    if (res == NULL) {
+        /* For example, the loop was closed. */
+        PyErr_WriteUnraisable(self->loop);
+    }
+    Py_XDECREF(res);
+    Py_DECREF(self);
+    PyGILState_Release(gstate);
+}
+
+/* Creates an asyncio future on the current event loop for the result. */
+static BOOL
+future_use_loop(Future* self) {
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL) {
+        return FALSE;
+    }
+    self->loop = PyObject_CallMethod(asyncio, "get_event_loop", NULL);
+    Py_DECREF(asyncio);
+    if (self->loop == NULL) {
+        return FALSE;
+    }
+    self->aiofuture = PyObject_CallMethod(self->loop, "create_future", NULL);
+    if (self->aiofuture == NULL) {
+        return FALSE;
+    }
+    self->notify = future_notify_loop;
+    return TRUE;
+}
+
+/* Steals the reference to a submitted future. Returns its asyncio future. */
+static PyObject*
+future_awaitable(PyObject* pyfuture) {
+    PyObject* aiofuture;
+    if (pyfuture == NULL) {
+        return NULL;
+    }
+    aiofuture = ((Future*)pyfuture)->aiofuture;
+    Py_INCREF(aiofuture);
+    Py_DECREF(pyfuture);
+    return aiofuture;
+}
+
+static PyObject*
+client_context_step_async(ClientContext* self, PyObject* args) {
+    Future* future = new_future(OP_CLIENT_STEP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "s*", &future->data)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (_string_too_long("challenge", (SIZE_T)future->data.len) ||
+        !future_use_loop(future)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return future_awaitable(submit_client_future(future, (PyObject*)self));
+}
+
+static PyObject*
+server_context_step_async(ServerContext* self, PyObject* args) {
+    Future* future = new_future(OP_SERVER_STEP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "s*", &future->data)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (_string_too_long("challenge", (SIZE_T)future->data.len) ||
+        !future_use_loop(future)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return future_awaitable(submit_server_future(future, (PyObject*)self));
+}
+
+/* Completion queue */
+
+typedef struct {
+    PyObject_HEAD
+    sspi_completion_queue* queue;
+} CompletionQueue;
+
+static PyTypeObject CompletionQueue_Type;
+
+/* Runs on the worker. The queue takes over the notify reference. */
+static VOID
+future_notify_queue(Future* self) {
+    sspi_completion_queue* cq = self->cq;
+    self->cq = NULL;
+    if (!sspi_completion_queue_push(cq, &self->task)) {
+        /* The CompletionQueue is gone. Nothing will drain the future. */
+#if PY_VERSION_HEX >= 0x030D0000
+        if (!Py_IsFinalizing()) {
+#elif PY_VERSION_HEX >= 0x03070000
+        if (!_Py_IsFinalizing()) {
+#else
+        {
+#endif
+            PyGILState_STATE gstate = PyGILState_Ensure();
+            Py_DECREF(self);
+            PyGILState_Release(gstate);
+        }
+    }
+    sspi_completion_queue_release(cq);
+}
+
+static PyObject*
+completion_queue_new(PyTypeObject* type, PyObject* args, PyObject* kw) {
+    CompletionQueue* self;
+    DWORD error;
+    static SEC_CHAR* keywords[] = {NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "", keywords)) {
+        return NULL;
+    }
+    self = (CompletionQueue*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->queue = sspi_completion_queue_new(&error);
+    if (self->queue == NULL) {
+        set_gsserror(error, "Unable to create the completion socket");
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static VOID
+completion_queue_dealloc(CompletionQueue* self) {
+    /* Futures still running hold their own reference to the queue. */
+    if (self->queue) {
+        sspi_task* task = sspi_completion_queue_close(self->queue);
+        while (task) {
+            sspi_task* next = task->next;
+            Py_DECREF((Future*)((CHAR*)task - offsetof(Future, task)));
+            task = next;
+        }
+        sspi_completion_queue_release(self->queue);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(completion_queue_fileno_doc,
+"fileno()\n"
+"\n"
+":Returns: A socket that becomes readable when futures finish. Pass it\n"
+"          to ``select``, ``selectors`` or the event loop's reader API,\n"
+"          and call :meth:`drain` when it is readable. Do not read from\n"
+"          it directly.");
+
+static PyObject*
+completion_queue_fileno(CompletionQueue* self, PyObject* unused) {
+    return PyLong_FromUnsignedLongLong(
+        (unsigned PY_LONG_LONG)sspi_completion_queue_fileno(self->queue));
+}
+
+PyDoc_STRVAR(completion_queue_drain_doc,
+"drain()\n"
+"\n"
+"Removes the finished futures from the queue, without blocking.\n"
+"\n"
+":Returns: A list of the :class:`Future` objects that finished since the\n"
+"          last call, in the order they finished. It can be empty.");
+
+static PyObject*
+completion_queue_drain(CompletionQueue* self, PyObject* unused) {
+    PyObject* result = PyList_New(0);
+    sspi_task* task = sspi_completion_queue_drain(self->queue);
+
+    while (task) {
+        sspi_task* next = task->next;
+        PyObject* future = (PyObject*)((CHAR*)task - offsetof(Future, task));
+        if (result && PyList_Append(result, future)) {
+            Py_CLEAR(result);
+        }
+        Py_DECREF(future);
+        task = next;
+    }
+    return result;
+}
+
+static PyMethodDef CompletionQueue_methods[] = {
+    {"fileno", (PyCFunction)completion_queue_fileno,
+     METH_NOARGS, completion_queue_fileno_doc},
+    {"drain", (PyCFunction)completion_queue_drain,
+     METH_NOARGS, completion_queue_drain_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(completion_queue_doc,
+"CompletionQueue()\n"
+"\n"
+"Collects finished futures for event loops other than asyncio. Pass it\n"
+"as the `queue` argument of :func:`authGSSClientStepAsync` or\n"
+":func:`authGSSServerStepAsync`, wait for :meth:`fileno` to become\n"
+"readable, then call :meth:`drain`. Any number of operations can share\n"
+"one queue. Several completions between two drains cause a single\n"
+"wakeup.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyTypeObject CompletionQueue_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "winkerberos.CompletionQueue",          /* tp_name */
+    sizeof(CompletionQueue),                /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)completion_queue_dealloc,   /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    completion_queue_doc,                   /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    CompletionQueue_methods,                /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    completion_queue_new,                   /* tp_new */
+};
+
+/* Pushes the future to queue, if not None, when it finishes. */
+static VOID
+future_use_queue(Future* self, PyObject* queue) {
+    if (queue == Py_None) {
+        return;
+    }
+    self->cq = ((CompletionQueue*)queue)->queue;
+    sspi_completion_queue_retain(self->cq);
+    self->notify = future_notify_queue;
+}
+
+PyDoc_STRVAR(sspi_client_init_async_doc,
+"authGSSClientInitAsync(service, principal=None, gssflags="
+"GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
+" password=None, mech_oid=GSS_MECH_OID_KRB5)\n"
+"\n"
+"Queues :func:`authGSSClientInit` on the worker pool. Acquiring\n"
+"credentials for an explicit user can block on the KDC.\n"
+"\n"
+":Returns: A :class:`Future` whose result is the (result, context) tuple\n"
+"          :func:`authGSSClientInit` returns.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_init_async(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* serviceobj;
+    client_init_options opts;
+    Future* future;
+
+    if (!parse_client_init_args(
+            args, kw, "service", &serviceobj, &opts, NULL, NULL)) {
+        return NULL;
+    }
+    future = new_future(OP_CLIENT_INIT);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!client_args_from_values(serviceobj, &opts, &future->args)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_future(future, NULL, NULL);
+}
+
+PyDoc_STRVAR(sspi_client_prefetch_doc,
+"authGSSClientPrefetch(services, principal=None, gssflags="
+"GSS_C_MUTUAL_FLAG|GSS_C_SEQUENCE_FLAG, user=None, domain=None,"
+" password=None, mech_oid=GSS_MECH_OID_KRB5)\n"
+"\n"
+"Fetches the service tickets for several services in the background,\n"
+"so the first :func:`authGSSClientStep` for each of them does not wait\n"
+"for the KDC. Call it at startup, before traffic arrives.\n"
+"\n"
+"Credentials are acquired once, then a first step runs for each service\n"
+"concurrently on the worker pool and its context is thrown away. The\n"
+"tickets stay in the LSA ticket cache of the logon session the\n"
+"credentials belong to. With the default credentials that is the\n"
+"session of the current user, shared by every later context. Tickets\n"
+"fetched for an explicit `user` or `principal` are only cached for\n"
+"the credentials acquired here.\n"
+"\n"
+":Parameters:\n"
+"  - `services`: A sequence of service principal names, each in the\n"
+"    format accepted by :func:`authGSSClientInit`.\n"
+"  - The remaining parameters are the same as for\n"
+"    :func:`authGSSClientInit` and apply to every service.\n"
+"\n"
+":Returns: A :class:`Future` whose result is a list with a\n"
+"          (service, result, elapsed) tuple for each service, in the\n"
+"          order given. result is the return value of the first step, or\n"
+"          the :exc:`GSSError` it would have raised, which is not raised.\n"
+"          elapsed is the time the step took in seconds. If credentials\n"
+"          could not be acquired the result raises :exc:`GSSError`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_prefetch(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* servicesobj;
+    client_init_options opts;
+    Future* future;
+    Py_ssize_t count, i;
+
+    if (!parse_client_init_args(
+            args, kw, "services", &servicesobj, &opts, NULL, NULL)) {
+        return NULL;
+    }
+    future = new_future(OP_CLIENT_PREFETCH);
+    if (future == NULL) {
+        return NULL;
+    }
+    future->services = PySequence_Fast(
+        servicesobj, "services must be a sequence");
+    if (future->services == NULL) {
+        goto fail;
+    }
+    count = PySequence_Fast_GET_SIZE(future->services);
+    if (count == 0) {
+        PyErr_SetString(PyExc_ValueError, "services must not be empty");
+        goto fail;
+    }
+    if (_too_many("services", count)) {
+        goto fail;
+    }
+    future->names = (WCHAR**)calloc(count, sizeof(WCHAR*));
+    future->prefetch = (sspi_prefetch_result*)calloc(
+        count, sizeof(sspi_prefetch_result));
+    if (future->names == NULL || future->prefetch == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    future->count = (ULONG)count;
+    /* The first service is the one credentials are acquired for. */
+    if (!client_args_from_values(PySequence_Fast_GET_ITEM(future->services, 0),
+                                 &opts,
+                                 &future->args)) {
+        goto fail;
+    }
+    for (i = 1; i < count; i++) {
+        Py_ssize_t slen;
+        if (!StringObject_AsWCHAR(
+                PySequence_Fast_GET_ITEM(future->services, i),
+                1,
+                FALSE,
+                &future->names[i],
+                &slen)) {
+            goto fail;
+        }
+    }
+    return submit_future(future, NULL, NULL);
+
+fail:
+    Py_DECREF(future);
+    return NULL;
+}
+
+PyDoc_STRVAR(sspi_client_step_async_doc,
+"authGSSClientStepAsync(context, challenge, queue=None)\n"
+"\n"
+"Queues :func:`authGSSClientStep` on the worker pool.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by\n"
+"    :func:`authGSSClientInit`.\n"
+"  - `challenge`: As for :func:`authGSSClientStep`.\n"
+"  - `queue`: An optional :class:`CompletionQueue` the future is added\n"
+"    to when it finishes.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_step_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    PyObject* queue = Py_None;
+    Future* future = new_future(OP_CLIENT_STEP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "Os*|O", &pyctx, &future->data, &queue)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (queue != Py_None &&
+        !PyObject_TypeCheck(queue, &CompletionQueue_Type)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "queue must be a CompletionQueue or None");
+        Py_DECREF(future);
+        return NULL;
+    }
+    future_use_queue(future, queue);
+    if (_string_too_long("challenge", (SIZE_T)future->data.len)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_client_future(future, pyctx);
+}
+
+PyDoc_STRVAR(sspi_client_unwrap_async_doc,
+"authGSSClientUnwrapAsync(context, challenge)\n"
+"\n"
+"Queues :func:`authGSSClientUnwrap` on the worker pool.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_unwrap_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    Future* future = new_future(OP_CLIENT_UNWRAP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "Os*", &pyctx, &future->data)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (_string_too_long("challenge", (SIZE_T)future->data.len)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_client_future(future, pyctx);
+}
+
+PyDoc_STRVAR(sspi_client_wrap_async_doc,
+"authGSSClientWrapAsync(context, data, user=None, protect=0)\n"
+"\n"
+"Queues :func:`authGSSClientWrap` on the worker pool.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_client_wrap_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    Future* future = new_future(OP_CLIENT_WRAP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args,
+                          "Os*|z*i",
+                          &pyctx,
+                          &future->data,
+                          &future->user,
+                          &future->protect)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    /* z* leaves user untouched if it is not passed. */
+    if (PyTuple_GET_SIZE(args) > 2) {
+        future->haveUser = 1;
+    } else {
+        future->user.buf = NULL;
+        future->user.len = 0;
+    }
+    if (_string_too_long("data", (SIZE_T)future->data.len) ||
+        /* Length of user + 4 bytes for security options. */
+        _string_too_long("user", (SIZE_T)future->user.len + 4)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_client_future(future, pyctx);
+}
+
+PyDoc_STRVAR(sspi_server_step_async_doc,
+"authGSSServerStepAsync(context, challenge, queue=None)\n"
+"\n"
+"Queues :func:`authGSSServerStep` on the worker pool.\n"
+"\n"
+":Parameters:\n"
+"  - `context`: The context object returned by\n"
+"    :func:`authGSSServerInit`.\n"
+"  - `challenge`: As for :func:`authGSSServerStep`.\n"
+"  - `queue`: An optional :class:`CompletionQueue` the future is added\n"
+"    to when it finishes.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_step_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    PyObject* queue = Py_None;
+    Future* future = new_future(OP_SERVER_STEP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "Os*|O", &pyctx, &future->data, &queue)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (queue != Py_None &&
+        !PyObject_TypeCheck(queue, &CompletionQueue_Type)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "queue must be a CompletionQueue or None");
+        Py_DECREF(future);
+        return NULL;
+    }
+    future_use_queue(future, queue);
+    if (_string_too_long("challenge", (SIZE_T)future->data.len)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_server_future(future, pyctx);
+}
+
+PyDoc_STRVAR(sspi_server_unwrap_async_doc,
+"authGSSServerUnwrapAsync(context, challenge)\n"
+"\n"
+"Queues :func:`authGSSServerUnwrap` on the worker pool.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_unwrap_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    Future* future = new_future(OP_SERVER_UNWRAP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "Os*", &pyctx, &future->data)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (_string_too_long("challenge", (SIZE_T)future->data.len)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_server_future(future, pyctx);
+}
+
+PyDoc_STRVAR(sspi_server_wrap_async_doc,
+"authGSSServerWrapAsync(context, data, protect=0)\n"
+"\n"
+"Queues :func:`authGSSServerWrap` on the worker pool.\n"
+"\n"
+":Returns: A :class:`Future`.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+sspi_server_wrap_async(PyObject* self, PyObject* args) {
+    PyObject* pyctx;
+    Future* future = new_future(OP_SERVER_WRAP);
+    if (future == NULL) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(
+            args, "Os*|i", &pyctx, &future->data, &future->protect)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    future->haveData = 1;
+    if (_string_too_long("data", (SIZE_T)future->data.len)) {
+        Py_DECREF(future);
+        return NULL;
+    }
+    return submit_server_future(future, pyctx);
+}
+
+PyDoc_STRVAR(configure_thread_pool_doc,
+"configureThreadPool(workers=0, message_workers=0)\n"
+"\n"
+"Sets the number of threads in the worker pool used by the ``*Async``\n"
+"functions and :func:`authGSSClientInitMany`. The pool has two lanes,\n"
+"each with its own threads and queue: one for the init and step\n"
+"functions and one for wrap and unwrap, so that messages on established\n"
+"contexts are not queued behind handshakes. The threads are started\n"
+"when the first operation is queued. If the pool is running, this\n"
+"waits for the queued operations to finish and stops its threads.\n"
+"\n"
+":Parameters:\n"
+"  - `workers`: The number of threads for init and step. 0, the\n"
+"    default, means one per processor.\n"
+"  - `message_workers`: The number of threads for wrap and unwrap. 0,\n"
+"    the default, means one per two processors.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+configure_thread_pool(PyObject* self, PyObject* args, PyObject* kw) {
+    LONG workers = 0;
+    LONG message_workers = 0;
+    static SEC_CHAR* keywords[] = {"workers", "message_workers", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|ll", keywords, &workers, &message_workers)) {
+        return NULL;
+    }
+    if (workers < 0 || message_workers < 0) {
+        PyErr_SetString(PyExc_ValueError, "workers must be >= 0");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    sspi_pool_configure(SSPI_LANE_HANDSHAKE, (ULONG)workers);
+    sspi_pool_configure(SSPI_LANE_MESSAGE, (ULONG)message_workers);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(thread_pool_stats_doc,
+"threadPoolStats()\n"
+"\n"
+"Get the worker pool's metrics. The counters are process wide and are\n"
+"not reset by :func:`configureThreadPool`.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `workers`: The number of threads for init and step.\n"
+"  - `message_workers`: The number of threads for wrap and unwrap.\n"
+"  - `queued`: The number of operations waiting for a thread.\n"
+"  - `max_queued`: The largest value `queued` has had in one lane.\n"
+"  - `submitted`: The number of operations queued.\n"
+"  - `completed`: The number of operations finished.\n"
+"  - `stolen`: The number of operations run by a thread other than the\n"
+"    one they were queued on.\n"
+"  - `total_wait`: The time, in seconds, operations spent queued.\n"
+"  - `max_wait`: The longest time, in seconds, an operation spent queued.\n"
+"  - `lanes`: A dict mapping ``\"handshake\"`` and ``\"message\"`` to\n"
+"    a dict with the keys above, except `message_workers` and `lanes`,\n"
+"    for that lane alone.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+lane_stats_dict(sspi_pool_stats* stats) {
+    return Py_BuildValue("{s:k,s:l,s:L,s:L,s:L,s:L,s:d,s:d}",
+                         "workers", stats->workers,
+                         "queued", stats->queued,
+                         "max_queued", stats->max_queued,
+                         "submitted", stats->submitted,
+                         "completed", stats->completed,
+                         "stolen", stats->stolen,
+                         "total_wait", stats->wait_us / 1e6,
+                         "max_wait", stats->max_wait_us / 1e6);
+}
+
+static PyObject*
+thread_pool_stats(PyObject* self, PyObject* unused) {
+    sspi_pool_stats hs;
+    sspi_pool_stats msg;
+    PyObject* hsdict;
+    PyObject* msgdict;
+    PyObject* result = NULL;
+    LONG64 max_queued, max_wait_us;
+
+    sspi_pool_get_stats(SSPI_LANE_HANDSHAKE, &hs);
+    sspi_pool_get_stats(SSPI_LANE_MESSAGE, &msg);
+    max_queued = hs.max_queued > msg.max_queued ?
+        hs.max_queued : msg.max_queued;
+    max_wait_us = hs.max_wait_us > msg.max_wait_us ?
+        hs.max_wait_us : msg.max_wait_us;
+    hsdict = lane_stats_dict(&hs);
+    msgdict = lane_stats_dict(&msg);
+    if (hsdict && msgdict) {
+        result = Py_BuildValue(
+            "{s:k,s:k,s:l,s:L,s:L,s:L,s:L,s:d,s:d,s:{s:O,s:O}}",
+            "workers", hs.workers,
+            "message_workers", msg.workers,
+            "queued", hs.queued + msg.queued,
+            "max_queued", max_queued,
+            "submitted", hs.submitted + msg.submitted,
+            "completed", hs.completed + msg.completed,
+            "stolen", hs.stolen + msg.stolen,
+            "total_wait", (hs.wait_us + msg.wait_us) / 1e6,
+            "max_wait", max_wait_us / 1e6,
+            "lanes",
+            "handshake", hsdict,
+            "message", msgdict);
+    }
+    Py_XDECREF(hsdict);
+    Py_XDECREF(msgdict);
+    return result;
+}
+
+PyDoc_STRVAR(configure_negative_cache_doc,
+"configureNegativeCache(ttl=0)\n"
+"\n"
+"Enables or disables the negative cache and empties it.\n"
+"\n"
+"When enabled, a first :func:`authGSSClientStep` that fails because the\n"
+"KDC does not know the service principal (``SEC_E_TARGET_UNKNOWN`` or\n"
+"``SEC_E_WRONG_PRINCIPAL``) is remembered for `ttl` seconds, keyed by\n"
+"service principal, mechanism and user. Until then, first steps for\n"
+"the same key raise the same :exc:`GSSError` at once instead of asking\n"
+"the KDC again. The cache is process wide.\n"
+"\n"
+":Parameters:\n"
+"  - `ttl`: The number of seconds to remember a failure. 0, the default,\n"
+"    disables the cache.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+configure_negative_cache(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* ttlobj = NULL;
+    DWORD ttl = 0;
+    static SEC_CHAR* keywords[] = {"ttl", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|O", keywords, &ttlobj)) {
+        return NULL;
+    }
+    if (ttlobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "ttl must be a number");
+        return NULL;
+    }
+    if (ttlobj && !parse_timeout(ttlobj, "ttl", &ttl)) {
+        return NULL;
+    }
+
+    auth_sspi_negative_cache_configure(ttl);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(negative_cache_stats_doc,
+"negativeCacheStats()\n"
+"\n"
+"Get the negative cache's metrics. The counters are process wide and are\n"
+"not reset by :func:`configureNegativeCache`.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `ttl`: The configured time to live, in seconds. 0 if disabled.\n"
+"  - `entries`: The number of failures remembered, including expired\n"
+"    ones not yet dropped.\n"
+"  - `recorded`: The number of failures added to the cache. Repeating a\n"
+"    remembered failure only extends its entry. When the cache is full\n"
+"    the entry closest to expiring is replaced.\n"
+"  - `suppressed`: The number of first steps failed from the cache\n"
+"    without contacting the KDC.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+negative_cache_stats(PyObject* self, PyObject* unused) {
+    sspi_negative_cache_stats stats;
+    auth_sspi_negative_cache_get_stats(&stats);
+    return Py_BuildValue("{s:d,s:k,s:L,s:L}",
+                         "ttl", stats.ttl / 1e3,
+                         "entries", stats.entries,
+                         "recorded", stats.recorded,
+                         "suppressed", stats.suppressed);
+}
+
+PyDoc_STRVAR(configure_mechanism_memory_doc,
+"configureMechanismMemory(ttl=3600)\n"
+"\n"
+"Sets how long the mechanism chosen for GSS_MECH_OID_AUTO is remembered\n"
+"and empties the memory.\n"
+"\n"
+"Contexts initialized with `mech_oid` GSS_MECH_OID_AUTO use Kerberos for\n"
+"a service principal and user not in the memory. When a handshake with\n"
+"such a context completes, its mechanism is remembered. When its first\n"
+":func:`authGSSClientStep` fails because Kerberos is unavailable, such as\n"
+"when the user has no Kerberos credentials, Negotiate is remembered\n"
+"instead, so the next context for the service skips Kerberos. Failures\n"
+"that Negotiate would not avoid, such as an unreachable KDC or an unknown\n"
+"service principal, are not remembered. The memory is process wide.\n"
+"\n"
+":Parameters:\n"
+"  - `ttl`: The number of seconds to remember a mechanism. 0 stops\n"
+"    remembering, so GSS_MECH_OID_AUTO always uses Kerberos.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+configure_mechanism_memory(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* ttlobj = NULL;
+    DWORD ttl = 3600 * 1000;
+    static SEC_CHAR* keywords[] = {"ttl", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|O", keywords, &ttlobj)) {
         return NULL;
     }
-
-    state = (sspi_client_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    if (ttlobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "ttl must be a number");
         return NULL;
     }
-
-    result = auth_sspi_client_wrap(state, data, user, (ULONG)ulen, protect);
-    if (result == AUTH_GSS_ERROR) {
+    if (ttlobj && !parse_timeout(ttlobj, "ttl", &ttl)) {
         return NULL;
     }
 
-    return Py_BuildValue("i", result);
+    auth_sspi_mech_memory_configure(ttl);
+    Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR(mechanism_memory_stats_doc,
+"mechanismMemoryStats()\n"
+"\n"
+"Get the mechanism memory's metrics. The counters are process wide and\n"
+"are not reset by :func:`configureMechanismMemory`.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `ttl`: The configured time to live, in seconds.\n"
+"  - `entries`: The number of service principals remembered, including\n"
+"    expired ones not yet dropped.\n"
+"  - `recorded`: The number of outcomes remembered.\n"
+"  - `hits`: The number of GSS_MECH_OID_AUTO contexts whose mechanism\n"
+"    came from the memory.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
-/* Server Methods */
-
-static VOID
-#if PY_MAJOR_VERSION >=3
-destroy_sspi_server(PyObject* obj) {
-    sspi_server_state* state = PyCapsule_GetPointer(obj, NULL);
-#else
-destroy_sspi_server(VOID* obj) {
-    sspi_server_state* state = (sspi_server_state*)obj;
-#endif
-    if (state) {
-        destroy_sspi_server_state(state);
-        free(state);
-    }
+static PyObject*
+mechanism_memory_stats(PyObject* self, PyObject* unused) {
+    sspi_mech_memory_stats stats;
+    auth_sspi_mech_memory_get_stats(&stats);
+    return Py_BuildValue("{s:d,s:k,s:L,s:L}",
+                         "ttl", stats.ttl / 1e3,
+                         "entries", stats.entries,
+                         "recorded", stats.recorded,
+                         "hits", stats.hits);
 }
 
-PyDoc_STRVAR(sspi_server_init_doc,
-"authGSSServerInit(service)\n"
+PyDoc_STRVAR(configure_circuit_breaker_doc,
+"configureCircuitBreaker(cooldown=0, failure_ratio=0.5, min_calls=20,"
+" slow_call=None)\n"
 "\n"
-"Initializes a context for Kerberos SSPI server side authentication.\n"
-"the given service principal.\n"
-
+"Enables or disables the circuit breaker and closes it.\n"
+"\n"
+"The breaker watches the calls that may contact the KDC: acquiring\n"
+"credentials in :func:`authGSSClientInit` and the first\n"
+":func:`authGSSClientStep` of a handshake. A call fails if SSPI returns\n"
+"an error other than an unknown service principal or bad credentials,\n"
+"or if it takes `slow_call` seconds or longer. When at least\n"
+"`failure_ratio` of `min_calls` consecutive calls fail, the breaker\n"
+"opens and these calls raise :exc:`GSSError` at once for `cooldown`\n"
+"seconds. Then one call is let through as a probe. If it succeeds the\n"
+"breaker closes, otherwise it opens again. The breaker is process wide.\n"
 "\n"
 ":Parameters:\n"
-"  - `service`: A string containing the service principal in RFC-2078 format\n"
-"    (``service@hostname``) or SPN format (``service/hostname`` or\n"
-"    ``service/hostname@REALM``).\n"
+"  - `cooldown`: The number of seconds to stay open. 0, the default,\n"
+"    disables the breaker.\n"
+"  - `failure_ratio`: The fraction of failed calls, greater than 0 and\n"
+"    at most 1, that opens the breaker.\n"
+"  - `min_calls`: The number of calls over which `failure_ratio` is\n"
+"    computed.\n"
+"  - `slow_call`: An optional number of seconds after which a call that\n"
+"    succeeded counts as failed.\n"
 "\n"
-":Returns: A tuple of (result, context) where result is\n"
-"          :data:`AUTH_GSS_COMPLETE` and context is an opaque value passed\n"
-"          in subsequent function calls.\n");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_init(PyObject* self, PyObject* args, PyObject* kw) {
-    sspi_server_state* state;
-    PyObject* pyctx = NULL;
-    PyObject* serviceobj;
-    WCHAR *service = NULL;
-    Py_ssize_t slen = 0;
-    PyObject* resultobj = NULL;
-    INT result = 0;
+configure_circuit_breaker(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* cooldownobj = NULL;
+    PyObject* slowobj = Py_None;
+    LONG min_calls = 20;
+    sspi_breaker_config config;
     static SEC_CHAR* keywords[] = {
-        "service", NULL};
+        "cooldown", "failure_ratio", "min_calls", "slow_call", NULL};
 
+    config.cooldown = 0;
+    config.failure_ratio = 0.5;
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kw,
-                                     "O|OlOOOO",
+                                     "|OdlO",
                                      keywords,
-                                     &serviceobj)) {
+                                     &cooldownobj,
+                                     &config.failure_ratio,
+                                     &min_calls,
+                                     &slowobj)) {
         return NULL;
     }
-
-    if (!StringObject_AsWCHAR(serviceobj, 1, FALSE, &service, &slen)) {
-        goto done;
+    if (cooldownobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "cooldown must be a number");
+        return NULL;
     }
-
-    state = (sspi_server_state*)malloc(sizeof(sspi_server_state));
-    if (state == NULL) {
-        goto memoryerror;
+    if (cooldownobj &&
+        !parse_timeout(cooldownobj, "cooldown", &config.cooldown)) {
+        return NULL;
     }
-
-    pyctx = PyCObject_FromVoidPtr(state, &destroy_sspi_server);
-    if (pyctx == NULL) {
-        free(state);
-        goto done;
+    if (!(config.failure_ratio > 0.0 && config.failure_ratio <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "failure_ratio must be > 0 and <= 1");
+        return NULL;
     }
-
-    result = auth_sspi_server_init(service, state);
-    if (result == AUTH_GSS_ERROR) {
-        Py_DECREF(pyctx);
-        goto done;
+    if (min_calls < 1) {
+        PyErr_SetString(PyExc_ValueError, "min_calls must be >= 1");
+        return NULL;
+    }
+    config.min_calls = (ULONG)min_calls;
+    if (!parse_timeout(slowobj, "slow_call", &config.slow_call)) {
+        return NULL;
     }
 
-    resultobj =  Py_BuildValue("(iN)", result, pyctx);
-    goto done;
+    auth_sspi_breaker_configure(&config);
+    Py_RETURN_NONE;
+}
 
-memoryerror:
-    PyErr_SetNone(PyExc_MemoryError);
+PyDoc_STRVAR(circuit_breaker_stats_doc,
+"circuitBreakerStats()\n"
+"\n"
+"Get the circuit breaker's state and metrics. The counters are process\n"
+"wide and are not reset by :func:`configureCircuitBreaker`.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `state`: ``\"closed\"``, ``\"open\"`` or ``\"half_open\"``. A\n"
+"    disabled breaker is closed.\n"
+"  - `cooldown`, `failure_ratio`, `min_calls` and `slow_call`: The\n"
+"    configuration. `slow_call` is None if not set.\n"
+"  - `calls`: The number of calls watched.\n"
+"  - `failures`: The number of those that failed or were slow.\n"
+"  - `rejected`: The number of calls failed fast while open.\n"
+"  - `opened`, `half_opened`, `closed`: The number of transitions to\n"
+"    each state.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
-done:
-    free(service);
-    return resultobj;
+static PyObject*
+circuit_breaker_stats(PyObject* self, PyObject* unused) {
+    static const SEC_CHAR* states[] = {"closed", "open", "half_open"};
+    sspi_breaker_stats stats;
+    PyObject* slow;
+
+    auth_sspi_breaker_get_stats(&stats);
+    if (stats.config.slow_call == INFINITE) {
+        Py_INCREF(Py_None);
+        slow = Py_None;
+    } else {
+        slow = PyFloat_FromDouble(stats.config.slow_call / 1e3);
+        if (slow == NULL) {
+            return NULL;
+        }
+    }
+    return Py_BuildValue("{s:s,s:d,s:d,s:k,s:N,s:L,s:L,s:L,s:L,s:L,s:L}",
+                         "state", states[stats.state],
+                         "cooldown", stats.config.cooldown / 1e3,
+                         "failure_ratio", stats.config.failure_ratio,
+                         "min_calls", stats.config.min_calls,
+                         "slow_call", slow,
+                         "calls", stats.calls,
+                         "failures", stats.failures,
+                         "rejected", stats.rejected,
+                         "opened", stats.opened,
+                         "half_opened", stats.half_opened,
+                         "closed", stats.closed);
 }
 
-PyDoc_STRVAR(sspi_server_step_doc,
-"authGSSServerStep(context, challenge)\n"
+PyDoc_STRVAR(configure_server_admission_doc,
+"configureServerAdmission(max_concurrent=0, max_queue=1024,"
+" queue_timeout=None)\n"
 "\n"
-"Executes a single Kerberos SSPI server step using the supplied client "
-"data.\n"
+"Enables or disables admission control for server handshakes.\n"
+"\n"
+"At most `max_concurrent` calls to :func:`authGSSServerStep`, including\n"
+"those on the worker pool, are inside AcceptSecurityContext at once.\n"
+"Further calls wait in first come, first served order. A call raises\n"
+":exc:`GSSError` at once if `max_queue` calls are already waiting, or\n"
+"after waiting `queue_timeout` seconds. Under a storm of connections\n"
+"this keeps the LSA at the concurrency it handles best instead of\n"
+"slowing every handshake down. The limit is process wide.\n"
+"\n"
+"Changing the limit applies to calls already waiting.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
-"  - `challenge`: A string containing the base64 encoded client data.\n"
+"  - `max_concurrent`: The number of concurrent handshake legs. 0, the\n"
+"    default, disables admission control.\n"
+"  - `max_queue`: The number of calls that can wait.\n"
+"  - `queue_timeout`: An optional number of seconds a call waits before\n"
+"    it is rejected.\n"
 "\n"
-":Returns: :data:`AUTH_GSS_CONTINUE` or :data:`AUTH_GSS_COMPLETE`");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_step(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-    SEC_CHAR* challenge = NULL;
-    INT result = 0;
+configure_server_admission(PyObject* self, PyObject* args, PyObject* kw) {
+    LONG max_concurrent = 0;
+    LONG max_queue = 1024;
+    PyObject* timeoutobj = Py_None;
+    sspi_admission_config config;
+    static SEC_CHAR* keywords[] = {
+        "max_concurrent", "max_queue", "queue_timeout", NULL};
 
-    if (!PyArg_ParseTuple(args, "Os", &pyctx, &challenge)) {
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "|llO",
+                                     keywords,
+                                     &max_concurrent,
+                                     &max_queue,
+                                     &timeoutobj)) {
         return NULL;
     }
-
-    if (_string_too_long("challenge", strlen(challenge))) {
+    if (max_concurrent < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_concurrent must be >= 0");
         return NULL;
     }
-
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    if (max_queue < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_queue must be >= 0");
         return NULL;
     }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    if (!parse_timeout(timeoutobj, "queue_timeout", &config.queue_timeout)) {
         return NULL;
     }
+    config.max_concurrent = (ULONG)max_concurrent;
+    config.max_queue = (ULONG)max_queue;
 
-    result = auth_sspi_server_step(state, challenge);
-    if (result == AUTH_GSS_ERROR) {
-        return NULL;
-    }
+    auth_sspi_admission_configure(&config);
+    Py_RETURN_NONE;
+}
 
-    return Py_BuildValue("i", result);
+PyDoc_STRVAR(server_admission_stats_doc,
+"serverAdmissionStats()\n"
+"\n"
+"Get the configuration and metrics of server admission control. The\n"
+"counters are process wide and are not reset by\n"
+":func:`configureServerAdmission`.\n"
+"\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `max_concurrent`, `max_queue` and `queue_timeout`: The\n"
+"    configuration. `queue_timeout` is None if not set.\n"
+"  - `in_flight`: The number of calls inside AcceptSecurityContext.\n"
+"  - `queued`: The number of calls waiting.\n"
+"  - `admitted`: The number of calls let in.\n"
+"  - `rejected`: The number of calls rejected because the queue was\n"
+"    full.\n"
+"  - `timed_out`: The number of calls rejected after `queue_timeout`.\n"
+"  - `waited`: The number of admitted calls that had to wait.\n"
+"  - `wait_time`: The seconds those calls waited in total.\n"
+"  - `max_wait`: The longest wait in seconds.\n"
+"\n"
+".. versionadded:: 0.7.0");
+
+static PyObject*
+server_admission_stats(PyObject* self, PyObject* unused) {
+    sspi_admission_stats stats;
+    PyObject* timeout;
+
+    auth_sspi_admission_get_stats(&stats);
+    if (stats.config.queue_timeout == INFINITE) {
+        Py_INCREF(Py_None);
+        timeout = Py_None;
+    } else {
+        timeout = PyFloat_FromDouble(stats.config.queue_timeout / 1e3);
+        if (timeout == NULL) {
+            return NULL;
+        }
+    }
+    return Py_BuildValue("{s:k,s:k,s:N,s:k,s:k,s:L,s:L,s:L,s:L,s:d,s:d}",
+                         "max_concurrent", stats.config.max_concurrent,
+                         "max_queue", stats.config.max_queue,
+                         "queue_timeout", timeout,
+                         "in_flight", stats.in_flight,
+                         "queued", stats.queued,
+                         "admitted", stats.admitted,
+                         "rejected", stats.rejected,
+                         "timed_out", stats.timed_out,
+                         "waited", stats.waited,
+                         "wait_time", stats.wait_us / 1e6,
+                         "max_wait", stats.max_wait_us / 1e6);
 }
 
-PyDoc_STRVAR(sspi_server_response_doc,
-"authGSSServerResponse(context)\n"
+PyDoc_STRVAR(configure_token_screening_doc,
+"configureTokenScreening(enabled=False, allow_ntlm=True)\n"
 "\n"
-"Get the response to the last successful server operation.\n"
+"Enables or disables screening of the tokens given to\n"
+":func:`authGSSServerStep`.\n"
+"\n"
+"Each token is classified by its framing as a Kerberos AP-REQ, an NTLM\n"
+"message, a SPNEGO NegTokenInit or NegTokenResp, or invalid, without\n"
+"calling into SSPI. When screening is enabled, invalid tokens and,\n"
+"unless `allow_ntlm` is true, NTLM tokens, bare or carried by SPNEGO,\n"
+"raise :exc:`GSSError` before AcceptSecurityContext is called, so they\n"
+"cost no call to the LSA. Bound the size of tokens with the\n"
+"`server_step` limit of :func:`configureTokenSizeLimits`.\n"
+"Tokens are classified and counted even when screening is disabled.\n"
+"The setting is process wide.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `enabled`: Whether to reject tokens. False, the default, passes\n"
+"    every token to SSPI.\n"
+"  - `allow_ntlm`: Whether to accept NTLM.\n"
 "\n"
-":Returns: A base64 encoded string to return to the client.");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_response(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+configure_token_screening(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* enabled = Py_False;
+    PyObject* allow_ntlm = Py_True;
+    sspi_screen_config config;
+    INT truth;
+    static SEC_CHAR* keywords[] = {"enabled", "allow_ntlm", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|OO", keywords, &enabled, &allow_ntlm)) {
         return NULL;
     }
-
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    truth = PyObject_IsTrue(enabled);
+    if (truth < 0) {
         return NULL;
     }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    config.enabled = truth;
+    truth = PyObject_IsTrue(allow_ntlm);
+    if (truth < 0) {
         return NULL;
     }
+    config.allow_ntlm = truth;
 
-    return Py_BuildValue("s", state->response);
+    auth_sspi_screen_configure(&config);
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(sspi_server_username_doc,
-"authGSSServerUserName(context)\n"
+PyDoc_STRVAR(token_screening_stats_doc,
+"tokenScreeningStats()\n"
 "\n"
-"Get the user name of the authenticated principal. Will only succeed after\n"
-"authentication is complete.\n"
+"Get the configuration and metrics of token screening. The counters\n"
+"are process wide and are not reset by :func:`configureTokenScreening`.\n"
 "\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+":Returns: A dict with the keys:\n"
 "\n"
-":Returns: A string containing the username.");
+"  - `enabled` and `allow_ntlm`: The configuration.\n"
+"  - `seen`: A dict mapping each class, ``\"kerberos\"``, ``\"ntlm\"``,\n"
+"    ``\"spnego_init\"``, ``\"spnego_resp\"`` and ``\"invalid\"``, to the\n"
+"    number of tokens of that class.\n"
+"  - `rejected`: The same, for the tokens rejected.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_username(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
-        return NULL;
-    }
+screen_counts(const LONG64* counts) {
+    return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L}",
+                         "kerberos", counts[SSPI_CLASS_KERBEROS],
+                         "ntlm", counts[SSPI_CLASS_NTLM],
+                         "spnego_init", counts[SSPI_CLASS_SPNEGO_INIT],
+                         "spnego_resp", counts[SSPI_CLASS_SPNEGO_RESP],
+                         "invalid", counts[SSPI_CLASS_INVALID]);
+}
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+static PyObject*
+token_screening_stats(PyObject* self, PyObject* unused) {
+    sspi_screen_stats stats;
+    PyObject* seen;
+    PyObject* rejected;
+
+    auth_sspi_screen_get_stats(&stats);
+    seen = screen_counts(stats.seen);
+    if (seen == NULL) {
         return NULL;
     }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    rejected = screen_counts(stats.rejected);
+    if (rejected == NULL) {
+        Py_DECREF(seen);
         return NULL;
     }
-
-    return Py_BuildValue("s", state->username);
+    return Py_BuildValue("{s:N,s:N,s:N,s:N}",
+                         "enabled", PyBool_FromLong(stats.config.enabled),
+                         "allow_ntlm",
+                         PyBool_FromLong(stats.config.allow_ntlm),
+                         "seen", seen,
+                         "rejected", rejected);
 }
 
-PyDoc_STRVAR(sspi_server_targetname_doc,
-"authGSSServerTargetName(context)\n"
+PyDoc_STRVAR(configure_token_size_limits_doc,
+"configureTokenSizeLimits(client_step=131072, server_step=131072,"
+" unwrap=0)\n"
 "\n"
-"Get the target name if the server did not supply its own credentials. Will only succeed after\n"
-"authentication is complete.\n"
+"Sets the longest base64 encoded input accepted by the step and unwrap\n"
+"functions, including their ``*Async`` versions.\n"
+"\n"
+"The length is checked before the input is decoded, so a peer sending\n"
+"an oversized token costs no memory and no decoding. Longer inputs raise\n"
+":exc:`GSSError`. The limits are process wide.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `client_step`: The limit, in characters, for\n"
+"    :func:`authGSSClientStep`.\n"
+"  - `server_step`: The limit for :func:`authGSSServerStep`.\n"
+"  - `unwrap`: The limit for :func:`authGSSClientUnwrap` and\n"
+"    :func:`authGSSServerUnwrap`.\n"
 "\n"
-":Returns: A string containing the target name.");
+"0 means no limit. The step defaults are well above the largest token\n"
+"SSPI produces.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_targetname(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
-        return NULL;
-    }
+configure_token_size_limits(PyObject* self, PyObject* args, PyObject* kw) {
+    LONG client_step = 131072;
+    LONG server_step = 131072;
+    LONG unwrap = 0;
+    sspi_size_limits limits;
+    static SEC_CHAR* keywords[] = {
+        "client_step", "server_step", "unwrap", NULL};
 
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kw,
+                                     "|lll",
+                                     keywords,
+                                     &client_step,
+                                     &server_step,
+                                     &unwrap)) {
         return NULL;
     }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    if (client_step < 0 || server_step < 0 || unwrap < 0) {
+        PyErr_SetString(PyExc_ValueError, "limits must be >= 0");
         return NULL;
     }
+    limits.max_length[SSPI_LIMIT_CLIENT_STEP] = (ULONG)client_step;
+    limits.max_length[SSPI_LIMIT_SERVER_STEP] = (ULONG)server_step;
+    limits.max_length[SSPI_LIMIT_UNWRAP] = (ULONG)unwrap;
 
-    return Py_BuildValue("s", state->targetname);
+    auth_sspi_size_limits_configure(&limits);
+    Py_RETURN_NONE;
 }
 
-
-PyDoc_STRVAR(sspi_server_clean_doc,
-"authGSSServerClean(context)\n"
+PyDoc_STRVAR(token_size_limit_stats_doc,
+"tokenSizeLimitStats()\n"
 "\n"
-"Destroys the context. This function is provided for API compatibility with\n"
-"pykerberos but does nothing. The context object destroys itself when it\n"
-"is reclaimed.\n"
+"Get the token size limits and the number of inputs each rejected. The\n"
+"counters are process wide and are not reset by\n"
+":func:`configureTokenSizeLimits`.\n"
 "\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+":Returns: A dict with the keys:\n"
+"\n"
+"  - `client_step`, `server_step` and `unwrap`: The limits.\n"
+"  - `rejected`: A dict mapping the same keys to the number of inputs\n"
+"    rejected.\n"
 "\n"
-":Returns: :data:`AUTH_GSS_COMPLETE`");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_clean(PyObject* self, PyObject* args) {
-    /* Do nothing. For compatibility with pykerberos only. */
-    return Py_BuildValue("i", AUTH_GSS_COMPLETE);
+token_size_limit_stats(PyObject* self, PyObject* unused) {
+    sspi_size_limit_stats stats;
+
+    auth_sspi_size_limits_get_stats(&stats);
+    return Py_BuildValue(
+        "{s:k,s:k,s:k,s:{s:L,s:L,s:L}}",
+        "client_step", stats.limits.max_length[SSPI_LIMIT_CLIENT_STEP],
+        "server_step", stats.limits.max_length[SSPI_LIMIT_SERVER_STEP],
+        "unwrap", stats.limits.max_length[SSPI_LIMIT_UNWRAP],
+        "rejected",
+        "client_step", stats.rejected[SSPI_LIMIT_CLIENT_STEP],
+        "server_step", stats.rejected[SSPI_LIMIT_SERVER_STEP],
+        "unwrap", stats.rejected[SSPI_LIMIT_UNWRAP]);
 }
 
-
-//Helpers to figure stuff out
-
-PyDoc_STRVAR(sspi_server_impersonate_doc,
-"authGSSServerImpersonate(context)\n"
+PyDoc_STRVAR(configure_credential_refresh_doc,
+"configureCredentialRefresh(interval=0, margin=600)\n"
 "\n"
-"Impersonate client credentials\n"
+"Starts, stops or reconfigures the credential refresher.\n"
+"\n"
+"The refresher is a background thread that wakes up every `interval`\n"
+"seconds and acquires new credentials for those that expire within\n"
+"`margin` seconds, so that no handshake waits for the KDC to issue\n"
+"them or fails because they expired. It watches the credentials of\n"
+"every :class:`ClientTemplate`, client context and server context\n"
+"created while it runs, until they are freed. Client contexts take\n"
+"the renewed credentials at their next handshake, server contexts\n"
+"at their next handshake after :func:`authGSSServerReset`.\n"
+"\n"
+"To renew explicit credentials, the `user`, `domain` and `password`\n"
+"or `principal` they were acquired with are kept in memory for as\n"
+"long as they are watched.\n"
 "\n"
 ":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+"  - `interval`: The number of seconds between checks. 0, the default,\n"
+"    stops the refresher.\n"
+"  - `margin`: How many seconds before they expire credentials are\n"
+"    renewed. Should be less than their lifetime.\n"
 "\n"
-":Returns: :data:");
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_impersonate(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-    INT result = 0;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
+configure_credential_refresh(PyObject* self, PyObject* args, PyObject* kw) {
+    PyObject* intervalobj = NULL;
+    PyObject* marginobj = NULL;
+    DWORD interval = 0;
+    DWORD margin = 600 * 1000;
+    BOOL started;
+    static SEC_CHAR* keywords[] = {"interval", "margin", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kw, "|OO", keywords, &intervalobj, &marginobj)) {
         return NULL;
     }
-
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
+    if (intervalobj == Py_None || marginobj == Py_None) {
+        PyErr_SetString(PyExc_TypeError,
+                        "interval and margin must be numbers");
         return NULL;
     }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
+    if (intervalobj &&
+        !parse_timeout(intervalobj, "interval", &interval)) {
+        return NULL;
+    }
+    if (marginobj && !parse_timeout(marginobj, "margin", &margin)) {
         return NULL;
     }
 
-    result = auth_sspi_server_impersonate(state);
-    return Py_BuildValue("i", result);
+    /* Waits for a pass in progress. */
+    Py_BEGIN_ALLOW_THREADS
+    started = auth_sspi_refresh_configure(interval, margin);
+    Py_END_ALLOW_THREADS
+    if (!started) {
+        PyErr_SetString(GSSError, "Unable to start the refresher thread.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(sspi_server_revert_doc,
-"authGSSServerRevert(context)\n"
+PyDoc_STRVAR(credential_refresh_stats_doc,
+"credentialRefreshStats()\n"
 "\n"
-"Revert client credentials (to server creds)\n"
+"Get the credential refresher's configuration and metrics. The counters\n"
+"are process wide and are not reset by\n"
+":func:`configureCredentialRefresh`.\n"
 "\n"
-":Parameters:\n"
-"  - `context`: The context object returned by :func:`authGSSServerInit`.\n"
+":Returns: A dict with the keys:\n"
 "\n"
-":Returns: :data:");
+"  - `interval` and `margin`: The configuration, in seconds. `interval`\n"
+"    is 0 while the refresher is stopped.\n"
+"  - `clients`: The number of client templates and contexts watched.\n"
+"  - `servers`: The number of server contexts watched.\n"
+"  - `refreshed`: The number of credentials renewed.\n"
+"  - `failures`: The number of renewals that failed. They are retried\n"
+"    at the next check.\n"
+"\n"
+".. versionadded:: 0.7.0");
 
 static PyObject*
-sspi_server_revert(PyObject* self, PyObject* args) {
-    sspi_server_state* state;
-    PyObject* pyctx;
-    INT result = 0;
-
-    if (!PyArg_ParseTuple(args, "O", &pyctx)) {
-        return NULL;
-    }
-
-
-    if (!PyCObject_Check(pyctx)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a context object");
-        return NULL;
-    }
-
-    state = (sspi_server_state*)PyCObject_AsVoidPtr(pyctx);
-    if (state == NULL) {
-        return NULL;
-    }
-
-    result = auth_sspi_server_revert(state);
-    return Py_BuildValue("i", result);
+credential_refresh_stats(PyObject* self, PyObject* unused) {
+    sspi_refresh_stats stats;
+    auth_sspi_refresh_get_stats(&stats);
+    return Py_BuildValue("{s:d,s:d,s:k,s:k,s:L,s:L}",
+                         "interval", stats.interval / 1e3,
+                         "margin", stats.margin / 1e3,
+                         "clients", stats.clients,
+                         "servers", stats.servers,
+                         "refreshed", stats.refreshed,
+                         "failures", stats.failures);
 }
 
-
 static PyMethodDef WinKerberosClientMethods[] = {
     {"authGSSClientInit", (PyCFunction)sspi_client_init,
      METH_VARARGS | METH_KEYWORDS, sspi_client_init_doc},
+    {"authGSSClientInitMany", (PyCFunction)sspi_client_init_many,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_init_many_doc},
+    {"authGSSClientInitHedged", (PyCFunction)sspi_client_init_hedged,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_init_hedged_doc},
     {"authGSSClientClean", sspi_client_clean,
      METH_VARARGS, sspi_client_clean_doc},
-    {"authGSSClientStep", sspi_client_step,
-     METH_VARARGS, sspi_client_step_doc},
+    {"authGSSClientReset", sspi_client_reset,
+     METH_VARARGS, sspi_client_reset_doc},
+    {"authGSSClientExport", (PyCFunction)sspi_client_export,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_export_doc},
+    {"authGSSClientImport", sspi_client_import,
+     METH_VARARGS, sspi_client_import_doc},
+    {"authGSSClientStep", (PyCFunction)sspi_client_step,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_step_doc},
     {"authGSSClientResponse", sspi_client_response,
      METH_VARARGS, sspi_client_response_doc},
     {"authGSSClientResponseConf", sspi_client_response_conf,
@@ -1029,23 +5737,86 @@ static PyMethodDef WinKerberosClientMethods[] = {
      METH_VARARGS, sspi_client_unwrap_doc},
     {"authGSSClientWrap", sspi_client_wrap,
      METH_VARARGS, sspi_client_wrap_doc},
+    {"authGSSClientGetMIC", sspi_client_get_mic,
+     METH_VARARGS, sspi_client_get_mic_doc},
+    {"authGSSClientVerifyMIC", sspi_client_verify_mic,
+     METH_VARARGS, sspi_client_verify_mic_doc},
+    {"authGSSClientInitAsync", (PyCFunction)sspi_client_init_async,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_init_async_doc},
+    {"authGSSClientPrefetch", (PyCFunction)sspi_client_prefetch,
+     METH_VARARGS | METH_KEYWORDS, sspi_client_prefetch_doc},
+    {"authGSSClientStepAsync", sspi_client_step_async,
+     METH_VARARGS, sspi_client_step_async_doc},
+    {"authGSSClientUnwrapAsync", sspi_client_unwrap_async,
+     METH_VARARGS, sspi_client_unwrap_async_doc},
+    {"authGSSClientWrapAsync", sspi_client_wrap_async,
+     METH_VARARGS, sspi_client_wrap_async_doc},
     // Server Methods
     {"authGSSServerInit", (PyCFunction)sspi_server_init,
      METH_VARARGS | METH_KEYWORDS, sspi_server_init_doc},
     {"authGSSServerClean", sspi_server_clean,
      METH_VARARGS, sspi_server_clean_doc},
-    {"authGSSServerStep", sspi_server_step,
-     METH_VARARGS, sspi_server_step_doc},
+    {"authGSSServerReset", sspi_server_reset,
+     METH_VARARGS, sspi_server_reset_doc},
+    {"authGSSServerExport", (PyCFunction)sspi_server_export,
+     METH_VARARGS | METH_KEYWORDS, sspi_server_export_doc},
+    {"authGSSServerImport", sspi_server_import,
+     METH_VARARGS, sspi_server_import_doc},
+    {"authGSSServerStep", (PyCFunction)sspi_server_step,
+     METH_VARARGS | METH_KEYWORDS, sspi_server_step_doc},
     {"authGSSServerResponse", sspi_server_response,
      METH_VARARGS, sspi_server_response_doc},
     {"authGSSServerUserName", sspi_server_username,
      METH_VARARGS, sspi_server_username_doc},
     {"authGSSServerTargetName", sspi_server_targetname,
      METH_VARARGS, sspi_server_targetname_doc},
+    {"authGSSServerUnwrap", sspi_server_unwrap,
+     METH_VARARGS, sspi_server_unwrap_doc},
+    {"authGSSServerWrap", sspi_server_wrap,
+     METH_VARARGS, sspi_server_wrap_doc},
     {"authGSSServerImpersonate", sspi_server_impersonate,
      METH_VARARGS, sspi_server_impersonate_doc},
     {"authGSSServerRevert", sspi_server_revert,
      METH_VARARGS, sspi_server_revert_doc},
+    {"authGSSServerStepAsync", sspi_server_step_async,
+     METH_VARARGS, sspi_server_step_async_doc},
+    {"authGSSServerUnwrapAsync", sspi_server_unwrap_async,
+     METH_VARARGS, sspi_server_unwrap_async_doc},
+    {"authGSSServerWrapAsync", sspi_server_wrap_async,
+     METH_VARARGS, sspi_server_wrap_async_doc},
+    // Worker pool
+    {"configureThreadPool", (PyCFunction)configure_thread_pool,
+     METH_VARARGS | METH_KEYWORDS, configure_thread_pool_doc},
+    {"threadPoolStats", thread_pool_stats,
+     METH_NOARGS, thread_pool_stats_doc},
+    {"configureNegativeCache", (PyCFunction)configure_negative_cache,
+     METH_VARARGS | METH_KEYWORDS, configure_negative_cache_doc},
+    {"negativeCacheStats", negative_cache_stats,
+     METH_NOARGS, negative_cache_stats_doc},
+    {"configureMechanismMemory", (PyCFunction)configure_mechanism_memory,
+     METH_VARARGS | METH_KEYWORDS, configure_mechanism_memory_doc},
+    {"mechanismMemoryStats", mechanism_memory_stats,
+     METH_NOARGS, mechanism_memory_stats_doc},
+    {"configureCircuitBreaker", (PyCFunction)configure_circuit_breaker,
+     METH_VARARGS | METH_KEYWORDS, configure_circuit_breaker_doc},
+    {"circuitBreakerStats", circuit_breaker_stats,
+     METH_NOARGS, circuit_breaker_stats_doc},
+    {"configureServerAdmission", (PyCFunction)configure_server_admission,
+     METH_VARARGS | METH_KEYWORDS, configure_server_admission_doc},
+    {"serverAdmissionStats", server_admission_stats,
+     METH_NOARGS, server_admission_stats_doc},
+    {"configureTokenScreening", (PyCFunction)configure_token_screening,
+     METH_VARARGS | METH_KEYWORDS, configure_token_screening_doc},
+    {"tokenScreeningStats", token_screening_stats,
+     METH_NOARGS, token_screening_stats_doc},
+    {"configureTokenSizeLimits", (PyCFunction)configure_token_size_limits,
+     METH_VARARGS | METH_KEYWORDS, configure_token_size_limits_doc},
+    {"tokenSizeLimitStats", token_size_limit_stats,
+     METH_NOARGS, token_size_limit_stats_doc},
+    {"configureCredentialRefresh", (PyCFunction)configure_credential_refresh,
+     METH_VARARGS | METH_KEYWORDS, configure_credential_refresh_doc},
+    {"credentialRefreshStats", credential_refresh_stats,
+     METH_NOARGS, credential_refresh_stats_doc},
     {NULL, NULL, 0, NULL}
 };
 
@@ -1084,6 +5855,26 @@ initwinkerberos(VOID)
         INITERROR;
     }
 
+    if (PyType_Ready(&ClientContext_Type) < 0 ||
+        PyType_Ready(&ClientTemplate_Type) < 0 ||
+        PyType_Ready(&ServerContext_Type) < 0 ||
+        PyType_Ready(&Future_Type) < 0 ||
+        PyType_Ready(&CompletionQueue_Type) < 0 ||
+        PyType_Ready(&ServerSessionTable_Type) < 0 ||
+        PyType_Ready(&SessionTokenIssuer_Type) < 0 ||
+        PyType_Ready(&SharedSessionCache_Type) < 0) {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(&ClientContext_Type);
+    Py_INCREF(&ClientTemplate_Type);
+    Py_INCREF(&ServerContext_Type);
+    Py_INCREF(&Future_Type);
+    Py_INCREF(&CompletionQueue_Type);
+    Py_INCREF(&ServerSessionTable_Type);
+    Py_INCREF(&SessionTokenIssuer_Type);
+    Py_INCREF(&SharedSessionCache_Type);
+
     KrbError = PyErr_NewException(
         "winkerberos.KrbError", NULL, NULL);
     if (KrbError == NULL) {
@@ -1101,12 +5892,49 @@ initwinkerberos(VOID)
     }
     Py_INCREF(GSSError);
 
+    GSSTimeoutError = PyErr_NewException(
+        "winkerberos.GSSTimeoutError", GSSError, NULL);
+    if (GSSTimeoutError == NULL) {
+        Py_DECREF(GSSError);
+        Py_DECREF(KrbError);
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(GSSTimeoutError);
+
     if (PyModule_AddObject(module,
                            "KrbError",
                            KrbError) ||
         PyModule_AddObject(module,
                            "GSSError",
                            GSSError) ||
+        PyModule_AddObject(module,
+                           "GSSTimeoutError",
+                           GSSTimeoutError) ||
+        PyModule_AddObject(module,
+                           "ClientContext",
+                           (PyObject*)&ClientContext_Type) ||
+        PyModule_AddObject(module,
+                           "ClientTemplate",
+                           (PyObject*)&ClientTemplate_Type) ||
+        PyModule_AddObject(module,
+                           "ServerContext",
+                           (PyObject*)&ServerContext_Type) ||
+        PyModule_AddObject(module,
+                           "Future",
+                           (PyObject*)&Future_Type) ||
+        PyModule_AddObject(module,
+                           "CompletionQueue",
+                           (PyObject*)&CompletionQueue_Type) ||
+        PyModule_AddObject(module,
+                           "ServerSessionTable",
+                           (PyObject*)&ServerSessionTable_Type) ||
+        PyModule_AddObject(module,
+                           "SessionTokenIssuer",
+                           (PyObject*)&SessionTokenIssuer_Type) ||
+        PyModule_AddObject(module,
+                           "SharedSessionCache",
+                           (PyObject*)&SharedSessionCache_Type) ||
         PyModule_AddObject(module,
                            "AUTH_GSS_COMPLETE",
                            PyInt_FromLong(AUTH_GSS_COMPLETE)) ||
@@ -1137,9 +5965,13 @@ initwinkerberos(VOID)
         PyModule_AddObject(module,
                            "GSS_MECH_OID_SPNEGO",
                            PyCObject_FromVoidPtr(GSS_MECH_OID_SPNEGO, NULL)) ||
+        PyModule_AddObject(module,
+                           "GSS_MECH_OID_AUTO",
+                           PyCObject_FromVoidPtr(GSS_MECH_OID_AUTO, NULL)) ||
         PyModule_AddObject(module,
                            "__version__",
                            PyString_FromString("0.6.0"))) {
+        Py_DECREF(GSSTimeoutError);
         Py_DECREF(GSSError);
         Py_DECREF(KrbError);
         Py_DECREF(module);
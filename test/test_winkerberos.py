@@ -14,9 +14,14 @@
 
 import array
 import base64
+import hashlib
+import hmac
 import mmap
 import os
+import struct
 import sys
+import threading
+import time
 
 if sys.version_info[:2] == (2, 6):
     import unittest2 as unittest
@@ -47,6 +52,48 @@ _DOMAIN = os.environ.get('KERBEROS_DOMAIN')
 _PASSWORD = os.environ.get('KERBEROS_PASSWORD')
 
 
+def _mint_token(key, username, expires):
+    """A session token as SessionTokenIssuer mints it, expiring at
+    `expires` seconds since the epoch.
+    """
+    data = (b"\x01" + struct.pack(">Q", int(expires * 1000)) +
+            username.encode("utf-8"))
+    mac = hmac.new(key, data, hashlib.sha256).digest()
+    return base64.standard_b64encode(data + mac).decode("ascii")
+
+
+def _der(tag, contents):
+    """A DER element: tag, definite length and contents."""
+    if len(contents) < 0x80:
+        length = struct.pack("B", len(contents))
+    else:
+        length = struct.pack(">I", len(contents)).lstrip(b"\x00")
+        length = struct.pack("B", 0x80 | len(length)) + length
+    return struct.pack("B", tag) + length + contents
+
+
+_KRB5_OID = _der(0x06, b"\x2a\x86\x48\x86\xf7\x12\x01\x02\x02")
+_SPNEGO_OID = _der(0x06, b"\x2b\x06\x01\x05\x05\x02")
+_NTLM_NEGOTIATE = b"NTLMSSP\x00\x01\x00\x00\x00" + b"\x00" * 28
+
+
+def _ap_req(body=b""):
+    """A Kerberos InitialContextToken carrying an AP-REQ."""
+    return _der(0x60, _KRB5_OID + b"\x01\x00" + _der(0x6e, body))
+
+
+def _neg_token_init(mech_token):
+    return _der(0x60, _SPNEGO_OID + _der(0xa0, _der(
+        0x30, _der(0xa0, _der(0x30, _KRB5_OID)) +
+        _der(0xa2, _der(0x04, mech_token)))))
+
+
+def _neg_token_resp(response_token):
+    return _der(0xa1, _der(
+        0x30, _der(0xa0, _der(0x0a, b"\x01")) +
+        _der(0xa2, _der(0x04, response_token))))
+
+
 class TestWinKerberos(unittest.TestCase):
 
     @classmethod
@@ -161,6 +208,17 @@ class TestWinKerberos(unittest.TestCase):
 
         self.assertIsInstance(kerberos.authGSSClientUsername(ctx), str)
 
+        # Detached MIC over a payload that is never copied or encoded.
+        res = kerberos.authGSSClientGetMIC(ctx, b"payload")
+        self.assertEqual(res, 1)
+        mic = kerberos.authGSSClientResponse(ctx)
+        self.assertIsInstance(mic, str)
+        self.assertRaises(kerberos.GSSError,
+                          kerberos.authGSSClientVerifyMIC,
+                          ctx,
+                          b"altered",
+                          mic)
+
     def test_uninitialized_context(self):
         res, ctx = kerberos.authGSSClientInit(
             _SPN,
@@ -177,6 +235,810 @@ class TestWinKerberos(unittest.TestCase):
             kerberos.GSSError, kerberos.authGSSClientUnwrap, ctx, "foobar")
         self.assertRaises(
             kerberos.GSSError, kerberos.authGSSClientWrap, ctx, "foobar")
+        # Buffer protocol challenges are accepted, not rejected with
+        # TypeError.
+        challenges = [b"foobar", bytearray(b"foobar")]
+        # memoryview doesn't exist in python 2.6
+        if sys.version_info[:2] >= (2, 7):
+            challenges.append(memoryview(b"foobar"))
+        for challenge in challenges:
+            self.assertRaises(kerberos.GSSError,
+                              kerberos.authGSSClientUnwrap,
+                              ctx,
+                              challenge)
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientGetMIC, ctx, b"foobar")
+        self.assertRaises(
+            kerberos.GSSError,
+            kerberos.authGSSClientVerifyMIC, ctx, b"foobar", "Zm9vYmFy")
+
+    def test_uninitialized_server_context(self):
+        res, ctx = kerberos.authGSSServerInit(_SPN)
+        self.assertEqual(res, kerberos.AUTH_GSS_COMPLETE)
+
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSServerUnwrap, ctx, "foobar")
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSServerWrap, ctx, "Zm9vYmFy")
+        self.assertRaises(
+            kerberos.GSSError,
+            kerberos.authGSSServerWrap, ctx, bytearray(b"Zm9vYmFy"), 1)
+        self.assertIsNone(kerberos.authGSSServerResponse(ctx))
+
+        res, client = kerberos.authGSSClientInit(_SPN)
+        for func in (kerberos.authGSSServerUnwrap, kerberos.authGSSServerWrap):
+            self.assertRaises(TypeError, func, client, "Zm9vYmFy")
+            self.assertRaises(TypeError, func, None, "Zm9vYmFy")
+            self.assertRaises(TypeError, func, ctx, None)
+            self.assertRaises(TypeError, func, ctx)
+        self.assertRaises(
+            TypeError, kerberos.authGSSServerWrap, ctx, "Zm9vYmFy", "1")
+
+    def test_clean(self):
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        self.assertIsInstance(ctx, kerberos.ClientContext)
+        self.assertEqual(
+            kerberos.authGSSClientClean(ctx), kerberos.AUTH_GSS_COMPLETE)
+        # Cleaning again is a no-op.
+        self.assertEqual(
+            kerberos.authGSSClientClean(ctx), kerberos.AUTH_GSS_COMPLETE)
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientStep, ctx, "")
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientResponse, ctx)
+
+        with kerberos.authGSSClientInit(_SPN)[1] as ctx:
+            kerberos.authGSSClientStep(ctx, "")
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientResponse, ctx)
+
+    def test_reset(self):
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        self.assertEqual(
+            kerberos.authGSSClientStep(ctx, ""), kerberos.AUTH_GSS_CONTINUE)
+        self.assertEqual(
+            kerberos.authGSSClientReset(ctx), kerberos.AUTH_GSS_COMPLETE)
+        self.assertIsNone(kerberos.authGSSClientResponse(ctx))
+        # The context is uninitialized again...
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientUnwrap, ctx, "foobar")
+        # ...but can start a new handshake.
+        self.assertEqual(
+            kerberos.authGSSClientStep(ctx, ""), kerberos.AUTH_GSS_CONTINUE)
+        self.assertEqual(ctx.reset(), kerberos.AUTH_GSS_COMPLETE)
+
+    def test_export_import(self):
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        # Only completed contexts can be exported.
+        self.assertRaises(kerberos.GSSError, kerberos.authGSSClientExport, ctx)
+        res = kerberos.authGSSClientStep(ctx, "")
+        payload = kerberos.authGSSClientResponse(ctx)
+        response = self.db.command(
+            'saslStart', mechanism='GSSAPI', payload=payload)
+        while res == kerberos.AUTH_GSS_CONTINUE:
+            res = kerberos.authGSSClientStep(ctx, response['payload'])
+            payload = kerberos.authGSSClientResponse(ctx) or ''
+            response = self.db.command(
+               'saslContinue',
+               conversationId=response['conversationId'],
+               payload=payload)
+        username = kerberos.authGSSClientUsername(ctx)
+
+        data = kerberos.authGSSClientExport(ctx, pid=os.getpid())
+        self.assertIsInstance(data, bytes)
+        # The exported context is deleted.
+        self.assertRaises(kerberos.GSSError,
+                          kerberos.authGSSClientUnwrap,
+                          ctx,
+                          response['payload'])
+        ctx = kerberos.authGSSClientImport(data)
+        self.assertEqual(kerberos.authGSSClientUsername(ctx), username)
+        self.assertEqual(
+            kerberos.authGSSClientUnwrap(ctx, response['payload']), 1)
+        kerberos.authGSSClientWrap(
+            ctx, kerberos.authGSSClientResponse(ctx), _UPN)
+        response = self.db.command(
+           'saslContinue',
+           conversationId=response['conversationId'],
+           payload=kerberos.authGSSClientResponse(ctx))
+        self.assertTrue(response['done'])
+
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSClientImport, b"garbage")
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSServerImport, data)
+        _, ctx = kerberos.authGSSServerInit(_SPN)
+        self.assertRaises(kerberos.GSSError, kerberos.authGSSServerExport, ctx)
+        # A failed export leaves the context usable.
+        self.assertIsNone(kerberos.authGSSServerResponse(ctx))
+
+    def test_client_template(self):
+        template = kerberos.ClientTemplate(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        ctx1 = template.new_context()
+        ctx2 = template.new_context()
+        self.assertIsInstance(ctx1, kerberos.ClientContext)
+        self.assertIsNot(ctx1, ctx2)
+        # Contexts outlive the template and are independent of each other.
+        del template
+        kerberos.authGSSClientClean(ctx1)
+        self.assertEqual(
+            kerberos.authGSSClientStep(ctx2, ""), kerberos.AUTH_GSS_CONTINUE)
+        self.assertRaises(TypeError, kerberos.ClientTemplate, None)
+
+    def test_init_many(self):
+        self.assertEqual(kerberos.authGSSClientInitMany([]), [])
+        results = kerberos.authGSSClientInitMany(
+            [_SPN, _SPN],
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        self.assertEqual(len(results), 2)
+        for result, ctx in results:
+            self.assertEqual(result, kerberos.AUTH_GSS_CONTINUE)
+            self.assertIsInstance(ctx, kerberos.ClientContext)
+            self.assertTrue(kerberos.authGSSClientResponse(ctx))
+        self.assertIsNot(results[0][1], results[1][1])
+        self.assertRaises(TypeError, kerberos.authGSSClientInitMany, None)
+        self.assertRaises(
+            TypeError, kerberos.authGSSClientInitMany, [_SPN, None])
+
+    def test_prefetch(self):
+        bogus = u"HTTP/nonexistent.invalid"
+        future = kerberos.authGSSClientPrefetch(
+            [_SPN, bogus],
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        self.assertIsInstance(future, kerberos.Future)
+        results = future.result()
+        self.assertEqual(len(results), 2)
+        service, result, elapsed = results[0]
+        self.assertEqual(service, _SPN)
+        self.assertEqual(result, kerberos.AUTH_GSS_CONTINUE)
+        self.assertGreaterEqual(elapsed, 0)
+        service, result, elapsed = results[1]
+        self.assertEqual(service, bogus)
+        self.assertIsInstance(result, kerberos.GSSError)
+        self.assertRaises(ValueError, kerberos.authGSSClientPrefetch, [])
+        self.assertRaises(
+            TypeError, kerberos.authGSSClientPrefetch, [_SPN, None])
+
+    def test_init_hedged(self):
+        bogus = u"HTTP/nonexistent.invalid"
+        for delay in (None, 0, 0.1):
+            result, ctx, service = kerberos.authGSSClientInitHedged(
+                [bogus, _SPN],
+                None,
+                kerberos.GSS_C_MUTUAL_FLAG,
+                _USER,
+                _DOMAIN,
+                _PASSWORD,
+                hedge_delay=delay)
+            self.assertEqual(result, kerberos.AUTH_GSS_CONTINUE)
+            self.assertEqual(service, _SPN)
+            self.assertTrue(kerberos.authGSSClientResponse(ctx))
+        self.assertRaises(kerberos.GSSError,
+                          kerberos.authGSSClientInitHedged,
+                          [bogus],
+                          hedge_delay=0)
+        self.assertRaises(ValueError, kerberos.authGSSClientInitHedged, [])
+        self.assertRaises(ValueError,
+                          kerberos.authGSSClientInitHedged,
+                          [_SPN],
+                          hedge_delay=-1)
+
+    def test_async(self):
+        kerberos.configureThreadPool(2)
+        self.assertEqual(kerberos.threadPoolStats()['workers'], 2)
+        future = kerberos.authGSSClientInitAsync(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        self.assertIsInstance(future, kerberos.Future)
+        res, ctx = future.result()
+        self.assertEqual(res, kerberos.AUTH_GSS_COMPLETE)
+        future = kerberos.authGSSClientStepAsync(ctx, "")
+        self.assertEqual(future.result(), kerberos.AUTH_GSS_CONTINUE)
+        self.assertTrue(future.done())
+        self.assertTrue(kerberos.authGSSClientResponse(ctx))
+        self.assertRaises(
+            kerberos.GSSError,
+            kerberos.authGSSClientUnwrapAsync(ctx, "").result)
+        stats = kerberos.threadPoolStats()
+        self.assertGreaterEqual(stats['completed'], 3)
+        self.assertEqual(stats['queued'], 0)
+        kerberos.configureThreadPool()
+
+    def test_thread_pool_lanes(self):
+        kerberos.configureThreadPool(2, message_workers=1)
+        stats = kerberos.threadPoolStats()
+        self.assertEqual(stats['workers'], 2)
+        self.assertEqual(stats['message_workers'], 1)
+        self.assertEqual(stats['lanes']['message']['workers'], 1)
+        handshakes = stats['lanes']['handshake']['submitted']
+        messages = stats['lanes']['message']['submitted']
+        res, ctx = kerberos.authGSSClientInitAsync(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD).result()
+        self.assertEqual(res, kerberos.AUTH_GSS_COMPLETE)
+        # Unwrap runs in the message lane, even before the handshake.
+        self.assertRaises(
+            kerberos.GSSError,
+            kerberos.authGSSClientUnwrapAsync(ctx, "").result)
+        stats = kerberos.threadPoolStats()
+        self.assertEqual(
+            stats['lanes']['handshake']['submitted'], handshakes + 1)
+        self.assertEqual(
+            stats['lanes']['message']['submitted'], messages + 1)
+        self.assertEqual(
+            stats['submitted'],
+            stats['lanes']['handshake']['submitted'] +
+            stats['lanes']['message']['submitted'])
+        self.assertRaises(
+            ValueError, kerberos.configureThreadPool, message_workers=-1)
+        kerberos.configureThreadPool()
+
+    def test_timeout(self):
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD,
+            timeout=30)
+        self.assertEqual(res, kerberos.AUTH_GSS_COMPLETE)
+        res = kerberos.authGSSClientStep(ctx, "", timeout=30)
+        self.assertEqual(res, kerberos.AUTH_GSS_CONTINUE)
+        self.assertTrue(kerberos.authGSSClientResponse(ctx))
+        self.assertRaises(ValueError,
+                          kerberos.authGSSClientStep, ctx, "", timeout=-1)
+
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        # With one handshake worker busy with these, the step is still
+        # queued when the caller stops waiting.
+        kerberos.configureThreadPool(1)
+        try:
+            ahead = [kerberos.authGSSClientInitAsync(
+                         _SPN,
+                         None,
+                         kerberos.GSS_C_MUTUAL_FLAG,
+                         _USER,
+                         _DOMAIN,
+                         _PASSWORD) for _ in range(8)]
+            self.assertRaises(kerberos.GSSTimeoutError,
+                              kerberos.authGSSClientStep,
+                              ctx,
+                              "",
+                              timeout=0)
+            # The abandoned step owns the state; the context is detached.
+            try:
+                kerberos.authGSSClientResponse(ctx)
+                self.fail("GSSError not raised")
+            except kerberos.GSSError as exc:
+                self.assertIn("destroyed", str(exc))
+            self.assertRaises(kerberos.GSSError,
+                              kerberos.authGSSClientStepAsync,
+                              ctx,
+                              "")
+            self.assertEqual(kerberos.authGSSClientClean(ctx),
+                             kerberos.AUTH_GSS_COMPLETE)
+            for future in ahead:
+                future.result()
+        finally:
+            kerberos.configureThreadPool()
+        self.assertEqual(kerberos.threadPoolStats()['queued'], 0)
+
+    def test_negative_cache(self):
+        kerberos.configureNegativeCache(60)
+        try:
+            self.assertEqual(kerberos.negativeCacheStats()['ttl'], 60)
+            before = kerberos.negativeCacheStats()
+            for _ in range(2):
+                res, ctx = kerberos.authGSSClientInit(
+                    u"HTTP/nonexistent.invalid",
+                    None,
+                    kerberos.GSS_C_MUTUAL_FLAG,
+                    _USER,
+                    _DOMAIN,
+                    _PASSWORD)
+                self.assertRaises(
+                    kerberos.GSSError, kerberos.authGSSClientStep, ctx, "")
+            after = kerberos.negativeCacheStats()
+            self.assertEqual(after['recorded'], before['recorded'] + 1)
+            self.assertEqual(after['suppressed'], before['suppressed'] + 1)
+            self.assertEqual(after['entries'], 1)
+        finally:
+            kerberos.configureNegativeCache()
+        self.assertEqual(kerberos.negativeCacheStats()['entries'], 0)
+        self.assertRaises(ValueError, kerberos.configureNegativeCache, -1)
+
+    def test_mechanism_memory(self):
+        kerberos.configureMechanismMemory(60)
+        try:
+            self.authenticate(mech_oid=kerberos.GSS_MECH_OID_AUTO)
+            before = kerberos.mechanismMemoryStats()
+            self.assertEqual(before['entries'], 1)
+            self.authenticate(mech_oid=kerberos.GSS_MECH_OID_AUTO)
+            after = kerberos.mechanismMemoryStats()
+            self.assertEqual(after['hits'], before['hits'] + 1)
+            self.assertEqual(after['entries'], 1)
+        finally:
+            kerberos.configureMechanismMemory()
+        self.assertEqual(kerberos.mechanismMemoryStats()['entries'], 0)
+
+    def test_circuit_breaker(self):
+        kerberos.configureCircuitBreaker(60, failure_ratio=1, min_calls=1,
+                                         slow_call=0)
+        try:
+            stats = kerberos.circuitBreakerStats()
+            self.assertEqual(stats['state'], 'closed')
+            self.assertEqual(stats['slow_call'], 0)
+            # Every call counts as slow, so the first one opens the breaker.
+            res, ctx = kerberos.authGSSClientInit(
+                _SPN,
+                None,
+                kerberos.GSS_C_MUTUAL_FLAG,
+                _USER,
+                _DOMAIN,
+                _PASSWORD)
+            after = kerberos.circuitBreakerStats()
+            self.assertEqual(after['state'], 'open')
+            self.assertEqual(after['opened'], stats['opened'] + 1)
+            self.assertRaises(
+                kerberos.GSSError, kerberos.authGSSClientStep, ctx, "")
+            self.assertEqual(kerberos.circuitBreakerStats()['rejected'],
+                             after['rejected'] + 1)
+        finally:
+            kerberos.configureCircuitBreaker()
+        self.assertEqual(kerberos.circuitBreakerStats()['state'], 'closed')
+        self.assertRaises(ValueError,
+                          kerberos.configureCircuitBreaker,
+                          60,
+                          failure_ratio=0)
+        self.assertRaises(ValueError,
+                          kerberos.configureCircuitBreaker,
+                          60,
+                          min_calls=0)
+
+    def test_server_admission(self):
+        kerberos.configureServerAdmission(
+            1, max_queue=0, queue_timeout=0.5)
+        try:
+            stats = kerberos.serverAdmissionStats()
+            self.assertEqual(stats['max_concurrent'], 1)
+            self.assertEqual(stats['max_queue'], 0)
+            self.assertEqual(stats['queue_timeout'], 0.5)
+            _, ctx = kerberos.authGSSServerInit(_SPN)
+            # Not a valid token, but it is admitted to the LSA.
+            self.assertRaises(kerberos.GSSError,
+                              kerberos.authGSSServerStep,
+                              ctx,
+                              base64.standard_b64encode(b"invalid"))
+            after = kerberos.serverAdmissionStats()
+            self.assertEqual(after['admitted'], stats['admitted'] + 1)
+            self.assertEqual(after['in_flight'], 0)
+            self.assertEqual(after['queued'], 0)
+        finally:
+            kerberos.configureServerAdmission()
+        stats = kerberos.serverAdmissionStats()
+        self.assertEqual(stats['max_concurrent'], 0)
+        self.assertIsNone(stats['queue_timeout'])
+        self.assertRaises(
+            ValueError, kerberos.configureServerAdmission, -1)
+        self.assertRaises(
+            ValueError, kerberos.configureServerAdmission, 1, -1)
+
+    def test_server_admission_threads(self):
+        token = base64.standard_b64encode(b"invalid")
+        outcomes = {'admitted': 0, 'rejected': 0, 'timed_out': 0}
+        lock = threading.Lock()
+
+        def steps():
+            for _ in range(50):
+                _, ctx = kerberos.authGSSServerInit(_SPN)
+                try:
+                    kerberos.authGSSServerStep(ctx, token)
+                    key = 'admitted'
+                except kerberos.GSSError as exc:
+                    if "Too many server handshakes" in str(exc):
+                        key = 'rejected'
+                    elif "Timed out waiting for the LSA" in str(exc):
+                        key = 'timed_out'
+                    else:
+                        key = 'admitted'
+                with lock:
+                    outcomes[key] += 1
+
+        # One leg at a time, one waiter, and a short wait, so that
+        # concurrent legs are admitted, queued, rejected or timed out.
+        kerberos.configureServerAdmission(
+            1, max_queue=1, queue_timeout=0.001)
+        try:
+            before = kerberos.serverAdmissionStats()
+            threads = [threading.Thread(target=steps) for _ in range(8)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            after = kerberos.serverAdmissionStats()
+        finally:
+            kerberos.configureServerAdmission()
+        self.assertEqual(sum(outcomes.values()), 8 * 50)
+        self.assertGreater(outcomes['admitted'], 0)
+        for key in outcomes:
+            self.assertEqual(after[key] - before[key], outcomes[key])
+        self.assertLessEqual(after['waited'] - before['waited'],
+                             outcomes['admitted'])
+        self.assertEqual(after['in_flight'], 0)
+        self.assertEqual(after['queued'], 0)
+
+    def test_token_screening(self):
+        ntlm = base64.standard_b64encode(b"NTLMSSP\x00\x01\x00\x00\x00")
+        kerberos.configureTokenScreening(True, allow_ntlm=False)
+        try:
+            stats = kerberos.tokenScreeningStats()
+            self.assertTrue(stats['enabled'])
+            self.assertFalse(stats['allow_ntlm'])
+            _, ctx = kerberos.authGSSServerInit(_SPN)
+            self.assertRaises(kerberos.GSSError,
+                              kerberos.authGSSServerStep,
+                              ctx,
+                              base64.standard_b64encode(b"invalid"))
+            self.assertRaises(
+                kerberos.GSSError, kerberos.authGSSServerStep, ctx, ntlm)
+            after = kerberos.tokenScreeningStats()
+            self.assertEqual(after['rejected']['invalid'],
+                             stats['rejected']['invalid'] + 1)
+            self.assertEqual(after['rejected']['ntlm'],
+                             stats['rejected']['ntlm'] + 1)
+            self.assertEqual(after['seen']['ntlm'], stats['seen']['ntlm'] + 1)
+        finally:
+            kerberos.configureTokenScreening()
+        stats = kerberos.tokenScreeningStats()
+        self.assertFalse(stats['enabled'])
+        self.assertTrue(stats['allow_ntlm'])
+
+    def test_token_screening_fixtures(self):
+        # Each token, its class, and whether screening rejects it.
+        fixtures = [
+            (_ap_req(), 'kerberos', False),
+            # A length in the long form.
+            (_ap_req(b"\x00" * 300), 'kerberos', False),
+            (_NTLM_NEGOTIATE, 'ntlm', True),
+            (_neg_token_init(_ap_req()), 'spnego_init', False),
+            (_neg_token_init(_NTLM_NEGOTIATE), 'spnego_init', True),
+            (_neg_token_resp(_NTLM_NEGOTIATE), 'spnego_resp', True),
+            (_neg_token_resp(_ap_req()), 'spnego_resp', False),
+            # Truncated, and one byte past the outer length.
+            (_ap_req()[:-1], 'invalid', True),
+            (_ap_req() + b"\x00", 'invalid', True),
+            # A nested length that runs past the token.
+            (_der(0x60, _KRB5_OID[:-1] + b"\x7f"), 'invalid', True),
+            # A four byte length far longer than the token, and a five
+            # byte one.
+            (b"\x60\x84\x7f\xff\xff\xff" + _KRB5_OID, 'invalid', True),
+            (b"\x60\x85\x00\x00\x00\x00\x0b" + _KRB5_OID,
+             'invalid', True),
+            # BER's indefinite length is not DER.
+            (b"\x60\x80" + _KRB5_OID + b"\x00\x00", 'invalid', True),
+            # An AP-REP, not an AP-REQ.
+            (_der(0x60, _KRB5_OID + b"\x02\x00" + _der(0x6f, b"")),
+             'invalid', True),
+        ]
+        seen = dict.fromkeys(
+            ['kerberos', 'ntlm', 'spnego_init', 'spnego_resp', 'invalid'], 0)
+        rejected = dict(seen)
+        kerberos.configureTokenScreening(True, allow_ntlm=False)
+        try:
+            before = kerberos.tokenScreeningStats()
+            for token, cls, refused in fixtures:
+                _, ctx = kerberos.authGSSServerInit(_SPN)
+                try:
+                    kerberos.authGSSServerStep(
+                        ctx, base64.standard_b64encode(token))
+                except kerberos.GSSError:
+                    # The LSA fails the tokens screening lets through.
+                    pass
+                seen[cls] += 1
+                if refused:
+                    rejected[cls] += 1
+            after = kerberos.tokenScreeningStats()
+        finally:
+            kerberos.configureTokenScreening()
+        for cls in seen:
+            self.assertEqual(
+                after['seen'][cls] - before['seen'][cls], seen[cls], cls)
+            self.assertEqual(
+                after['rejected'][cls] - before['rejected'][cls],
+                rejected[cls],
+                cls)
+
+    def test_token_size_limits(self):
+        token = "A" * 64
+        kerberos.configureTokenSizeLimits(16, 16, 16)
+        try:
+            stats = kerberos.tokenSizeLimitStats()
+            self.assertEqual(stats['client_step'], 16)
+            self.assertEqual(stats['unwrap'], 16)
+            _, ctx = kerberos.authGSSServerInit(_SPN)
+            self.assertRaises(
+                kerberos.GSSError, kerberos.authGSSServerStep, ctx, token)
+            res, ctx = kerberos.authGSSClientInit(
+                _SPN,
+                None,
+                kerberos.GSS_C_MUTUAL_FLAG,
+                _USER,
+                _DOMAIN,
+                _PASSWORD)
+            self.assertEqual(res, kerberos.AUTH_GSS_COMPLETE)
+            res = kerberos.authGSSClientStep(ctx, "")
+            self.assertEqual(res, kerberos.AUTH_GSS_CONTINUE)
+            self.assertRaises(
+                kerberos.GSSError, kerberos.authGSSClientStep, ctx, token)
+            self.assertRaises(
+                kerberos.GSSError, kerberos.authGSSClientUnwrap, ctx, token)
+            after = kerberos.tokenSizeLimitStats()['rejected']
+            for key in ('client_step', 'server_step', 'unwrap'):
+                self.assertEqual(after[key], stats['rejected'][key] + 1)
+        finally:
+            kerberos.configureTokenSizeLimits()
+        stats = kerberos.tokenSizeLimitStats()
+        self.assertEqual(stats['server_step'], 131072)
+        self.assertEqual(stats['unwrap'], 0)
+        self.assertRaises(
+            ValueError, kerberos.configureTokenSizeLimits, unwrap=-1)
+
+    def test_credential_refresh(self):
+        # With a margin this long every credential with an expiry is due.
+        kerberos.configureCredentialRefresh(0.05, margin=30 * 86400)
+        try:
+            tmpl = kerberos.ClientTemplate(
+                _SPN,
+                None,
+                kerberos.GSS_C_MUTUAL_FLAG,
+                _USER,
+                _DOMAIN,
+                _PASSWORD)
+            stats = kerberos.credentialRefreshStats()
+            self.assertEqual(stats['interval'], 0.05)
+            self.assertGreaterEqual(stats['clients'], 1)
+            expiry = tmpl.credentials_expiry
+            if expiry is not None:
+                self.assertGreater(expiry, time.time())
+                deadline = time.time() + 10
+                while (kerberos.credentialRefreshStats()['refreshed'] ==
+                       stats['refreshed'] and time.time() < deadline):
+                    time.sleep(0.05)
+                self.assertGreater(
+                    kerberos.credentialRefreshStats()['refreshed'],
+                    stats['refreshed'])
+            ctx = tmpl.new_context()
+            self.assertIsNone(ctx.expiry)
+            self.assertEqual(kerberos.authGSSClientStep(ctx, ""),
+                             kerberos.AUTH_GSS_CONTINUE)
+            self.assertIsNotNone(ctx.expiry)
+            del ctx, tmpl
+        finally:
+            kerberos.configureCredentialRefresh()
+        self.assertEqual(kerberos.credentialRefreshStats()['interval'], 0)
+        self.assertRaises(
+            ValueError, kerberos.configureCredentialRefresh, -1)
+
+    def test_server_session_table(self):
+        table = kerberos.ServerSessionTable(max_size=2, ttl=60, shards=1)
+        self.assertEqual(len(table), 0)
+        self.assertIsNone(table.take("missing"))
+
+        _, ctx = kerberos.authGSSServerInit(_SPN)
+        table.put("a", ctx)
+        # The table owns the security context now.
+        self.assertRaises(
+            kerberos.GSSError, kerberos.authGSSServerResponse, ctx)
+        _, ctx = kerberos.authGSSServerInit(_SPN)
+        table.put(b"b", ctx)
+        _, ctx = kerberos.authGSSServerInit(_SPN)
+        table.put("c", ctx, ttl=0.05)
+        # "a" was stored least recently.
+        self.assertEqual(len(table), 2)
+        self.assertIsNone(table.take("a"))
+
+        ctx = table.take("b")
+        self.assertIsInstance(ctx, kerberos.ServerContext)
+        self.assertIsNone(table.take("b"))
+        time.sleep(0.1)
+        self.assertFalse(table.remove("c"))
+
+        stats = table.stats()
+        self.assertEqual(stats['size'], 0)
+        self.assertEqual(stats['inserted'], 3)
+        self.assertEqual(stats['evicted'], 1)
+        self.assertEqual(stats['expired'], 1)
+        self.assertEqual(stats['hits'], 1)
+
+        # The shards' limits add up to max_size.
+        for max_size in (1, 3, 20):
+            table = kerberos.ServerSessionTable(max_size=max_size, shards=16)
+            for i in range(64):
+                _, ctx = kerberos.authGSSServerInit(_SPN)
+                table.put(str(i), ctx)
+            self.assertLessEqual(len(table), max_size)
+            self.assertLessEqual(table.stats()['shards'], max_size)
+
+        self.assertRaises(ValueError, kerberos.ServerSessionTable, 0)
+        self.assertRaises(ValueError, kerberos.ServerSessionTable, ttl=0)
+        self.assertRaises(
+            ValueError, kerberos.ServerSessionTable, shards=0)
+
+    def test_session_tokens(self):
+        issuer = kerberos.SessionTokenIssuer(b"k" * 32, ttl=60)
+        _, ctx = kerberos.authGSSServerInit(_SPN)
+        # No user is authenticated until the handshake completes.
+        self.assertRaises(kerberos.GSSError, issuer.issue, ctx)
+        self.assertIsNone(issuer.verify(""))
+        self.assertIsNone(issuer.verify("not a token"))
+        self.assertIsNone(issuer.verify(base64.standard_b64encode(
+            b"\x01" + b"\x00" * 8 + b"user" + b"\x00" * 32)))
+        self.assertIsNone(issuer.verify("A" * 100000))
+        stats = issuer.stats()
+        self.assertEqual(stats['ttl'], 60)
+        self.assertEqual(stats['issued'], 0)
+        self.assertEqual(stats['verified'], 0)
+        self.assertEqual(stats['rejected'], 4)
+
+        # A genuine token verifies; one altered byte does not.
+        token = _mint_token(b"k" * 32, u"user@EXAMPLE.COM", time.time() + 60)
+        self.assertEqual(issuer.verify(token), "user@EXAMPLE.COM")
+        raw = bytearray(base64.standard_b64decode(token))
+        raw[12] ^= 1
+        self.assertIsNone(issuer.verify(base64.standard_b64encode(raw)))
+        # A genuine token past its expiry is refused.
+        self.assertIsNone(issuer.verify(
+            _mint_token(b"k" * 32, u"user@EXAMPLE.COM", time.time() - 1)))
+        stats = issuer.stats()
+        self.assertEqual(stats['verified'], 1)
+        self.assertEqual(stats['rejected'], 5)
+        self.assertEqual(stats['expired'], 1)
+
+        # After rotating, tokens under the old key verify until it is
+        # dropped.
+        rotated = kerberos.SessionTokenIssuer(
+            b"n" * 32, previous_key=b"k" * 32)
+        self.assertEqual(rotated.verify(token), "user@EXAMPLE.COM")
+        self.assertEqual(rotated.verify(_mint_token(
+            b"n" * 32, u"user@EXAMPLE.COM", time.time() + 60)),
+            "user@EXAMPLE.COM")
+        self.assertIsNone(
+            kerberos.SessionTokenIssuer(b"n" * 32).verify(token))
+
+        kerberos.SessionTokenIssuer()
+        self.assertRaises(ValueError, kerberos.SessionTokenIssuer, b"short")
+        self.assertRaises(
+            ValueError, kerberos.SessionTokenIssuer, previous_key=b"")
+        self.assertRaises(ValueError, kerberos.SessionTokenIssuer, ttl=0)
+
+    def test_shared_session_cache(self):
+        name = "Local\\winkerberos-test-%d" % (os.getpid(),)
+        cache = kerberos.SharedSessionCache(name, max_entries=4, ttl=60)
+        # A second handle on the same name sees the same entries.
+        other = kerberos.SharedSessionCache(name)
+        self.assertEqual(other.stats()['slots'], 4)
+        self.assertIsNone(cache.get("missing"))
+
+        self.assertTrue(cache.put("a", "user@REALM", attributes=b"\x01"))
+        username, expires, attributes = other.get(b"a")
+        self.assertEqual(username, "user@REALM")
+        self.assertGreater(expires, time.time())
+        self.assertLessEqual(expires, time.time() + 60)
+        self.assertEqual(attributes, b"\x01")
+
+        self.assertTrue(cache.put("b", "user", expires=time.time() + 0.05))
+        time.sleep(0.1)
+        self.assertIsNone(other.get("b"))
+        # More entries than slots: the clock sweep makes room.
+        for i in range(8):
+            self.assertTrue(cache.put("k%d" % (i,), "user"))
+        self.assertIsNotNone(cache.get("k7"))
+        self.assertGreater(cache.stats()['evicted'], 0)
+
+        self.assertTrue(other.remove("k7"))
+        self.assertIsNone(cache.get("k7"))
+        self.assertFalse(other.remove("k7"))
+        # A put that is already expired drops what was shared before.
+        self.assertTrue(cache.put("k6", "user"))
+        self.assertTrue(other.put("k6", "user", expires=time.time() - 1))
+        self.assertIsNone(cache.get("k6"))
+
+        self.assertRaises(ValueError, cache.put, "x" * 129, "user")
+        self.assertRaises(ValueError, cache.put, "a", "u" * 257)
+        self.assertRaises(ValueError, cache.put, "a", "u", None, b"x" * 513)
+        self.assertRaises(ValueError, kerberos.SharedSessionCache, "")
+        self.assertRaises(
+            ValueError, kerberos.SharedSessionCache, name, max_entries=0)
+
+    @unittest.skipIf(sys.version_info < (3, 5), "requires asyncio")
+    def test_step_async(self):
+        import asyncio
+
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(loop)
+        try:
+            res = loop.run_until_complete(ctx.step_async(""))
+        finally:
+            asyncio.set_event_loop(None)
+            loop.close()
+        self.assertEqual(res, kerberos.AUTH_GSS_CONTINUE)
+        self.assertTrue(kerberos.authGSSClientResponse(ctx))
+
+    def test_completion_queue(self):
+        import select
+
+        res, ctx = kerberos.authGSSClientInit(
+            _SPN,
+            None,
+            kerberos.GSS_C_MUTUAL_FLAG,
+            _USER,
+            _DOMAIN,
+            _PASSWORD)
+        queue = kerberos.CompletionQueue()
+        future = kerberos.authGSSClientStepAsync(ctx, "", queue)
+        finished = []
+        while not finished:
+            readable, _, _ = select.select([queue.fileno()], [], [], 30)
+            self.assertTrue(readable)
+            finished = queue.drain()
+        self.assertEqual(finished, [future])
+        self.assertTrue(future.done())
+        self.assertEqual(future.result(), kerberos.AUTH_GSS_CONTINUE)
+        self.assertEqual(queue.drain(), [])
 
     def test_arg_parsing(self):
 